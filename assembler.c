@@ -2,743 +2,9549 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <dirent.h>
+#endif
 
-#define MAX_LINES 1024         // Maximum number of lines in the source
-#define MAX_LABEL_LEN 32       // Maximum length of a label
-#define MAX_MNEMONIC_LEN 32    // Maximum length of a mnemonic
-#define MAX_OPERAND_LEN 64     // Maximum length of an operand
-#define MAX_OBJECT_CODE_LEN 64 // Maximum length of object code
-#define MAX_SYMBOLS 1024       // Maximum number of symbols in the symbol table
+#include "libsic.h"
 
-static int error_count = 0;
+#define SOURCE_READ_CHUNK (1 << 20) // Read size when the source cannot be mapped
+#define OUTPUT_BUFFER_SIZE (1 << 20) // Output is formatted here and written in large blocks
+#define TEXT_RECORD_MAX 30     // Maximum data bytes in one T record
+#define HEX_RECORD_MAX 16      // Data bytes per Intel HEX / S-record line
+#define SYMTAB_INIT_CAPACITY 256 // Initial slot count of the symbol hash table (power of two)
+#define LINE_CHUNK_SIZE 4096   // Line records per chunk
+#define PASS2_CHUNK_LINES 8192 // Lines per pass2 task
+#define ARENA_BLOCK_SIZE (1 << 20) // Default size of one arena block
+#define LITERAL_MAX 32         // Bytes in one =C'..' / =X'..' literal
+#define MACRO_PARAM_MAX 32     // Parameters of one macro
+#define MACRO_DEPTH_MAX 32     // Macro invocations inside expansions, IFs inside IFs
 
-// Data structure to store one line (similar to the Python 'Line' class)
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+// A (pointer, length) view into the source text; not NUL-terminated
+typedef struct {
+    const char *ptr;
+    int len;
+} StrView;
+
+// Addressing flags of an instruction (the n, i, x, b, p, e bits)
+enum {
+    FLAG_E = 0x01,
+    FLAG_P = 0x02,
+    FLAG_B = 0x04,
+    FLAG_X = 0x08,
+    FLAG_I = 0x10,
+    FLAG_N = 0x20
+};
+
+// Line state bits
+enum {
+    LINE_DEFINES = 0x01,        // This statement's label is the one in the symbol table
+    LINE_DIRTY = 0x02,          // Must be (re-)encoded
+    LINE_UNRESOLVED = 0x04,     // Operand symbol was undefined when last encoded
+    LINE_RELOCATE = 0x08,       // Format 4 address or WORD the loader must relocate (M record)
+    LINE_EXTERNAL = 0x10        // Format 4 address or WORD holding an EXTREF symbol (M record)
+};
+
+struct Keyword;
+
+// Data structure to store one statement (similar to the Python 'Line' class)
+// Everything is kept in binary form; hex text is only produced by the
+// .obj/.lst writers. Label, mnemonic and operand are views into the source.
 typedef struct {
-    char address[8];
-    char label[MAX_LABEL_LEN];
-    char mnemonic[MAX_MNEMONIC_LEN];
-    char operand[MAX_OPERAND_LEN];
-    char object_code[MAX_OBJECT_CODE_LEN];
+    int address;                // Location counter at this statement
+    int value;                  // Resolved operand value (target, immediate or constant)
+    int line_no;                // Source line number (1-based) for diagnostics
+    int code_off;               // Encoded bytes are as->code.data[code_off .. +code_len)
+    int code_len;
+    unsigned char directive;    // DIR_* (DIR_NONE for instructions)
+    unsigned char flags;        // FLAG_* addressing flags
+    unsigned char format;       // Instruction format 1-4 (0 for directives and unknown mnemonics)
+    unsigned char state;        // LINE_* bookkeeping for incremental reassembly
+    const struct Keyword *kw;   // Opcode or directive entry, NULL if unknown
+    StrView label;
+    StrView mnemonic;
+    StrView operand;
 } Line;
 
-// Data structure to store a symbol and its address
+// Whole source file, memory-mapped when possible, otherwise read into memory
+typedef struct {
+    const char *data;
+    size_t size;
+    int kind;           // SOURCE_BORROWED / SOURCE_MAPPED / SOURCE_HEAP
+} SourceBuffer;
+
+enum {
+    SOURCE_BORROWED = 0,    // Caller's memory, not released
+    SOURCE_MAPPED,          // munmap on close
+    SOURCE_HEAP             // free on close
+};
+
+// Allocation context of one assembly (or one task of it): where a failed
+// allocation unwinds to, and where --stats counts the successful ones
+typedef struct {
+    jmp_buf jump;
+    long *allocations;  // Shared by the tasks of an assembly; NULL: not counted
+} AllocContext;
+
+// One block of the bump allocator
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for records that never move (line chunks)
+typedef struct {
+    ArenaBlock *head;
+    AllocContext *oom;       // Where to unwind on allocation failure
+} Arena;
+
+// Output sink with a large reusable formatting buffer. With a file the
+// buffer is flushed in large blocks; without one it grows and holds the
+// whole output in memory.
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t written;     // Bytes already flushed to fp
+    int borrowed;       // fp is stdout: flushed, never closed
+    AllocContext *oom;       // Where to unwind on allocation failure
+} OutBuf;
+
+// Encoded object bytes of all statements, laid out by pass1. The storage
+// is kept across assembler_reset() and only grows.
 typedef struct {
-    char symbol[MAX_LABEL_LEN];
-    char address[8];
+    unsigned char *data;
+    int len;
+    int cap;
+} CodeBuffer;
+
+// Data structure to store a symbol and its address (one hash table slot)
+// Probe statistics; parallel readers keep their own and add them up afterwards
+typedef struct {
+    long lookups;       // Number of find/insert operations
+    long probes;        // Total slots inspected by those operations
+    long collisions;    // Operations that had to skip at least one occupied slot
+    int max_probe;      // Longest probe sequence seen
+} ProbeStats;
+
+// What a symbol's value means
+enum {
+    SYM_RELATIVE = 0,   // Address inside its control section
+    SYM_EXTERNAL,       // Named by EXTREF, resolved by the loader (value 0)
+    SYM_ABSOLUTE,       // Constant defined by EQU; not moved by the loader
+    SYM_PENDING,        // EQU waiting for later symbols (value: its PendingEqu)
+    SYM_FORWARD         // Referenced before its definition in one-pass mode (value: its fixup chain)
+};
+
+typedef struct {
+    unsigned int hash;  // Cached hash of the name, 0 marks an empty slot
+    int name_off;       // Offset of the interned name in the name pool
+    int name_len;
+    int address;
+    int kind;           // SYM_*
 } Symbol;
 
-// Data structure to store an opcode (mnemonic -> code)
+// Open-addressing symbol table (linear probing, power-of-two capacity)
+typedef struct {
+    Symbol *slots;
+    int capacity;
+    int count;
+
+    char *names;        // Interned symbol names, each NUL-terminated
+    int names_len;
+    int names_cap;
+
+    AllocContext *oom;       // Where to unwind on allocation failure
+
+    ProbeStats stats;   // Counted by inserts and serial lookups
+} SymbolTable;
+
+// Kind of a reserved word in the keyword table
+enum {
+    KW_OPCODE = 1,
+    KW_DIRECTIVE,
+    KW_REGISTER
+};
+
+// Assembler directives
+enum {
+    DIR_NONE = 0,
+    DIR_START,
+    DIR_END,
+    DIR_BYTE,
+    DIR_WORD,
+    DIR_RESW,
+    DIR_RESB,
+    DIR_ORG,
+    DIR_EQU,
+    DIR_CSECT,
+    DIR_BASE,
+    DIR_NOBASE,
+    DIR_EXTDEF,
+    DIR_EXTREF,
+    DIR_LTORG,
+    DIR_MACRO,
+    DIR_MEND,
+    DIR_IF,
+    DIR_ELSE,
+    DIR_ENDIF,
+    DIR_CALL,       // Macro invocation (not a keyword); its expansion follows it
+    DIR_REMOVED     // Instruction taken out by -O (not a keyword); listed without code
+};
+
+// Operand shape of a format 2 instruction
+enum {
+    F2_NONE = 0,
+    F2_R,   // r1        (CLEAR, TIXR)
+    F2_RR,  // r1,r2     (ADDR, RMO, ...)
+    F2_RN,  // r1,n      (SHIFTL, SHIFTR)
+    F2_N    // n         (SVC)
+};
+
+// Data structure to store one reserved word (opcode, directive or register)
+typedef struct Keyword {
+    const char *name;
+    unsigned char len;
+    unsigned char kind;      // KW_OPCODE / KW_DIRECTIVE / KW_REGISTER
+    unsigned char opcode;    // Machine opcode (KW_OPCODE)
+    unsigned char format;    // Instruction format 1, 2 or 3 (KW_OPCODE)
+    unsigned char directive; // DIR_* (KW_DIRECTIVE)
+    unsigned char reg;       // Register number (KW_REGISTER)
+    unsigned char operands;  // F2_* operand shape (format 2 opcodes)
+} Keyword;
+
+// A literal operand (=C'..' or =X'..') waiting for, or placed in, a pool
+typedef struct {
+    StrView text;       // As first written
+    int size;           // Bytes
+    int line_no;        // First use, for diagnostics
+} Literal;
+
+// Literals placed by one LTORG (or END): literals first..first+count-1 of
+// the section. Only pools holding at least one literal are recorded.
+typedef struct {
+    int line;           // Statement index of the LTORG or END
+    int first;
+    int count;
+} LiteralPool;
+
+// An EQU naming symbols defined further on, resolved at the end of the
+// section's layout
+typedef struct {
+    StrView label;
+    StrView operand;
+    int line_no;
+    int here;           // Value of * in the operand
+    int state;          // EQU_WAITING / EQU_ACTIVE / EQU_DONE
+} PendingEqu;
+
+// What the -O pass saved
+typedef struct {
+    int rewrites;       // Statements rewritten or removed
+    int bytes;          // Object code saved
+    long cycles;        // Simulator cycles saved, each statement run once
+} PeepholeStats;
+
+// One control section: the statements from the start of the program, or
+// from a CSECT statement, up to the next CSECT. Each has its own location
+// counter (the first one starts at the START address, the others at 0),
+// its own symbol scope and its own H/D/R/T/M/E records, so sections are
+// laid out independently of each other.
+typedef struct {
+    int first;          // Statements first..last-1
+    int last;
+    int start_addr;
+    int length;
+    int start_index;    // Statement holding the START that set start_addr, -1 if none
+    int end_index;      // Last END statement, -1 if none
+    int final_lc;       // Location counter after the last statement
+    int code_off;       // Object code of the section is code.data[code_off .. +code_len)
+    int code_len;
+    int relaxed_count;  // Instructions widened to format 4 by relaxation
+    int extref_count;   // Names declared by EXTREF
+
+    SymbolTable symtab;
+
+    int *base_lines;    // BASE and NOBASE statements, in order
+    int base_count;
+    int base_cap;
+
+    Literal *literals;  // Pool by pool, each in order of first use
+    int literal_count;
+    int literal_cap;
+    LiteralPool *pools;
+    int pool_count;
+    int pool_cap;
+
+    int equ_count;      // EQU statements
+    PendingEqu *pending;
+    int pending_count;
+    int pending_cap;
+
+    // Pass1 diagnostics, kept here while sections are laid out in parallel
+    SicDiagnostic *diags;
+    int diag_count;
+    int diag_cap;
+    int error_count;
+
+    PeepholeStats peephole; // What -O saved in the section
+
+    AllocContext task_oom;   // Unwind target of a layout task on a worker thread
+    int out_of_memory;  // The layout task ran out of memory
+} Section;
+
+// What a piece of a macro body field stands for
+enum {
+    MSEG_TEXT = 0,      // Text as written
+    MSEG_PARAM,         // The argument given for a parameter
+    MSEG_UNIQUE         // The $ of a label local to one expansion
+};
+
+typedef struct {
+    StrView text;       // MSEG_TEXT
+    int kind;           // MSEG_*
+    int param;          // MSEG_PARAM: parameter number
+} MacroSegment;
+
+// Segments first..first+count-1 (also: expanded statements of a cache entry)
+typedef struct {
+    int first;
+    int count;
+} MacroField;
+
+// A statement of a macro body, its label, mnemonic and operand cut into segments
+typedef struct {
+    MacroField field[3];
+    int directive;      // DIR_IF / DIR_ELSE / DIR_ENDIF, or whatever it is
+    int jump;           // IF: its ELSE or ENDIF, ELSE: its ENDIF (body statement numbers)
+} MacroStatement;
+
+typedef struct {
+    StrView name;
+    int first_param;    // Parameter names params[first_param ..]
+    int param_count;
+    int first;          // Body statements[first .. first+count-1]
+    int count;
+    int line_no;        // The MACRO statement
+} Macro;
+
+// A statement as an expansion produces it, before its $ labels are named
+typedef struct {
+    Line line;
+    unsigned char unique;   // Label, mnemonic, operand (bits 0-2) hold MACRO_UNIQUE
+    int macro;              // Macro this statement invokes, -1 if none
+} ExpandedStatement;
+
+// Macro definitions and the expansions made of them
+typedef struct {
+    Macro *macros;
+    int macro_count;
+    int macro_cap;
+    SymbolTable names;          // Macro name => index in macros
+
+    MacroStatement *statements;
+    int statement_count;
+    int statement_cap;
+    MacroSegment *segments;
+    int segment_count;
+    int segment_cap;
+    StrView *params;
+    int param_count;
+    int param_cap;
+
+    SymbolTable cache;          // Macro and arguments => index in entries
+    MacroField *entries;        // Statements of one expansion in expanded[]
+    int entry_count;
+    int entry_cap;
+    ExpandedStatement *expanded;
+    int expanded_count;
+    int expanded_cap;
+    char *key;                  // Cache key being built
+    int key_cap;
+
+    long expansions;            // Invocations expanded
+    long cache_hits;            // ... of which were found in the cache
+    long serial;                // Expansions that named $ labels so far
+
+    int runaway;                // The invocation being expanded nests too deeply
+    int definitions;            // MACRO statements read, valid or not
+    int in_body;                // Line of the MACRO whose body is read (up to its MEND), 0 if none
+    int defining;               // Macro whose body is read, -1 if it is not kept
+    int if_depth;               // IFs open in the body
+    int if_stack[MACRO_DEPTH_MAX]; // Their (or their ELSE's) body statement numbers
+} MacroTable;
+
+// Phases of an assembly timed by --stats
+enum {
+    PHASE_READ = 0,
+    PHASE_PASS1,
+    PHASE_PASS2,
+    PHASE_OBJECT,
+    PHASE_LISTING,
+    PHASE_COUNT
+};
+
+// Figures --stats reports besides the lookup statistics the tables always
+// keep. They are only gathered while an Assembler's stats pointer is set,
+// so an ordinary assembly never reads a clock.
 typedef struct {
-    char mnemonic[MAX_MNEMONIC_LEN];
-    char opcode[4];
-} Opcode;
+    double wall[PHASE_COUNT];   // Seconds spent in each phase
+    double cpu[PHASE_COUNT];    // Process CPU seconds (all threads) in each phase
+    double mark_wall;           // Clocks when the running phase began
+    double mark_cpu;
+    long bytes_read;
+    long bytes_written;
+    long text_records;          // T records of the object program
+    long allocations;           // Counted by xrealloc through the Assembler's oom context
+} AssemblyStats;
 
-// Data structure to store a register (name -> code)
+// The listing while it is written on a thread of its own
 typedef struct {
-    char regName[MAX_LABEL_LEN];
-    char regCode[2];
-} RegisterMap;
+    pthread_t thread;
+    int running;        // The thread has yet to be joined
+    OutBuf *lst;
+    AllocContext oom;   // Unwind target of the listing thread
+    int out_of_memory;  // The thread ran out of memory
+} ListingWriter;
 
 // Data structure to store the Assembler context
 typedef struct {
-    Line lines[MAX_LINES];
+    SourceBuffer src;
+    Arena arena;
+    CodeBuffer code;
+
+    Line **line_chunks;        // Lines live in fixed-size chunks allocated from arena
+    int chunk_count;
+    int chunk_cap;
     int line_count;
 
-    Symbol symbol_table[MAX_SYMBOLS];
-    int symbol_count;
+    Section *sections;  // Control sections in source order (at least one after pass1)
+    int section_count;
+    int section_cap;
+    MacroTable macros;
+    ProbeStats lookup_stats;    // Symbol lookups made by pass2 readers
+    ProbeStats keyword_stats;   // Keyword table lookups (mnemonics, register names)
+    int source_line_count;      // Physical lines read by pass1
+    int entry;                  // Execution address: END's operand, else the start address
+    int entry_diag;             // The last pass1 diagnostic is resolve_entry()'s
+    AssemblyStats *stats;       // Phase times and output counts go here when set
 
-    Opcode opcode_map[64];     // Enough to store all possible opcodes
-    int opcode_count;
+    int jobs;           // Threads pass1, pass2 and the outputs may use (1 = run on the calling thread)
+    int fill_records;   // T records are filled to the limit, splitting statements between them
+    int optimize;       // Run the peephole pass (-O) on every section after layout
+    PeepholeStats peephole;     // What it saved, all sections together
+    ListingWriter listing;      // Writes the listing while the object is written
 
-    RegisterMap register_map[16];
-    int register_count;
+    // Diagnostics in the order they were reported
+    SicDiagnostic *diags;
+    int diag_count;
+    int diag_cap;
+    int error_count;
+    int pass1_diag_count;   // The first diagnostics come from pass1
 
-    int start_addr;
-    int program_length;
+    AllocContext oom;   // Allocation failures unwind here (see run_assembly)
 } Assembler;
 
 /* 
  * Utility functions
  */
 
-// Trim leading and trailing whitespace from a string
-static void trim(char *str) {
-    char *end;
-    // Trim leading spaces
-    while (isspace((unsigned char)*str)) {
-        str++;
-    }
-    // All spaces?
-    if (*str == 0) {
-        return;
+// realloc that does not return on failure: it unwinds to the running
+// assembly (run_assembly), leaving the old block owned by the caller.
+// Allocations are counted when the context has a counter; the tasks of one
+// assembly share it, so it is added to atomically.
+static void* xrealloc(AllocContext *oom, void *p, size_t size) {
+    void *q = realloc(p, size);
+    if (q == NULL && size > 0) {
+        longjmp(oom->jump, 1);
     }
-    // Trim trailing spaces
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) {
-        end--;
+    if (oom->allocations != NULL) {
+#ifdef __GNUC__
+        __atomic_fetch_add(oom->allocations, 1, __ATOMIC_RELAXED);
+#else
+        (*oom->allocations)++;
+#endif
     }
-    end[1] = '\0';
+    return q;
 }
 
-// Check if a given mnemonic is a directive
-static int is_directive(const char *mnemonic) {
-    // For convenience, we store the known directives
-    const char *directives[] = {
-        "START", "END", "BYTE", "WORD", "RESW", "RESB",
-        "ORG", "EQU", "CSECT"
-    };
-    int n = sizeof(directives) / sizeof(directives[0]);
-    for (int i = 0; i < n; i++) {
-        if (strcmp(mnemonic, directives[i]) == 0) {
-            return 1;
+// Append an entry to a growable diagnostics list; NULL if it cannot grow
+static SicDiagnostic* diag_slot(SicDiagnostic **diags, int *count, int *cap) {
+    if (*count == *cap) {
+        int new_cap = *cap ? *cap * 2 : 16;
+        SicDiagnostic *d = (SicDiagnostic*)realloc(*diags, new_cap * sizeof(SicDiagnostic));
+        if (d == NULL) {
+            return NULL;
         }
+        *diags = d;
+        *cap = new_cap;
     }
-    return 0;
+    return &(*diags)[(*count)++];
 }
 
-// Find opcode in the opcode_map (linear search)
-static const char* find_opcode(Assembler *as, const char *mnemonic) {
-    for (int i = 0; i < as->opcode_count; i++) {
-        if (strcmp(as->opcode_map[i].mnemonic, mnemonic) == 0) {
-            return as->opcode_map[i].opcode;
-        }
+static void diag_append(SicDiagnostic **diags, int *count, int *cap, const SicDiagnostic *src) {
+    SicDiagnostic *d = diag_slot(diags, count, cap);
+    if (d != NULL) {
+        *d = *src;
     }
-    return NULL;
 }
 
-// Find register code in the register_map
-static const char* find_register_code(Assembler *as, const char *regName) {
-    for (int i = 0; i < as->register_count; i++) {
-        if (strcmp(as->register_map[i].regName, regName) == 0) {
-            return as->register_map[i].regCode;
-        }
+// Format a diagnostic into a growable list; dropped if the list cannot grow
+static void diag_vadd(SicDiagnostic **diags, int *count, int *cap, int severity, int line_no,
+                      const char *fmt, va_list ap) {
+    SicDiagnostic *d = diag_slot(diags, count, cap);
+    if (d == NULL) {
+        return;
     }
-    return NULL;
+    d->line = line_no;
+    d->severity = severity;
+    vsnprintf(d->message, sizeof(d->message), fmt, ap);
 }
 
-// Check if the token is a mnemonic (either an opcode or a directive)
-static int is_mnemonic(Assembler *as, const char *token) {
-    if (find_opcode(as, token) != NULL) {
-        return 1;
+// Record a diagnostic; line 0 means it is not tied to a source line
+static void report(Assembler *as, int severity, int line_no, const char *fmt, ...) {
+    if (severity == SIC_SEVERITY_ERROR) {
+        as->error_count++; // counted even if it cannot be stored
     }
-    if (is_directive(token)) {
-        return 1;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vadd(&as->diags, &as->diag_count, &as->diag_cap, severity, line_no, fmt, ap);
+    va_end(ap);
+}
+
+#define report_error(as, line_no, ...) report((as), SIC_SEVERITY_ERROR, (line_no), __VA_ARGS__)
+
+// Monotonic wall clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// CPU time used by the whole process (every thread) in seconds
+static double cpu_seconds(void) {
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Start timing a phase; does nothing unless as->stats is set
+static void stats_mark(Assembler *as) {
+    if (as->stats != NULL) {
+        as->stats->mark_wall = now_seconds();
+        as->stats->mark_cpu = cpu_seconds();
     }
-    return 0;
 }
 
-// Add a symbol to the symbol table
-static int add_symbol(Assembler *as, const char *symbol, const char *address) {
-    // Check for duplicate
-    for (int i = 0; i < as->symbol_count; i++) {
-        if (strcmp(as->symbol_table[i].symbol, symbol) == 0) {
-            // Duplicate symbol
-            return 0;
-        }
+// Charge the time since the last mark to phase and start timing the next
+static void stats_phase(Assembler *as, int phase) {
+    AssemblyStats *st = as->stats;
+    if (st != NULL) {
+        double wall = now_seconds();
+        double cpu = cpu_seconds();
+        st->wall[phase] += wall - st->mark_wall;
+        st->cpu[phase] += cpu - st->mark_cpu;
+        st->mark_wall = wall;
+        st->mark_cpu = cpu;
     }
-    // Add new symbol
-    strcpy(as->symbol_table[as->symbol_count].symbol, symbol);
-    strcpy(as->symbol_table[as->symbol_count].address, address);
-    as->symbol_count++;
-    return 1;
 }
 
-// Find a symbol in the symbol table
-static const char* find_symbol(Assembler *as, const char *symbol) {
-    for (int i = 0; i < as->symbol_count; i++) {
-        if (strcmp(as->symbol_table[i].symbol, symbol) == 0) {
-            return as->symbol_table[i].address;
-        }
+static const StrView empty_view = {"", 0};
+
+static StrView make_view(const char *ptr, int len) {
+    StrView v;
+    v.ptr = len > 0 ? ptr : "";
+    v.len = len;
+    return v;
+}
+
+static int view_eq(StrView a, StrView b) {
+    return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static int view_starts_with(StrView v, const char *prefix) {
+    int n = (int)strlen(prefix);
+    return v.len >= n && memcmp(v.ptr, prefix, n) == 0;
+}
+
+// Drop leading and trailing whitespace
+static StrView view_trim(StrView v) {
+    while (v.len > 0 && isspace((unsigned char)v.ptr[0])) {
+        v.ptr++;
+        v.len--;
     }
-    return NULL;
+    while (v.len > 0 && isspace((unsigned char)v.ptr[v.len - 1])) {
+        v.len--;
+    }
+    return make_view(v.ptr, v.len);
 }
 
-/*
- * Assembler initialization
- */
-static void initialize_opcode_map(Assembler *as) {
-    // List of opcodes
-    Opcode opcodes[] = {
-        {"LDA", "00"}, {"LDX", "04"}, {"LDL", "08"}, {"STA", "0C"},
-        {"STX", "10"}, {"STL", "14"}, {"ADD", "18"}, {"SUB", "1C"},
-        {"MUL", "20"}, {"DIV", "24"}, {"COMP","28"}, {"TIX", "2C"},
-        {"JEQ", "30"}, {"JGT", "34"}, {"JLT", "38"}, {"J",   "3C"},
-        {"JSUB","48"}, {"RSUB","4C"}, {"AND", "40"}, {"OR",  "44"},
-        {"LDCH","50"}, {"STCH","54"}, {"LDB", "68"}, {"STB", "78"},
-        {"LDT", "74"}, {"LDS", "6C"}, {"STT", "84"}, {"RD",  "D8"},
-        {"WD",  "DC"}, {"TD",  "E0"}, {"STSW","E8"}, 
-        // Format 2
-        {"ADDR","90"}, {"SUBR","94"}, {"COMPR","A0"}, {"MULR","98"},
-        {"DIVR","9C"}, {"RMO", "AC"}, {"CLEAR","B4"}, {"TIXR","B8"},
-        {"SHIFTL","A4"}, {"SHIFTR","A8"},
-        // Additional
-        {"STS","7C"},
-    };
-    int count = sizeof(opcodes) / sizeof(opcodes[0]);
-    for (int i = 0; i < count; i++) {
-        strcpy(as->opcode_map[i].mnemonic, opcodes[i].mnemonic);
-        strcpy(as->opcode_map[i].opcode, opcodes[i].opcode);
+// Return the next whitespace-separated token and advance *p past it
+static StrView next_token(const char **p, const char *end) {
+    const char *s = *p;
+    while (s < end && isspace((unsigned char)*s)) {
+        s++;
+    }
+    const char *e = s;
+    while (e < end && !isspace((unsigned char)*e)) {
+        e++;
     }
-    as->opcode_count = count;
+    *p = e;
+    return make_view(s, (int)(e - s));
 }
 
-static void initialize_register_map(Assembler *as) {
-    RegisterMap regs[] = {
-        {"A",  "0"}, {"X",  "1"}, {"L",  "2"},
-        {"B",  "3"}, {"S",  "4"}, {"T",  "5"},
-        {"F",  "6"}, {"PC", "8"}, {"SW", "9"}
-    };
-    int count = sizeof(regs) / sizeof(regs[0]);
-    for (int i = 0; i < count; i++) {
-        strcpy(as->register_map[i].regName, regs[i].regName);
-        strcpy(as->register_map[i].regCode, regs[i].regCode);
+// Split "a,b" at the first comma; b is empty when there is no comma
+static void split_comma(StrView v, StrView *a, StrView *b) {
+    const char *comma = (const char*)memchr(v.ptr, ',', (size_t)v.len);
+    if (comma == NULL) {
+        *a = view_trim(v);
+        *b = empty_view;
+        return;
     }
-    as->register_count = count;
+    *a = view_trim(make_view(v.ptr, (int)(comma - v.ptr)));
+    *b = view_trim(make_view(comma + 1, (int)(v.ptr + v.len - comma - 1)));
 }
 
-// Initialize the assembler data structure
-static void assembler_init(Assembler *as) {
-    as->line_count = 0;
-    as->symbol_count = 0;
-    as->start_addr = 0;
-    as->program_length = 0;
-    // Initialize opcode and register maps
-    initialize_opcode_map(as);
-    initialize_register_map(as);
+// Parse a number like strtol: optional sign, then digits up to the first invalid char
+static long view_to_long(StrView v, int base) {
+    int i = 0;
+    int neg = 0;
+    long value = 0;
+    while (i < v.len && isspace((unsigned char)v.ptr[i])) {
+        i++;
+    }
+    if (i < v.len && (v.ptr[i] == '-' || v.ptr[i] == '+')) {
+        neg = v.ptr[i] == '-';
+        i++;
+    }
+    for (; i < v.len; i++) {
+        int c = (unsigned char)v.ptr[i];
+        int d;
+        if (isdigit(c)) {
+            d = c - '0';
+        } else if (isalpha(c)) {
+            d = toupper(c) - 'A' + 10;
+        } else {
+            break;
+        }
+        if (d >= base) {
+            break;
+        }
+        // Saturate rather than overflow
+        value = value > (LONG_MAX - d) / base ? LONG_MAX : value * base + d;
+    }
+    return neg ? -value : value;
 }
 
 /*
- * PASS 1
+ * Source reader
  */
-static void pass1(Assembler *as, char **raw_lines, int raw_count) {
-    int LC = 0;
-    int start_found = 0;
-    int line_num = 0;
-    
-    for (int i = 0; i < raw_count; i++) {
-        // Copy the line, then trim
-        char buffer[256];
-        strcpy(buffer, raw_lines[i]);
-        trim(buffer);
-        if (strlen(buffer) == 0) {
-            continue; // skip empty line
+
+#ifndef SIC_NO_MAIN
+// Map the whole file read-only; pipes, stdin ("-") and unmappable files are
+// read in large chunks instead. Returns 0 if the file cannot be opened or
+// read into memory.
+static int source_open(SourceBuffer *src, const char *path) {
+    memset(src, 0, sizeof(SourceBuffer));
+    src->data = "";
+#ifndef _WIN32
+    if (strcmp(path, "-") != 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return 0;
         }
-        
-        // Prepare a new line structure
-        Line current_line;
-        memset(&current_line, 0, sizeof(Line));
-        
-        // Tokenize (split by spaces)
-        char *tokens[8];
-        int token_count = 0;
-        char *p = strtok(buffer, " \t");
-        while (p != NULL && token_count < 8) {
-            tokens[token_count++] = p;
-            p = strtok(NULL, " \t");
-        }
-        
-        if (token_count == 0) {
-            continue;
-        }
-        
-        // Check first token: is it a mnemonic or label?
-        if (is_mnemonic(as, tokens[0])) {
-            // No label
-            strcpy(current_line.label, "");
-            strcpy(current_line.mnemonic, tokens[0]);
-            // Remainder is operand
-            if (token_count > 1) {
-                int len = 0;
-                // Join the rest as operand
-                for (int k = 1; k < token_count; k++) {
-                    if (k > 1) {
-                        current_line.operand[len++] = ' ';
-                    }
-                    strcat(current_line.operand, tokens[k]);
-                    len = strlen(current_line.operand);
-                }
-            }
-        } else {
-            // First token is label
-            strcpy(current_line.label, tokens[0]);
-            if (token_count > 1) {
-                strcpy(current_line.mnemonic, tokens[1]);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (st.st_size == 0) {
+                close(fd);
+                return 1;
             }
-            if (token_count > 2) {
-                int len = 0;
-                for (int k = 2; k < token_count; k++) {
-                    if (k > 2) {
-                        current_line.operand[len++] = ' ';
-                    }
-                    strcat(current_line.operand, tokens[k]);
-                    len = strlen(current_line.operand);
-                }
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+                close(fd);
+                src->data = (const char*)map;
+                src->size = (size_t)st.st_size;
+                src->kind = SOURCE_MAPPED;
+                return 1;
             }
         }
-        
-        // Handle START
-        if (!start_found && strcmp(current_line.mnemonic, "START") == 0) {
-            // parse the hex address
-            LC = (int)strtol(current_line.operand, NULL, 16);
-            as->start_addr = LC;
-            sprintf(current_line.address, "%04X", LC);
-            as->lines[as->line_count++] = current_line;
-            start_found = 1;
-            continue;
-        }
-        
-        // If there's a label, add to symbol table
-        if (strlen(current_line.label) > 0) {
-            char address_str[8];
-            sprintf(address_str, "%04X", LC);
-            if (!add_symbol(as, current_line.label, address_str)) {
-                fprintf(stderr, "Error: Duplicate symbol '%s' at line %d\n",
-                        current_line.label, i+1);
-                        error_count+=1;
-            }
-        }
-        
-        // Set address
-        sprintf(current_line.address, "%04X", LC);
-        as->lines[as->line_count++] = current_line;
-        
-        // Update LC based on mnemonic
-        if (is_directive(current_line.mnemonic)) {
-            if (strcmp(current_line.mnemonic, "START") == 0 ||
-                strcmp(current_line.mnemonic, "END") == 0 ||
-                strcmp(current_line.mnemonic, "CSECT") == 0) {
-                if (strcmp(current_line.mnemonic, "END") == 0) {
-                    as->program_length = LC - as->start_addr;
-                }
-                continue;
-            } else if (strcmp(current_line.mnemonic, "BYTE") == 0) {
-                if (strncmp(current_line.operand, "C'", 2) == 0) {
-                    // count chars
-                    // e.g. C'EOF'
-                    int len = (int)strlen(current_line.operand);
-                    // minus 3 for C' '
-                    int count = len - 3;
-                    LC += count;
-                } else if (strncmp(current_line.operand, "X'", 2) == 0) {
-                    // e.g. X'F1'
-                    int len = (int)strlen(current_line.operand);
-                    // substring between X' and '
-                    int hex_len = len - 3;
-                    LC += hex_len / 2;
-                }
-            } else if (strcmp(current_line.mnemonic, "WORD") == 0) {
-                LC += 3;
-            } else if (strcmp(current_line.mnemonic, "RESW") == 0) {
-                int reserve = atoi(current_line.operand);
-                LC += 3 * reserve;
-            } else if (strcmp(current_line.mnemonic, "RESB") == 0) {
-                int reserve = atoi(current_line.operand);
-                LC += reserve;
-            } else if (strcmp(current_line.mnemonic, "ORG") == 0) {
-                const char *addr_str = find_symbol(as, current_line.operand);
-                if (addr_str) {
-                    LC = (int)strtol(addr_str, NULL, 16);
-                } else {
-                    LC = (int)strtol(current_line.operand, NULL, 16);
-                }
-            } else if (strcmp(current_line.mnemonic, "EQU") == 0) {
-                // e.g. LABEL EQU value or symbol
-                char address_str[8];
-                if (isdigit(current_line.operand[0])) {
-                    int value = atoi(current_line.operand);
-                    sprintf(address_str, "%04X", value);
-                    add_symbol(as, current_line.label, address_str);
-                } else {
-                    const char *addr_str2 = find_symbol(as, current_line.operand);
-                    if (addr_str2) {
-                        // Update
-                        add_symbol(as, current_line.label, addr_str2);
-                    } else {
-                        fprintf(stderr, "Error: Undefined symbol in EQU at line %d\n",
-                                i+1);
-                        // default
-                        add_symbol(as, current_line.label, "0000");
-                        error_count+=1;
-                    }
-                }
-            }
-        } else {
-            // Format 2 instructions
-            const char *format2_list[] = {
-                "CLEAR", "TIXR", "ADDR", "SUBR", "COMPR",
-                "MULR", "DIVR", "RMO", "SVC", "STPR"
-            };
-            int is_format2 = 0;
-            for (int f = 0; f < 10; f++) {
-                if (strcmp(current_line.mnemonic, format2_list[f]) == 0) {
-                    is_format2 = 1;
-                    break;
+        close(fd);
+    }
+#endif
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!fp) {
+        return 0;
+    }
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    for (;;) {
+        if (cap - len < SOURCE_READ_CHUNK) {
+            cap = cap ? cap * 2 : SOURCE_READ_CHUNK;
+            char *grown = (char*)realloc(buf, cap);
+            if (grown == NULL) {
+                free(buf);
+                if (fp != stdin) {
+                    fclose(fp);
                 }
+                return 0;
             }
-            if (is_format2) {
-                LC += 2;
-            } else {
-                LC += 3;
-            }
+            buf = grown;
+        }
+        size_t n = fread(buf + len, 1, cap - len, fp);
+        if (n == 0) {
+            break;
         }
+        len += n;
     }
-    // If there's no END or if END not updated the length
-    if (as->program_length == 0) {
-        as->program_length = LC - as->start_addr;
+    if (fp != stdin) {
+        fclose(fp);
     }
+    if (buf != NULL) {
+        src->data = buf;
+        src->kind = SOURCE_HEAP;
+    }
+    src->size = len;
+    return 1;
 }
-    static int is_format2(const char *mnemonic) {
-        const char *format2_list[] = {
-            "CLEAR", "TIXR", "ADDR", "SUBR", "COMPR",
-            "MULR", "DIVR", "RMO", "SVC", "STPR", "SHIFTL", "SHIFTR"
-        };
-        for (int i = 0; i < 10; i++) {
-            if (strcmp(mnemonic, format2_list[i]) == 0) {
-                return 1;  // found
-            }
-        }
-        return 0;  // not found
+#endif
+
+// Wrap a caller-owned buffer without copying it
+static void source_borrow(SourceBuffer *src, const char *data, size_t size) {
+    src->data = size > 0 ? data : "";
+    src->size = size;
+    src->kind = SOURCE_BORROWED;
+}
+
+static void source_close(SourceBuffer *src) {
+#ifndef _WIN32
+    if (src->kind == SOURCE_MAPPED) {
+        munmap((void*)src->data, src->size);
+    }
+#endif
+    if (src->kind == SOURCE_HEAP) {
+        free((void*)src->data);
+    }
+    memset(src, 0, sizeof(SourceBuffer));
+    src->data = "";
+}
+
+#ifndef SIC_NO_MAIN
+// Return the next physical line (without its newline) and advance *cursor
+static int next_line(const char **cursor, const char *end, StrView *line) {
+    const char *s = *cursor;
+    if (s >= end) {
+        return 0;
     }
+    const char *nl = (const char*)memchr(s, '\n', (size_t)(end - s));
+    const char *e = nl ? nl : end;
+    *cursor = nl ? nl + 1 : end;
+    *line = make_view(s, (int)(e - s));
+    return 1;
+}
+#endif
+
 /*
- * PASS 2
+ * Lexer
+ *
+ * lex_line() cuts the next line off the source and, in the same scan,
+ * finds every boundary a statement is split at: the first two tokens, what
+ * follows each of them and the last non-blank character. Blocks of 32
+ * (AVX2) or 16 (SSE2) bytes are classified at once into masks of blanks
+ * and newlines, and the boundaries are read off the masks with bit scans;
+ * other targets look at one byte at a time. Blanks are the isspace()
+ * characters of the C locale, as everywhere else.
  */
-static void pass2(Assembler *as) {
-    // 專門用來檢查某個 mnemonic 是否為 format2 指令 (純 C 寫法)
 
+#if defined(SIC_SCALAR_LEXER)
+// Byte at a time everywhere (check_lexer.py compares it with the block scan)
+#elif defined(__GNUC__) && defined(__AVX2__)
+#define LEX_BLOCK 32
+#elif defined(__GNUC__) && defined(__SSE2__)
+#define LEX_BLOCK 16
+#endif
 
-    for (int i = 0; i < as->line_count; i++) {
-        Line *line = &as->lines[i];
-        if (strlen(line->mnemonic) == 0) {
-            continue;
-        }
-        if (is_directive(line->mnemonic)) {
-            // Handle BYTE / WORD to fill object_code
-            if (strcmp(line->mnemonic, "BYTE") == 0) {
-                char *operand = line->operand;
-                if (strncmp(operand, "C'", 2) == 0) {
-                    // Convert each char to hex
-                    char *val = operand + 2; // skip C'
-                    int len = strlen(val);
-                    if (len >= 1 && val[len-1] == '\'') {
-                        val[len-1] = '\0'; // remove trailing '
-                    }
-                    // Construct object code
-                    char obj[256];
-                    obj[0] = '\0';
-                    for (int c = 0; c < (int)strlen(val); c++) {
-                        char tmp[8];
-                        sprintf(tmp, "%02X", (unsigned char)val[c]);
-                        strcat(obj, tmp);
-                    }
-                    strcpy(line->object_code, obj);
-                } else if (strncmp(operand, "X'", 2) == 0) {
-                    // Just copy what's inside X' '
-                    char *val = operand + 2;
-                    int len = strlen(val);
-                    if (len >= 1 && val[len-1] == '\'') {
-                        val[len-1] = '\0'; // remove trailing '
-                    }
-                    // Validate hex string if needed
-                    // For now, just upper-case it
-                    for (int c = 0; c < (int)strlen(val); c++) {
-                        val[c] = (char)toupper(val[c]);
-                    }
-                    strcpy(line->object_code, val);
-                }
-            } else if (strcmp(line->mnemonic, "WORD") == 0) {
-                // Convert decimal to 6 hex digits
-                int value = atoi(line->operand);
-                char obj[8];
-                sprintf(obj, "%06X", value);
-                strcpy(line->object_code, obj);
-            }
-            continue;
-        }
-        
-        // Check if mnemonic exists
-        const char *opcode = find_opcode(as, line->mnemonic);
-        if (!opcode) {
-            fprintf(stderr, "Error: Undefined mnemonic '%s' at line %d\n", 
-                    line->mnemonic, i+1);
-                    error_count+=1;
-            strcpy(line->object_code, "000000");
-            continue;
-        }
-        
-        // Handle format 2
-        if (is_format2(line->mnemonic)) {
-            // parse registers
-            char temp_op[MAX_OPERAND_LEN];
-            strcpy(temp_op, line->operand);
-            // split by comma
-            char *r1 = strtok(temp_op, ",");
-            char *r2 = strtok(NULL, ",");
-            
-            char obj[8];
-            if (r1 && r2) {
-                const char *reg_code1 = find_register_code(as, r1);
-                const char *reg_code2 = find_register_code(as, r2);
-                if (reg_code1 && reg_code2) {
-                    sprintf(obj, "%s%s%s", opcode, reg_code1, reg_code2);
-                } else {
-                    fprintf(stderr, "Error: Invalid register(s) at line %d\n", i+1);
-                    error_count+=1;
-                    sprintf(obj, "0000");
-                }
-            } else if (r1) {
-                // Only one register
-                const char *reg_code1 = find_register_code(as, r1);
-                if (reg_code1) {
-                    sprintf(obj, "%s%s0", opcode, reg_code1);
-                } else {
-                    fprintf(stderr, "Error: Invalid register '%s' at line %d\n", r1, i+1);
-                    error_count+=1;
-                    sprintf(obj, "0000");
-                }
-            } else {
-                fprintf(stderr, "Error: Invalid operands for format2 at line %d\n", i+1);
-                error_count+=1;
-                sprintf(obj, "0000");
-            }
-            strcpy(line->object_code, obj);
-            continue;
-        }
-        
-        // Format 1 (e.g. RSUB) or Format 3
-        if (strcmp(line->mnemonic, "RSUB") == 0) {
-            // RSUB
-            strcpy(line->object_code, "4C0000");
-            continue;
-        }
-        
-        // Format 3
-        // We will set "nixbpe" bits in a simplified manner
-        // n,i bits in decimal: (# => immediate = 1, @ => indirect = 2, else => simple=4)
-        
-        int nix = 0;
-        char address[4];
-        strcpy(address, "000");
-        
-        char operand[MAX_OPERAND_LEN];
-        strcpy(operand, line->operand);
-        
-        // Check immediate
-        if (operand[0] == '#') {
-            nix = 3; // # => i=1, n=0
-            char *symbol = operand + 1; // skip #
-            // check digit or symbol
-            if (isdigit(symbol[0])) {
-                int imm_val = atoi(symbol);
-                if (imm_val > 0xFFF) {
-                    fprintf(stderr, "Error: Immediate value out of range at line %d\n", i+1);
-                    error_count+=1;
-                    imm_val = 0;
-                }
-                sprintf(address, "%03X", imm_val);
-            } else {
-                const char *addr_str = find_symbol(as, symbol);
-                if (addr_str) {
-                    int tmp_val = (int)strtol(addr_str, NULL, 16);
-                    tmp_val &= 0xFFF; // keep lower 3 hex digits
-                    sprintf(address, "%03X", tmp_val);
-                } else {
-                    fprintf(stderr, "\033[1;31mError: Undefined symbol '%s' at line %d\033[0m\n", symbol, i+1);
-                    error_count+=1;
-                    strcpy(address, "000");
-                }
-            }
-        }
-        else if (operand[0] == '@') {
-            nix = 2; // @ => i=0, n=1
-            char *symbol = operand + 1; // skip @
-            const char *addr_str = find_symbol(as, symbol);
-            if (addr_str) {
-                int tmp_val = (int)strtol(addr_str, NULL, 16);
-                tmp_val &= 0xFFF;
-                sprintf(address, "%03X", tmp_val);
-            } else {
-                fprintf(stderr, "Error: Undefined symbol '%s' at line %d\n", symbol, i+1);
-                error_count+=1;
-                strcpy(address, "000");
-            }
-        }
-        else {
-            // simple addressing => i=1, n=1 => 4 in decimal
-            nix = 1;
-            // check if there's ,X
-            char *pos = strstr(operand, ",X");
-            if (pos) {
-                // we also need to set x=1 => +1
-                nix += 1;
-                *pos = '\0'; // separate the symbol from ",X"
-            }
-            const char *addr_str = find_symbol(as, operand);
-            if (addr_str) {
-                int tmp_val = (int)strtol(addr_str, NULL, 16);
-                tmp_val &= 0xFFF;
-                sprintf(address, "%03X", tmp_val);
-            } else {
-                fprintf(stderr, "Error: Undefined symbol '%s' at line %d\n", operand, i+1);
-                error_count+=1;
-                strcpy(address, "000");
-            }
+// Boundaries of one source line, as offsets from its start
+typedef struct {
+    const char *ptr;    // Start of the line
+    int len;            // Without the newline
+    int mark[5];        // First token [mark[0], mark[1]), second [mark[2],
+                        // mark[3]), then the next non-blank; len when absent
+    int end;            // One past the last non-blank character, 0 if there is none
+} LexedLine;
+
+#ifdef LEX_BLOCK
+// Masks of the newlines (returned) and the blanks among LEX_BLOCK bytes at p
+static unsigned int lex_classify(const char *p, unsigned int *blank) {
+#if LEX_BLOCK == 32
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i ctl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8('\r' - '\t')), ctl);
+    __m256i is_space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    *blank = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(is_ctl, is_space));
+    return (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+#else
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+    __m128i is_space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    *blank = (unsigned int)_mm_movemask_epi8(_mm_or_si128(is_ctl, is_space));
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+#endif
+}
+
+// Take the boundaries among the first count bytes of a block at offset
+// base of the line; *k boundaries have been found so far
+static void lex_block(LexedLine *lx, int *k, unsigned int blank, int base, int count) {
+    unsigned int valid = count == 32 ? 0xFFFFFFFFu : (1u << count) - 1;
+    unsigned int solid = ~blank & valid;
+    blank &= valid;
+    if (solid != 0) {
+        lx->end = base + 32 - __builtin_clz(solid);
+    }
+    unsigned int from = valid;  // Bits at or after the last boundary
+    while (*k < 5) {
+        // Boundaries alternate: a non-blank, then a blank
+        unsigned int bits = (*k & 1 ? blank : solid) & from;
+        if (bits == 0) {
+            return;
         }
-        
-        // Construct object code: opcode + (nix in hex) + address
-        char obj_code[16];
-        sprintf(obj_code, "%s%X%s", opcode, nix, address);
-        strcpy(line->object_code, obj_code);
+        int b = __builtin_ctz(bits);
+        lx->mark[(*k)++] = base + b;
+        from = ~0u << b & valid;
     }
 }
+#endif
 
-/*
- * Generate Object File
- */
-static void generate_object_file(Assembler *as, const char *obj_filename) {
-    FILE *fp = fopen(obj_filename, "w");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open %s for writing.\n", obj_filename);
-        error_count+=1;
-        return;
-    }
-    
-    // Header record
-    // Program name: use the label of the first line (up to 6 chars)
-    char program_name[7];
-    memset(program_name, 0, sizeof(program_name));
-    strncpy(program_name, as->lines[0].label, 6);
-    fprintf(fp, "H%-6s%06X%06X\n", program_name, as->start_addr, as->program_length);
-    
-    // Text records (max 30 bytes => 60 hex digits)
-    int current_text_start = -1;
-    int current_length = 0;
-    char current_text[256];
-    current_text[0] = '\0';
-    
-    for (int i = 0; i < as->line_count; i++) {
-        if (strlen(as->lines[i].object_code) > 0) {
-            // If we haven't started a text record
-            if (current_text_start < 0) {
-                current_text_start = (int)strtol(as->lines[i].address, NULL, 16);
-            }
-            int obj_len = (int)strlen(as->lines[i].object_code) / 2; // each 2 hex => 1 byte
-            if (current_length + obj_len > 30) {
-                // flush
-                fprintf(fp, "T%06X%02X%s\n", current_text_start, current_length, current_text);
-                // reset
-                current_text_start = (int)strtol(as->lines[i].address, NULL, 16);
-                current_length = 0;
-                current_text[0] = '\0';
-            }
-            // append
-            strcat(current_text, as->lines[i].object_code);
-            current_length += obj_len;
+// Find the boundaries of the line at s, which ends at the first newline
+// or at end; returns its length
+static int lex_fields(const char *s, const char *end, LexedLine *lx) {
+    int n = (int)(end - s);
+    int len = -1;
+    int k = 0;
+    lx->ptr = s;
+    lx->end = 0;
+#ifdef LEX_BLOCK
+    for (int i = 0; len < 0; i += LEX_BLOCK) {
+        unsigned int blank;
+        unsigned int nl;
+        if (n - i >= LEX_BLOCK) {
+            nl = lex_classify(s + i, &blank);
         } else {
-            // if there's no object code but we have some in buffer, flush it
-            if (current_length > 0) {
-                fprintf(fp, "T%06X%02X%s\n", current_text_start, current_length, current_text);
-                current_text_start = -1;
-                current_length = 0;
-                current_text[0] = '\0';
-            }
+            // The last bytes of the text, padded with a newline
+            char tail[LEX_BLOCK];
+            memset(tail, '\n', LEX_BLOCK);
+            memcpy(tail, s + i, n - i);
+            nl = lex_classify(tail, &blank);
         }
+        int count = LEX_BLOCK;
+        if (nl != 0) {
+            count = __builtin_ctz(nl);
+            len = i + count;
+        }
+        lex_block(lx, &k, blank, i, count);
     }
-    // flush the last text record
-    if (current_length > 0) {
-        fprintf(fp, "T%06X%02X%s\n", current_text_start, current_length, current_text);
+#else
+    for (len = 0; len < n && s[len] != '\n'; len++) {
+        int c = (unsigned char)s[len];
+        int blank = c == ' ' || (c >= '\t' && c <= '\r');
+        if (!blank) {
+            lx->end = len + 1;
+        }
+        if (k < 5 && blank == (k & 1)) {
+            lx->mark[k++] = len;
+        }
     }
-    
-    // End record
-    fprintf(fp, "E%06X\n", as->start_addr);
-    
-    fclose(fp);
+#endif
+    for (; k < 5; k++) {
+        lx->mark[k] = len;
+    }
+    lx->len = len;
+    return len;
 }
 
-/*
- * Generate List File
- */
-static void generate_list_file(Assembler *as, const char *lst_filename) {
-    FILE *fp = fopen(lst_filename, "w");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open %s for writing.\n", lst_filename);
-        error_count+=1;
-        return;
-    }
-    fprintf(fp, "Address\tLabel\tMnemonic\tOperand\tObject Code\n");
-    for (int i = 0; i < as->line_count; i++) {
-        fprintf(fp, "%s\t%s\t%s\t%s\t%s\n",
-                as->lines[i].address,
-                as->lines[i].label,
-                as->lines[i].mnemonic,
-                as->lines[i].operand,
-                as->lines[i].object_code);
+// lex_fields() for the next line of the text; advances *cursor past its
+// newline and returns 0 at the end of the text
+static int lex_line(const char **cursor, const char *end, LexedLine *lx) {
+    const char *s = *cursor;
+    if (s >= end) {
+        return 0;
     }
-    fclose(fp);
+    int len = lex_fields(s, end, lx);
+    *cursor = s + len < end ? s + len + 1 : end;
+    return 1;
 }
 
-/*
- * The assemble function (main workflow)
- */
-static void assemble(Assembler *as, const char *input_file, const char *obj_file, const char *lst_file) {
-    // Read all lines from input_file
-    FILE *fp = fopen(input_file, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open %s for reading.\n", input_file);
-        error_count+=1;
-        exit(1);
-    }
-    char *raw_lines[MAX_LINES];
-    int raw_count = 0;
-    char linebuf[256];
-    
-    while (fgets(linebuf, sizeof(linebuf), fp)) {
-        // Allocate memory for line
-        raw_lines[raw_count] = (char*)malloc(strlen(linebuf) + 1);
-        strcpy(raw_lines[raw_count], linebuf);
-        raw_count++;
-        if (raw_count >= MAX_LINES) {
+// A line holding no statement: blank, or a comment (. in its first column
+// that is not blank)
+static int lex_is_blank(const LexedLine *lx) {
+    return lx->end == 0 || lx->ptr[lx->mark[0]] == '.';
+}
+
+// One past the last character of the operand starting at offset from: it
+// runs to the end of the line or to a comment, a . after a blank. Quoted
+// text such as C'A . B' is never cut.
+static int lex_operand_end(const LexedLine *lx, int from) {
+    const char *s = lx->ptr;
+    int end = from;
+    int quoted = 0;
+    for (int i = from; i < lx->end; i++) {
+        int c = (unsigned char)s[i];
+        if (c == '\'') {
+            quoted = !quoted;
+        } else if (quoted) {
+            // Part of the quoted text
+        } else if (c == '.' && (i == from || isspace((unsigned char)s[i-1]))) {
             break;
+        } else if (isspace(c)) {
+            continue;
         }
+        end = i + 1;
     }
-    fclose(fp);
-    
-    // PASS1
-    pass1(as, raw_lines, raw_count);
-    // PASS2
-    pass2(as);
-    // Generate object file
-    generate_object_file(as, obj_file);
-    // Generate list file
-    generate_list_file(as, lst_file);
-    
-    // free memory
-    for (int i = 0; i < raw_count; i++) {
-        free(raw_lines[i]);
-    }
+    return end;
 }
 
 /*
- * main function
+ * Arena storage
  */
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <input_file> <output_obj> <output_lst>\n", argv[0]);
-        return 1;
+
+static void* arena_alloc(Arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (a->head == NULL || a->head->used + size > a->head->size) {
+        size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *b = (ArenaBlock*)xrealloc(a->oom, NULL, sizeof(ArenaBlock) + block);
+        b->next = a->head;
+        b->size = block;
+        b->used = 0;
+        a->head = b;
     }
-    // Initializ*e assembler
-    Assembler assembler;
-    assembler_init(&assembler);
+    void *p = a->head->data + a->head->used;
+    a->head->used += size;
+    return p;
+}
 
-    // Assemble
-    assemble(&assembler, argv[1], argv[2], argv[3]);
-    if (error_count>0){
-        printf("\033[1;31mAssembly failed.\033[0m\n");
-        printf("\033[1;31m number of errors: %d\033[0m\n",error_count);
+// Release every block except the most recent one, which is kept for reuse
+static void arena_reset(Arena *a) {
+    if (a->head == NULL) {
+        return;
     }
-    else{
-        printf("\033[0;32mAssembly completed.\033[0m\n");
+    ArenaBlock *b = a->head->next;
+    while (b != NULL) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
     }
+    a->head->next = NULL;
+    a->head->used = 0;
+}
 
-    
-    return 0;
+static void arena_free(Arena *a) {
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
+
+// Encoded bytes of a line
+static unsigned char* line_code(Assembler *as, const Line *line) {
+    return as->code.data + line->code_off;
+}
+
+// Return line i
+static Line* line_at(Assembler *as, int i) {
+    return &as->line_chunks[i / LINE_CHUNK_SIZE][i % LINE_CHUNK_SIZE];
+}
+
+// Append a zeroed line record, allocating a new chunk when the last one is full
+static Line* append_line(Assembler *as) {
+    int chunk = as->line_count / LINE_CHUNK_SIZE;
+    if (chunk == as->chunk_count) {
+        if (as->chunk_count == as->chunk_cap) {
+            as->chunk_cap = as->chunk_cap ? as->chunk_cap * 2 : 16;
+            as->line_chunks = (Line**)xrealloc(&as->oom, as->line_chunks,
+                                               as->chunk_cap * sizeof(Line*));
+        }
+        as->line_chunks[as->chunk_count++] =
+            (Line*)arena_alloc(&as->arena, LINE_CHUNK_SIZE * sizeof(Line));
+    }
+    Line *line = line_at(as, as->line_count++);
+    memset(line, 0, sizeof(Line));
+    return line;
+}
+
+#ifndef SIC_NO_MAIN
+// Replace lines [at, at+remove) with `insert` zeroed lines, moving the
+// ones after them (used when an incremental edit changes the line count)
+static void splice_lines(Assembler *as, int at, int remove, int insert) {
+    int old_count = as->line_count;
+    if (insert > remove) {
+        for (int i = remove; i < insert; i++) {
+            append_line(as);
+        }
+        for (int i = old_count - 1; i >= at + remove; i--) {
+            *line_at(as, i + insert - remove) = *line_at(as, i);
+        }
+    } else if (insert < remove) {
+        for (int i = at + remove; i < old_count; i++) {
+            *line_at(as, i + insert - remove) = *line_at(as, i);
+        }
+        as->line_count -= remove - insert;
+    }
+    for (int i = at; i < at + insert; i++) {
+        memset(line_at(as, i), 0, sizeof(Line));
+    }
+}
+#endif
+
+/*
+ * Keyword table
+ *
+ * Opcodes, directives and registers share one static table that is laid out
+ * at compile time with a collision-free (perfect) hash, so a single probe and
+ * one comparison identify any reserved word. Edit the lists in gen_keywords.py
+ * and rerun it to regenerate the table below.
+ */
+/* BEGIN GENERATED KEYWORD TABLE (gen_keywords.py) */
+#define KEYWORD_TABLE_SIZE 512
+#define KEYWORD_HASH_SEED 0x853AA64Fu
+
+static const Keyword keyword_table[KEYWORD_TABLE_SIZE] = {
+    [  0] = {"JEQ", 3, KW_OPCODE, 0x30, 3, DIR_NONE, 0, F2_NONE},
+    [ 12] = {"JLT", 3, KW_OPCODE, 0x38, 3, DIR_NONE, 0, F2_NONE},
+    [ 17] = {"MACRO", 5, KW_DIRECTIVE, 0x00, 0, DIR_MACRO, 0, F2_NONE},
+    [ 23] = {"JSUB", 4, KW_OPCODE, 0x48, 3, DIR_NONE, 0, F2_NONE},
+    [ 27] = {"WORD", 4, KW_DIRECTIVE, 0x00, 0, DIR_WORD, 0, F2_NONE},
+    [ 31] = {"L", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 2, F2_NONE},
+    [ 33] = {"RSUB", 4, KW_OPCODE, 0x4C, 3, DIR_NONE, 0, F2_NONE},
+    [ 39] = {"T", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 5, F2_NONE},
+    [ 52] = {"EXTDEF", 6, KW_DIRECTIVE, 0x00, 0, DIR_EXTDEF, 0, F2_NONE},
+    [ 55] = {"JGT", 3, KW_OPCODE, 0x34, 3, DIR_NONE, 0, F2_NONE},
+    [ 69] = {"LDS", 3, KW_OPCODE, 0x6C, 3, DIR_NONE, 0, F2_NONE},
+    [ 73] = {"ENDIF", 5, KW_DIRECTIVE, 0x00, 0, DIR_ENDIF, 0, F2_NONE},
+    [ 74] = {"FLOAT", 5, KW_OPCODE, 0xC0, 1, DIR_NONE, 0, F2_NONE},
+    [ 75] = {"LDA", 3, KW_OPCODE, 0x00, 3, DIR_NONE, 0, F2_NONE},
+    [ 95] = {"RESB", 4, KW_DIRECTIVE, 0x00, 0, DIR_RESB, 0, F2_NONE},
+    [ 96] = {"CLEAR", 5, KW_OPCODE, 0xB4, 2, DIR_NONE, 0, F2_R},
+    [104] = {"LDL", 3, KW_OPCODE, 0x08, 3, DIR_NONE, 0, F2_NONE},
+    [122] = {"STI", 3, KW_OPCODE, 0xD4, 3, DIR_NONE, 0, F2_NONE},
+    [129] = {"TIXR", 4, KW_OPCODE, 0xB8, 2, DIR_NONE, 0, F2_R},
+    [133] = {"AND", 3, KW_OPCODE, 0x40, 3, DIR_NONE, 0, F2_NONE},
+    [135] = {"ADD", 3, KW_OPCODE, 0x18, 3, DIR_NONE, 0, F2_NONE},
+    [141] = {"F", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 6, F2_NONE},
+    [142] = {"NOBASE", 6, KW_DIRECTIVE, 0x00, 0, DIR_NOBASE, 0, F2_NONE},
+    [147] = {"X", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 1, F2_NONE},
+    [148] = {"START", 5, KW_DIRECTIVE, 0x00, 0, DIR_START, 0, F2_NONE},
+    [149] = {"ELSE", 4, KW_DIRECTIVE, 0x00, 0, DIR_ELSE, 0, F2_NONE},
+    [151] = {"MULR", 4, KW_OPCODE, 0x98, 2, DIR_NONE, 0, F2_RR},
+    [153] = {"SIO", 3, KW_OPCODE, 0xF0, 1, DIR_NONE, 0, F2_NONE},
+    [154] = {"STX", 3, KW_OPCODE, 0x10, 3, DIR_NONE, 0, F2_NONE},
+    [155] = {"ORG", 3, KW_DIRECTIVE, 0x00, 0, DIR_ORG, 0, F2_NONE},
+    [159] = {"COMPF", 5, KW_OPCODE, 0x88, 3, DIR_NONE, 0, F2_NONE},
+    [164] = {"EXTREF", 6, KW_DIRECTIVE, 0x00, 0, DIR_EXTREF, 0, F2_NONE},
+    [168] = {"STCH", 4, KW_OPCODE, 0x54, 3, DIR_NONE, 0, F2_NONE},
+    [170] = {"LDF", 3, KW_OPCODE, 0x70, 3, DIR_NONE, 0, F2_NONE},
+    [172] = {"A", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 0, F2_NONE},
+    [173] = {"IF", 2, KW_DIRECTIVE, 0x00, 0, DIR_IF, 0, F2_NONE},
+    [178] = {"S", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 4, F2_NONE},
+    [179] = {"ADDR", 4, KW_OPCODE, 0x90, 2, DIR_NONE, 0, F2_RR},
+    [185] = {"MEND", 4, KW_DIRECTIVE, 0x00, 0, DIR_MEND, 0, F2_NONE},
+    [187] = {"STS", 3, KW_OPCODE, 0x7C, 3, DIR_NONE, 0, F2_NONE},
+    [188] = {"SUBR", 4, KW_OPCODE, 0x94, 2, DIR_NONE, 0, F2_RR},
+    [189] = {"RD", 2, KW_OPCODE, 0xD8, 3, DIR_NONE, 0, F2_NONE},
+    [194] = {"STA", 3, KW_OPCODE, 0x0C, 3, DIR_NONE, 0, F2_NONE},
+    [197] = {"TD", 2, KW_OPCODE, 0xE0, 3, DIR_NONE, 0, F2_NONE},
+    [200] = {"NORM", 4, KW_OPCODE, 0xC8, 1, DIR_NONE, 0, F2_NONE},
+    [208] = {"LDT", 3, KW_OPCODE, 0x74, 3, DIR_NONE, 0, F2_NONE},
+    [209] = {"B", 1, KW_REGISTER, 0x00, 0, DIR_NONE, 3, F2_NONE},
+    [225] = {"RESW", 4, KW_DIRECTIVE, 0x00, 0, DIR_RESW, 0, F2_NONE},
+    [230] = {"LDB", 3, KW_OPCODE, 0x68, 3, DIR_NONE, 0, F2_NONE},
+    [243] = {"FIX", 3, KW_OPCODE, 0xC4, 1, DIR_NONE, 0, F2_NONE},
+    [248] = {"DIVR", 4, KW_OPCODE, 0x9C, 2, DIR_NONE, 0, F2_RR},
+    [259] = {"STSW", 4, KW_OPCODE, 0xE8, 3, DIR_NONE, 0, F2_NONE},
+    [261] = {"MUL", 3, KW_OPCODE, 0x20, 3, DIR_NONE, 0, F2_NONE},
+    [265] = {"TIX", 3, KW_OPCODE, 0x2C, 3, DIR_NONE, 0, F2_NONE},
+    [271] = {"SHIFTR", 6, KW_OPCODE, 0xA8, 2, DIR_NONE, 0, F2_RN},
+    [273] = {"SHIFTL", 6, KW_OPCODE, 0xA4, 2, DIR_NONE, 0, F2_RN},
+    [277] = {"SUB", 3, KW_OPCODE, 0x1C, 3, DIR_NONE, 0, F2_NONE},
+    [283] = {"COMPR", 5, KW_OPCODE, 0xA0, 2, DIR_NONE, 0, F2_RR},
+    [291] = {"STF", 3, KW_OPCODE, 0x80, 3, DIR_NONE, 0, F2_NONE},
+    [302] = {"STT", 3, KW_OPCODE, 0x84, 3, DIR_NONE, 0, F2_NONE},
+    [304] = {"COMP", 4, KW_OPCODE, 0x28, 3, DIR_NONE, 0, F2_NONE},
+    [319] = {"TIO", 3, KW_OPCODE, 0xF8, 1, DIR_NONE, 0, F2_NONE},
+    [323] = {"OR", 2, KW_OPCODE, 0x44, 3, DIR_NONE, 0, F2_NONE},
+    [347] = {"LTORG", 5, KW_DIRECTIVE, 0x00, 0, DIR_LTORG, 0, F2_NONE},
+    [356] = {"SVC", 3, KW_OPCODE, 0xB0, 2, DIR_NONE, 0, F2_N},
+    [359] = {"PC", 2, KW_REGISTER, 0x00, 0, DIR_NONE, 8, F2_NONE},
+    [372] = {"DIVF", 4, KW_OPCODE, 0x64, 3, DIR_NONE, 0, F2_NONE},
+    [375] = {"STB", 3, KW_OPCODE, 0x78, 3, DIR_NONE, 0, F2_NONE},
+    [377] = {"J", 1, KW_OPCODE, 0x3C, 3, DIR_NONE, 0, F2_NONE},
+    [382] = {"SSK", 3, KW_OPCODE, 0xEC, 3, DIR_NONE, 0, F2_NONE},
+    [386] = {"END", 3, KW_DIRECTIVE, 0x00, 0, DIR_END, 0, F2_NONE},
+    [387] = {"DIV", 3, KW_OPCODE, 0x24, 3, DIR_NONE, 0, F2_NONE},
+    [389] = {"LDCH", 4, KW_OPCODE, 0x50, 3, DIR_NONE, 0, F2_NONE},
+    [398] = {"HIO", 3, KW_OPCODE, 0xF4, 1, DIR_NONE, 0, F2_NONE},
+    [402] = {"CSECT", 5, KW_DIRECTIVE, 0x00, 0, DIR_CSECT, 0, F2_NONE},
+    [413] = {"BYTE", 4, KW_DIRECTIVE, 0x00, 0, DIR_BYTE, 0, F2_NONE},
+    [414] = {"LPS", 3, KW_OPCODE, 0xD0, 3, DIR_NONE, 0, F2_NONE},
+    [415] = {"ADDF", 4, KW_OPCODE, 0x58, 3, DIR_NONE, 0, F2_NONE},
+    [417] = {"SUBF", 4, KW_OPCODE, 0x5C, 3, DIR_NONE, 0, F2_NONE},
+    [422] = {"SW", 2, KW_REGISTER, 0x00, 0, DIR_NONE, 9, F2_NONE},
+    [430] = {"WD", 2, KW_OPCODE, 0xDC, 3, DIR_NONE, 0, F2_NONE},
+    [437] = {"STL", 3, KW_OPCODE, 0x14, 3, DIR_NONE, 0, F2_NONE},
+    [443] = {"MULF", 4, KW_OPCODE, 0x60, 3, DIR_NONE, 0, F2_NONE},
+    [450] = {"EQU", 3, KW_DIRECTIVE, 0x00, 0, DIR_EQU, 0, F2_NONE},
+    [466] = {"RMO", 3, KW_OPCODE, 0xAC, 2, DIR_NONE, 0, F2_RR},
+    [495] = {"BASE", 4, KW_DIRECTIVE, 0x00, 0, DIR_BASE, 0, F2_NONE},
+    [503] = {"LDX", 3, KW_OPCODE, 0x04, 3, DIR_NONE, 0, F2_NONE},
+};
+/* END GENERATED KEYWORD TABLE */
+
+// Must match hash_keyword() in gen_keywords.py
+static unsigned int hash_keyword(const char *s, int len) {
+    unsigned int h = KEYWORD_HASH_SEED;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+// Look up a reserved word; returns NULL for anything else (labels, symbols)
+static const Keyword* lookup_keyword_n(const char *s, int len) {
+    const Keyword *kw = &keyword_table[hash_keyword(s, len)];
+    if (kw->name != NULL && kw->len == len && memcmp(kw->name, s, len) == 0) {
+        return kw;
+    }
+    return NULL;
+}
+
+// lookup_keyword_n() counted in ps: a perfect hash inspects one slot
+static const Keyword* lookup_keyword(StrView v, ProbeStats *ps) {
+    ps->lookups++;
+    ps->probes++;
+    ps->max_probe = 1;
+    return lookup_keyword_n(v.ptr, v.len);
+}
+
+// Look up a keyword of one kind only
+static const Keyword* lookup_kind(StrView v, int kind, ProbeStats *ps) {
+    const Keyword *kw = lookup_keyword(v, ps);
+    return (kw != NULL && kw->kind == kind) ? kw : NULL;
+}
+
+// Check if the token is a mnemonic (either an opcode or a directive)
+static int is_mnemonic(StrView token, ProbeStats *ps) {
+    const Keyword *kw = lookup_keyword(token, ps);
+    return kw != NULL && kw->kind != KW_REGISTER;
+}
+
+/*
+ * Symbol table
+ */
+
+// FNV-1a hash of a symbol name
+static unsigned int hash_name(const char *name, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    // 0 is reserved for empty slots
+    return h ? h : 1;
+}
+
+// Slots are allocated on the first insert
+static void symtab_init(SymbolTable *st, AllocContext *oom) {
+    memset(st, 0, sizeof(SymbolTable));
+    st->oom = oom;
+}
+
+// Forget every symbol but keep the slots and name pool
+static void symtab_clear(SymbolTable *st) {
+    if (st->slots != NULL) {
+        memset(st->slots, 0, st->capacity * sizeof(Symbol));
+    }
+    st->count = 0;
+    st->names_len = 0;
+}
+
+static void symtab_free(SymbolTable *st) {
+    AllocContext *oom = st->oom;
+    free(st->slots);
+    free(st->names);
+    symtab_init(st, oom);
+}
+
+// Return the slot holding name, or the empty slot where it would be inserted.
+// The table itself is not modified, only the statistics in ps.
+static Symbol* symtab_probe(const SymbolTable *st, ProbeStats *ps, const char *name, int len,
+                            unsigned int h) {
+    unsigned int mask = (unsigned int)st->capacity - 1;
+    unsigned int idx = h & mask;
+    int probe = 1;
+    ps->lookups++;
+    for (;;) {
+        Symbol *slot = &st->slots[idx];
+        if (slot->hash == 0 ||
+            (slot->hash == h && slot->name_len == len &&
+             memcmp(st->names + slot->name_off, name, len) == 0)) {
+            ps->probes += probe;
+            if (probe > 1) {
+                ps->collisions++;
+            }
+            if (probe > ps->max_probe) {
+                ps->max_probe = probe;
+            }
+            return slot;
+        }
+        idx = (idx + 1) & mask;
+        probe++;
+    }
+}
+
+// Double the slot array and reinsert every symbol (hashes are cached)
+static void symtab_grow(SymbolTable *st) {
+    Symbol *old = st->slots;
+    int old_cap = st->capacity;
+    int cap = old_cap ? old_cap * 2 : SYMTAB_INIT_CAPACITY;
+    Symbol *slots = (Symbol*)xrealloc(st->oom, NULL, cap * sizeof(Symbol));
+    memset(slots, 0, cap * sizeof(Symbol));
+    st->slots = slots;
+    st->capacity = cap;
+    unsigned int mask = (unsigned int)st->capacity - 1;
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].hash == 0) {
+            continue;
+        }
+        unsigned int idx = old[i].hash & mask;
+        while (st->slots[idx].hash != 0) {
+            idx = (idx + 1) & mask;
+        }
+        st->slots[idx] = old[i];
+    }
+    free(old);
+}
+
+// Copy a name into the pool and return its offset
+static int symtab_intern(SymbolTable *st, const char *name, int len) {
+    if (st->names_len + len + 1 > st->names_cap) {
+        int cap = st->names_cap ? st->names_cap : 4096;
+        while (st->names_len + len + 1 > cap) {
+            cap *= 2;
+        }
+        st->names = (char*)xrealloc(st->oom, st->names, cap);
+        st->names_cap = cap;
+    }
+    int off = st->names_len;
+    memcpy(st->names + off, name, len);
+    st->names[off + len] = '\0';
+    st->names_len += len + 1;
+    return off;
+}
+
+// Insert name => address; returns 0 if the name is already defined (first definition wins)
+static int symtab_insert(SymbolTable *st, const char *name, int len, int address, int kind) {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if ((st->count + 1) * 2 > st->capacity) {
+        symtab_grow(st);
+    }
+    unsigned int h = hash_name(name, len);
+    Symbol *slot = symtab_probe(st, &st->stats, name, len, h);
+    if (slot->hash != 0) {
+        return 0;
+    }
+    slot->hash = h;
+    slot->name_off = symtab_intern(st, name, len);
+    slot->name_len = len;
+    slot->address = address;
+    slot->kind = kind;
+    st->count++;
+    return 1;
+}
+
+// The symbol called name, NULL if there is none. Safe to call from several
+// threads at once as long as each passes its own ps.
+static const Symbol* symtab_find(const SymbolTable *st, ProbeStats *ps, const char *name, int len) {
+    if (st->count == 0) {
+        return NULL;
+    }
+    const Symbol *slot = symtab_probe(st, ps, name, len, hash_name(name, len));
+    return slot->hash != 0 ? slot : NULL;
+}
+
+#ifndef SIC_NO_MAIN
+// Look up name; returns 1 and stores its address if found
+static int symtab_lookup(const SymbolTable *st, ProbeStats *ps, const char *name, int len,
+                         int *address) {
+    const Symbol *sym = symtab_find(st, ps, name, len);
+    if (sym == NULL) {
+        return 0;
+    }
+    *address = sym->address;
+    return 1;
+}
+#endif
+
+// Give the existing symbol name a new address and kind
+static void symtab_set(SymbolTable *st, const char *name, int len, int address, int kind) {
+    if (st->count == 0) {
+        return;
+    }
+    Symbol *slot = symtab_probe(st, &st->stats, name, len, hash_name(name, len));
+    if (slot->hash != 0) {
+        slot->address = address;
+        slot->kind = kind;
+    }
+}
+
+#ifndef SIC_NO_MAIN
+// Remove name. Later members of its probe run are shifted back into the
+// hole, so lookups never meet tombstones; the interned name is not reclaimed.
+static void symtab_remove(SymbolTable *st, const char *name, int len) {
+    if (st->count == 0) {
+        return;
+    }
+    Symbol *slot = symtab_probe(st, &st->stats, name, len, hash_name(name, len));
+    if (slot->hash == 0) {
+        return;
+    }
+    unsigned int mask = (unsigned int)st->capacity - 1;
+    unsigned int hole = (unsigned int)(slot - st->slots);
+    unsigned int idx = hole;
+    for (;;) {
+        idx = (idx + 1) & mask;
+        Symbol *next = &st->slots[idx];
+        if (next->hash == 0) {
+            break;
+        }
+        // It may move back only if the hole lies between its home slot and idx
+        unsigned int home = next->hash & mask;
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            st->slots[hole] = *next;
+            hole = idx;
+        }
+    }
+    st->slots[hole].hash = 0;
+    st->count--;
+}
+#endif
+
+// Add the statistics gathered by one reader into the table's own
+static void probe_stats_merge(ProbeStats *into, const ProbeStats *from) {
+    into->lookups += from->lookups;
+    into->probes += from->probes;
+    into->collisions += from->collisions;
+    if (from->max_probe > into->max_probe) {
+        into->max_probe = from->max_probe;
+    }
+}
+
+#ifndef SIC_NO_MAIN
+// Print probe statistics of all section symbol tables together, used to
+// confirm lookups stay O(1)
+static void symtab_report(const Assembler *as, FILE *out) {
+    int count = 0;
+    int capacity = 0;
+    ProbeStats ps = as->lookup_stats;
+    for (int i = 0; i < as->section_count; i++) {
+        const SymbolTable *st = &as->sections[i].symtab;
+        count += st->count;
+        capacity += st->capacity;
+        probe_stats_merge(&ps, &st->stats);
+    }
+    fprintf(out, "Symbol table: %d symbols, %d slots (load %.2f)",
+            count, capacity, capacity ? (double)count / capacity : 0.0);
+    if (as->section_count > 1) {
+        fprintf(out, " in %d control sections", as->section_count);
+    }
+    fprintf(out, "\n  lookups: %ld, collisions: %ld, avg probe: %.3f, max probe: %d\n",
+            ps.lookups, ps.collisions,
+            ps.lookups ? (double)ps.probes / ps.lookups : 0.0,
+            ps.max_probe);
+}
+
+// Print what --stats gathered, as a table or as one JSON object
+static void stats_report(const Assembler *as, const AssemblyStats *st, int json, FILE *out) {
+    static const char *const phases[PHASE_COUNT] = {"read", "pass1", "pass2", "object", "listing"};
+    double wall = 0;
+    double cpu = 0;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        wall += st->wall[i];
+        cpu += st->cpu[i];
+    }
+    int symbols = 0;
+    ProbeStats sym = as->lookup_stats;
+    for (int i = 0; i < as->section_count; i++) {
+        symbols += as->sections[i].symtab.count;
+        probe_stats_merge(&sym, &as->sections[i].symtab.stats);
+    }
+    const ProbeStats *kw = &as->keyword_stats;
+    double sym_avg = sym.lookups ? (double)sym.probes / sym.lookups : 0.0;
+    double kw_avg = kw->lookups ? (double)kw->probes / kw->lookups : 0.0;
+
+    if (json) {
+        fprintf(out, "{\"phases\": {");
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(out, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+                    i ? ", " : "", phases[i], st->wall[i], st->cpu[i]);
+        }
+        fprintf(out, "}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f}, ", wall, cpu);
+        fprintf(out, "\"source_lines\": %d, \"statements\": %d, \"sections\": %d, \"symbols\": %d, ",
+                as->source_line_count, as->line_count, as->section_count, symbols);
+        fprintf(out, "\"symbol_lookups\": {\"count\": %ld, \"avg_probe\": %.3f, \"max_probe\": %d}, ",
+                sym.lookups, sym_avg, sym.max_probe);
+        fprintf(out, "\"keyword_lookups\": {\"count\": %ld, \"avg_probe\": %.3f, \"max_probe\": %d}, ",
+                kw->lookups, kw_avg, kw->max_probe);
+        fprintf(out, "\"macros\": %d, \"macro_expansions\": {\"count\": %ld, \"cache_hits\": %ld}, ",
+                as->macros.macro_count, as->macros.expansions, as->macros.cache_hits);
+        fprintf(out, "\"allocations\": %ld, \"bytes_read\": %ld, \"bytes_written\": %ld, "
+                "\"text_records\": %ld}\n",
+                st->allocations, st->bytes_read, st->bytes_written, st->text_records);
+        return;
+    }
+    fprintf(out, "Phase        wall s      cpu s\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(out, "  %-8s %9.4f  %9.4f\n", phases[i], st->wall[i], st->cpu[i]);
+    }
+    fprintf(out, "  %-8s %9.4f  %9.4f\n", "total", wall, cpu);
+    fprintf(out, "Lines: %d source, %d statements in %d control section%s; %d symbols\n",
+            as->source_line_count, as->line_count, as->section_count,
+            as->section_count == 1 ? "" : "s", symbols);
+    fprintf(out, "Symbol lookups: %ld, avg probe %.3f, max probe %d\n",
+            sym.lookups, sym_avg, sym.max_probe);
+    fprintf(out, "Keyword lookups: %ld, avg probe %.3f, max probe %d\n",
+            kw->lookups, kw_avg, kw->max_probe);
+    fprintf(out, "Macros: %d; expansions: %ld, cache hits %ld\n",
+            as->macros.macro_count, as->macros.expansions, as->macros.cache_hits);
+    fprintf(out, "Allocations: %ld\n", st->allocations);
+    fprintf(out, "Bytes read: %ld, written: %ld; T records: %ld\n",
+            st->bytes_read, st->bytes_written, st->text_records);
+}
+#endif
+
+// Add a symbol to a section's symbol table
+static int add_symbol(Section *sec, StrView symbol, int address, int kind) {
+    return symtab_insert(&sec->symtab, symbol.ptr, symbol.len, address, kind);
+}
+
+
+/*
+ * Assembler initialization
+ */
+// Initialize the assembler data structure
+static void assembler_init(Assembler *as) {
+    memset(as, 0, sizeof(Assembler));
+    as->src.data = "";
+    as->arena.oom = &as->oom;
+    as->jobs = 1;
+    symtab_init(&as->macros.names, &as->oom);
+    symtab_init(&as->macros.cache, &as->oom);
+    as->macros.defining = -1;
+}
+
+#ifndef SIC_NO_MAIN
+// Forget every macro and expansion, keeping the arrays for reuse
+static void macros_clear(MacroTable *mt) {
+    symtab_clear(&mt->names);
+    symtab_clear(&mt->cache);
+    mt->macro_count = 0;
+    mt->statement_count = 0;
+    mt->segment_count = 0;
+    mt->param_count = 0;
+    mt->entry_count = 0;
+    mt->expanded_count = 0;
+    mt->expansions = 0;
+    mt->cache_hits = 0;
+    mt->serial = 0;
+    mt->runaway = 0;
+    mt->definitions = 0;
+    mt->in_body = 0;
+    mt->defining = -1;
+    mt->if_depth = 0;
+}
+#endif
+
+static void macros_free(MacroTable *mt) {
+    symtab_free(&mt->names);
+    symtab_free(&mt->cache);
+    free(mt->macros);
+    free(mt->statements);
+    free(mt->segments);
+    free(mt->params);
+    free(mt->entries);
+    free(mt->expanded);
+    free(mt->key);
+}
+
+// Release what the sections own; the array itself is kept
+static void sections_free(Assembler *as) {
+    for (int i = 0; i < as->section_count; i++) {
+        Section *sec = &as->sections[i];
+        symtab_free(&sec->symtab);
+        free(sec->base_lines);
+        free(sec->literals);
+        free(sec->pools);
+        free(sec->pending);
+        free(sec->diags);
+    }
+    as->section_count = 0;
+}
+
+// Start a new control section at statement first
+static Section* section_begin(Assembler *as, int first) {
+    if (as->section_count == as->section_cap) {
+        as->section_cap = as->section_cap ? as->section_cap * 2 : 4;
+        as->sections = (Section*)xrealloc(&as->oom, as->sections, as->section_cap * sizeof(Section));
+    }
+    Section *sec = &as->sections[as->section_count++];
+    memset(sec, 0, sizeof(Section));
+    sec->first = first;
+    sec->last = first;
+    sec->start_index = -1;
+    sec->end_index = -1;
+    symtab_init(&sec->symtab, &as->oom);
+    return sec;
+}
+
+// Control section holding statement index (the last one for index == line_count)
+static Section* section_of(Assembler *as, int index) {
+    int lo = 0;
+    int hi = as->section_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (as->sections[mid].first <= index) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &as->sections[lo];
+}
+
+#ifndef SIC_NO_MAIN
+// Drop all lines, strings and symbols at once, keeping buffers for reuse
+static void assembler_reset(Assembler *as) {
+    source_close(&as->src);
+    arena_reset(&as->arena);
+    as->chunk_count = 0;
+    as->line_count = 0;
+    as->code.len = 0;
+    sections_free(as);
+    macros_clear(&as->macros);
+    memset(&as->lookup_stats, 0, sizeof(ProbeStats));
+    memset(&as->keyword_stats, 0, sizeof(ProbeStats));
+    memset(&as->peephole, 0, sizeof(PeepholeStats));
+    as->diag_count = 0;
+    as->error_count = 0;
+}
+#endif
+
+// Release memory owned by the assembler
+static void assembler_free(Assembler *as) {
+    source_close(&as->src);
+    arena_free(&as->arena);
+    free(as->line_chunks);
+    free(as->code.data);
+    sections_free(as);
+    free(as->sections);
+    macros_free(&as->macros);
+    free(as->diags);
+}
+
+/*
+ * Work-stealing thread pool
+ *
+ * parallel_for() runs tasks 0..count-1 on up to `jobs` threads. Each worker
+ * starts with a contiguous block of task indices in its own deque and takes
+ * work from the back; a worker that runs dry steals from the front of the
+ * other deques, so uneven tasks still keep every thread busy.
+ */
+
+typedef void (*TaskFn)(void *ctx, int task, int worker);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int lo;             // Next task a thief would take
+    int hi;             // One past the next task the owner takes
+} TaskDeque;
+
+typedef struct {
+    TaskDeque *deques;
+    int workers;
+    TaskFn fn;
+    void *ctx;
+} TaskPool;
+
+typedef struct {
+    TaskPool *pool;
+    int id;
+} WorkerArg;
+
+// Take a task from the owner's end (own == 1) or a thief's end
+static int deque_take(TaskDeque *d, int own) {
+    int task = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->lo < d->hi) {
+        task = own ? --d->hi : d->lo++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static void* pool_worker(void *arg) {
+    WorkerArg *wa = (WorkerArg*)arg;
+    TaskPool *pool = wa->pool;
+    for (;;) {
+        int task = deque_take(&pool->deques[wa->id], 1);
+        // Own deque empty: try to steal, starting with the next worker
+        for (int k = 1; task < 0 && k < pool->workers; k++) {
+            task = deque_take(&pool->deques[(wa->id + k) % pool->workers], 0);
+        }
+        if (task < 0) {
+            // The task set is fixed, so empty deques everywhere means done
+            return NULL;
+        }
+        pool->fn(pool->ctx, task, wa->id);
+    }
+}
+
+// Number of workers parallel_for will use for count tasks
+static int pool_workers(int jobs, int count) {
+    if (jobs > count) {
+        jobs = count;
+    }
+    return jobs < 1 ? 1 : jobs;
+}
+
+static void parallel_for(int jobs, int count, TaskFn fn, void *ctx) {
+    int workers = pool_workers(jobs, count);
+    if (workers == 1) {
+        for (int i = 0; i < count; i++) {
+            fn(ctx, i, 0);
+        }
+        return;
+    }
+    TaskPool pool;
+    pool.deques = (TaskDeque*)calloc(workers, sizeof(TaskDeque));
+    pthread_t *threads = (pthread_t*)calloc(workers, sizeof(pthread_t));
+    WorkerArg *args = (WorkerArg*)calloc(workers, sizeof(WorkerArg));
+    if (pool.deques == NULL || threads == NULL || args == NULL) {
+        // Fall back to running everything on the calling thread
+        free(pool.deques);
+        free(threads);
+        free(args);
+        for (int i = 0; i < count; i++) {
+            fn(ctx, i, 0);
+        }
+        return;
+    }
+    pool.workers = workers;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].lo = (int)((long long)count * w / workers);
+        pool.deques[w].hi = (int)((long long)count * (w + 1) / workers);
+        args[w].pool = &pool;
+        args[w].id = w;
+    }
+    // Worker 0 is the calling thread
+    int started = 1;
+    for (int w = 1; w < workers; w++) {
+        if (pthread_create(&threads[w], NULL, pool_worker, &args[w]) != 0) {
+            break; // Remaining deques get stolen by the running workers
+        }
+        started++;
+    }
+    pool_worker(&args[0]);
+    for (int w = 1; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    }
+    free(pool.deques);
+    free(threads);
+    free(args);
+}
+
+/*
+ * PASS 1
+ */
+// Mnemonic without the + that marks a format 4 instruction
+static StrView strip_extended(StrView mnemonic) {
+    if (mnemonic.len > 1 && mnemonic.ptr[0] == '+') {
+        return make_view(mnemonic.ptr + 1, mnemonic.len - 1);
+    }
+    return mnemonic;
+}
+
+// Give a statement the keyword, directive and format its mnemonic names;
+// +OP asks for format 4
+static void classify_statement(Line *line, ProbeStats *ps) {
+    StrView name = strip_extended(line->mnemonic);
+    const Keyword *kw = lookup_keyword(name, ps);
+    line->kw = kw;
+    line->directive = (kw != NULL && kw->kind == KW_DIRECTIVE) ? kw->directive : DIR_NONE;
+    line->format = 0;
+    if (kw != NULL && kw->kind == KW_OPCODE) {
+        line->format = (kw->format == 3 && name.len < line->mnemonic.len) ? 4 : kw->format;
+    }
+}
+
+// Cut a lexed, non-blank source line into label, mnemonic and operand;
+// keyword lookups are counted in ps
+static void parse_lexed(Line *line, const LexedLine *lx, int line_no, ProbeStats *ps) {
+    const int *mark = lx->mark;
+    StrView label = empty_view;
+    StrView mnemonic;
+    StrView first = make_view(lx->ptr + mark[0], mark[1] - mark[0]);
+    int rest;
+
+    // Check first token: is it a mnemonic or label?
+    if (is_mnemonic(strip_extended(first), ps)) {
+        // No label
+        mnemonic = first;
+        rest = mark[2];
+    } else {
+        // First token is label
+        label = first;
+        mnemonic = make_view(lx->ptr + mark[2], mark[3] - mark[2]);
+        rest = mark[4];
+    }
+    // Remainder is operand, up to a comment
+    int end = lex_operand_end(lx, rest);
+    StrView operand = make_view(lx->ptr + rest, end > rest ? end - rest : 0);
+
+    line->line_no = line_no;
+    line->label = label;
+    line->mnemonic = mnemonic;
+    line->operand = operand;
+    // Classify the mnemonic once
+    classify_statement(line, ps);
+}
+
+#ifndef SIC_NO_MAIN
+// parse_lexed() for a non-empty line of text without its newline
+static void parse_statement(Line *line, StrView raw, int line_no, ProbeStats *ps) {
+    LexedLine lx;
+    lex_fields(raw.ptr, raw.ptr + raw.len, &lx);
+    parse_lexed(line, &lx, line_no, ps);
+}
+#endif
+
+// Text between the quotes of a C'...' or X'...' BYTE operand into *val;
+// returns the length of the constant up to its closing quote, 0 if the
+// operand is not one
+static int byte_constant(StrView operand, StrView *val) {
+    if (!view_starts_with(operand, "C'") && !view_starts_with(operand, "X'")) {
+        return 0;
+    }
+    const char *close = (const char*)memchr(operand.ptr + 2, '\'', operand.len - 2);
+    int len = close ? (int)(close - operand.ptr) : operand.len;
+    *val = make_view(operand.ptr + 2, len - 2);
+    return close ? len + 1 : len;
+}
+
+// Bytes of object code a BYTE, WORD or instruction statement produces.
+// It depends on the statement alone (and on relaxation widening it to
+// format 4), never directly on addresses or symbols.
+static int code_size(const Line *line) {
+    const Keyword *kw = line->kw;
+    StrView operand = line->operand;
+    int size = 0;
+    switch (line->directive) {
+    case DIR_BYTE: {
+        // e.g. C'EOF' or X'F1': the text between the quotes
+        StrView val;
+        if (byte_constant(operand, &val) > 0) {
+            size = operand.ptr[0] == 'C' ? val.len : val.len / 2;
+        }
+        break;
+    }
+    case DIR_WORD:
+        size = 3;
+        break;
+    case DIR_NONE:
+        // Instruction: its format is its size (format 4 takes 4 bytes);
+        // unknown mnemonics take 3 bytes.
+        // A label on its own line just marks the current address.
+        if (line->mnemonic.len == 0) {
+            size = 0;
+        } else if (kw != NULL && kw->kind == KW_OPCODE) {
+            size = line->format;
+        } else {
+            size = 3;
+        }
+        break;
+    default:
+        break;
+    }
+    return size < 0 ? 0 : size;
+}
+
+// Addressing flags of a format 3 operand and the symbol (or immediate
+// number) it names
+static StrView split_operand(StrView operand, unsigned char *flags) {
+    StrView symbol = operand;
+
+    // Check immediate
+    if (operand.len > 0 && operand.ptr[0] == '#') {
+        *flags = FLAG_I;
+        symbol = make_view(operand.ptr + 1, operand.len - 1); // skip #
+    }
+    else if (operand.len > 0 && operand.ptr[0] == '@') {
+        *flags = FLAG_N;
+        symbol = make_view(operand.ptr + 1, operand.len - 1); // skip @
+    }
+    else {
+        // simple addressing => n=1, i=1
+        *flags = FLAG_N | FLAG_I;
+        // check if there's ,X (after the closing quote of a literal)
+        int from = 0;
+        for (int c = 0; operand.len > 0 && operand.ptr[0] == '=' && c < operand.len; c++) {
+            if (operand.ptr[c] == '\'') {
+                from = c;
+            }
+        }
+        for (int c = from; c + 1 < operand.len; c++) {
+            if (operand.ptr[c] == ',' && operand.ptr[c+1] == 'X') {
+                *flags |= FLAG_X;
+                symbol.len = c; // separate the symbol from ",X"
+                break;
+            }
+        }
+    }
+    return symbol;
+}
+
+// Whether v is a non-empty run of decimal digits
+static int is_number(StrView v) {
+    for (int i = 0; i < v.len; i++) {
+        if (!isdigit((unsigned char)v.ptr[i])) {
+            return 0;
+        }
+    }
+    return v.len > 0;
+}
+
+// Symbol (or expression) whose value the encoding of line depends on, for
+// a format 3/4 instruction or a WORD (empty if none)
+static StrView line_symbol(const Line *line) {
+    if (line->directive == DIR_WORD) {
+        return is_number(line->operand) ? empty_view : line->operand;
+    }
+    const Keyword *kw = line->kw;
+    if (kw == NULL || kw->kind != KW_OPCODE || kw->format != 3 || kw->opcode == 0x4C) {
+        return empty_view;
+    }
+    unsigned char flags;
+    StrView symbol = split_operand(line->operand, &flags);
+    if (flags == FLAG_I && is_number(symbol)) {
+        return empty_view;
+    }
+    return symbol;
+}
+
+/*
+ * Literals
+ *
+ * An operand =C'..' or =X'..' names a constant the assembler places by
+ * itself. Pass1 collects the literals of a section as it meets them and
+ * lays them out as a pool at the next LTORG, or at END. Each is entered in
+ * the section's symbol table under a name made of its pool number and its
+ * bytes (the leading '=' keeps it apart from labels), so a value used all
+ * over, however it is written, is stored once per pool and found again
+ * with a single hash lookup.
+ */
+
+#define LITERAL_KEY_MAX (2 * LITERAL_MAX + 16)
+
+static int is_literal(StrView symbol) {
+    return symbol.len > 0 && symbol.ptr[0] == '=';
+}
+
+// Value of one hex digit, -1 if c is not a hex digit
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = toupper(c);
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Bytes of a literal into bytes[LITERAL_MAX]; returns how many, -1 if the
+// literal is malformed or too long
+static int literal_bytes(StrView text, unsigned char *bytes) {
+    if (text.len < 5 || text.ptr[2] != '\'' || text.ptr[text.len - 1] != '\'') {
+        return -1;
+    }
+    StrView val = make_view(text.ptr + 3, text.len - 4);
+    if (text.ptr[1] == 'C' && val.len <= LITERAL_MAX) {
+        memcpy(bytes, val.ptr, val.len);
+        return val.len;
+    }
+    if (text.ptr[1] == 'X' && val.len % 2 == 0 && val.len / 2 <= LITERAL_MAX) {
+        for (int c = 0; c < val.len / 2; c++) {
+            int hi = hex_digit((unsigned char)val.ptr[2*c]);
+            int lo = hex_digit((unsigned char)val.ptr[2*c+1]);
+            if (hi < 0 || lo < 0) {
+                return -1;
+            }
+            bytes[c] = (unsigned char)(hi << 4 | lo);
+        }
+        return val.len / 2;
+    }
+    return -1;
+}
+
+// Symbol table name of a literal in pool `pool` into key[LITERAL_KEY_MAX]:
+// '=', the pool number, ':' and the bytes in hex. Returns its length (0 if
+// the literal is malformed) and stores the literal's size in *size.
+static int literal_key(StrView text, int pool, char *key, int *size) {
+    static const char digits[] = "0123456789ABCDEF";
+    unsigned char bytes[LITERAL_MAX];
+    int n = literal_bytes(text, bytes);
+    if (n < 0) {
+        return 0;
+    }
+    int len = 0;
+    key[len++] = '=';
+    int shift = 28;
+    while (shift > 0 && (pool >> shift) == 0) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        key[len++] = digits[(pool >> shift) & 15];
+    }
+    key[len++] = ':';
+    for (int i = 0; i < n; i++) {
+        key[len++] = digits[bytes[i] >> 4];
+        key[len++] = digits[bytes[i] & 15];
+    }
+    *size = n;
+    return len;
+}
+
+// The symbol of a literal used in pool `pool` of sec, NULL if there is none
+static const Symbol* find_literal(const Section *sec, ProbeStats *ps, StrView text, int pool) {
+    char key[LITERAL_KEY_MAX];
+    int size;
+    int len = literal_key(text, pool, key, &size);
+    return len > 0 ? symtab_find(&sec->symtab, ps, key, len) : NULL;
+}
+
+// Number of pools of sec placed before statement index
+static int pool_before(const Section *sec, int index) {
+    int lo = 0;
+    int hi = sec->pool_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sec->pools[mid].line < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Literals of sec already placed in a pool
+static int placed_literals(const Section *sec) {
+    if (sec->pool_count == 0) {
+        return 0;
+    }
+    const LiteralPool *last = &sec->pools[sec->pool_count - 1];
+    return last->first + last->count;
+}
+
+// Add a literal operand to the pool being collected unless it is already
+// there; a malformed one is left for pass2 to report
+static void use_literal(Section *sec, StrView text, int line_no) {
+    char key[LITERAL_KEY_MAX];
+    int size;
+    int len = literal_key(text, sec->pool_count, key, &size);
+    if (len == 0 || !symtab_insert(&sec->symtab, key, len, 0, SYM_RELATIVE)) {
+        return;
+    }
+    if (sec->literal_count == sec->literal_cap) {
+        sec->literal_cap = sec->literal_cap ? sec->literal_cap * 2 : 16;
+        sec->literals = (Literal*)xrealloc(sec->symtab.oom, sec->literals,
+                                           sec->literal_cap * sizeof(Literal));
+    }
+    Literal *lit = &sec->literals[sec->literal_count++];
+    lit->text = text;
+    lit->size = size;
+    lit->line_no = line_no;
+}
+
+// Place the literals collected since the last pool at address, as the pool
+// of statement index; returns the bytes they take
+static int place_pool(Section *sec, int index, int address) {
+    int first = placed_literals(sec);
+    if (first == sec->literal_count) {
+        return 0;
+    }
+    int total = 0;
+    for (int i = first; i < sec->literal_count; i++) {
+        char key[LITERAL_KEY_MAX];
+        int size;
+        int len = literal_key(sec->literals[i].text, sec->pool_count, key, &size);
+        symtab_set(&sec->symtab, key, len, address + total, SYM_RELATIVE);
+        total += size;
+    }
+    if (sec->pool_count == sec->pool_cap) {
+        sec->pool_cap = sec->pool_cap ? sec->pool_cap * 2 : 8;
+        sec->pools = (LiteralPool*)xrealloc(sec->symtab.oom, sec->pools,
+                                            sec->pool_cap * sizeof(LiteralPool));
+    }
+    LiteralPool *pool = &sec->pools[sec->pool_count++];
+    pool->line = index;
+    pool->first = first;
+    pool->count = sec->literal_count - first;
+    return total;
+}
+
+/*
+ * Expressions
+ *
+ * Operands of EQU, ORG, WORD, RESB, RESW, BASE and format 3/4
+ * instructions are expressions: decimal numbers, symbols and * (the
+ * address of the statement) combined with + - * / and parentheses. Each value is absolute
+ * or relative to its control section. Relative terms must pair off under
+ * + and -, leaving none (absolute) or one with a plus sign (relative), and
+ * are never multiplied or divided; so BUFEND-BUFFER is an absolute length
+ * and TABLE+3*N a relative address. EXTREF symbols may be added or
+ * subtracted (BUFEND-BUFFER over two of them), never multiplied or divided;
+ * the loader adds or subtracts each one's address, from an M record with
+ * that sign, to the rest of the sum. Constant parts are folded as they are parsed, and a symbol defined by
+ * EQU holds the folded value, so no expression is evaluated twice over.
+ */
+
+#define EXPR_DEPTH_MAX 64      // Nested parentheses and signs
+#define EXPR_EXTERNAL_MAX 8     // EXTREF terms in one expression
+
+// How an evaluation ended
+enum {
+    EXPR_OK = 0,
+    EXPR_UNDEFINED,     // Names a symbol not (yet) defined
+    EXPR_EXTERNAL,      // Multiplies, divides or has too many EXTREF symbols, or has one where none may be
+    EXPR_RELATIVE,      // Relative terms do not pair off, or are multiplied
+    EXPR_DIVIDE,        // Division by zero
+    EXPR_SYNTAX
+};
+
+// An EXTREF symbol added to (sign 1) or subtracted from (sign -1) an expression
+typedef struct {
+    StrView name;
+    int sign;
+} ExprExternal;
+
+typedef struct {
+    int status;         // EXPR_*
+    int value;          // 0 unless EXPR_OK; with EXTREF terms, the sum of the others
+    int kind;           // SYM_ABSOLUTE, SYM_RELATIVE or (EXTREF terms) SYM_EXTERNAL
+    int relative;       // SYM_EXTERNAL: the other terms leave a relative value
+    int external_count;
+    ExprExternal externals[EXPR_EXTERNAL_MAX]; // In source order
+    StrView name;       // Symbol the status is about
+    const Symbol *sym;  // For EXPR_UNDEFINED, the pending EQU symbol (or NULL)
+} Expr;
+
+// Value of a subexpression: relative counts its relative terms, with sign.
+// Its EXTREF terms are out->externals[external_first ..] (those read while
+// parsing it, so a sum's are its operands' back to back).
+typedef struct {
+    int value;
+    int relative;
+    int external_first;
+    int external_count;
+} ExprTerm;
+
+typedef struct {
+    const SymbolTable *st;
+    ProbeStats *ps;
+    int here;           // Value of *
+    const char *p;
+    const char *end;
+    int depth;
+    Expr *out;          // Keeps the first failure and collects the EXTREF terms
+} ExprParser;
+
+static void expr_fail(ExprParser *ep, int status, StrView name) {
+    if (ep->out->status == EXPR_OK) {
+        ep->out->status = status;
+        ep->out->name = name;
+    }
+}
+
+// Skip blanks; returns the next character, 0 at the end
+static char expr_peek(ExprParser *ep) {
+    while (ep->p < ep->end && isspace((unsigned char)*ep->p)) {
+        ep->p++;
+    }
+    return ep->p < ep->end ? *ep->p : 0;
+}
+
+static int expr_delimiter(char c) {
+    return c == '+' || c == '-' || c == '*' || c == '/' || c == '(' || c == ')' ||
+           c == ' ' || c == '\t';
+}
+
+static ExprTerm expr_sum(ExprParser *ep);
+
+// A term with nothing read yet
+static ExprTerm expr_term(const ExprParser *ep) {
+    ExprTerm t = { 0, 0, ep->out->external_count, 0 };
+    return t;
+}
+
+// Reject the EXTREF terms of t, which may not be multiplied or divided
+static void expr_no_product(ExprParser *ep, const ExprTerm *t) {
+    if (t->external_count > 0) {
+        expr_fail(ep, EXPR_EXTERNAL, ep->out->externals[t->external_first].name);
+    }
+}
+
+// Value of a decimal number; one too large for an int is held at INT_MAX,
+// which no range check lets through
+static int expr_number(StrView word) {
+    long value = view_to_long(word, 10);
+    return value > INT_MAX ? INT_MAX : (int)value;
+}
+
+// A number, symbol, * or parenthesized sum, after any signs
+static ExprTerm expr_primary(ExprParser *ep) {
+    ExprTerm t = expr_term(ep);
+    char c = expr_peek(ep);
+    if (c == '+' || c == '-' || c == '(') {
+        if (ep->depth == EXPR_DEPTH_MAX) {
+            expr_fail(ep, EXPR_SYNTAX, empty_view);
+            return t;
+        }
+        ep->depth++;
+        ep->p++;
+        if (c == '(') {
+            t = expr_sum(ep);
+            if (expr_peek(ep) == ')') {
+                ep->p++;
+            } else {
+                expr_fail(ep, EXPR_SYNTAX, empty_view);
+            }
+        } else {
+            t = expr_primary(ep);
+            if (c == '-') {
+                t.value = (int)(0u - (unsigned)t.value);
+                t.relative = -t.relative;
+                for (int i = 0; i < t.external_count; i++) {
+                    ep->out->externals[t.external_first + i].sign *= -1;
+                }
+            }
+        }
+        ep->depth--;
+        return t;
+    }
+    if (c == '*') {
+        ep->p++;
+        t.value = ep->here;
+        t.relative = 1;
+        return t;
+    }
+    const char *start = ep->p;
+    while (ep->p < ep->end && !expr_delimiter(*ep->p)) {
+        ep->p++;
+    }
+    StrView word = make_view(start, (int)(ep->p - start));
+    if (word.len == 0) {
+        expr_fail(ep, EXPR_SYNTAX, empty_view);
+        return t;
+    }
+    if (isdigit((unsigned char)word.ptr[0])) {
+        if (!is_number(word)) {
+            expr_fail(ep, EXPR_SYNTAX, empty_view);
+        }
+        t.value = expr_number(word);
+        return t;
+    }
+    const Symbol *sym = symtab_find(ep->st, ep->ps, word.ptr, word.len);
+    if (sym == NULL || sym->kind == SYM_PENDING || sym->kind == SYM_FORWARD) {
+        if (ep->out->status == EXPR_OK) {
+            ep->out->sym = sym;
+        }
+        expr_fail(ep, EXPR_UNDEFINED, word);
+    } else if (sym->kind == SYM_EXTERNAL) {
+        Expr *out = ep->out;
+        if (out->external_count == EXPR_EXTERNAL_MAX) {
+            expr_fail(ep, EXPR_EXTERNAL, word);
+        } else {
+            out->externals[out->external_count].name = word;
+            out->externals[out->external_count++].sign = 1;
+            t.external_count = 1;
+        }
+    } else {
+        t.value = sym->address;
+        t.relative = sym->kind == SYM_RELATIVE;
+    }
+    return t;
+}
+
+static ExprTerm expr_product(ExprParser *ep) {
+    ExprTerm t = expr_primary(ep);
+    for (char c = expr_peek(ep); c == '*' || c == '/'; c = expr_peek(ep)) {
+        ep->p++;
+        ExprTerm r = expr_primary(ep);
+        expr_no_product(ep, &t);
+        expr_no_product(ep, &r);
+        if (t.relative != 0 || r.relative != 0) {
+            expr_fail(ep, EXPR_RELATIVE, empty_view);
+        }
+        if (c == '*') {
+            t.value = (int)((unsigned)t.value * (unsigned)r.value);
+        } else if (r.value == 0) {
+            expr_fail(ep, EXPR_DIVIDE, empty_view);
+        } else if (r.value == -1) {
+            t.value = (int)(0u - (unsigned)t.value);
+        } else {
+            t.value /= r.value;
+        }
+        t.relative = 0;
+        t.external_count = 0;
+    }
+    return t;
+}
+
+static ExprTerm expr_sum(ExprParser *ep) {
+    ExprTerm t = expr_product(ep);
+    for (char c = expr_peek(ep); c == '+' || c == '-'; c = expr_peek(ep)) {
+        ep->p++;
+        ExprTerm r = expr_product(ep);
+        if (c == '+') {
+            t.value = (int)((unsigned)t.value + (unsigned)r.value);
+            t.relative += r.relative;
+        } else {
+            t.value = (int)((unsigned)t.value - (unsigned)r.value);
+            t.relative -= r.relative;
+            for (int i = 0; i < r.external_count; i++) {
+                ep->out->externals[r.external_first + i].sign *= -1;
+            }
+        }
+        t.external_count += r.external_count;
+    }
+    return t;
+}
+
+// Parse and evaluate an expression with operators into out
+static void eval_parsed(const SymbolTable *st, ProbeStats *ps, StrView text, int here, Expr *out) {
+    ExprParser ep;
+    memset(&ep, 0, sizeof(ExprParser));
+    ep.st = st;
+    ep.ps = ps;
+    ep.here = here;
+    ep.p = text.ptr;
+    ep.end = text.ptr + text.len;
+    ep.out = out;
+    ExprTerm t = expr_sum(&ep);
+    if (expr_peek(&ep) != 0) {
+        expr_fail(&ep, EXPR_SYNTAX, empty_view);
+    }
+    if (t.relative != 0 && t.relative != 1) {
+        expr_fail(&ep, EXPR_RELATIVE, empty_view);
+    }
+    if (out->status != EXPR_OK) {
+        return;
+    }
+    out->value = t.value;
+    if (out->external_count > 0) {
+        out->kind = SYM_EXTERNAL;
+        out->relative = t.relative;
+        return;
+    }
+    out->kind = t.relative ? SYM_RELATIVE : SYM_ABSOLUTE;
+}
+
+// Evaluate text against st, with here as the value of *. A lone number or
+// symbol, by far the most common operands, is read directly: a symbol
+// takes one lookup.
+static void eval_expression(const SymbolTable *st, ProbeStats *ps, StrView text, int here, Expr *out) {
+    out->status = EXPR_OK;
+    out->value = 0;
+    out->kind = SYM_ABSOLUTE;
+    out->relative = 0;
+    out->external_count = 0;
+    out->name = empty_view;
+    out->sym = NULL;
+    for (int i = 0; i < text.len; i++) {
+        if (expr_delimiter(text.ptr[i])) {
+            eval_parsed(st, ps, text, here, out);
+            return;
+        }
+    }
+    if (text.len == 0 || (isdigit((unsigned char)text.ptr[0]) && !is_number(text))) {
+        eval_parsed(st, ps, text, here, out);
+    } else if (isdigit((unsigned char)text.ptr[0])) {
+        out->value = expr_number(text);
+    } else {
+        const Symbol *sym = symtab_find(st, ps, text.ptr, text.len);
+        out->sym = sym;
+        if (sym == NULL || sym->kind == SYM_PENDING || sym->kind == SYM_FORWARD) {
+            out->status = EXPR_UNDEFINED;
+            out->name = text;
+        } else if (sym->kind == SYM_EXTERNAL) {
+            out->kind = SYM_EXTERNAL;
+            out->externals[0].name = text;
+            out->externals[0].sign = 1;
+            out->external_count = 1;
+        } else {
+            out->value = sym->address;
+            out->kind = sym->kind;
+        }
+    }
+}
+
+// Turn an evaluation with EXTREF terms into an EXPR_EXTERNAL failure, for
+// operands the loader does not fix up
+static void expr_no_external(Expr *e) {
+    if (e->status == EXPR_OK && e->kind == SYM_EXTERNAL) {
+        e->status = EXPR_EXTERNAL;
+        e->name = e->externals[0].name;
+        e->kind = SYM_ABSOLUTE;
+        e->value = 0;
+    }
+}
+
+// Diagnostic for an evaluation of text that did not end in EXPR_OK
+static void expr_message(const Expr *e, StrView text, char *buf, int size) {
+    switch (e->status) {
+    case EXPR_UNDEFINED:
+        snprintf(buf, size, "Undefined symbol '%.*s'", e->name.len, e->name.ptr);
+        break;
+    case EXPR_EXTERNAL:
+        snprintf(buf, size, "External symbol '%.*s' cannot be used in '%.*s'",
+                 e->name.len, e->name.ptr, text.len, text.ptr);
+        break;
+    case EXPR_RELATIVE:
+        snprintf(buf, size, "Relative terms do not pair off in '%.*s'", text.len, text.ptr);
+        break;
+    case EXPR_DIVIDE:
+        snprintf(buf, size, "Division by zero in '%.*s'", text.len, text.ptr);
+        break;
+    default:
+        if (text.len == 0) {
+            snprintf(buf, size, "Missing operand");
+        } else {
+            snprintf(buf, size, "Invalid expression '%.*s'", text.len, text.ptr);
+        }
+        break;
+    }
+}
+
+// Whether an absolute value fits in a 24-bit word, as a signed or an
+// unsigned number
+static int fits_word(long long value) {
+    return value >= -0x800000 && value <= 0xFFFFFF;
+}
+
+// Bytes a RESB or RESW statement reserves into *size. The count is an
+// absolute expression over symbols defined above; returns 0 after writing
+// why it reserves nothing into msg.
+static int reserve_size(const SymbolTable *st, ProbeStats *ps, const Line *line, int here,
+                        int *size, char *msg, int msg_size) {
+    StrView operand = line->operand;
+    Expr e;
+    eval_expression(st, ps, operand, here, &e);
+    if (e.status != EXPR_OK) {
+        expr_message(&e, operand, msg, msg_size);
+        return 0;
+    }
+    long long bytes = (long long)e.value * (line->directive == DIR_RESW ? 3 : 1);
+    if (e.kind != SYM_ABSOLUTE) {
+        snprintf(msg, msg_size, "%.*s count '%.*s' must be absolute",
+                 line->mnemonic.len, line->mnemonic.ptr, operand.len, operand.ptr);
+    } else if (bytes < 0) {
+        snprintf(msg, msg_size, "%.*s count %d is negative",
+                 line->mnemonic.len, line->mnemonic.ptr, e.value);
+    } else if (here + bytes > 0x1000000) {
+        snprintf(msg, msg_size, "%.*s %d goes past the end of memory",
+                 line->mnemonic.len, line->mnemonic.ptr, e.value);
+    } else {
+        *size = (int)bytes;
+        return 1;
+    }
+    return 0;
+}
+
+// Location counter state carried from one statement to the next
+typedef struct {
+    Section *sec;       // Section being laid out
+    int LC;
+    int start_found;
+    int code_total;     // Code buffer offset of the next statement's bytes
+} Layout;
+
+// report_error() for a section being laid out (never unwinds)
+static void section_error(Section *sec, int line_no, const char *fmt, ...) {
+    sec->error_count++;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vadd(&sec->diags, &sec->diag_count, &sec->diag_cap, SIC_SEVERITY_ERROR, line_no, fmt, ap);
+    va_end(ap);
+}
+
+// Next entry of a comma-separated name list; *list keeps the rest
+static StrView next_list_item(StrView *list) {
+    StrView item;
+    split_comma(*list, &item, list);
+    return item;
+}
+
+// Report an expression that did not evaluate, at line_no of sec
+static void section_expr_error(Section *sec, int line_no, const Expr *e, StrView text) {
+    char msg[256];
+    expr_message(e, text, msg, (int)sizeof(msg));
+    section_error(sec, line_no, "%s", msg);
+}
+
+// States of a PendingEqu
+enum {
+    EQU_WAITING = 0,
+    EQU_ACTIVE,         // On the resolution stack
+    EQU_DONE
+};
+
+// LABEL EQU expression. One naming symbols not defined yet enters its
+// label as SYM_PENDING, to be resolved by layout_end.
+static void define_equ(Section *sec, Line *line, int here) {
+    sec->equ_count++;
+    if (line->label.len == 0) {
+        section_error(sec, line->line_no, "EQU needs a label");
+        return;
+    }
+    Expr e;
+    eval_expression(&sec->symtab, &sec->symtab.stats, line->operand, here, &e);
+    expr_no_external(&e);
+    if (e.status == EXPR_UNDEFINED) {
+        e.kind = SYM_PENDING;
+        e.value = sec->pending_count;
+    } else if (e.status != EXPR_OK) {
+        section_expr_error(sec, line->line_no, &e, line->operand);
+    }
+    if (!add_symbol(sec, line->label, e.value, e.kind)) {
+        section_error(sec, line->line_no, "Duplicate symbol '%.*s'", line->label.len, line->label.ptr);
+        return;
+    }
+    line->state |= LINE_DEFINES;
+    if (e.kind == SYM_PENDING) {
+        if (sec->pending_count == sec->pending_cap) {
+            sec->pending_cap = sec->pending_cap ? sec->pending_cap * 2 : 16;
+            sec->pending = (PendingEqu*)xrealloc(sec->symtab.oom, sec->pending,
+                                                 sec->pending_cap * sizeof(PendingEqu));
+        }
+        PendingEqu *pe = &sec->pending[sec->pending_count++];
+        pe->label = line->label;
+        pe->operand = line->operand;
+        pe->line_no = line->line_no;
+        pe->here = here;
+        pe->state = EQU_WAITING;
+    }
+}
+
+// Resolve the pending EQUs of sec in dependency order: each is evaluated
+// again only once the pending EQU it stopped at has a value, following
+// the chain depth first on an explicit stack. A cycle, or a symbol that is
+// never defined, is reported and the EQU gets 0.
+static void resolve_pending_equs(Section *sec) {
+    if (sec->pending_count == 0) {
+        return;
+    }
+    int *stack = (int*)xrealloc(sec->symtab.oom, NULL, sec->pending_count * sizeof(int));
+    for (int i = 0; i < sec->pending_count; i++) {
+        if (sec->pending[i].state != EQU_WAITING) {
+            continue;
+        }
+        int depth = 0;
+        stack[depth++] = i;
+        sec->pending[i].state = EQU_ACTIVE;
+        while (depth > 0) {
+            PendingEqu *pe = &sec->pending[stack[depth - 1]];
+            Expr e;
+            eval_expression(&sec->symtab, &sec->symtab.stats, pe->operand, pe->here, &e);
+            if (e.status == EXPR_UNDEFINED && e.sym != NULL) {
+                PendingEqu *dep = &sec->pending[e.sym->address];
+                if (dep->state == EQU_WAITING) {
+                    dep->state = EQU_ACTIVE;
+                    stack[depth++] = (int)(dep - sec->pending);
+                    continue;
+                }
+                section_error(sec, pe->line_no, "Circular EQU definition of '%.*s'",
+                              pe->label.len, pe->label.ptr);
+                e.kind = SYM_ABSOLUTE;
+            } else if (e.status == EXPR_OK && e.kind == SYM_EXTERNAL) {
+                expr_no_external(&e);
+                section_expr_error(sec, pe->line_no, &e, pe->operand);
+            } else if (e.status != EXPR_OK) {
+                section_expr_error(sec, pe->line_no, &e, pe->operand);
+            }
+            symtab_set(&sec->symtab, pe->label.ptr, pe->label.len, e.status == EXPR_OK ? e.value : 0,
+                       e.kind);
+            pe->state = EQU_DONE;
+            depth--;
+        }
+    }
+    free(stack);
+}
+
+static void layout_begin(Assembler *as, Section *sec, Layout *lay) {
+    lay->sec = sec;
+    lay->LC = 0;
+    // Only the first section can be placed by START
+    lay->start_found = sec != &as->sections[0];
+    lay->code_total = sec->code_off;
+    sec->start_addr = 0;
+    sec->length = 0;
+    sec->start_index = -1;
+    sec->end_index = -1;
+    sec->base_count = 0;
+    sec->extref_count = 0;
+    sec->literal_count = 0;
+    sec->pool_count = 0;
+    sec->equ_count = 0;
+    sec->pending_count = 0;
+}
+
+// New location counter named by an ORG operand. A bare number is a hex
+// address, as for START; anything else is an expression over symbols
+// defined before.
+static void eval_origin(const SymbolTable *st, ProbeStats *ps, StrView operand, int here, Expr *e) {
+    int hex = operand.len > 0 && isdigit((unsigned char)operand.ptr[0]);
+    for (int c = 0; c < operand.len; c++) {
+        hex &= isxdigit((unsigned char)operand.ptr[c]) != 0;
+    }
+    if (hex) {
+        e->status = EXPR_OK;
+        e->value = (int)view_to_long(operand, 16);
+        e->kind = SYM_RELATIVE;
+        return;
+    }
+    eval_expression(st, ps, operand, here, e);
+    expr_no_external(e);
+}
+
+// Assign statement `index` its address and code slice, define its label
+// and advance the location counter
+static void layout_statement(Line *line, int index, Layout *lay) {
+    Section *sec = lay->sec;
+    StrView label = line->label;
+    StrView operand = line->operand;
+    int directive = line->directive;
+    line->address = lay->LC;
+    line->code_off = lay->code_total;
+    line->code_len = 0;
+    line->state &= ~LINE_DEFINES;
+
+    // Handle START
+    if (!lay->start_found && directive == DIR_START) {
+        // parse the hex address
+        lay->LC = (int)view_to_long(operand, 16);
+        line->address = lay->LC;
+        sec->start_addr = lay->LC;
+        sec->start_index = index;
+        lay->start_found = 1;
+        return;
+    }
+    // CSECT opens its section; its label names the section
+    if (directive == DIR_CSECT) {
+        return;
+    }
+
+    // If there's a label, add to symbol table (EQU gives it its own value)
+    if (label.len > 0 && directive != DIR_EQU) {
+        if (add_symbol(sec, label, lay->LC, SYM_RELATIVE)) {
+            line->state |= LINE_DEFINES;
+        } else {
+            section_error(sec, line->line_no, "Duplicate symbol '%.*s'", label.len, label.ptr);
+        }
+    }
+
+    // Literal operands join the pool being collected
+    if (line->format >= 3) {
+        StrView symbol = line_symbol(line);
+        if (is_literal(symbol)) {
+            use_literal(sec, symbol, line->line_no);
+        }
+    }
+
+    // Update LC based on mnemonic
+    int pool = 0;
+    switch (directive) {
+    case DIR_LTORG:
+        pool = place_pool(sec, index, lay->LC);
+        break;
+    case DIR_END:
+        // Literals still waiting are placed here and count in the length
+        pool = place_pool(sec, index, lay->LC);
+        sec->length = lay->LC + pool - sec->start_addr;
+        sec->end_index = index;
+        break;
+    case DIR_RESW:
+    case DIR_RESB: {
+        int size;
+        char msg[256];
+        if (reserve_size(&sec->symtab, &sec->symtab.stats, line, lay->LC, &size, msg, (int)sizeof(msg))) {
+            lay->LC += size;
+        } else {
+            section_error(sec, line->line_no, "%s", msg);
+        }
+        break;
+    }
+    case DIR_ORG: {
+        Expr e;
+        eval_origin(&sec->symtab, &sec->symtab.stats, operand, lay->LC, &e);
+        if (e.status == EXPR_OK) {
+            lay->LC = e.value;
+        } else {
+            section_expr_error(sec, line->line_no, &e, operand);
+        }
+        break;
+    }
+    case DIR_BASE:
+    case DIR_NOBASE:
+        // Where the base register assumption changes (allocations of a
+        // section unwind wherever its symbol table's do)
+        if (sec->base_count == sec->base_cap) {
+            sec->base_cap = sec->base_cap ? sec->base_cap * 2 : 16;
+            sec->base_lines = (int*)xrealloc(sec->symtab.oom, sec->base_lines,
+                                             sec->base_cap * sizeof(int));
+        }
+        sec->base_lines[sec->base_count++] = index;
+        break;
+    case DIR_EXTREF: {
+        // Names other sections define; the loader supplies their addresses
+        StrView list = operand;
+        while (list.len > 0) {
+            StrView name = next_list_item(&list);
+            if (name.len == 0) {
+                continue;
+            }
+            if (!add_symbol(sec, name, 0, SYM_EXTERNAL)) {
+                section_error(sec, line->line_no, "Duplicate symbol '%.*s'", name.len, name.ptr);
+            }
+            sec->extref_count++;
+        }
+        break;
+    }
+    case DIR_EQU:
+        define_equ(sec, line, lay->LC);
+        break;
+    case DIR_MEND:
+    case DIR_IF:
+    case DIR_ELSE:
+    case DIR_ENDIF:
+        section_error(sec, line->line_no, "%.*s outside a macro definition",
+                      line->mnemonic.len, line->mnemonic.ptr);
+        break;
+    default:
+        break;
+    }
+    // Lay out the statement's bytes (or its literal pool) in the code buffer
+    int size = code_size(line) + pool;
+    line->code_len = size;
+    lay->code_total += size;
+    lay->LC += size;
+}
+
+// Make room for len bytes of object code (contents are not preserved)
+static void code_reserve(CodeBuffer *code, int len, AllocContext *oom) {
+    if (len > code->cap) {
+        int cap = code->cap ? code->cap : 4096;
+        while (cap < len) {
+            cap *= 2;
+        }
+        free(code->data);
+        code->data = NULL;
+        code->cap = 0;
+        code->data = (unsigned char*)xrealloc(oom, NULL, cap);
+        code->cap = cap;
+    }
+    code->len = len;
+}
+
+static void layout_end(Layout *lay) {
+    Section *sec = lay->sec;
+    resolve_pending_equs(sec);
+    for (int i = placed_literals(sec); i < sec->literal_count; i++) {
+        Literal *lit = &sec->literals[i];
+        section_error(sec, lit->line_no, "Literal %.*s has no LTORG or END to place it",
+                      lit->text.len, lit->text.ptr);
+    }
+    sec->final_lc = lay->LC;
+    sec->code_len = lay->code_total - sec->code_off;
+    // If there's no END or if END not updated the length
+    if (sec->length == 0) {
+        sec->length = lay->LC - sec->start_addr;
+    }
+}
+
+/*
+ * Macros
+ *
+ * NAME MACRO &P1,&P2,... starts a definition that runs to MEND. Its body
+ * is split into statements and fields once, when it is read, and each
+ * field into segments: text as written, a parameter, or the $ that starts
+ * a label local to one expansion ($LOOP becomes $AALOOP, $ABLOOP, ...). An
+ * invocation, NAME arguments (with or without a label of its own), stays
+ * in the program as a DIR_CALL statement that defines its label, and the
+ * expansion is appended after it as statement records built straight from
+ * the segments; no text is parsed again. IF (a op b)/ELSE/ENDIF in a body
+ * are decided while expanding, on the arguments; op is EQ, NE, LT, GT, LE
+ * or GE, comparing numbers as numbers and anything else as text.
+ *
+ * The statements an invocation produces depend only on the macro and its
+ * arguments, so they are cached under both: an invocation repeated with
+ * the same arguments copies the cached records, renaming only its $
+ * labels. Invocations inside a body are kept as such in the cache and
+ * expanded when the body is, up to MACRO_DEPTH_MAX levels deep.
+ */
+
+#define MACRO_UNIQUE '\1'      // Stands for the $ of a local label in cached text
+
+// Index of the macro named name, -1 if there is none
+static int find_macro(Assembler *as, StrView name) {
+    MacroTable *mt = &as->macros;
+    if (mt->macro_count == 0 || name.len == 0) {
+        return -1;
+    }
+    const Symbol *sym = symtab_find(&mt->names, &mt->names.stats, name.ptr, name.len);
+    return sym != NULL ? sym->address : -1;
+}
+
+static int is_name_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static MacroSegment* add_segment(MacroTable *mt, AllocContext *oom) {
+    if (mt->segment_count == mt->segment_cap) {
+        mt->segment_cap = mt->segment_cap ? mt->segment_cap * 2 : 256;
+        mt->segments = (MacroSegment*)xrealloc(oom, mt->segments, mt->segment_cap * sizeof(MacroSegment));
+    }
+    MacroSegment *seg = &mt->segments[mt->segment_count++];
+    memset(seg, 0, sizeof(MacroSegment));
+    return seg;
+}
+
+// Cut a field of a body statement of macro m into segments
+static MacroField split_field(Assembler *as, const Macro *m, StrView text, int line_no) {
+    MacroTable *mt = &as->macros;
+    MacroField field;
+    field.first = mt->segment_count;
+    int run = 0;
+    int quoted = 0;
+    for (int i = 0; i <= text.len; i++) {
+        int c = i < text.len ? (unsigned char)text.ptr[i] : 0;
+        int param = c == '&' && i + 1 < text.len && is_name_char((unsigned char)text.ptr[i + 1]);
+        int unique = c == '$' && !quoted && (i == 0 || !is_name_char((unsigned char)text.ptr[i - 1])) &&
+                     i + 1 < text.len && is_name_char((unsigned char)text.ptr[i + 1]);
+        if (c == '\'') {
+            quoted = !quoted;
+        }
+        if (i < text.len && !param && !unique) {
+            continue;
+        }
+        if (i > run) {
+            MacroSegment *seg = add_segment(mt, &as->oom);
+            seg->kind = MSEG_TEXT;
+            seg->text = make_view(text.ptr + run, i - run);
+        }
+        if (unique) {
+            add_segment(mt, &as->oom)->kind = MSEG_UNIQUE;
+            run = i + 1;
+        } else if (param) {
+            int end = i + 1;
+            while (end < text.len && is_name_char((unsigned char)text.ptr[end])) {
+                end++;
+            }
+            StrView name = make_view(text.ptr + i, end - i);
+            int p = 0;
+            while (p < m->param_count && !view_eq(mt->params[m->first_param + p], name)) {
+                p++;
+            }
+            if (p < m->param_count) {
+                MacroSegment *seg = add_segment(mt, &as->oom);
+                seg->kind = MSEG_PARAM;
+                seg->param = p;
+                run = end;
+            } else {
+                report_error(as, line_no, "Undefined macro parameter '%.*s'", name.len, name.ptr);
+                run = i;
+            }
+            i = end - 1;
+        }
+    }
+    field.count = mt->segment_count - field.first;
+    return field;
+}
+
+// NAME MACRO &P1,&P2,...: start reading a body
+static void macro_begin(Assembler *as, const Line *line) {
+    MacroTable *mt = &as->macros;
+    mt->definitions++;
+    mt->defining = -1;
+    mt->if_depth = 0;
+    if (line->label.len == 0) {
+        report_error(as, line->line_no, "MACRO needs a name");
+    } else if (!symtab_insert(&mt->names, line->label.ptr, line->label.len, mt->macro_count, 0)) {
+        report_error(as, line->line_no, "Duplicate macro '%.*s'", line->label.len, line->label.ptr);
+    } else {
+        if (mt->macro_count == mt->macro_cap) {
+            mt->macro_cap = mt->macro_cap ? mt->macro_cap * 2 : 16;
+            mt->macros = (Macro*)xrealloc(&as->oom, mt->macros, mt->macro_cap * sizeof(Macro));
+        }
+        mt->defining = mt->macro_count++;
+    }
+    // The body is read (and skipped) even if the macro cannot be defined
+    mt->in_body = line->line_no;
+    if (mt->defining < 0) {
+        return;
+    }
+    Macro *m = &mt->macros[mt->defining];
+    m->name = line->label;
+    m->line_no = line->line_no;
+    m->first = mt->statement_count;
+    m->count = 0;
+    m->first_param = mt->param_count;
+    m->param_count = 0;
+    StrView list = line->operand;
+    while (list.len > 0) {
+        StrView name = next_list_item(&list);
+        if (name.len < 2 || name.ptr[0] != '&') {
+            report_error(as, line->line_no, "Invalid macro parameter '%.*s'", name.len, name.ptr);
+            continue;
+        }
+        if (m->param_count == MACRO_PARAM_MAX) {
+            report_error(as, line->line_no, "Too many macro parameters");
+            break;
+        }
+        if (mt->param_count == mt->param_cap) {
+            mt->param_cap = mt->param_cap ? mt->param_cap * 2 : 64;
+            mt->params = (StrView*)xrealloc(&as->oom, mt->params, mt->param_cap * sizeof(StrView));
+        }
+        mt->params[mt->param_count++] = name;
+        m->param_count++;
+    }
+}
+
+// One line of a body, up to and including its MEND
+static void macro_body_line(Assembler *as, const LexedLine *lx, int line_no) {
+    MacroTable *mt = &as->macros;
+    Line tmp;
+    memset(&tmp, 0, sizeof(Line));
+    parse_lexed(&tmp, lx, line_no, &as->keyword_stats);
+    if (tmp.directive == DIR_MEND) {
+        if (mt->if_depth > 0) {
+            report_error(as, line_no, "IF without ENDIF");
+        }
+        mt->in_body = 0;
+        mt->defining = -1;
+        return;
+    }
+    if (tmp.directive == DIR_MACRO) {
+        report_error(as, line_no, "Macro definitions cannot be nested");
+        return;
+    }
+    if (mt->defining < 0) {
+        return;
+    }
+    Macro *m = &mt->macros[mt->defining];
+    int index = m->count;
+
+    // Pair IF with its ELSE and ENDIF; unpaired ones are left out
+    if (tmp.directive == DIR_IF && mt->if_depth == MACRO_DEPTH_MAX) {
+        report_error(as, line_no, "IF nested too deeply");
+        return;
+    }
+    if (tmp.directive == DIR_ELSE || tmp.directive == DIR_ENDIF) {
+        MacroStatement *open = mt->if_depth > 0 ? &mt->statements[m->first + mt->if_stack[mt->if_depth - 1]] : NULL;
+        if (open == NULL || (tmp.directive == DIR_ELSE && open->directive == DIR_ELSE)) {
+            report_error(as, line_no, "%s without IF", tmp.directive == DIR_ELSE ? "ELSE" : "ENDIF");
+            return;
+        }
+        open->jump = index;
+    }
+    if (tmp.directive == DIR_IF || tmp.directive == DIR_ELSE) {
+        mt->if_stack[tmp.directive == DIR_IF ? mt->if_depth++ : mt->if_depth - 1] = index;
+    } else if (tmp.directive == DIR_ENDIF) {
+        mt->if_depth--;
+    }
+
+    if (mt->statement_count == mt->statement_cap) {
+        mt->statement_cap = mt->statement_cap ? mt->statement_cap * 2 : 256;
+        mt->statements = (MacroStatement*)xrealloc(&as->oom, mt->statements,
+                                                   mt->statement_cap * sizeof(MacroStatement));
+    }
+    MacroStatement *st = &mt->statements[mt->statement_count++];
+    m->count++;
+    st->directive = tmp.directive;
+    st->jump = -1;
+    st->field[0] = split_field(as, m, tmp.label, line_no);
+    st->field[1] = split_field(as, m, tmp.mnemonic, line_no);
+    st->field[2] = split_field(as, m, tmp.operand, line_no);
+}
+
+// Text of a field with args substituted, \1 standing for each local
+// label's $. A field that is a single piece of text is returned as is;
+// anything else is built in the arena. *unique is set if it holds \1.
+static StrView expand_field(Assembler *as, MacroField field, const StrView *args, int *unique) {
+    const MacroSegment *segs = &as->macros.segments[field.first];
+    *unique = 0;
+    if (field.count == 0) {
+        return empty_view;
+    }
+    if (field.count == 1 && segs[0].kind == MSEG_TEXT) {
+        return segs[0].text;
+    }
+    int len = 0;
+    for (int i = 0; i < field.count; i++) {
+        len += segs[i].kind == MSEG_TEXT ? segs[i].text.len : segs[i].kind == MSEG_PARAM ? args[segs[i].param].len : 1;
+    }
+    char *text = (char*)arena_alloc(&as->arena, len > 0 ? len : 1);
+    char *p = text;
+    for (int i = 0; i < field.count; i++) {
+        if (segs[i].kind == MSEG_UNIQUE) {
+            *p++ = MACRO_UNIQUE;
+            *unique = 1;
+        } else {
+            StrView v = segs[i].kind == MSEG_TEXT ? segs[i].text : args[segs[i].param];
+            memcpy(p, v.ptr, v.len);
+            p += v.len;
+        }
+    }
+    return make_view(text, len);
+}
+
+// Strip the quotes of a '...' operand of an IF condition
+static StrView condition_term(StrView v) {
+    if (v.len >= 2 && v.ptr[0] == '\'' && v.ptr[v.len - 1] == '\'') {
+        return make_view(v.ptr + 1, v.len - 2);
+    }
+    return v;
+}
+
+// Number of the comparison operator v names, -1 if it names none
+static int condition_op(StrView v) {
+    static const char *const ops[] = {"EQ", "NE", "LT", "GT", "LE", "GE"};
+    for (int i = 0; i < 6; i++) {
+        if (view_eq(v, make_view(ops[i], 2))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Value of an IF condition, (a op b) or (a); -1 if it is malformed. A term
+// left out by an empty argument compares as empty text.
+static int macro_condition(StrView cond) {
+    cond = view_trim(cond);
+    if (cond.len >= 2 && cond.ptr[0] == '(' && cond.ptr[cond.len - 1] == ')') {
+        cond = make_view(cond.ptr + 1, cond.len - 2);
+    }
+    const char *p = cond.ptr;
+    const char *end = cond.ptr + cond.len;
+    StrView tok[4];
+    int n = 0;
+    while (n < 4 && (tok[n] = next_token(&p, end)).len > 0) {
+        n++;
+    }
+    StrView a = empty_view;
+    StrView b = empty_view;
+    int op = -1;
+    if (n == 1) {
+        a = condition_term(tok[0]);
+        return a.len > 0 && !view_eq(a, make_view("0", 1));
+    } else if (n == 2) {
+        if ((op = condition_op(tok[0])) >= 0) {
+            b = condition_term(tok[1]);
+        } else if ((op = condition_op(tok[1])) >= 0) {
+            a = condition_term(tok[0]);
+        }
+    } else if (n == 3) {
+        op = condition_op(tok[1]);
+        a = condition_term(tok[0]);
+        b = condition_term(tok[2]);
+    }
+    if (op < 0) {
+        return n == 0 ? 0 : -1;
+    }
+    int cmp;
+    if (is_number(a) && is_number(b) && a.len > 0 && b.len > 0) {
+        long x = view_to_long(a, 10);
+        long y = view_to_long(b, 10);
+        cmp = x < y ? -1 : x > y;
+    } else {
+        int common = a.len < b.len ? a.len : b.len;
+        cmp = memcmp(a.ptr, b.ptr, common);
+        if (cmp == 0) {
+            cmp = a.len < b.len ? -1 : a.len > b.len;
+        }
+    }
+    switch (op) {
+    case 0: return cmp == 0;
+    case 1: return cmp != 0;
+    case 2: return cmp < 0;
+    case 3: return cmp > 0;
+    case 4: return cmp <= 0;
+    default: return cmp >= 0;
+    }
+}
+
+// If line, whose mnemonic is not a keyword, invokes a macro, turn it into
+// its DIR_CALL statement (label, macro name, arguments) and return the
+// macro; -1 otherwise. Without a label of its own the macro name was taken
+// for one, and the arguments for the mnemonic.
+static int macro_call(Assembler *as, Line *line) {
+    int m = find_macro(as, line->mnemonic);
+    if (m < 0) {
+        m = find_macro(as, line->label);
+        if (m < 0) {
+            return -1;
+        }
+        StrView args = line->mnemonic;
+        if (line->operand.len > 0) {
+            // Rejoin what the tokenizer split at white space
+            int len = line->mnemonic.len + 1 + line->operand.len;
+            char *text = (char*)arena_alloc(&as->arena, len);
+            memcpy(text, line->mnemonic.ptr, line->mnemonic.len);
+            text[line->mnemonic.len] = ' ';
+            memcpy(text + line->mnemonic.len + 1, line->operand.ptr, line->operand.len);
+            args = make_view(text, len);
+        }
+        line->mnemonic = line->label;
+        line->label = empty_view;
+        line->operand = args;
+    }
+    line->kw = NULL;
+    line->directive = DIR_CALL;
+    line->format = 0;
+    return m;
+}
+
+// Split invocation arguments at the commas outside quotes
+static int split_arguments(StrView text, StrView *args, int max) {
+    int n = 0;
+    int start = 0;
+    int quoted = 0;
+    text = view_trim(text);
+    if (text.len == 0) {
+        return 0;
+    }
+    for (int i = 0; i <= text.len; i++) {
+        if (i < text.len && text.ptr[i] == '\'') {
+            quoted = !quoted;
+        }
+        if (i == text.len || (text.ptr[i] == ',' && !quoted)) {
+            if (n == max) {
+                return max + 1;
+            }
+            args[n++] = view_trim(make_view(text.ptr + start, i - start));
+            start = i + 1;
+        }
+    }
+    return n;
+}
+
+// Expand macro m for args into cached statements; returns the first, the
+// count going to *count
+static int macro_build(Assembler *as, int m, const StrView *args, int line_no, int *count) {
+    MacroTable *mt = &as->macros;
+    const Macro *mac = &mt->macros[m];
+    int first = mt->expanded_count;
+    for (int pc = 0; pc < mac->count; ) {
+        const MacroStatement *st = &mt->statements[mac->first + pc];
+        int unique[3];
+        if (st->directive == DIR_IF) {
+            StrView cond = expand_field(as, st->field[2], args, &unique[2]);
+            int value = macro_condition(cond);
+            if (value < 0) {
+                report_error(as, line_no, "Invalid IF condition '%.*s'", cond.len, cond.ptr);
+            }
+            // False: on past the ELSE, or the ENDIF
+            pc = value > 0 || st->jump < 0 ? pc + 1 : st->jump + 1;
+            continue;
+        }
+        if (st->directive == DIR_ELSE) {
+            // End of the true branch
+            pc = st->jump < 0 ? pc + 1 : st->jump + 1;
+            continue;
+        }
+        if (st->directive == DIR_ENDIF) {
+            pc++;
+            continue;
+        }
+        if (mt->expanded_count == mt->expanded_cap) {
+            mt->expanded_cap = mt->expanded_cap ? mt->expanded_cap * 2 : 256;
+            mt->expanded = (ExpandedStatement*)xrealloc(&as->oom, mt->expanded,
+                                                        mt->expanded_cap * sizeof(ExpandedStatement));
+        }
+        ExpandedStatement *ex = &mt->expanded[mt->expanded_count++];
+        memset(&ex->line, 0, sizeof(Line));
+        ex->line.label = expand_field(as, st->field[0], args, &unique[0]);
+        ex->line.mnemonic = expand_field(as, st->field[1], args, &unique[1]);
+        ex->line.operand = expand_field(as, st->field[2], args, &unique[2]);
+        classify_statement(&ex->line, &as->keyword_stats);
+        ex->macro = -1;
+        if (ex->line.kw == NULL) {
+            StrView label = ex->line.label;
+            ex->macro = macro_call(as, &ex->line);
+            if (ex->macro >= 0 && label.len > 0 && ex->line.label.len == 0) {
+                // The name was read as a label: each field moved one on
+                unique[2] |= unique[1];
+                unique[1] = unique[0];
+                unique[0] = 0;
+            }
+        }
+        ex->unique = (unsigned char)(unique[0] | unique[1] << 1 | unique[2] << 2);
+        pc++;
+    }
+    *count = mt->expanded_count - first;
+    return first;
+}
+
+// Replace each \1 of a cached field by the $ prefix of this instance
+static StrView unique_field(Assembler *as, StrView v, const char *prefix, int prefix_len) {
+    int marks = 0;
+    for (int i = 0; i < v.len; i++) {
+        marks += v.ptr[i] == MACRO_UNIQUE;
+    }
+    int len = v.len + marks * (prefix_len - 1);
+    char *text = (char*)arena_alloc(&as->arena, len > 0 ? len : 1);
+    char *p = text;
+    for (int i = 0; i < v.len; i++) {
+        if (v.ptr[i] == MACRO_UNIQUE) {
+            memcpy(p, prefix, prefix_len);
+            p += prefix_len;
+        } else {
+            *p++ = v.ptr[i];
+        }
+    }
+    return make_view(text, len);
+}
+
+// Called for each statement appended to the program: a CSECT starts a new
+// control section (unless it is the first statement of the current one)
+static void statement_added(Assembler *as) {
+    int index = as->line_count - 1;
+    Section *sec = &as->sections[as->section_count - 1];
+    if (line_at(as, index)->directive == DIR_CSECT && index > sec->first) {
+        sec->last = index;
+        section_begin(as, index);
+    }
+}
+
+// Append the expansion of macro m for the argument text args, invoked on
+// line line_no, depth invocations deep
+static void macro_expand(Assembler *as, int m, StrView args_text, int line_no, int depth) {
+    MacroTable *mt = &as->macros;
+    const Macro *mac = &mt->macros[m];
+    if (mt->runaway) {
+        return;
+    }
+    if (depth >= MACRO_DEPTH_MAX) {
+        // Abandon the whole invocation: a macro that calls itself twice
+        // would otherwise take 2^depth expansions to get here every time
+        report_error(as, line_no, "Macro '%.*s' nested too deeply", mac->name.len, mac->name.ptr);
+        mt->runaway = 1;
+        return;
+    }
+    StrView args[MACRO_PARAM_MAX];
+    int argc = split_arguments(args_text, args, MACRO_PARAM_MAX);
+    if (argc > mac->param_count) {
+        report_error(as, line_no, "Too many arguments for macro '%.*s'", mac->name.len, mac->name.ptr);
+        argc = mac->param_count;
+    }
+    for (int i = argc; i < mac->param_count; i++) {
+        args[i] = empty_view;
+    }
+
+    // Cache key: the macro number and the arguments, separated by \1
+    int key_len = 12;
+    for (int i = 0; i < mac->param_count; i++) {
+        key_len += args[i].len + 1;
+    }
+    if (key_len > mt->key_cap) {
+        mt->key_cap = key_len * 2;
+        mt->key = (char*)xrealloc(&as->oom, mt->key, mt->key_cap);
+    }
+    int len = snprintf(mt->key, 12, "%d", m);
+    for (int i = 0; i < mac->param_count; i++) {
+        mt->key[len++] = MACRO_UNIQUE;
+        memcpy(mt->key + len, args[i].ptr, args[i].len);
+        len += args[i].len;
+    }
+    int first;
+    int count;
+    const Symbol *hit = symtab_find(&mt->cache, &mt->cache.stats, mt->key, len);
+    if (hit != NULL) {
+        first = mt->entries[hit->address].first;
+        count = mt->entries[hit->address].count;
+        mt->cache_hits++;
+    } else {
+        first = macro_build(as, m, args, line_no, &count);
+        if (mt->entry_count == mt->entry_cap) {
+            mt->entry_cap = mt->entry_cap ? mt->entry_cap * 2 : 64;
+            mt->entries = (MacroField*)xrealloc(&as->oom, mt->entries, mt->entry_cap * sizeof(MacroField));
+        }
+        mt->entries[mt->entry_count].first = first;
+        mt->entries[mt->entry_count].count = count;
+        symtab_insert(&mt->cache, mt->key, len, mt->entry_count++, 0);
+    }
+    mt->expansions++;
+
+    // $ prefix of this instance: two or more letters, AA, AB, ...
+    char prefix[16];
+    int prefix_len = 0;
+    for (int i = first; i < first + count && prefix_len == 0; i++) {
+        if (mt->expanded[i].unique) {
+            char letters[12];
+            int n = 0;
+            for (long serial = mt->serial++; n < 2 || serial > 0; serial /= 26) {
+                letters[n++] = (char)('A' + serial % 26);
+            }
+            prefix[prefix_len++] = '$';
+            while (n > 0) {
+                prefix[prefix_len++] = letters[--n];
+            }
+        }
+    }
+
+    for (int i = first; i < first + count; i++) {
+        const ExpandedStatement *ex = &mt->expanded[i];
+        int nested = ex->macro;
+        Line *line = append_line(as);
+        *line = ex->line;
+        line->line_no = line_no;
+        if (ex->unique & 1) {
+            line->label = unique_field(as, line->label, prefix, prefix_len);
+        }
+        if (ex->unique & 2) {
+            line->mnemonic = unique_field(as, line->mnemonic, prefix, prefix_len);
+        }
+        if (ex->unique & 4) {
+            line->operand = unique_field(as, line->operand, prefix, prefix_len);
+        }
+        statement_added(as);
+        if (nested >= 0) {
+            // May grow the cache: ex is not used past here
+            macro_expand(as, nested, line->operand, line_no, depth + 1);
+        }
+    }
+}
+
+// Take a statement pass1 just appended: a MACRO statement is dropped and
+// starts a definition; a macro invocation is expanded after it
+static void macro_statement(Assembler *as, Line *line) {
+    MacroTable *mt = &as->macros;
+    if (line->directive == DIR_MACRO) {
+        as->line_count--;
+        macro_begin(as, line);
+        return;
+    }
+    statement_added(as);
+    if (line->kw == NULL && mt->macro_count > 0) {
+        int m = macro_call(as, line);
+        if (m >= 0) {
+            mt->runaway = 0;
+            macro_expand(as, m, line->operand, line->line_no, 0);
+        }
+    }
+}
+
+/*
+ * Branch relaxation
+ *
+ * A format 3 instruction reaches its target PC-relative (-2048..2047 from
+ * the next instruction) or BASE-relative (0..4095 above the base register);
+ * only an absolute value may sit in the field directly. Instructions that
+ * reach neither way are widened to format 4 (which the loader relocates) and their section is laid out again, until nothing
+ * grows. Instructions only ever grow, so this terminates, and a program
+ * that fits keeps every instruction at 3 bytes.
+ */
+
+// Value the base register holds after a BASE statement, -1 if unknown or
+// out of range
+static int base_operand(const SymbolTable *st, ProbeStats *ps, const Line *line) {
+    Expr e;
+    eval_expression(st, ps, line->operand, line->address, &e);
+    if (e.status != EXPR_OK || e.kind == SYM_EXTERNAL || e.value < 0) {
+        return -1;
+    }
+    return e.value;
+}
+
+// Base register assumption in effect at statement index of sec (-1: none)
+static int base_before(Assembler *as, const Section *sec, ProbeStats *ps, int index) {
+    int lo = 0;
+    int hi = sec->base_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sec->base_lines[mid] < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    Line *line = line_at(as, sec->base_lines[lo - 1]);
+    return line->directive == DIR_BASE ? base_operand(&sec->symtab, ps, line) : -1;
+}
+
+// Displacement field for a relative target from a format 3 instruction at
+// address, with the FLAG_P/FLAG_B bits it needs; returns 0 if it cannot
+// reach. There is no direct (b=p=0) form here: format 3 has no M record,
+// so a relative address in the field would break once the program is
+// loaded anywhere but 0. Only absolute values use it, checked by callers.
+static int format3_disp(int address, int target, int base, int *disp, unsigned char *bp) {
+    int pc = target - (address + 3);
+    if (pc >= -2048 && pc <= 2047) {
+        *disp = pc & 0xFFF;
+        *bp = FLAG_P;
+        return 1;
+    }
+    if (base >= 0 && target - base >= 0 && target - base <= 4095) {
+        *disp = target - base;
+        *bp = FLAG_B;
+        return 1;
+    }
+    return 0;
+}
+
+// Whether a format 3 instruction of sec reaches its operand where it
+// stands, after `pool` literal pools. An absolute value must fit the 12-bit
+// field as it is. Operands that do not evaluate count as reachable: pass2
+// reports them. An EXTREF symbol is only placed by the loader, so it needs
+// format 4.
+static int reaches_format3(Section *sec, const Line *line, int base, int pool) {
+    unsigned char flags;
+    StrView symbol = split_operand(line->operand, &flags);
+    Expr e;
+    if (is_literal(symbol)) {
+        const Symbol *sym = find_literal(sec, &sec->symtab.stats, symbol, pool);
+        if (sym == NULL) {
+            return 1;
+        }
+        e.value = sym->address;
+        e.kind = SYM_RELATIVE;
+    } else {
+        eval_expression(&sec->symtab, &sec->symtab.stats, symbol, line->address, &e);
+        if (e.status != EXPR_OK) {
+            return 1;
+        }
+    }
+    if (e.kind == SYM_ABSOLUTE) {
+        return e.value <= 0xFFF;
+    }
+    int disp;
+    unsigned char bp;
+    return e.kind != SYM_EXTERNAL && format3_disp(line->address, e.value, base, &disp, &bp);
+}
+
+// Widen every format 3 instruction of sec that cannot reach its operand;
+// returns how many grew
+static int widen_far_instructions(Assembler *as, Section *sec) {
+    int grown = 0;
+    int base = -1;
+    int pool = 0;
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        while (pool < sec->pool_count && sec->pools[pool].line < i) {
+            pool++;
+        }
+        if (line->directive == DIR_BASE) {
+            base = base_operand(&sec->symtab, &sec->symtab.stats, line);
+        } else if (line->directive == DIR_NOBASE) {
+            base = -1;
+        } else if (line->format == 3 && line->kw->opcode != 0x4C &&
+                   !reaches_format3(sec, line, base, pool)) {
+            line->format = 4;
+            grown++;
+        }
+    }
+    sec->relaxed_count += grown;
+    return grown;
+}
+
+// Lay out all statements of sec, from scratch: its symbols and pass1
+// diagnostics are produced afresh
+static void relayout(Assembler *as, Section *sec) {
+    Layout lay;
+    symtab_clear(&sec->symtab);
+    sec->diag_count = 0;
+    sec->error_count = 0;
+    layout_begin(as, sec, &lay);
+    for (int i = sec->first; i < sec->last; i++) {
+        layout_statement(line_at(as, i), i, &lay);
+    }
+    layout_end(&lay);
+}
+
+// Lay out sec, widening instructions until addresses converge
+static void layout_section(Assembler *as, Section *sec) {
+    sec->relaxed_count = 0;
+    relayout(as, sec);
+    while (widen_far_instructions(as, sec) > 0) {
+        relayout(as, sec);
+    }
+}
+
+// Undo relaxation: instructions written without '+' go back to format 3
+static void unrelax_section(Assembler *as, Section *sec) {
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        if (line->format == 4 && line->mnemonic.ptr[0] != '+') {
+            line->format = 3;
+        }
+    }
+    sec->relaxed_count = 0;
+}
+
+/*
+ * Peephole optimizer (-O)
+ *
+ * With -O every control section, once laid out, is scanned for redundant
+ * instruction patterns. A table of rules rewrites them in the statement
+ * records themselves, then the section is laid out again (relaxation
+ * included) and scanned again, until nothing changes. A rewritten
+ * statement keeps its source line; a removed one stays in the listing
+ * without object code.
+ *
+ * Labels are barriers: control may arrive at any of them from elsewhere (a
+ * jump, an indirect jump through a WORD, the return of a JSUB, another
+ * section through EXTDEF), so no pattern extends across one. A section
+ * whose code depends on its exact layout - an indexed jump into a table of
+ * jumps, a jump to an expression, an operand counted from * - is left as
+ * written.
+ */
+
+#define PEEPHOLE_ROUNDS 8      // Rewrite and lay out again at most this often
+#define PEEPHOLE_CHAIN_MAX 16  // Jumps followed along one chain
+
+// Load and store of one register, and the register CLEAR names when a
+// load of #0 can become one
+typedef struct {
+    unsigned char store;
+    unsigned char load;
+    const char *clear;      // NULL: no CLEAR for it
+} PeepholeRegister;
+
+static const PeepholeRegister peephole_registers[] = {
+    {0x0C, 0x00, "A"},      // STA / LDA
+    {0x10, 0x04, "X"},      // STX / LDX
+    {0x14, 0x08, "L"},      // STL / LDL
+    {0x78, 0x68, "B"},      // STB / LDB
+    {0x7C, 0x6C, "S"},      // STS / LDS
+    {0x84, 0x74, "T"},      // STT / LDT
+    {0x80, 0x70, NULL},     // STF / LDF
+    {0x54, 0x50, NULL},     // STCH / LDCH
+};
+
+// What a jump to the next instruction and a jump to a jump may become
+typedef struct {
+    unsigned char opcode;
+    unsigned char to_next;  // Goes on at the next instruction either way: removable
+    unsigned char through;  // Unconditional: a chain continues through it
+} PeepholeJump;
+
+static const PeepholeJump peephole_jumps[] = {
+    {0x3C, 1, 1},           // J
+    {0x30, 1, 0},           // JEQ
+    {0x34, 1, 0},           // JGT
+    {0x38, 1, 0},           // JLT
+    {0x48, 0, 0},           // JSUB (also sets L)
+};
+
+typedef struct {
+    Assembler *as;
+    Section *sec;
+    SymbolTable targets;    // Label => the statement defining it (in the address field)
+    ProbeStats stats;
+} Peephole;
+
+// A rule looks at statement index and rewrites what it matches there;
+// returns the cycles that saves, 0 if it does not apply
+typedef int (*PeepholeRule)(Peephole *ph, int index);
+
+// Cycles the simulator charges for one execution of the statement
+static int statement_cycles(const Line *line) {
+    if (line->format <= 2) {
+        return 1;
+    }
+    return (line->flags & (FLAG_N | FLAG_I)) == FLAG_N ? 3 : 2;
+}
+
+static const PeepholeRegister* peephole_register(int opcode, int store) {
+    for (size_t i = 0; i < sizeof(peephole_registers) / sizeof(peephole_registers[0]); i++) {
+        if ((store ? peephole_registers[i].store : peephole_registers[i].load) == opcode) {
+            return &peephole_registers[i];
+        }
+    }
+    return NULL;
+}
+
+static const PeepholeJump* peephole_jump(int opcode) {
+    for (size_t i = 0; i < sizeof(peephole_jumps) / sizeof(peephole_jumps[0]); i++) {
+        if (peephole_jumps[i].opcode == opcode) {
+            return &peephole_jumps[i];
+        }
+    }
+    return NULL;
+}
+
+// Opcode of a format 3/4 instruction, -1 for anything else
+static int peephole_opcode(const Line *line) {
+    if (line->directive != DIR_NONE || line->format < 3) {
+        return -1;
+    }
+    return line->kw->opcode;
+}
+
+// A symbol on its own (no expression, number or literal)
+static int is_plain_symbol(StrView v) {
+    if (v.len == 0 || !isalpha((unsigned char)v.ptr[0])) {
+        return 0;
+    }
+    for (int i = 1; i < v.len; i++) {
+        if (!is_name_char((unsigned char)v.ptr[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The operand of line with simple addressing (no #, @ or ,X) naming a
+// symbol on its own; empty if it is anything else
+static StrView simple_symbol(const Line *line) {
+    unsigned char flags;
+    StrView symbol = split_operand(line->operand, &flags);
+    return flags == (FLAG_N | FLAG_I) && is_plain_symbol(symbol) ? symbol : empty_view;
+}
+
+// Address symbol names in the section if it is a label there, else -1
+static int peephole_address(Peephole *ph, StrView symbol) {
+    const Symbol *sym = symtab_find(&ph->sec->symtab, &ph->stats, symbol.ptr, symbol.len);
+    return sym != NULL && sym->kind == SYM_RELATIVE ? sym->address : -1;
+}
+
+// Statement defining label symbol, -1 if none
+static int peephole_label(Peephole *ph, StrView symbol) {
+    const Symbol *sym = symtab_find(&ph->targets, &ph->stats, symbol.ptr, symbol.len);
+    return sym != NULL ? sym->address : -1;
+}
+
+// The statement that runs after statement index: statements that neither
+// produce code nor change the machine state are passed over, a label
+// stops the search. -1 at a barrier or the end of the section.
+static int peephole_next(Peephole *ph, int index) {
+    for (int i = index + 1; i < ph->sec->last; i++) {
+        Line *line = line_at(ph->as, i);
+        if (line->label.len > 0) {
+            return -1;
+        }
+        switch (line->directive) {
+        case DIR_REMOVED:
+        case DIR_BASE:
+        case DIR_NOBASE:
+        case DIR_EXTDEF:
+        case DIR_EXTREF:
+        case DIR_CALL:
+            continue;
+        default:
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void peephole_remove(Line *line) {
+    line->directive = DIR_REMOVED;
+    line->format = 0;
+}
+
+// STA X followed by LDA X: the register already holds what it would load
+static int rule_reload(Peephole *ph, int index) {
+    Line *line = line_at(ph->as, index);
+    const PeepholeRegister *reg = peephole_register(peephole_opcode(line), 1);
+    unsigned char flags;
+    split_operand(line->operand, &flags);
+    if (reg == NULL || (flags & (FLAG_N | FLAG_I)) != (FLAG_N | FLAG_I)) {
+        return 0;
+    }
+    int next = peephole_next(ph, index);
+    if (next < 0) {
+        return 0;
+    }
+    Line *load = line_at(ph->as, next);
+    if (peephole_opcode(load) != reg->load || !view_eq(load->operand, line->operand)) {
+        return 0;
+    }
+    int cycles = statement_cycles(load);
+    peephole_remove(load);
+    return cycles;
+}
+
+// A jump to the next instruction goes on where it would have anyway
+static int rule_jump_next(Peephole *ph, int index) {
+    Line *line = line_at(ph->as, index);
+    const PeepholeJump *jump = peephole_jump(peephole_opcode(line));
+    StrView target = simple_symbol(line);
+    if (jump == NULL || !jump->to_next || target.len == 0 ||
+        peephole_address(ph, target) != line->address + line->code_len) {
+        return 0;
+    }
+    int cycles = statement_cycles(line);
+    peephole_remove(line);
+    return cycles;
+}
+
+// LDA #0 => CLEAR A (one byte shorter, or two for +LDA, and one cycle less)
+static int rule_clear(Peephole *ph, int index) {
+    Line *line = line_at(ph->as, index);
+    const PeepholeRegister *reg = peephole_register(peephole_opcode(line), 0);
+    if (reg == NULL || reg->clear == NULL || !view_eq(line->operand, make_view("#0", 2))) {
+        return 0;
+    }
+    int cycles = statement_cycles(line) - 1;
+    line->mnemonic = make_view("CLEAR", 5);
+    line->operand = make_view(reg->clear, (int)strlen(reg->clear));
+    line->kw = lookup_keyword_n(line->mnemonic.ptr, line->mnemonic.len);
+    line->format = 2;
+    return cycles;
+}
+
+// A jump to a J goes straight to where that J goes
+static int rule_jump_chain(Peephole *ph, int index) {
+    Line *line = line_at(ph->as, index);
+    StrView target = simple_symbol(line);
+    if (peephole_jump(peephole_opcode(line)) == NULL || target.len == 0) {
+        return 0;
+    }
+    int cycles = 0;
+    int at = peephole_label(ph, target);
+    for (int hops = 0; at >= 0 && hops < PEEPHOLE_CHAIN_MAX; hops++) {
+        Line *via = line_at(ph->as, at);
+        const PeepholeJump *jump = peephole_jump(peephole_opcode(via));
+        StrView next = simple_symbol(via);
+        if (jump == NULL || !jump->through || next.len == 0 || view_eq(next, target)) {
+            break;
+        }
+        cycles += statement_cycles(via);
+        target = next;
+        at = peephole_label(ph, target);
+    }
+    if (cycles == 0) {
+        return 0;
+    }
+    line->operand = target;
+    return cycles;
+}
+
+static const PeepholeRule peephole_rules[] = {
+    rule_reload,
+    rule_jump_next,
+    rule_clear,
+    rule_jump_chain,
+};
+
+// Whether operand counts from the location counter (*+3, ALPHA-*)
+static int counts_from_star(StrView operand) {
+    for (int i = 0; i < operand.len; i++) {
+        if (operand.ptr[i] != '*') {
+            continue;
+        }
+        int before = i > 0 ? operand.ptr[i - 1] : 0;
+        int after = i + 1 < operand.len ? operand.ptr[i + 1] : 0;
+        if (before == '+' || before == '-' || after == '+' || after == '-') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the code of the section works wherever its statements land:
+// every jump names a label (or * for itself) and nothing counts from *
+static int peephole_movable(Peephole *ph) {
+    Section *sec = ph->sec;
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(ph->as, i);
+        if (line->directive == DIR_BYTE) {
+            continue;
+        }
+        if (counts_from_star(line->operand)) {
+            return 0;
+        }
+        if (peephole_jump(peephole_opcode(line)) != NULL) {
+            unsigned char flags;
+            StrView symbol = split_operand(line->operand, &flags);
+            if (flags & FLAG_X) {
+                return 0;
+            }
+            if (view_eq(symbol, make_view("*", 1))) {
+                continue;
+            }
+            const Symbol *sym = is_plain_symbol(symbol)
+                ? symtab_find(&sec->symtab, &ph->stats, symbol.ptr, symbol.len) : NULL;
+            if (sym == NULL || sym->kind == SYM_ABSOLUTE) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Apply the rules to sec until nothing changes, laying it out again after
+// each round; what was saved is added up in sec->peephole
+static void peephole_section(Assembler *as, Section *sec) {
+    Peephole ph;
+    ph.as = as;
+    ph.sec = sec;
+    memset(&ph.stats, 0, sizeof(ProbeStats));
+    if (sec->error_count > 0 || !peephole_movable(&ph)) {
+        return;
+    }
+    symtab_init(&ph.targets, sec->symtab.oom);
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        if (line->label.len > 0) {
+            symtab_insert(&ph.targets, line->label.ptr, line->label.len, i, SYM_RELATIVE);
+        }
+    }
+    int code_len = sec->code_len;
+    for (int round = 0; round < PEEPHOLE_ROUNDS; round++) {
+        int rewrites = 0;
+        for (int i = sec->first; i < sec->last; i++) {
+            for (size_t r = 0; r < sizeof(peephole_rules) / sizeof(peephole_rules[0]); r++) {
+                int cycles = peephole_rules[r](&ph, i);
+                if (cycles > 0) {
+                    sec->peephole.cycles += cycles;
+                    rewrites++;
+                    break;
+                }
+            }
+        }
+        if (rewrites == 0) {
+            break;
+        }
+        sec->peephole.rewrites += rewrites;
+        // Statements only got shorter: start relaxation over
+        unrelax_section(as, sec);
+        layout_section(as, sec);
+    }
+    sec->peephole.bytes = code_len - sec->code_len;
+    symtab_free(&ph.targets);
+}
+
+static void layout_task(void *ctx, int task, int worker) {
+    (void)worker;
+    Assembler *as = (Assembler*)ctx;
+    Section *sec = &as->sections[task];
+    // Running out of memory on a worker ends the task, not the thread
+    sec->symtab.oom = &sec->task_oom;
+    sec->task_oom.allocations = as->oom.allocations;
+    if (setjmp(sec->task_oom.jump)) {
+        sec->out_of_memory = 1;
+    } else {
+        layout_section(as, sec);
+        if (as->optimize) {
+            peephole_section(as, sec);
+        }
+    }
+    sec->symtab.oom = &as->oom;
+}
+
+// Parse every statement, cutting the program into control sections at
+// CSECT statements. The sections share nothing, so they are laid out on
+// as->jobs threads, each from code offset 0; their code is then moved into
+// place one after the other and their diagnostics are collected in order.
+// Find the execution address the END of the program names. Its operand is
+// a symbol of the first section, whose E record carries it, even when END
+// closes a later one, or the program name; without one the program starts
+// at its start address.
+static void resolve_entry(Assembler *as) {
+    const Section *first = &as->sections[0];
+    const Line *end = NULL;
+    for (int s = as->section_count - 1; s >= 0 && end == NULL; s--) {
+        if (as->sections[s].end_index >= 0) {
+            end = line_at(as, as->sections[s].end_index);
+        }
+    }
+    as->entry = first->start_addr;
+    as->entry_diag = 0;
+    if (end == NULL || end->operand.len == 0) {
+        return;
+    }
+    Expr e;
+    eval_expression(&first->symtab, &as->lookup_stats, end->operand, end->address, &e);
+    expr_no_external(&e);
+    if (e.status == EXPR_UNDEFINED && first->start_index >= 0 &&
+        view_eq(end->operand, line_at(as, first->start_index)->label)) {
+        return;
+    }
+    if (e.status != EXPR_OK) {
+        char msg[256];
+        expr_message(&e, end->operand, msg, (int)sizeof(msg));
+        int count = as->diag_count;
+        report_error(as, end->line_no, "%s", msg);
+        as->entry_diag = as->diag_count > count;
+        return;
+    }
+    as->entry = e.value;
+}
+
+static void pass1(Assembler *as) {
+    const char *cursor = as->src.data;
+    const char *src_end = as->src.data + as->src.size;
+    LexedLine lx;
+
+    Section *sec = section_begin(as, 0);
+    for (int i = 0; lex_line(&cursor, src_end, &lx); i++) {
+        // Work directly on the source: tokens are views, nothing is copied
+        if (lx.end == 0) {
+            continue; // skip empty line
+        }
+        as->source_line_count = i + 1;
+        if (lex_is_blank(&lx)) {
+            continue; // skip comment line
+        }
+        if (as->macros.in_body) {
+            macro_body_line(as, &lx, i+1);
+            continue;
+        }
+        Line *line = append_line(as);
+        parse_lexed(line, &lx, i+1, &as->keyword_stats);
+        macro_statement(as, line);
+    }
+    if (as->macros.in_body) {
+        report_error(as, as->macros.in_body, "MACRO without MEND");
+    }
+    sec = &as->sections[as->section_count - 1];
+    sec->last = as->line_count;
+
+    parallel_for(as->jobs, as->section_count, layout_task, as);
+
+    int code_total = 0;
+    for (int s = 0; s < as->section_count; s++) {
+        sec = &as->sections[s];
+        if (sec->out_of_memory) {
+            longjmp(as->oom.jump, 1);
+        }
+        sec->code_off = code_total;
+        for (int i = sec->first; code_total > 0 && i < sec->last; i++) {
+            line_at(as, i)->code_off += code_total;
+        }
+        code_total += sec->code_len;
+        for (int i = 0; i < sec->diag_count; i++) {
+            diag_append(&as->diags, &as->diag_count, &as->diag_cap, &sec->diags[i]);
+        }
+        as->error_count += sec->error_count;
+        as->peephole.rewrites += sec->peephole.rewrites;
+        as->peephole.bytes += sec->peephole.bytes;
+        as->peephole.cycles += sec->peephole.cycles;
+        sec->diag_count = 0;
+        sec->error_count = 0;
+    }
+    code_reserve(&as->code, code_total, &as->oom);
+    if (code_total > 0) {
+        memset(as->code.data, 0, code_total);
+    }
+    resolve_entry(as);
+}
+
+/*
+ * PASS 2
+ */
+
+// A run of lines encoded by one pass2 task. Workers only read the
+// Assembler and its symbol tables; what they report stays in the chunk.
+typedef struct {
+    Assembler *as;
+    int first;          // Lines first..last-1
+    int last;
+    Section *sec;       // Section of the current line
+    SicDiagnostic *diags;
+    int diag_count;
+    int diag_cap;
+    int error_count;    // Counted even if a diagnostic could not be stored
+    ProbeStats stats;
+    ProbeStats keyword_stats;
+    int base;           // Base register assumption at the current line (-1: none)
+    int pool;           // Literal pools of the section placed before the current line
+} Pass2Chunk;
+
+// report_error() for a pass2 chunk (never unwinds: no longjmp off a worker)
+static void chunk_error(Pass2Chunk *pc, int line_no, const char *fmt, ...) {
+    pc->error_count++;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vadd(&pc->diags, &pc->diag_count, &pc->diag_cap, SIC_SEVERITY_ERROR, line_no, fmt, ap);
+    va_end(ap);
+}
+
+// Evaluate the expression text of line into line->value; returns its
+// kind (SYM_ABSOLUTE, SYM_RELATIVE or SYM_EXTERNAL), -1 after reporting
+// why it has none
+static int chunk_eval(Pass2Chunk *pc, Line *line, StrView text) {
+    Expr e;
+    eval_expression(&pc->sec->symtab, &pc->stats, text, line->address, &e);
+    line->value = e.value;
+    if (e.status != EXPR_OK) {
+        char msg[256];
+        expr_message(&e, text, msg, (int)sizeof(msg));
+        chunk_error(pc, line->line_no, "%s", msg);
+        if (e.status == EXPR_UNDEFINED) {
+            line->state |= LINE_UNRESOLVED;
+        }
+        return -1;
+    }
+    return e.kind;
+}
+
+// Resolve a format 3/4 operand into line->flags and line->value. Returns
+// the kind of its value as chunk_eval does; an absolute value is checked
+// against the address field.
+static int resolve_operand(Pass2Chunk *pc, Line *line) {
+    StrView symbol = split_operand(line->operand, &line->flags);
+    if (is_literal(symbol)) {
+        const Symbol *sym = find_literal(pc->sec, &pc->stats, symbol, pc->pool);
+        if (sym == NULL) {
+            chunk_error(pc, line->line_no, "Invalid literal %.*s", symbol.len, symbol.ptr);
+            line->value = 0;
+            return -1;
+        }
+        line->value = sym->address;
+        return SYM_RELATIVE;
+    }
+    int kind = chunk_eval(pc, line, symbol);
+    if (kind == SYM_ABSOLUTE && (line->value < 0 || line->value > (line->format == 4 ? 0xFFFFF : 0xFFF))) {
+        chunk_error(pc, line->line_no, line->flags == FLAG_I ? "Immediate value out of range" :
+                                                               "Address out of range");
+        line->value = 0;
+    }
+    return kind;
+}
+
+// Encode one line into its slice of the code buffer
+static void encode_line(Pass2Chunk *pc, Line *line) {
+    line->state &= ~(LINE_RELOCATE | LINE_EXTERNAL);
+    if (line->mnemonic.len == 0) {
+        return;
+    }
+    StrView operand = line->operand;
+    const Keyword *kw = line->kw;
+    unsigned char *code = line_code(pc->as, line);
+    if (line->directive != DIR_NONE) {
+        // Handle BYTE / WORD to fill the object code
+        if (line->directive == DIR_BYTE && line->code_len > 0) {
+            // Value between the quotes
+            StrView val;
+            int used = byte_constant(operand, &val);
+            if (val.ptr + val.len == operand.ptr + operand.len) {
+                chunk_error(pc, line->line_no, "Missing closing quote in BYTE constant");
+            } else if (used < operand.len) {
+                StrView rest = view_trim(make_view(operand.ptr + used, operand.len - used));
+                chunk_error(pc, line->line_no, "Unexpected text '%.*s' after BYTE constant",
+                            rest.len, rest.ptr);
+            }
+            if (operand.ptr[0] == 'C') {
+                // One byte per character
+                memcpy(code, val.ptr, line->code_len);
+            } else {
+                // Two hex digits per byte
+                int bad = val.len % 2 != 0;
+                for (int c = 0; c < line->code_len; c++) {
+                    int hi = hex_digit((unsigned char)val.ptr[2*c]);
+                    int lo = hex_digit((unsigned char)val.ptr[2*c+1]);
+                    if (hi < 0 || lo < 0) {
+                        bad = 1;
+                        hi = lo = 0;
+                    }
+                    code[c] = (unsigned char)(hi << 4 | lo);
+                }
+                if (bad) {
+                    chunk_error(pc, line->line_no, "Invalid hex constant");
+                }
+            }
+        } else if (line->directive == DIR_WORD) {
+            // 24-bit word; the loader relocates a relative value, and adds
+            // or subtracts the EXTREF symbols of the expression
+            int kind = chunk_eval(pc, line, operand);
+            if (kind == SYM_RELATIVE || kind == SYM_EXTERNAL) {
+                line->state |= kind == SYM_EXTERNAL ? LINE_EXTERNAL : LINE_RELOCATE;
+            } else if (kind == SYM_ABSOLUTE && !fits_word(line->value)) {
+                chunk_error(pc, line->line_no, "WORD value '%.*s' does not fit in 24 bits",
+                            operand.len, operand.ptr);
+                line->value = 0;
+            }
+            code[0] = (unsigned char)(line->value >> 16);
+            code[1] = (unsigned char)(line->value >> 8);
+            code[2] = (unsigned char)line->value;
+        } else if (line->directive == DIR_BASE) {
+            int kind = chunk_eval(pc, line, operand);
+            if (kind == SYM_EXTERNAL) {
+                chunk_error(pc, line->line_no, "External symbol '%.*s' cannot be a BASE",
+                            operand.len, operand.ptr);
+            } else if (kind >= 0 && line->value < 0) {
+                chunk_error(pc, line->line_no, "BASE value out of range");
+            }
+            pc->base = base_operand(&pc->sec->symtab, &pc->stats, line);
+        } else if (line->directive == DIR_NOBASE) {
+            pc->base = -1;
+        } else if ((line->directive == DIR_LTORG || line->directive == DIR_END) &&
+                   line->code_len > 0) {
+            // The literal pool this statement places
+            const LiteralPool *pool = &pc->sec->pools[pc->pool++];
+            for (int i = 0; i < pool->count; i++) {
+                code += literal_bytes(pc->sec->literals[pool->first + i].text, code);
+            }
+        } else if (line->directive == DIR_EXTDEF) {
+            // Exported names must be defined in this section
+            StrView list = operand;
+            while (list.len > 0) {
+                StrView name = next_list_item(&list);
+                const Symbol *sym = symtab_find(&pc->sec->symtab, &pc->stats, name.ptr, name.len);
+                if (name.len > 0 && (sym == NULL || sym->kind == SYM_EXTERNAL)) {
+                    chunk_error(pc, line->line_no, "EXTDEF symbol '%.*s' is not defined in this section",
+                                name.len, name.ptr);
+                }
+            }
+        }
+        return;
+    }
+    
+    // Check if mnemonic exists (its 3 bytes stay zero)
+    if (kw == NULL || kw->kind != KW_OPCODE) {
+        chunk_error(pc, line->line_no, "Undefined mnemonic '%.*s'",
+                    line->mnemonic.len, line->mnemonic.ptr);
+        return;
+    }
+    int opcode = kw->opcode;
+    code[0] = (unsigned char)opcode;
+
+    if (line->mnemonic.ptr[0] == '+' && kw->format != 3) {
+        chunk_error(pc, line->line_no, "Format 4 needs a format 3 instruction");
+    }
+
+    // Format 1: opcode only
+    if (kw->format == 1) {
+        return;
+    }
+
+    // Handle format 2
+    if (kw->format == 2) {
+        // split operands by comma
+        StrView r1, r2;
+        split_comma(operand, &r1, &r2);
+        const Keyword *reg1 = lookup_kind(r1, KW_REGISTER, &pc->keyword_stats);
+        const Keyword *reg2 = lookup_kind(r2, KW_REGISTER, &pc->keyword_stats);
+        int n1 = (int)view_to_long(r1, 10);
+        int n2 = (int)view_to_long(r2, 10);
+        int valid = 0;
+        switch (kw->operands) {
+        case F2_RR:
+            if (reg1 && reg2) {
+                code[1] = (unsigned char)(reg1->reg << 4 | reg2->reg);
+                valid = 1;
+            } else {
+                chunk_error(pc, line->line_no, "Invalid register(s)");
+            }
+            break;
+        case F2_R:
+            if (reg1 && r2.len == 0) {
+                code[1] = (unsigned char)(reg1->reg << 4);
+                valid = 1;
+            } else {
+                chunk_error(pc, line->line_no, "Invalid register '%.*s'", r1.len, r1.ptr);
+            }
+            break;
+        case F2_RN:
+            // SHIFTL/SHIFTR r1,n encode n-1 in the second nibble
+            if (reg1 && r2.len > 0 && isdigit((unsigned char)r2.ptr[0]) &&
+                n2 >= 1 && n2 <= 16) {
+                code[1] = (unsigned char)(reg1->reg << 4 | (n2 - 1));
+                valid = 1;
+            } else {
+                chunk_error(pc, line->line_no, "Invalid operands for format2");
+            }
+            break;
+        case F2_N:
+            if (r1.len > 0 && r2.len == 0 && isdigit((unsigned char)r1.ptr[0]) && n1 <= 15) {
+                code[1] = (unsigned char)(n1 << 4);
+                valid = 1;
+            } else {
+                chunk_error(pc, line->line_no, "Invalid operands for format2");
+            }
+            break;
+        }
+        if (!valid) {
+            code[0] = 0;
+        }
+        return;
+    }
+    
+    // RSUB takes no operand: simple addressing, zero target
+    if (opcode == 0x4C) {
+        line->flags = FLAG_N | FLAG_I | (line->format == 4 ? FLAG_E : 0);
+        code[0] = (unsigned char)(opcode | 3);
+        code[1] = (unsigned char)(line->format == 4 ? 0x10 : 0);
+        return;
+    }
+
+    // Format 3/4: opcode|n|i, then x b p e and the displacement or address
+    int kind = resolve_operand(pc, line);
+    code[0] = (unsigned char)(opcode | (line->flags & FLAG_N ? 2 : 0) |
+                              (line->flags & FLAG_I ? 1 : 0));
+    if (line->format == 4) {
+        // 20-bit address (or immediate value); a relative address gets an
+        // M record so the loader can relocate it, as does each EXTREF term
+        // for the loader to add or subtract
+        int address = line->value & 0xFFFFF;
+        if (kind == SYM_RELATIVE || kind == SYM_EXTERNAL) {
+            line->state |= kind == SYM_EXTERNAL ? LINE_EXTERNAL : LINE_RELOCATE;
+        }
+        line->flags |= FLAG_E;
+        code[1] = (unsigned char)((line->flags & FLAG_X ? 0x80 : 0) | 0x10 | address >> 16);
+        code[2] = (unsigned char)(address >> 8);
+        code[3] = (unsigned char)address;
+        return;
+    }
+    int disp = line->value & 0xFFF;
+    unsigned char bp = 0;
+    if (kind == SYM_EXTERNAL) {
+        chunk_error(pc, line->line_no, "External reference needs format 4");
+        disp = 0;
+    } else if (kind == SYM_RELATIVE && !format3_disp(line->address, line->value, pc->base, &disp, &bp)) {
+        chunk_error(pc, line->line_no, "Operand out of range for format 3");
+        disp = 0;
+    }
+    line->flags |= bp;
+    code[1] = (unsigned char)((line->flags & FLAG_X ? 0x80 : 0) | (bp & FLAG_B ? 0x40 : 0) |
+                              (bp & FLAG_P ? 0x20 : 0) | disp >> 8);
+    code[2] = (unsigned char)disp;
+}
+
+static void pass2_task(void *ctx, int task, int worker) {
+    (void)worker;
+    Pass2Chunk *pc = &((Pass2Chunk*)ctx)[task];
+    pc->sec = section_of(pc->as, pc->first);
+    pc->base = base_before(pc->as, pc->sec, &pc->stats, pc->first);
+    pc->pool = pool_before(pc->sec, pc->first);
+    for (int i = pc->first; i < pc->last; i++) {
+        if (i == pc->sec->last) {
+            // A new section starts without a base register assumption
+            while (i >= pc->sec->last) {
+                pc->sec++;
+            }
+            pc->base = -1;
+            pc->pool = 0;
+        }
+        encode_line(pc, line_at(pc->as, i));
+    }
+}
+
+// Encode every line. The lines are cut into chunks that may run on as->jobs
+// threads: after pass1 each line depends only on itself, the keyword table
+// and the (now frozen) symbol tables, and writes only its own code slice.
+// Chunk diagnostics are appended in chunk order, so the result does not
+// depend on the number of threads.
+static void pass2(Assembler *as) {
+    int count = (as->line_count + PASS2_CHUNK_LINES - 1) / PASS2_CHUNK_LINES;
+    if (count == 0) {
+        return;
+    }
+    Pass2Chunk *chunks = (Pass2Chunk*)arena_alloc(&as->arena, count * sizeof(Pass2Chunk));
+    memset(chunks, 0, count * sizeof(Pass2Chunk));
+    for (int c = 0; c < count; c++) {
+        chunks[c].as = as;
+        chunks[c].first = c * PASS2_CHUNK_LINES;
+        chunks[c].last = c + 1 < count ? (c + 1) * PASS2_CHUNK_LINES : as->line_count;
+    }
+    parallel_for(as->jobs, count, pass2_task, chunks);
+
+    for (int c = 0; c < count; c++) {
+        Pass2Chunk *pc = &chunks[c];
+        for (int i = 0; i < pc->diag_count; i++) {
+            SicDiagnostic *d = diag_slot(&as->diags, &as->diag_count, &as->diag_cap);
+            if (d != NULL) {
+                *d = pc->diags[i];
+            }
+        }
+        as->error_count += pc->error_count;
+        probe_stats_merge(&as->lookup_stats, &pc->stats);
+        probe_stats_merge(&as->keyword_stats, &pc->keyword_stats);
+        free(pc->diags);
+    }
+}
+
+/*
+ * Output buffer
+ */
+
+static const char hex_chars[] = "0123456789ABCDEF";
+
+#ifndef SIC_NO_MAIN
+// Open path for writing; the stream is unbuffered because OutBuf does the
+// buffering and hands the OS one large block at a time
+static int outbuf_open(OutBuf *ob, const char *path, int binary, AllocContext *oom) {
+    memset(ob, 0, sizeof(OutBuf));
+    ob->oom = oom;
+    if (strcmp(path, "-") == 0) {
+        ob->fp = stdout;
+        ob->borrowed = 1;
+        return 1;
+    }
+    ob->fp = fopen(path, binary ? "wb" : "w");
+    if (!ob->fp) {
+        return 0;
+    }
+    setvbuf(ob->fp, NULL, _IONBF, 0);
+    return 1;
+}
+#endif
+
+// In-memory sink: the buffer grows to hold the whole output
+static void outbuf_open_memory(OutBuf *ob, AllocContext *oom) {
+    memset(ob, 0, sizeof(OutBuf));
+    ob->oom = oom;
+}
+
+static void outbuf_flush(OutBuf *ob) {
+    if (ob->fp != NULL && ob->len > 0) {
+        fwrite(ob->buf, 1, ob->len, ob->fp);
+        ob->written += ob->len;
+        ob->len = 0;
+    }
+}
+
+// Make room for n more bytes and return where to write them
+static char* outbuf_reserve(OutBuf *ob, size_t n) {
+    if (ob->len + n > ob->cap) {
+        outbuf_flush(ob);
+        if (ob->len + n > ob->cap) {
+            size_t cap = ob->cap ? ob->cap : OUTPUT_BUFFER_SIZE;
+            while (ob->len + n > cap) {
+                cap *= 2;
+            }
+            ob->buf = (char*)xrealloc(ob->oom, ob->buf, cap);
+            ob->cap = cap;
+        }
+    }
+    char *p = ob->buf + ob->len;
+    ob->len += n;
+    return p;
+}
+
+// Flush and close a file sink; returns 0 if the data could not be written
+static int outbuf_close(OutBuf *ob) {
+    int ok = 1;
+    if (ob->fp != NULL) {
+        outbuf_flush(ob);
+        ok = !ferror(ob->fp);
+        ok = (ob->borrowed ? fflush(ob->fp) == 0 : fclose(ob->fp) == 0) && ok;
+    }
+    free(ob->buf);
+    memset(ob, 0, sizeof(OutBuf));
+    return ok;
+}
+
+#ifndef SIC_NO_MAIN
+// Overwrite n bytes at offset off of the output, whether still buffered or
+// already written; returns 0 if a file sink cannot seek back there
+static int outbuf_patch(OutBuf *ob, size_t off, const char *s, size_t n) {
+    if (off >= ob->written) {
+        memcpy(ob->buf + (off - ob->written), s, n);
+        return 1;
+    }
+    outbuf_flush(ob);
+    if (fseek(ob->fp, (long)off, SEEK_SET) != 0) {
+        return 0;
+    }
+    int ok = fwrite(s, 1, n, ob->fp) == n;
+    return fseek(ob->fp, 0, SEEK_END) == 0 && ok;
+}
+#endif
+
+// Hand the contents of a memory sink to the caller
+static char* outbuf_take(OutBuf *ob, size_t *size) {
+    char *buf = ob->buf;
+    *size = ob->len;
+    memset(ob, 0, sizeof(OutBuf));
+    return buf;
+}
+
+static void out_char(OutBuf *ob, char c) {
+    *outbuf_reserve(ob, 1) = c;
+}
+
+static void out_str(OutBuf *ob, const char *s, int n) {
+    memcpy(outbuf_reserve(ob, n), s, n);
+}
+
+// Upper-case hex, zero-padded to at least width digits (like %0*X)
+static void out_hex(OutBuf *ob, unsigned int value, int width) {
+    int digits = 1;
+    while (digits < 8 && (value >> (4 * digits)) != 0) {
+        digits++;
+    }
+    if (digits < width) {
+        digits = width;
+    }
+    char *p = outbuf_reserve(ob, digits);
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = hex_chars[value & 0xF];
+        value >>= 4;
+    }
+}
+
+// n bytes as 2n hex digits
+static void out_bytes_hex(OutBuf *ob, const unsigned char *src, int n) {
+    char *p = outbuf_reserve(ob, 2 * (size_t)n);
+    for (int i = 0; i < n; i++) {
+        p[2*i] = hex_chars[src[i] >> 4];
+        p[2*i+1] = hex_chars[src[i] & 0xF];
+    }
+}
+
+/*
+ * Generate Object File
+ */
+
+// Section name: the label of its first line, the START or CSECT statement
+// (up to 6 chars)
+static StrView section_name(Assembler *as, const Section *sec) {
+    StrView name = empty_view;
+    if (sec->first < sec->last) {
+        name = line_at(as, sec->first)->label;
+        if (name.len > 6) {
+            name.len = 6;
+        }
+    }
+    return name;
+}
+
+static StrView program_name(Assembler *as) {
+    return as->section_count > 0 ? section_name(as, &as->sections[0]) : empty_view;
+}
+
+// Only the H/D/R/T/M/E format can describe several control sections or
+// references the loader has to fill in
+static int needs_linking(const Assembler *as) {
+    return as->section_count > 1 || (as->section_count == 1 && as->sections[0].extref_count > 0);
+}
+
+// Calls emit(ctx, address, bytes, n) for each run of object code of lines
+// first..last-1, split so that no run exceeds max bytes. Runs only end where
+// the addresses do not continue (RESB, RESW, ORG): lines without code such
+// as EQU or BASE do not break them. Consecutive code-bearing lines are
+// adjacent in the code buffer, so a run is always a single slice of it.
+// A line that does not fit starts a new run, unless as->fill_records lets
+// runs fill up to max and go on with the rest of the line; a line longer
+// than max is split either way.
+static void for_each_code_run(Assembler *as, int first, int last, int max,
+                              void (*emit)(void *, int, const unsigned char *, int),
+                              void *ctx) {
+    int run_addr = 0;
+    int run_off = 0;
+    int run_len = 0;
+    for (int i = first; i < last; i++) {
+        Line *line = line_at(as, i);
+        if (line->code_len == 0) {
+            continue;
+        }
+        int off = line->code_off;
+        int addr = line->address;
+        int left = line->code_len;
+        if (run_len > 0 && addr != run_addr + run_len) {
+            emit(ctx, run_addr, as->code.data + run_off, run_len);
+            run_len = 0;
+        }
+        while (left > 0) {
+            if (run_len == max || (!as->fill_records && run_len > 0 && run_len + left > max)) {
+                emit(ctx, run_addr, as->code.data + run_off, run_len);
+                run_len = 0;
+            }
+            if (run_len == 0) {
+                run_addr = addr;
+                run_off = off;
+            }
+            int piece = left < max - run_len ? left : max - run_len;
+            run_len += piece;
+            off += piece;
+            addr += piece;
+            left -= piece;
+        }
+    }
+    if (run_len > 0) {
+        emit(ctx, run_addr, as->code.data + run_off, run_len);
+    }
+}
+
+// Told where each T record lands: its offset in the output and its bytes
+typedef void (*RecordNote)(void *ctx, long file_off, const unsigned char *bytes, int n);
+
+typedef struct {
+    OutBuf *ob;
+    RecordNote note;    // May be NULL
+    void *note_ctx;
+    long count;         // Records emitted
+} TextSink;
+
+// T record: T, start address, length, object code
+static void emit_text_record(void *ctx, int addr, const unsigned char *bytes, int n) {
+    TextSink *sink = (TextSink*)ctx;
+    OutBuf *ob = sink->ob;
+    if (sink->note != NULL) {
+        sink->note(sink->note_ctx, (long)(ob->written + ob->len), bytes, n);
+    }
+    sink->count++;
+    out_char(ob, 'T');
+    out_hex(ob, (unsigned int)addr, 6);
+    out_hex(ob, (unsigned int)n, 2);
+    out_bytes_hex(ob, bytes, n);
+    out_char(ob, '\n');
+}
+
+// Symbol name padded to the 6 columns of D and R records
+static void out_record_name(OutBuf *ob, StrView name) {
+    if (name.len > 6) {
+        name.len = 6;
+    }
+    out_str(ob, name.ptr, name.len);
+    out_str(ob, "      ", 6 - name.len);
+}
+
+// D records: the EXTDEF names of a section and their addresses, six per record
+static void write_define_records(Assembler *as, const Section *sec, OutBuf *ob) {
+    int count = 0;
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        if (line->directive != DIR_EXTDEF) {
+            continue;
+        }
+        StrView list = line->operand;
+        while (list.len > 0) {
+            StrView name = next_list_item(&list);
+            const Symbol *sym = symtab_find(&sec->symtab, &as->lookup_stats, name.ptr, name.len);
+            if (sym == NULL || sym->kind == SYM_EXTERNAL) {
+                continue;
+            }
+            if (count % 6 == 0) {
+                if (count > 0) {
+                    out_char(ob, '\n');
+                }
+                out_char(ob, 'D');
+            }
+            out_record_name(ob, name);
+            out_hex(ob, (unsigned int)sym->address, 6);
+            count++;
+        }
+    }
+    if (count > 0) {
+        out_char(ob, '\n');
+    }
+}
+
+// R records: the EXTREF names of a section, twelve per record
+static void write_refer_records(Assembler *as, const Section *sec, OutBuf *ob) {
+    int count = 0;
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        if (line->directive != DIR_EXTREF) {
+            continue;
+        }
+        StrView list = line->operand;
+        while (list.len > 0) {
+            StrView name = next_list_item(&list);
+            if (name.len == 0) {
+                continue;
+            }
+            if (count % 12 == 0) {
+                if (count > 0) {
+                    out_char(ob, '\n');
+                }
+                out_char(ob, 'R');
+            }
+            out_record_name(ob, name);
+            count++;
+        }
+    }
+    if (count > 0) {
+        out_char(ob, '\n');
+    }
+}
+
+// One M record: the loader adds (sign 1) or subtracts the address of name
+// to the field of half_bytes at address
+static void out_modification(OutBuf *ob, int address, int half_bytes, int sign, StrView name) {
+    out_char(ob, 'M');
+    out_hex(ob, (unsigned int)address, 6);
+    out_str(ob, half_bytes == 6 ? "06" : "05", 2);
+    out_char(ob, sign < 0 ? '-' : '+');
+    out_str(ob, name.ptr, name.len);
+    out_char(ob, '\n');
+}
+
+// M records: the 20-bit address field of every format 4 instruction, and
+// every WORD, holding a relative value or EXTREF terms, to be relocated by
+// the section's load address and have each EXTREF symbol's added or
+// subtracted as its sign says (BUFEND-BUFFER takes +BUFEND and -BUFFER)
+static void write_modification_records(Assembler *as, const Section *sec, OutBuf *ob) {
+    StrView self = section_name(as, sec);
+    for (int i = sec->first; i < sec->last; i++) {
+        Line *line = line_at(as, i);
+        if (!(line->state & (LINE_RELOCATE | LINE_EXTERNAL))) {
+            continue;
+        }
+        int word = line->directive == DIR_WORD;
+        int address = line->address + (word ? 0 : 1);
+        int half_bytes = word ? 6 : 5;
+        if (!(line->state & LINE_EXTERNAL)) {
+            out_modification(ob, address, half_bytes, 1, self);
+            continue;
+        }
+        // The terms, evaluated again: only these few statements need them
+        Expr e;
+        eval_expression(&sec->symtab, &as->lookup_stats, line_symbol(line), line->address, &e);
+        if (e.relative) {
+            out_modification(ob, address, half_bytes, 1, self);
+        }
+        for (int k = 0; k < e.external_count; k++) {
+            out_modification(ob, address, half_bytes, e.externals[k].sign, e.externals[k].name);
+        }
+    }
+}
+
+// H/D/R/T/M/E object program, one block of records per control section.
+// note, if not NULL, is told where each T record lands in the output.
+static void write_obj_records(Assembler *as, OutBuf *ob, RecordNote note, void *note_ctx) {
+    TextSink sink = { ob, note, note_ctx, 0 };
+    for (int s = 0; s < as->section_count; s++) {
+        const Section *sec = &as->sections[s];
+
+        // Header record
+        StrView name = section_name(as, sec);
+        out_char(ob, 'H');
+        out_str(ob, name.ptr, name.len);
+        out_str(ob, "      ", 6 - name.len);
+        out_hex(ob, (unsigned int)sec->start_addr, 6);
+        out_hex(ob, (unsigned int)sec->length, 6);
+        out_char(ob, '\n');
+
+        write_define_records(as, sec, ob);
+        write_refer_records(as, sec, ob);
+
+        // Text records (max 30 bytes => 60 hex digits)
+        for_each_code_run(as, sec->first, sec->last, TEXT_RECORD_MAX, emit_text_record, &sink);
+
+        write_modification_records(as, sec, ob);
+
+        // End record; only the first section names the entry point
+        out_char(ob, 'E');
+        if (s == 0) {
+            out_hex(ob, (unsigned int)as->entry, 6);
+        }
+        out_char(ob, '\n');
+    }
+    if (as->stats != NULL) {
+        as->stats->text_records += sink.count;
+    }
+}
+
+// Flat memory image from the lowest to the highest address holding code;
+// reserved areas in between are zero-filled
+static void write_bin_image(Assembler *as, OutBuf *ob) {
+    int lo = -1;
+    int hi = -1;
+    for (int i = 0; i < as->line_count; i++) {
+        Line *line = line_at(as, i);
+        if (line->code_len == 0) {
+            continue;
+        }
+        if (lo < 0 || line->address < lo) {
+            lo = line->address;
+        }
+        if (line->address + line->code_len > hi) {
+            hi = line->address + line->code_len;
+        }
+    }
+    if (lo < 0) {
+        return;
+    }
+    char *image = outbuf_reserve(ob, (size_t)(hi - lo));
+    memset(image, 0, (size_t)(hi - lo));
+    for (int i = 0; i < as->line_count; i++) {
+        Line *line = line_at(as, i);
+        if (line->code_len > 0) {
+            memcpy(image + (line->address - lo), line_code(as, line), line->code_len);
+        }
+    }
+}
+
+typedef struct {
+    OutBuf *ob;
+    int upper;      // Upper 16 address bits of the last extended linear address record
+} IhexState;
+
+// One Intel HEX record: ':' count address type data checksum
+static void out_ihex_record(OutBuf *ob, int type, int addr, const unsigned char *data, int n) {
+    unsigned int sum = (unsigned int)(n + (addr >> 8) + addr + type);
+    out_char(ob, ':');
+    out_hex(ob, (unsigned int)n, 2);
+    out_hex(ob, (unsigned int)addr & 0xFFFF, 4);
+    out_hex(ob, (unsigned int)type, 2);
+    out_bytes_hex(ob, data, n);
+    for (int i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    out_hex(ob, (0x100 - (sum & 0xFF)) & 0xFF, 2);
+    out_char(ob, '\n');
+}
+
+static void emit_ihex_data(void *ctx, int addr, const unsigned char *bytes, int n) {
+    IhexState *st = (IhexState*)ctx;
+    while (n > 0) {
+        // Records may not cross a 64K boundary
+        int piece = 0x10000 - (addr & 0xFFFF);
+        if (piece > n) {
+            piece = n;
+        }
+        if ((addr >> 16) != st->upper) {
+            unsigned char ext[2] = { (unsigned char)(addr >> 24), (unsigned char)(addr >> 16) };
+            st->upper = addr >> 16;
+            out_ihex_record(st->ob, 4, 0, ext, 2);
+        }
+        out_ihex_record(st->ob, 0, addr, bytes, piece);
+        addr += piece;
+        bytes += piece;
+        n -= piece;
+    }
+}
+
+// Start linear address (entry point), then end of file
+static void out_ihex_trailer(OutBuf *ob, int entry) {
+    unsigned char start[4] = {
+        (unsigned char)(entry >> 24), (unsigned char)(entry >> 16),
+        (unsigned char)(entry >> 8), (unsigned char)entry
+    };
+    out_ihex_record(ob, 5, 0, start, 4);
+    out_ihex_record(ob, 1, 0, NULL, 0);
+}
+
+static void write_ihex(Assembler *as, OutBuf *ob) {
+    IhexState st = { ob, 0 };
+    for_each_code_run(as, 0, as->line_count, HEX_RECORD_MAX, emit_ihex_data, &st);
+    out_ihex_trailer(ob, as->entry);
+}
+
+typedef struct {
+    OutBuf *ob;
+    int addr_bytes;     // 2 => S1/S9, 3 => S2/S8
+} SrecState;
+
+// One S-record: 'S' type count address data checksum
+static void out_srec_record(OutBuf *ob, int type, int addr_bytes, int addr,
+                            const unsigned char *data, int n) {
+    int count = addr_bytes + n + 1;
+    unsigned int sum = (unsigned int)count;
+    out_char(ob, 'S');
+    out_char(ob, (char)('0' + type));
+    out_hex(ob, (unsigned int)count, 2);
+    for (int i = addr_bytes - 1; i >= 0; i--) {
+        unsigned int b = ((unsigned int)addr >> (8 * i)) & 0xFF;
+        sum += b;
+        out_hex(ob, b, 2);
+    }
+    out_bytes_hex(ob, data, n);
+    for (int i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    out_hex(ob, ~sum & 0xFF, 2);
+    out_char(ob, '\n');
+}
+
+// Termination record carries the entry point
+static void out_srec_trailer(OutBuf *ob, int addr_bytes, int entry) {
+    if (addr_bytes == 2) {
+        out_srec_record(ob, 9, 2, entry, NULL, 0);
+    } else {
+        out_srec_record(ob, 8, 3, entry, NULL, 0);
+    }
+}
+
+static void emit_srec_data(void *ctx, int addr, const unsigned char *bytes, int n) {
+    SrecState *st = (SrecState*)ctx;
+    out_srec_record(st->ob, st->addr_bytes == 2 ? 1 : 2, st->addr_bytes, addr, bytes, n);
+}
+
+static void write_srec(Assembler *as, OutBuf *ob) {
+    // 16-bit addresses when everything fits, 24-bit otherwise
+    SrecState st = { ob, 2 };
+    for (int i = 0; i < as->line_count; i++) {
+        Line *line = line_at(as, i);
+        if (line->code_len > 0 && line->address + line->code_len > 0x10000) {
+            st.addr_bytes = 3;
+            break;
+        }
+    }
+    StrView name = program_name(as);
+    out_srec_record(ob, 0, 2, 0, (const unsigned char*)name.ptr, name.len);
+    for_each_code_run(as, 0, as->line_count, HEX_RECORD_MAX, emit_srec_data, &st);
+    out_srec_trailer(ob, st.addr_bytes, as->entry);
+}
+
+// Object program in the requested format
+static void write_object(Assembler *as, OutBuf *ob, int format) {
+    switch (format) {
+    case SIC_FORMAT_BIN:
+        write_bin_image(as, ob);
+        break;
+    case SIC_FORMAT_IHEX:
+        write_ihex(as, ob);
+        break;
+    case SIC_FORMAT_SREC:
+        write_srec(as, ob);
+        break;
+    default:
+        write_obj_records(as, ob, NULL, NULL);
+        break;
+    }
+}
+
+/*
+ * Generate List File
+ */
+static void list_row(OutBuf *ob, int address, StrView label, StrView mnemonic, StrView operand,
+                     const unsigned char *code, int code_len) {
+    out_hex(ob, (unsigned int)address, 4);
+    out_char(ob, '\t');
+    out_str(ob, label.ptr, label.len);
+    out_char(ob, '\t');
+    out_str(ob, mnemonic.ptr, mnemonic.len);
+    out_char(ob, '\t');
+    out_str(ob, operand.ptr, operand.len);
+    out_char(ob, '\t');
+    out_bytes_hex(ob, code, code_len);
+    out_char(ob, '\n');
+}
+
+static void write_listing(Assembler *as, OutBuf *ob) {
+    static const char header[] = "Address\tLabel\tMnemonic\tOperand\tObject Code\n";
+    out_str(ob, header, (int)sizeof(header) - 1);
+    for (int i = 0; i < as->line_count; i++) {
+        Line *line = line_at(as, i);
+        const unsigned char *code = line_code(as, line);
+        if ((line->directive == DIR_LTORG || line->directive == DIR_END) && line->code_len > 0) {
+            // A literal pool: the statement, then a "*" row per literal
+            list_row(ob, line->address, line->label, line->mnemonic, line->operand, code, 0);
+            Section *sec = section_of(as, i);
+            const LiteralPool *pool = &sec->pools[pool_before(sec, i)];
+            int address = line->address;
+            for (int l = pool->first; l < pool->first + pool->count; l++) {
+                const Literal *lit = &sec->literals[l];
+                list_row(ob, address, make_view("*", 1), lit->text, empty_view, code, lit->size);
+                address += lit->size;
+                code += lit->size;
+            }
+            continue;
+        }
+        list_row(ob, line->address, line->label, line->mnemonic, line->operand, code, line->code_len);
+    }
+}
+
+/*
+ * The assemble function (main workflow)
+ */
+
+// End an output phase. With --stats the buffered tail is written out now so
+// that it is charged to this phase, and the output bytes are counted.
+static void stats_output(Assembler *as, OutBuf *ob, int phase) {
+    if (as->stats != NULL) {
+        outbuf_flush(ob);
+        as->stats->bytes_written += (long)(ob->written + ob->len);
+        stats_phase(as, phase);
+    }
+}
+
+static void* listing_main(void *arg) {
+    Assembler *as = (Assembler*)arg;
+    ListingWriter *lw = &as->listing;
+    // Running out of memory here ends the thread; the caller unwinds
+    AllocContext *oom = lw->lst->oom;
+    lw->lst->oom = &lw->oom;
+    lw->oom.allocations = oom->allocations;
+    if (setjmp(lw->oom.jump)) {
+        lw->out_of_memory = 1;
+    } else {
+        write_listing(as, lw->lst);
+        outbuf_flush(lw->lst);
+    }
+    lw->lst->oom = oom;
+    return NULL;
+}
+
+// Start writing the listing into lst on a thread of its own; returns 0 if
+// no thread could be started
+static int listing_start(Assembler *as, OutBuf *lst) {
+    ListingWriter *lw = &as->listing;
+    lw->lst = lst;
+    lw->out_of_memory = 0;
+    lw->running = pthread_create(&lw->thread, NULL, listing_main, as) == 0;
+    return lw->running;
+}
+
+// Wait for the listing thread, if it runs
+static void listing_join(Assembler *as) {
+    if (as->listing.running) {
+        pthread_join(as->listing.thread, NULL);
+        as->listing.running = 0;
+    }
+}
+
+// Run both passes over as->src and write the requested outputs (either sink
+// may be NULL). The caller must have armed as->oom.
+static void run_passes(Assembler *as, OutBuf *obj, OutBuf *lst, int format) {
+    if (as->stats != NULL) {
+        as->stats->bytes_read += (long)as->src.size;
+    }
+    stats_mark(as);
+    // PASS1
+    pass1(as);
+    as->pass1_diag_count = as->diag_count;
+    stats_phase(as, PHASE_PASS1);
+    // PASS2
+    pass2(as);
+    stats_phase(as, PHASE_PASS2);
+    // Both outputs only read the finished statements: with both requested
+    // (and threads allowed) the listing is written on a second thread
+    // meanwhile, so it streams to its file or pipe while the object is
+    // being written
+    int concurrent = obj != NULL && lst != NULL && as->jobs > 1 && listing_start(as, lst);
+    // Generate object file
+    if (obj != NULL) {
+        if (format != SIC_FORMAT_OBJ && needs_linking(as)) {
+            report_error(as, 0, "Control sections and external references need the obj format");
+        } else {
+            write_object(as, obj, format);
+        }
+        stats_output(as, obj, PHASE_OBJECT);
+    }
+    // Generate list file (with --stats its phase is the wait for the thread)
+    if (concurrent) {
+        listing_join(as);
+        if (as->listing.out_of_memory) {
+            longjmp(as->oom.jump, 1);
+        }
+        stats_output(as, lst, PHASE_LISTING);
+    } else if (lst != NULL) {
+        write_listing(as, lst);
+        stats_output(as, lst, PHASE_LISTING);
+    }
+}
+
+// run_passes() with allocation failures unwinding back here
+static int run_assembly(Assembler *as, OutBuf *obj, OutBuf *lst, int format) {
+    if (setjmp(as->oom.jump)) {
+        // The listing thread may still be reading what is about to go
+        listing_join(as);
+        report_error(as, 0, "Out of memory");
+        return SIC_ERR_NOMEM;
+    }
+    run_passes(as, obj, lst, format);
+    return as->error_count > 0 ? SIC_ERR_ASSEMBLY : SIC_OK;
+}
+
+#ifndef SIC_NO_MAIN
+// Assemble the source already in as->src into obj_file/lst_file. *written is
+// set when every requested output was written out in full.
+static int assemble_source(Assembler *as, const char *obj_file, const char *lst_file,
+                           int format, int *written) {
+    *written = 0;
+    OutBuf obj, lst;
+    memset(&obj, 0, sizeof(OutBuf));
+    memset(&lst, 0, sizeof(OutBuf));
+    if (obj_file != NULL && !outbuf_open(&obj, obj_file, format == SIC_FORMAT_BIN, &as->oom)) {
+        report_error(as, 0, "Cannot open %s for writing.", obj_file);
+        return SIC_ERR_ARGS;
+    }
+    if (lst_file != NULL && !outbuf_open(&lst, lst_file, 0, &as->oom)) {
+        report_error(as, 0, "Cannot open %s for writing.", lst_file);
+        outbuf_close(&obj);
+        return SIC_ERR_ARGS;
+    }
+    int status = run_assembly(as, obj_file ? &obj : NULL, lst_file ? &lst : NULL, format);
+    *written = 1;
+    if (!outbuf_close(&obj)) {
+        report_error(as, 0, "Cannot write %s.", obj_file);
+        *written = 0;
+    }
+    if (!outbuf_close(&lst)) {
+        report_error(as, 0, "Cannot write %s.", lst_file);
+        *written = 0;
+    }
+    if (status == SIC_OK && as->error_count > 0) {
+        status = SIC_ERR_ASSEMBLY;
+    }
+    return status;
+}
+
+// Start from empty storage (so one Assembler can be reused for several
+// files) and map input_file; lines and tokens are views into it
+static int assembler_load(Assembler *as, const char *input_file) {
+    assembler_reset(as);
+    stats_mark(as);
+    if (!source_open(&as->src, input_file)) {
+        report_error(as, 0, "Cannot open %s for reading.", input_file);
+        return 0;
+    }
+    stats_phase(as, PHASE_READ);
+    return 1;
+}
+
+// Assemble input_file into obj_file/lst_file; either may be NULL to skip
+// that output, or "-" for standard output. Diagnostics stay in as->diags.
+static int assemble(Assembler *as, const char *input_file, const char *obj_file,
+                    const char *lst_file, int format) {
+    if (!assembler_load(as, input_file)) {
+        return SIC_ERR_ARGS;
+    }
+    int written;
+    return assemble_source(as, obj_file, lst_file, format, &written);
+}
+
+// Print diagnostics the way the command line tool always has, optionally
+// prefixed with the file they belong to
+static void print_diagnostics(const SicDiagnostic *diags, int count, const char *file, FILE *out) {
+    for (int i = 0; i < count; i++) {
+        const char *kind = diags[i].severity == SIC_SEVERITY_ERROR ? "Error" : "Warning";
+        if (file != NULL) {
+            fprintf(out, "%s: ", file);
+        }
+        if (diags[i].line > 0) {
+            fprintf(out, "%s: %s at line %d\n", kind, diags[i].message, diags[i].line);
+        } else {
+            fprintf(out, "%s: %s\n", kind, diags[i].message);
+        }
+    }
+}
+#endif
+
+/*
+ * Library interface (libsic.h)
+ */
+
+void sic_options_init(SicOptions *options) {
+    options->format = SIC_FORMAT_OBJ;
+    options->want_object = 1;
+    options->want_listing = 1;
+    options->threads = 1;
+    options->fill_records = 0;
+    options->optimize = 0;
+}
+
+int sic_assemble(const char *source, size_t size, const SicOptions *options,
+                 SicResult *result) {
+    if (result == NULL || (source == NULL && size > 0)) {
+        return SIC_ERR_ARGS;
+    }
+    memset(result, 0, sizeof(SicResult));
+    SicOptions defaults;
+    if (options == NULL) {
+        sic_options_init(&defaults);
+        options = &defaults;
+    }
+
+    Assembler *as = (Assembler*)malloc(sizeof(Assembler));
+    if (as == NULL) {
+        return SIC_ERR_NOMEM;
+    }
+    assembler_init(as);
+    as->jobs = options->threads;
+    as->fill_records = options->fill_records;
+    as->optimize = options->optimize;
+    as->oom.allocations = &result->allocations;
+    source_borrow(&as->src, source, size);
+
+    OutBuf obj, lst;
+    outbuf_open_memory(&obj, &as->oom);
+    outbuf_open_memory(&lst, &as->oom);
+    int status = run_assembly(as, options->want_object ? &obj : NULL,
+                              options->want_listing ? &lst : NULL, options->format);
+    if (status != SIC_ERR_NOMEM) {
+        result->object = (unsigned char*)outbuf_take(&obj, &result->object_size);
+        result->listing = outbuf_take(&lst, &result->listing_size);
+    }
+    outbuf_close(&obj);
+    outbuf_close(&lst);
+
+    // The diagnostics array moves to the result
+    result->diagnostics = as->diags;
+    result->diagnostic_count = as->diag_count;
+    result->error_count = as->error_count;
+    as->diags = NULL;
+    assembler_free(as);
+    free(as);
+    return status;
+}
+
+void sic_result_free(SicResult *result) {
+    if (result == NULL) {
+        return;
+    }
+    free(result->object);
+    free(result->listing);
+    free(result->diagnostics);
+    memset(result, 0, sizeof(SicResult));
+}
+
+#ifndef SIC_NO_MAIN
+/*
+ * Build cache (--cache)
+ *
+ * Remembers what assembling a source produced, keyed by a hash of the source
+ * bytes, the options that shape the outputs and the assembler build itself.
+ * Assembling the same source again restores the object file, the listing and
+ * the diagnostics from the cache directory without running either pass.
+ *
+ * Each entry is one file named after its key, holding a header, the
+ * diagnostics and both outputs. Entries are written to a temporary file and
+ * renamed into place, so parallel jobs (threads or processes) sharing the
+ * directory only ever see whole entries, and two jobs storing the same key
+ * simply replace one another with identical bytes. A hit touches the
+ * entry's modification time; when a run ends, the least recently used
+ * entries are removed until the directory is back under its size limit,
+ * under a lock that also guards the hit/miss totals kept in "stats".
+ */
+
+// 128-bit hash identifying an entry
+typedef struct {
+    unsigned long long a;
+    unsigned long long b;
+} CacheKey;
+
+// Running totals of a cache directory (its "stats" file)
+typedef struct {
+    long long hits;
+    long long misses;
+    long long stores;
+    long long evictions;
+} CacheTotals;
+
+typedef struct {
+    char *dir;
+    long long limit;            // Bytes the entries may take when a run ends
+    CacheKey seed;              // Hash of what makes this assembler build's outputs differ
+    CacheTotals run;            // This run; updated atomically by batch workers
+    CacheTotals total;          // The directory's totals, read by cache_close()
+    long long entries;          // Entries and their bytes after cache_close()
+    long long bytes;
+} BuildCache;
+
+static void cache_count(long long *counter) {
+#ifdef __GNUC__
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+#else
+    (*counter)++;
+#endif
+}
+
+#ifndef _WIN32
+#define CACHE_MAGIC "SICBC01\n"
+#define CACHE_VERSION 3         // Raise whenever the same source would assemble differently
+#define CACHE_FILE_MODE 0644    // Entries are readable by everyone sharing the directory
+#define CACHE_P1 0x9E3779B185EBCA87ULL
+#define CACHE_P2 0xC2B2AE3D27D4EB4FULL
+#define CACHE_STALE_TEMP 3600   // Seconds after which a temporary file is from a writer that died
+
+// Fixed part of an entry file; the diagnostics, the object file and the
+// listing follow it
+typedef struct {
+    char magic[8];
+    CacheKey key;
+    CacheKey payload;           // Hash of the three parts that follow
+    unsigned long long source_size;
+    unsigned long long object_size;
+    unsigned long long listing_size;
+    int status;
+    int error_count;
+    int diag_count;
+    int lines;
+} CacheHeader;
+
+static unsigned long long cache_round(unsigned long long acc, unsigned long long word) {
+    acc += word * CACHE_P2;
+    acc = acc << 31 | acc >> 33;
+    return acc * CACHE_P1;
+}
+
+static unsigned long long cache_avalanche(unsigned long long h) {
+    h ^= h >> 33;
+    h *= CACHE_P2;
+    h ^= h >> 29;
+    h *= CACHE_P1;
+    h ^= h >> 32;
+    return h;
+}
+
+// Fold len bytes into both halves of the 128-bit hash k. Four independent
+// lanes each take one 8-byte word of every 32-byte block, so the multiplies
+// overlap and the source is hashed at memory speed.
+static void cache_hash(CacheKey *k, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned long long lane[4] = {k->a, k->b, k->a ^ CACHE_P1, k->b ^ CACHE_P2};
+    unsigned long long w[4];
+    size_t n = len;
+    for (;;) {
+        if (n >= 32) {
+            memcpy(w, p, 32);
+            p += 32;
+            n -= 32;
+        } else {
+            // The last block is padded with zeros; the length tells the
+            // padding from data
+            unsigned char tail[32];
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, n);
+            memcpy(w, tail, 32);
+            n = 0;
+        }
+        for (int i = 0; i < 4; i++) {
+            lane[i] = cache_round(lane[i], w[i]);
+        }
+        if (n == 0) {
+            break;
+        }
+    }
+    unsigned long long h = (unsigned long long)len * CACHE_P1;
+    for (int i = 0; i < 4; i++) {
+        h = cache_round(h ^ lane[i], lane[(i + 1) & 3]);
+    }
+    k->a = cache_avalanche(h ^ lane[0]);
+    k->b = cache_avalanche(h + lane[2] + k->a);
+}
+
+// Everything besides the source that the outputs depend on: the version
+// of the assembler's output (CACHE_VERSION), its keyword table and the
+// layout of the entry files. Builds of the same assembler, on any machine,
+// share entries.
+static void cache_seed(CacheKey *k) {
+    static const char build[] = "SIC build cache";
+    int version = CACHE_VERSION;
+    k->a = CACHE_P1;
+    k->b = CACHE_P2;
+    cache_hash(k, build, sizeof(build));
+    cache_hash(k, &version, sizeof(version));
+    for (int i = 0; i < KEYWORD_TABLE_SIZE; i++) {
+        const Keyword *kw = &keyword_table[i];
+        if (kw->name != NULL) {
+            int fields[6] = {i, kw->kind, kw->opcode, kw->format, kw->directive,
+                             kw->reg * 16 + kw->operands};
+            cache_hash(k, kw->name, (size_t)kw->len);
+            cache_hash(k, fields, sizeof(fields));
+        }
+    }
+    int layout[3] = {(int)sizeof(CacheHeader), (int)sizeof(SicDiagnostic), SIC_MESSAGE_LEN};
+    cache_hash(k, layout, sizeof(layout));
+}
+
+// Use (and create if needed) dir as the cache, bounded to limit bytes
+static int cache_open(BuildCache *cache, const char *dir, long long limit) {
+    memset(cache, 0, sizeof(BuildCache));
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return 0;
+    }
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    cache->dir = (char*)malloc(strlen(dir) + 1);
+    if (cache->dir == NULL) {
+        return 0;
+    }
+    strcpy(cache->dir, dir);
+    cache->limit = limit;
+    cache_seed(&cache->seed);
+    return 1;
+}
+
+static void cache_path(const BuildCache *cache, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", cache->dir, name);
+}
+
+// Key of the source in as->src assembled to the outputs requested
+static CacheKey cache_key(const BuildCache *cache, const Assembler *as, int format,
+                          const char *obj_file, const char *lst_file) {
+    CacheKey k = cache->seed;
+    int options[5] = {format, obj_file != NULL, lst_file != NULL, as->fill_records, as->optimize};
+    cache_hash(&k, options, sizeof(options));
+    cache_hash(&k, as->src.data, as->src.size);
+    return k;
+}
+
+static void cache_entry_path(const BuildCache *cache, CacheKey key, char *path, size_t size) {
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%016llx", key.a, key.b);
+    cache_path(cache, name, path, size);
+}
+
+// Hash of the parts of an entry after its header
+static CacheKey cache_payload(const void *diags, int diag_count,
+                              const char *object, size_t object_size,
+                              const char *listing, size_t listing_size) {
+    CacheKey k = {CACHE_P2, CACHE_P1};
+    cache_hash(&k, diags, (size_t)diag_count * sizeof(SicDiagnostic));
+    cache_hash(&k, object, object_size);
+    cache_hash(&k, listing, listing_size);
+    return k;
+}
+
+// Write size bytes to path ("-" for standard output)
+static int cache_write_output(const char *path, const char *data, size_t size) {
+    if (strcmp(path, "-") == 0) {
+        return fwrite(data, 1, size, stdout) == size && fflush(stdout) == 0;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return 0;
+    }
+    int ok = fwrite(data, 1, size, fp) == size;
+    return fclose(fp) == 0 && ok;
+}
+
+// Restore the outputs and diagnostics of the entry at path into obj_file,
+// lst_file and as. Returns the assembly status, or -1 if there is no whole,
+// matching entry.
+static int cache_restore(Assembler *as, const char *path, CacheKey key,
+                         const char *obj_file, const char *lst_file, int *lines) {
+    SourceBuffer entry;
+    if (!source_open(&entry, path)) {
+        return -1;
+    }
+    if (entry.size < sizeof(CacheHeader)) {
+        source_close(&entry);
+        return -1;
+    }
+    CacheHeader h;
+    memcpy(&h, entry.data, sizeof(CacheHeader));
+    const char *body = entry.data + sizeof(CacheHeader);
+    size_t body_size = entry.size - sizeof(CacheHeader);
+    size_t diag_bytes = (size_t)h.diag_count * sizeof(SicDiagnostic);
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.key.a != key.a || h.key.b != key.b || h.source_size != as->src.size ||
+        h.diag_count < 0 || diag_bytes > body_size ||
+        h.object_size > body_size - diag_bytes ||
+        h.listing_size != body_size - diag_bytes - h.object_size) {
+        source_close(&entry);
+        return -1;
+    }
+    const char *object = body + diag_bytes;
+    const char *listing = object + h.object_size;
+    CacheKey payload = cache_payload(body, h.diag_count, object, h.object_size,
+                                     listing, h.listing_size);
+    if (payload.a != h.payload.a || payload.b != h.payload.b) {
+        source_close(&entry);
+        return -1;
+    }
+    for (int i = 0; i < h.diag_count; i++) {
+        SicDiagnostic d;
+        memcpy(&d, body + i * sizeof(SicDiagnostic), sizeof(SicDiagnostic));
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &d);
+    }
+    as->error_count = h.error_count;
+    if (obj_file != NULL && !cache_write_output(obj_file, object, h.object_size)) {
+        report_error(as, 0, "Cannot write %s.", obj_file);
+    }
+    if (lst_file != NULL && !cache_write_output(lst_file, listing, h.listing_size)) {
+        report_error(as, 0, "Cannot write %s.", lst_file);
+    }
+    source_close(&entry);
+    // The entry was just used: it goes to the back of the eviction order
+    utimensat(AT_FDCWD, path, NULL, 0);
+    *lines = h.lines;
+    return h.status == SIC_OK && as->error_count > 0 ? SIC_ERR_ASSEMBLY : h.status;
+}
+
+// Map an output just written so it can be copied into an entry; only
+// regular files can be read back
+static int cache_map_output(SourceBuffer *out, const char *path) {
+    struct stat st;
+    memset(out, 0, sizeof(SourceBuffer));
+    out->data = "";
+    if (path == NULL) {
+        return 1;
+    }
+    return strcmp(path, "-") != 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+           source_open(out, path);
+}
+
+// Record what assembling as->src produced as the entry at path
+static void cache_store(BuildCache *cache, const Assembler *as, const char *path, CacheKey key,
+                        const char *obj_file, const char *lst_file, int status) {
+    SourceBuffer obj, lst;
+    if (!cache_map_output(&obj, obj_file)) {
+        return;
+    }
+    if (!cache_map_output(&lst, lst_file)) {
+        source_close(&obj);
+        return;
+    }
+    CacheHeader h;
+    memset(&h, 0, sizeof(CacheHeader));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.key = key;
+    h.source_size = as->src.size;
+    h.object_size = obj.size;
+    h.listing_size = lst.size;
+    h.status = status;
+    h.error_count = as->error_count;
+    h.diag_count = as->diag_count;
+    h.lines = as->line_count;
+    h.payload = cache_payload(as->diags, as->diag_count, obj.data, obj.size, lst.data, lst.size);
+
+    // Written under a temporary name and renamed: readers see all of the
+    // entry or none of it
+    char temp[4096];
+    cache_path(cache, ".tmp-XXXXXX", temp, sizeof(temp));
+    int fd = mkstemp(temp);
+    if (fd >= 0) {
+        fchmod(fd, CACHE_FILE_MODE);
+    }
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fp != NULL) {
+        int ok = fwrite(&h, sizeof(CacheHeader), 1, fp) == 1 &&
+                 fwrite(as->diags, sizeof(SicDiagnostic), (size_t)as->diag_count, fp) == (size_t)as->diag_count &&
+                 fwrite(obj.data, 1, obj.size, fp) == obj.size &&
+                 fwrite(lst.data, 1, lst.size, fp) == lst.size;
+        ok = fclose(fp) == 0 && ok;
+        if (ok && rename(temp, path) == 0) {
+            cache_count(&cache->run.stores);
+        } else {
+            unlink(temp);
+        }
+    } else if (fd >= 0) {
+        close(fd);
+        unlink(temp);
+    }
+    source_close(&obj);
+    source_close(&lst);
+}
+
+// assemble() through the cache: a hit restores the outputs and diagnostics,
+// a miss assembles and stores what it produced. *lines is the statement
+// count either way.
+static int assemble_cached(BuildCache *cache, Assembler *as, const char *input_file,
+                           const char *obj_file, const char *lst_file, int format, int *lines) {
+    if (cache == NULL) {
+        int status = assemble(as, input_file, obj_file, lst_file, format);
+        *lines = as->line_count;
+        return status;
+    }
+    if (!assembler_load(as, input_file)) {
+        *lines = 0;
+        return SIC_ERR_ARGS;
+    }
+    CacheKey key = cache_key(cache, as, format, obj_file, lst_file);
+    char path[4096];
+    cache_entry_path(cache, key, path, sizeof(path));
+    int status = cache_restore(as, path, key, obj_file, lst_file, lines);
+    if (status >= 0) {
+        cache_count(&cache->run.hits);
+        return status;
+    }
+    cache_count(&cache->run.misses);
+    int written;
+    status = assemble_source(as, obj_file, lst_file, format, &written);
+    *lines = as->line_count;
+    if (written && (status == SIC_OK || status == SIC_ERR_ASSEMBLY)) {
+        cache_store(cache, as, path, key, obj_file, lst_file, status);
+    }
+    return status;
+}
+
+static void cache_read_totals(const BuildCache *cache, CacheTotals *t) {
+    char path[4096];
+    cache_path(cache, "stats", path, sizeof(path));
+    memset(t, 0, sizeof(CacheTotals));
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "hits %lld misses %lld stores %lld evictions %lld",
+                   &t->hits, &t->misses, &t->stores, &t->evictions) != 4) {
+            memset(t, 0, sizeof(CacheTotals));
+        }
+        fclose(fp);
+    }
+}
+
+static void cache_write_totals(const BuildCache *cache, const CacheTotals *t) {
+    char path[4096];
+    char temp[4096];
+    cache_path(cache, "stats", path, sizeof(path));
+    cache_path(cache, ".tmp-XXXXXX", temp, sizeof(temp));
+    int fd = mkstemp(temp);
+    if (fd >= 0) {
+        fchmod(fd, CACHE_FILE_MODE);
+    }
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (fp == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        return;
+    }
+    fprintf(fp, "hits %lld\nmisses %lld\nstores %lld\nevictions %lld\n",
+            t->hits, t->misses, t->stores, t->evictions);
+    if (fclose(fp) != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+typedef struct {
+    char name[40];
+    long long size;
+    struct timespec used;
+} CacheFile;
+
+static int cache_file_cmp(const void *a, const void *b) {
+    const CacheFile *x = (const CacheFile*)a;
+    const CacheFile *y = (const CacheFile*)b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Remove least recently used entries until the rest fit in the limit, and
+// temporary files left behind by writers that died
+static void cache_evict(BuildCache *cache) {
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL) {
+        return;
+    }
+    CacheFile *files = NULL;
+    int count = 0;
+    int cap = 0;
+    long long bytes = 0;
+    time_t now = time(NULL);
+    char path[4096];
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        int temp = strncmp(de->d_name, ".tmp-", 5) == 0;
+        if (!temp && (len != 32 || strspn(de->d_name, "0123456789abcdef") != 32)) {
+            continue;
+        }
+        struct stat st;
+        cache_path(cache, de->d_name, path, sizeof(path));
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (temp) {
+            if (now - st.st_mtime > CACHE_STALE_TEMP) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            CacheFile *grown = (CacheFile*)realloc(files, cap * sizeof(CacheFile));
+            if (grown == NULL) {
+                break;
+            }
+            files = grown;
+        }
+        CacheFile *f = &files[count++];
+        memcpy(f->name, de->d_name, len + 1);
+        f->size = (long long)st.st_size;
+#ifdef __APPLE__
+        f->used = st.st_mtimespec;
+#else
+        f->used = st.st_mtim;
+#endif
+        bytes += f->size;
+    }
+    closedir(dir);
+    if (bytes > cache->limit) {
+        qsort(files, count, sizeof(CacheFile), cache_file_cmp);
+        for (int i = 0; i < count && bytes > cache->limit; i++) {
+            cache_path(cache, files[i].name, path, sizeof(path));
+            if (unlink(path) == 0 || errno == ENOENT) {
+                bytes -= files[i].size;
+                files[i].size = -1;
+                cache->run.evictions++;
+            }
+        }
+    }
+    cache->entries = 0;
+    for (int i = 0; i < count; i++) {
+        cache->entries += files[i].size >= 0;
+    }
+    cache->bytes = bytes;
+    free(files);
+}
+
+// End a run: add its counters to the directory's totals and bring the
+// directory back under its limit, holding the lock so that concurrent runs
+// neither lose counts nor evict at the same time
+static void cache_close(BuildCache *cache) {
+    char path[4096];
+    cache_path(cache, "lock", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd >= 0) {
+        flock(fd, LOCK_EX);
+    }
+    cache_evict(cache);
+    CacheTotals *t = &cache->total;
+    cache_read_totals(cache, t);
+    t->hits += cache->run.hits;
+    t->misses += cache->run.misses;
+    t->stores += cache->run.stores;
+    t->evictions += cache->run.evictions;
+    cache_write_totals(cache, t);
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    free(cache->dir);
+    cache->dir = NULL;
+}
+#else
+// No cache on this platform: --cache is refused
+static int cache_open(BuildCache *cache, const char *dir, long long limit) {
+    (void)cache;
+    (void)dir;
+    (void)limit;
+    return 0;
+}
+
+static int assemble_cached(BuildCache *cache, Assembler *as, const char *input_file,
+                           const char *obj_file, const char *lst_file, int format, int *lines) {
+    (void)cache;
+    int status = assemble(as, input_file, obj_file, lst_file, format);
+    *lines = as->line_count;
+    return status;
+}
+
+static void cache_close(BuildCache *cache) {
+    (void)cache;
+}
+#endif
+
+// Counters of this run and the directory's totals (after cache_close())
+static void cache_report(const BuildCache *cache, FILE *out) {
+    fprintf(out, "Build cache: %lld hits, %lld misses, %lld stored, %lld evicted\n",
+            cache->run.hits, cache->run.misses, cache->run.stores, cache->run.evictions);
+    fprintf(out, "  %lld entries, %lld of %lld bytes; all runs: %lld hits, %lld misses\n",
+            cache->entries, cache->bytes, cache->limit, cache->total.hits, cache->total.misses);
+}
+
+/*
+ * Batch mode: many files assembled concurrently
+ */
+
+// One input file and everything produced for it
+typedef struct {
+    char *input;
+    char *obj_file;
+    char *lst_file;
+    int status;
+    int error_count;
+    int lines;
+    size_t bytes;
+    PeepholeStats peephole; // What -O saved (nothing for a cache hit)
+    SicDiagnostic *diags;
+    int diag_count;
+} BatchItem;
+
+typedef struct {
+    BatchItem *items;
+    Assembler *workers;     // One Assembler per worker thread, reset for each file
+    BuildCache *cache;      // NULL without --cache
+    int format;
+} BatchRun;
+
+static char* copy_string(const char *s, size_t len) {
+    char *copy = (char*)malloc(len + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+    }
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// input with its extension replaced by ext (a.asm => a.obj)
+static char* derive_output_name(const char *input, const char *ext) {
+    const char *base = input;
+    for (const char *p = input; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            base = p + 1;
+        }
+    }
+    const char *dot = strrchr(base, '.');
+    size_t stem = dot && dot != base ? (size_t)(dot - input) : strlen(input);
+    char *name = (char*)malloc(stem + strlen(ext) + 1);
+    if (name == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+    }
+    memcpy(name, input, stem);
+    strcpy(name + stem, ext);
+    return name;
+}
+
+static void batch_add(BatchItem **items, int *count, int *cap,
+                      StrView input, StrView obj, StrView lst) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *items = (BatchItem*)realloc(*items, *cap * sizeof(BatchItem));
+        if (*items == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            exit(1);
+        }
+    }
+    BatchItem *item = &(*items)[(*count)++];
+    memset(item, 0, sizeof(BatchItem));
+    item->input = copy_string(input.ptr, input.len);
+    item->obj_file = obj.len ? copy_string(obj.ptr, obj.len) : derive_output_name(item->input, ".obj");
+    item->lst_file = lst.len ? copy_string(lst.ptr, lst.len) : derive_output_name(item->input, ".lst");
+}
+
+// Manifest: one "input [output_obj [output_lst]]" per line, '#' starts a comment
+static int read_manifest(const char *path, BatchItem **items, int *count, int *cap) {
+    SourceBuffer src;
+    if (!source_open(&src, path)) {
+        return 0;
+    }
+    const char *cursor = src.data;
+    const char *end = src.data + src.size;
+    StrView line;
+    while (next_line(&cursor, end, &line)) {
+        line = view_trim(line);
+        if (line.len == 0 || line.ptr[0] == '#') {
+            continue;
+        }
+        const char *p = line.ptr;
+        const char *e = line.ptr + line.len;
+        StrView input = next_token(&p, e);
+        StrView obj = next_token(&p, e);
+        StrView lst = next_token(&p, e);
+        batch_add(items, count, cap, input, obj, lst);
+    }
+    source_close(&src);
+    return 1;
+}
+
+static void batch_task(void *ctx, int task, int worker) {
+    BatchRun *run = (BatchRun*)ctx;
+    BatchItem *item = &run->items[task];
+    Assembler *as = &run->workers[worker];
+    item->status = assemble_cached(run->cache, as, item->input, item->obj_file, item->lst_file,
+                                   run->format, &item->lines);
+    item->error_count = as->error_count;
+    item->bytes = as->src.size;
+    item->peephole = as->peephole;
+    // The diagnostics move to the item; the Assembler is reused for the next file
+    item->diags = as->diags;
+    item->diag_count = as->diag_count;
+    as->diags = NULL;
+    as->diag_count = 0;
+    as->diag_cap = 0;
+}
+
+// Assemble every item on `jobs` threads. Diagnostics are printed in input
+// order once all files are done, so the output and the exit code (0 if
+// every file assembled cleanly, 1 otherwise) do not depend on scheduling.
+static int run_batch(BatchItem *items, int count, int jobs, int threads, int format,
+                     int fill_records, int optimize, BuildCache *cache) {
+    BatchRun run;
+    int workers = pool_workers(jobs, count);
+    run.items = items;
+    run.cache = cache;
+    run.format = format;
+    run.workers = (Assembler*)calloc(workers, sizeof(Assembler));
+    if (run.workers == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    for (int w = 0; w < workers; w++) {
+        assembler_init(&run.workers[w]);
+        run.workers[w].jobs = threads;
+        run.workers[w].fill_records = fill_records;
+        run.workers[w].optimize = optimize;
+    }
+
+    double start = now_seconds();
+    parallel_for(workers, count, batch_task, &run);
+    double elapsed = now_seconds() - start;
+
+    int failed = 0;
+    long long lines = 0;
+    double bytes = 0;
+    PeepholeStats saved = {0, 0, 0};
+    for (int i = 0; i < count; i++) {
+        print_diagnostics(items[i].diags, items[i].diag_count, items[i].input, stderr);
+        if (items[i].status != SIC_OK) {
+            failed++;
+        }
+        lines += items[i].lines;
+        bytes += (double)items[i].bytes;
+        saved.rewrites += items[i].peephole.rewrites;
+        saved.bytes += items[i].peephole.bytes;
+        saved.cycles += items[i].peephole.cycles;
+    }
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+    if (failed > 0) {
+        printf("\033[1;31mAssembly failed for %d of %d files.\033[0m\n", failed, count);
+    } else {
+        printf("\033[0;32mAssembly completed for %d files.\033[0m\n", count);
+    }
+    printf("%lld lines, %.0f bytes in %.3f s on %d threads: %.0f lines/s, %.2f MB/s\n",
+           lines, bytes, elapsed, workers, lines / elapsed, bytes / elapsed / 1e6);
+    if (optimize) {
+        printf("Peephole: %d statements rewritten, %d bytes and about %ld cycles saved\n",
+               saved.rewrites, saved.bytes, saved.cycles);
+    }
+
+    for (int w = 0; w < workers; w++) {
+        assembler_free(&run.workers[w]);
+    }
+    free(run.workers);
+    return failed > 0 ? 1 : 0;
+}
+
+static int default_jobs(void) {
+#ifndef _WIN32
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Incremental session (--daemon)
+ *
+ * Keeps the statements, symbol table and object code of one program in
+ * memory between edits. An edit replaces a range of source lines:
+ *   - if every replaced statement keeps its label and size, only the new
+ *     statements are encoded and their bytes are patched into the T records
+ *     of the object file in place;
+ *   - otherwise pass1 runs again from the first changed statement, the code
+ *     of untouched statements is carried over, and only the new statements
+ *     and those whose operand symbol moved are encoded again.
+ */
+
+// Where one T record of the object file starts
+typedef struct {
+    int code_off;       // Its first byte in the code buffer
+    int len;
+    long file_off;      // Offset of the 'T' in the file
+} RecordPos;
+
+// Defining statements in order, to tell whether a relayout moved any symbol
+typedef struct {
+    StrView label;
+    int address;
+} Definition;
+
+// Temporary storage of the edit in progress, released if it runs out of memory
+typedef struct {
+    Line *fresh;        // Newly parsed statements
+    Definition *defs;
+    int *lines;         // Source lines of the statements encoded again
+    SicDiagnostic *old_diags;
+    Pass2Chunk pc;
+} EditScratch;
+
+typedef struct {
+    Assembler as;
+    int format;
+    char *obj_file;
+    char *lst_file;
+
+    StrView *doc;       // Source lines, without the newline
+    int doc_count;
+    int doc_cap;
+    char *base;         // Source of the last full assembly (as->src borrows it)
+    Arena text;         // Lines typed in since then
+    CodeBuffer spare;   // Previous code buffer during a relayout
+
+    RecordPos *records; // T records of obj_file as last written
+    int record_count;
+    int record_cap;
+    int *touched;       // Statements encoded since obj_file was written
+    int touched_count;
+    int touched_cap;
+    int object_stale;   // obj_file must be rewritten rather than patched
+    int broken;         // An edit failed part way: reassemble everything next time
+
+    // What the last request did
+    int relaid;         // Statements laid out again
+    int reencoded;      // Statements encoded again
+    int patched;        // T records rewritten in place
+    int rewritten;      // The object file was written from scratch
+    char failure[SIC_MESSAGE_LEN];
+
+    EditScratch scratch;
+} Session;
+
+static void session_init(Session *ss, int format, int jobs, int fill_records) {
+    memset(ss, 0, sizeof(Session));
+    assembler_init(&ss->as);
+    ss->as.jobs = jobs;
+    ss->as.fill_records = fill_records;
+    ss->text.oom = &ss->as.oom;
+    ss->format = format;
+}
+
+static void session_close(Session *ss) {
+    assembler_free(&ss->as);
+    arena_free(&ss->text);
+    free(ss->obj_file);
+    free(ss->lst_file);
+    free(ss->doc);
+    free(ss->base);
+    free(ss->spare.data);
+    free(ss->records);
+    free(ss->touched);
+    memset(ss, 0, sizeof(Session));
+}
+
+static void scratch_free(EditScratch *t) {
+    free(t->fresh);
+    free(t->defs);
+    free(t->lines);
+    free(t->old_diags);
+    free(t->pc.diags);
+    memset(t, 0, sizeof(EditScratch));
+}
+
+static char* session_strdup(Session *ss, const char *s) {
+    size_t len = strlen(s);
+    char *copy = (char*)xrealloc(&ss->as.oom, NULL, len + 1);
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+// Make room for n more document lines
+static void doc_reserve(Session *ss, int n) {
+    if (ss->doc_count + n > ss->doc_cap) {
+        int cap = ss->doc_cap ? ss->doc_cap : 1024;
+        while (cap < ss->doc_count + n) {
+            cap *= 2;
+        }
+        ss->doc = (StrView*)xrealloc(&ss->as.oom, ss->doc, cap * sizeof(StrView));
+        ss->doc_cap = cap;
+    }
+}
+
+// Assemble the whole document from scratch (as->oom must be armed). Its text is gathered into a
+// fresh base buffer, which also drops the copies of edited lines.
+static int session_rebuild(Session *ss) {
+    Assembler *as = &ss->as;
+    size_t size = 0;
+    for (int i = 0; i < ss->doc_count; i++) {
+        size += (size_t)ss->doc[i].len + 1;
+    }
+    char *base = (char*)xrealloc(&as->oom, NULL, size + 1);
+    char *p = base;
+    for (int i = 0; i < ss->doc_count; i++) {
+        memcpy(p, ss->doc[i].ptr, ss->doc[i].len);
+        ss->doc[i].ptr = p;
+        p += ss->doc[i].len;
+        *p++ = '\n';
+    }
+    free(ss->base);
+    ss->base = base;
+    arena_reset(&ss->text);
+
+    assembler_reset(as);
+    source_borrow(&as->src, base, size);
+    ss->broken = 1;
+    run_passes(as, NULL, NULL, ss->format);
+    ss->broken = 0;
+    ss->object_stale = 1;
+    ss->relaid = as->line_count;
+    ss->reencoded = as->line_count;
+    return as->error_count > 0 ? SIC_ERR_ASSEMBLY : SIC_OK;
+}
+
+// Remembers where each T record landed in the file
+static void note_text_record(void *ctx, long file_off, const unsigned char *bytes, int n) {
+    Session *ss = (Session*)ctx;
+    if (ss->record_count == ss->record_cap) {
+        ss->record_cap = ss->record_cap ? ss->record_cap * 2 : 256;
+        ss->records = (RecordPos*)xrealloc(&ss->as.oom, ss->records,
+                                           ss->record_cap * sizeof(RecordPos));
+    }
+    RecordPos *rec = &ss->records[ss->record_count];
+    rec->code_off = (int)(bytes - ss->as.code.data);
+    rec->len = n;
+    rec->file_off = file_off;
+    ss->record_count++;
+}
+
+// Rewrite obj_file and remember the T record layout for later patches
+static int session_write_object(Session *ss) {
+    if (ss->format != SIC_FORMAT_OBJ && needs_linking(&ss->as)) {
+        return 0;
+    }
+    OutBuf ob;
+    if (!outbuf_open(&ob, ss->obj_file, ss->format == SIC_FORMAT_BIN, &ss->as.oom)) {
+        return 0;
+    }
+    ss->record_count = 0;
+    if (ss->format == SIC_FORMAT_OBJ) {
+        write_obj_records(&ss->as, &ob, note_text_record, ss);
+    } else {
+        write_object(&ss->as, &ob, ss->format);
+    }
+    if (!outbuf_close(&ob)) {
+        return 0;
+    }
+    ss->touched_count = 0;
+    ss->object_stale = 0;
+    return 1;
+}
+
+// Why session_write_object() failed
+static void object_failure(Session *ss) {
+    if (ss->format != SIC_FORMAT_OBJ && needs_linking(&ss->as)) {
+        snprintf(ss->failure, sizeof(ss->failure),
+                 "Control sections and external references need the obj format");
+    } else {
+        snprintf(ss->failure, sizeof(ss->failure), "Cannot write %s.", ss->obj_file);
+    }
+}
+
+// Write the bytes of the touched statements into their T records in place
+static int session_patch_object(Session *ss) {
+    Assembler *as = &ss->as;
+    FILE *fp = fopen(ss->obj_file, "r+b");
+    if (fp == NULL) {
+        return 0;
+    }
+    int ok = 1;
+    int last = -1;
+    ss->patched = 0;
+    for (int t = 0; t < ss->touched_count && ok; t++) {
+        Line *line = line_at(as, ss->touched[t]);
+        int off = line->code_off;
+        int end = off + line->code_len;
+        // Last record starting at or before off
+        int lo = 0;
+        int hi = ss->record_count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (ss->records[mid].code_off <= off) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        for (int r = lo; r < ss->record_count && off < end; r++) {
+            RecordPos *rec = &ss->records[r];
+            int n = rec->code_off + rec->len - off;
+            if (n > end - off) {
+                n = end - off;
+            }
+            char hex[2 * TEXT_RECORD_MAX];
+            for (int i = 0; i < n; i++) {
+                hex[2*i] = hex_chars[as->code.data[off + i] >> 4];
+                hex[2*i+1] = hex_chars[as->code.data[off + i] & 15];
+            }
+            long pos = rec->file_off + 9 + 2L * (off - rec->code_off);
+            if (fseek(fp, pos, SEEK_SET) != 0 || fwrite(hex, 1, 2 * n, fp) != (size_t)(2 * n)) {
+                ok = 0;
+                break;
+            }
+            if (r != last) {
+                ss->patched++;
+                last = r;
+            }
+            off += n;
+        }
+    }
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    ss->touched_count = 0;
+    return ok;
+}
+
+static int session_write_listing(Session *ss) {
+    OutBuf ob;
+    if (!outbuf_open(&ob, ss->lst_file, 0, &ss->as.oom)) {
+        return 0;
+    }
+    write_listing(&ss->as, &ob);
+    return outbuf_close(&ob);
+}
+
+// Bring obj_file up to date: patch it when only bytes changed, rewrite it
+// when the layout did (or it is not an H/T/E object program)
+static int sync_object(Session *ss) {
+    ss->patched = 0;
+    ss->rewritten = ss->object_stale || ss->format != SIC_FORMAT_OBJ;
+    if (ss->rewritten) {
+        return session_write_object(ss);
+    }
+    return session_patch_object(ss);
+}
+
+static void session_touch(Session *ss, int index) {
+    if (ss->touched_count == ss->touched_cap) {
+        ss->touched_cap = ss->touched_cap ? ss->touched_cap * 2 : 64;
+        ss->touched = (int*)xrealloc(&ss->as.oom, ss->touched, ss->touched_cap * sizeof(int));
+    }
+    ss->touched[ss->touched_count++] = index;
+}
+
+static int open_program(Session *ss, const char *input, const char *obj_file,
+                        const char *lst_file) {
+    SourceBuffer src;
+    if (!source_open(&src, input)) {
+        snprintf(ss->failure, sizeof(ss->failure), "Cannot open %s for reading.", input);
+        return SIC_ERR_ARGS;
+    }
+    // Keep a private copy: the file will be rewritten while we hold it
+    free(ss->base);
+    ss->base = NULL;
+    ss->base = (char*)xrealloc(&ss->as.oom, NULL, src.size + 1);
+    memcpy(ss->base, src.data, src.size);
+    const char *cursor = ss->base;
+    const char *end = ss->base + src.size;
+    source_close(&src);
+    ss->doc_count = 0;
+    StrView line;
+    while (next_line(&cursor, end, &line)) {
+        doc_reserve(ss, 1);
+        ss->doc[ss->doc_count++] = line;
+    }
+    free(ss->obj_file);
+    free(ss->lst_file);
+    ss->obj_file = ss->lst_file = NULL;
+    ss->obj_file = session_strdup(ss, obj_file);
+    ss->lst_file = session_strdup(ss, lst_file);
+
+    int status = session_rebuild(ss);
+    if (!session_write_object(ss)) {
+        object_failure(ss);
+        return SIC_ERR_ARGS;
+    }
+    if (!session_write_listing(ss)) {
+        snprintf(ss->failure, sizeof(ss->failure), "Cannot write %s.", ss->lst_file);
+        return SIC_ERR_ARGS;
+    }
+    return status;
+}
+
+// Load and assemble input, writing both outputs
+static int session_open(Session *ss, const char *input, const char *obj_file,
+                        const char *lst_file) {
+    if (setjmp(ss->as.oom.jump)) {
+        ss->broken = 1;
+        return SIC_ERR_NOMEM;
+    }
+    return open_program(ss, input, obj_file, lst_file);
+}
+
+// First statement whose source line is at or after line_no
+static int statement_at_line(Assembler *as, int line_no) {
+    int lo = 0;
+    int hi = as->line_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (line_at(as, mid)->line_no < line_no) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Whether line's operand is an expression rather than a single symbol: its
+// code may then change when any address of the section moves, its own too
+static int operand_is_expression(const Line *line) {
+    StrView symbol = line_symbol(line);
+    if (is_literal(symbol)) {
+        return 0;
+    }
+    for (int i = 0; i < symbol.len; i++) {
+        if (expr_delimiter(symbol.ptr[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Statements that may be replaced without moving anything else
+static int same_shape(const Line *old, const Line *fresh) {
+    int plain = old->directive == DIR_NONE || old->directive == DIR_BYTE ||
+                old->directive == DIR_WORD;
+    return plain && old->directive == fresh->directive && old->line_no == fresh->line_no &&
+           view_eq(old->label, fresh->label) && old->code_len == code_size(fresh);
+}
+
+// Replace `remove` source lines starting at first (1-based) by the `insert`
+// lines in text[]. Returns an SIC_* status like an assembly.
+static int apply_edit(Session *ss, int first, int remove, const StrView *text, int insert) {
+    Assembler *as = &ss->as;
+    if (first < 1 || first > ss->doc_count + 1) {
+        return SIC_ERR_ARGS;
+    }
+    if (remove > ss->doc_count - (first - 1)) {
+        remove = ss->doc_count - (first - 1);
+    }
+    int delta = insert - remove;
+    EditScratch *t = &ss->scratch;
+    memset(&t->pc, 0, sizeof(Pass2Chunk));
+    t->pc.as = as;
+
+    // Splice the document; new text lives in the session arena
+    doc_reserve(ss, insert);
+    memmove(ss->doc + first - 1 + insert, ss->doc + first - 1 + remove,
+            (ss->doc_count - (first - 1) - remove) * sizeof(StrView));
+    ss->doc_count += delta;
+    for (int i = 0; i < insert; i++) {
+        char *copy = (char*)arena_alloc(&ss->text, text[i].len > 0 ? text[i].len : 1);
+        memcpy(copy, text[i].ptr, text[i].len);
+        ss->doc[first - 1 + i] = make_view(copy, text[i].len);
+    }
+    if (ss->broken) {
+        return session_rebuild(ss);
+    }
+
+    // Parse the new statements
+    int s0 = statement_at_line(as, first);
+    int s1 = statement_at_line(as, first + remove);
+    int fresh_count = 0;
+    t->fresh = (Line*)xrealloc(&as->oom, NULL, (insert > 0 ? insert : 1) * sizeof(Line));
+    for (int i = 0; i < insert; i++) {
+        StrView raw = view_trim(ss->doc[first - 1 + i]);
+        if (raw.len > 0 && raw.ptr[0] != '.') {
+            memset(&t->fresh[fresh_count], 0, sizeof(Line));
+            parse_statement(&t->fresh[fresh_count++], raw, first + i, &as->keyword_stats);
+        }
+    }
+
+    // Adding or removing a CSECT moves section boundaries, and the lines
+    // of a program with macros need not map one to one onto statements:
+    // start over
+    int resection = as->macros.definitions > 0;
+    for (int i = s0; i < s1; i++) {
+        resection |= line_at(as, i)->directive == DIR_CSECT;
+    }
+    for (int i = 0; i < fresh_count; i++) {
+        resection |= t->fresh[i].directive == DIR_CSECT ||
+                     (t->fresh[i].directive >= DIR_MACRO && t->fresh[i].directive <= DIR_ENDIF);
+    }
+    if (resection) {
+        scratch_free(t);
+        return session_rebuild(ss);
+    }
+
+    // Everything else lands in one section: the one holding the statement
+    // before the edit (new statements in front of a CSECT join the section
+    // it ends)
+    Section *sec = section_of(as, s0 > 0 ? s0 - 1 : 0);
+    t->pc.sec = sec;
+
+    // The fast path also needs each new instruction to reach its operand
+    // from where the old one stood. Relaxation widened instructions by
+    // looking at the whole section, and an edit may let them shrink again.
+    int fast = delta == 0 && fresh_count == s1 - s0 && sec->relaxed_count == 0;
+    for (int i = 0; fast && i < fresh_count; i++) {
+        Line *old = line_at(as, s0 + i);
+        t->fresh[i].address = old->address;
+        fast = same_shape(old, &t->fresh[i]) &&
+               !is_literal(line_symbol(old)) && !is_literal(line_symbol(&t->fresh[i])) &&
+               (t->fresh[i].format != 3 ||
+                reaches_format3(sec, &t->fresh[i], base_before(as, sec, &t->pc.stats, s0 + i),
+                                pool_before(sec, s0 + i)));
+    }
+    ss->relaid = 0;
+    ss->reencoded = 0;
+
+    // Pass1 diagnostics of statements laid out again are regenerated, the
+    // pass2 ones of statements encoded again too; the rest keep theirs
+    int old_count = as->diag_count;
+    int old_pass2 = as->pass1_diag_count;   // First pass2 diagnostic
+    int old_pass1 = old_pass2 - as->entry_diag; // resolve_entry() reports again below
+    int entry = as->entry;
+    t->old_diags = as->diags;
+    as->diags = NULL;
+    as->diag_count = 0;
+    as->diag_cap = 0;
+    int keep_pass1 = old_pass1;
+    int later_pass1 = old_pass1;    // First pass1 diagnostic of a later section
+
+    if (fast) {
+        // Addresses, sizes and symbols stay: swap in the new text only
+        for (int i = 0; i < fresh_count; i++) {
+            Line *line = line_at(as, s0 + i);
+            Line *src = &t->fresh[i];
+            line->line_no = src->line_no;
+            line->kw = src->kw;
+            line->directive = src->directive;
+            line->format = src->format;
+            line->flags = src->flags;
+            line->label = src->label;
+            line->mnemonic = src->mnemonic;
+            line->operand = src->operand;
+            line->state |= LINE_DIRTY;
+        }
+    } else {
+        // Lay out the section again from the first changed statement; the
+        // other sections keep their symbols and code and only move. It is
+        // laid out from its start when the edit is at START (which resets
+        // the location counter), when it has relaxed instructions, or when
+        // an EXTREF or a literal pool is involved, in which case every
+        // statement of the section is encoded again.
+        int all_dirty = sec->literal_count > 0 || sec->equ_count > 0;
+        for (int i = s0; i < sec->last; i++) {
+            all_dirty |= line_at(as, i)->directive == DIR_EXTREF;
+        }
+        for (int i = 0; i < fresh_count; i++) {
+            all_dirty |= t->fresh[i].directive == DIR_EXTREF || t->fresh[i].directive == DIR_LTORG ||
+                         t->fresh[i].directive == DIR_EQU || is_literal(line_symbol(&t->fresh[i]));
+        }
+        int restart = all_dirty || sec->relaxed_count > 0 || s0 == sec->start_index;
+        int k = restart ? sec->first : s0;
+        int kline = k < as->line_count ? line_at(as, k)->line_no : INT_MAX;
+        int next_line = sec + 1 < as->sections + as->section_count ?
+                        line_at(as, sec[1].first)->line_no : INT_MAX;
+        int section_line = sec->first < as->line_count ? line_at(as, sec->first)->line_no : INT_MAX;
+        int old_end = sec->code_off + sec->code_len;
+        int old_total = as->code.len;
+
+        Layout lay;
+        if (k == sec->first) {
+            layout_begin(as, sec, &lay);
+        } else {
+            lay.sec = sec;
+            lay.LC = k < sec->last ? line_at(as, k)->address : sec->final_lc;
+            lay.start_found = sec != &as->sections[0] ||
+                              (sec->start_index >= 0 && sec->start_index < k);
+            lay.code_total = k < sec->last ? line_at(as, k)->code_off : old_end;
+            if (!lay.start_found) {
+                sec->start_addr = 0;
+                sec->start_index = -1;
+            }
+            // The length comes from the last END, or from the end of the section
+            if (sec->end_index < 0 || sec->end_index >= k) {
+                sec->length = 0;
+                sec->end_index = -1;
+            }
+            while (sec->base_count > 0 && sec->base_lines[sec->base_count - 1] >= k) {
+                sec->base_count--;
+            }
+        }
+
+        // BASE statements from k on are recorded again by the relayout. One
+        // among the replaced or new statements changes the displacement of
+        // every instruction after it.
+        int base_changed = 0;
+        for (int i = s0; i < s1; i++) {
+            int dir = line_at(as, i)->directive;
+            base_changed |= dir == DIR_BASE || dir == DIR_NOBASE;
+        }
+        for (int i = 0; i < fresh_count; i++) {
+            base_changed |= t->fresh[i].directive == DIR_BASE || t->fresh[i].directive == DIR_NOBASE;
+        }
+
+        // Symbols defined from k on are defined again by the relayout
+        int def_count = 0;
+        t->defs = (Definition*)xrealloc(&as->oom, NULL, (sec->last - k + 1) * sizeof(Definition));
+        for (int i = k; i < sec->last; i++) {
+            Line *line = line_at(as, i);
+            if (line->state & LINE_DEFINES) {
+                if (k > sec->first) {
+                    symtab_remove(&sec->symtab, line->label.ptr, line->label.len);
+                }
+                t->defs[def_count].label = line->label;
+                t->defs[def_count++].address = line->address;
+            }
+        }
+        if (k == sec->first) {
+            symtab_clear(&sec->symtab);
+        }
+
+        // Splice in the new statements; later sections only shift
+        int stmt_delta = fresh_count - (s1 - s0);
+        splice_lines(as, s0, s1 - s0, fresh_count);
+        for (int i = 0; i < fresh_count; i++) {
+            *line_at(as, s0 + i) = t->fresh[i];
+            line_at(as, s0 + i)->state = LINE_DIRTY;
+        }
+        if (delta != 0) {
+            for (int i = s0 + fresh_count; i < as->line_count; i++) {
+                line_at(as, i)->line_no += delta;
+            }
+        }
+        sec->last += stmt_delta;
+        for (Section *later = sec + 1; later < as->sections + as->section_count; later++) {
+            later->first += stmt_delta;
+            later->last += stmt_delta;
+            later->start_index += later->start_index >= 0 ? stmt_delta : 0;
+            later->end_index += later->end_index >= 0 ? stmt_delta : 0;
+            for (int b = 0; b < later->base_count; b++) {
+                later->base_lines[b] += stmt_delta;
+            }
+            for (int p = 0; p < later->pool_count; p++) {
+                later->pools[p].line += stmt_delta;
+            }
+        }
+        if (sec->relaxed_count > 0) {
+            unrelax_section(as, sec);
+        }
+
+        // Lay out the tail of the section into the spare buffer, carrying
+        // over the code of statements whose size did not change
+        CodeBuffer old = as->code;
+        as->code = ss->spare;
+        ss->spare = old;
+        int total = lay.code_total + (old_total - old_end);
+        for (int i = k; i < sec->last; i++) {
+            Line *line = line_at(as, i);
+            total += (line->state & LINE_DIRTY) ? code_size(line) : line->code_len;
+        }
+        code_reserve(&as->code, total > 0 ? total : 1, &as->oom);
+        memcpy(as->code.data, old.data, lay.code_total);
+
+        int moved = 0;
+        int def_seen = 0;
+        for (int i = k; i < sec->last; i++) {
+            Line *line = line_at(as, i);
+            int old_off = line->code_off;
+            int old_len = line->code_len;
+            int old_address = line->address;
+            layout_statement(line, i, &lay);
+            // PC-relative displacements depend on the instruction's own address
+            if (!all_dirty && !(line->state & LINE_DIRTY) && line->code_len == old_len &&
+                (line->format != 3 || line->address == old_address) && !operand_is_expression(line)) {
+                memcpy(as->code.data + line->code_off, old.data + old_off, old_len);
+            } else {
+                line->state |= LINE_DIRTY;
+            }
+            if (line->state & LINE_DEFINES) {
+                if (def_seen >= def_count || t->defs[def_seen].address != line->address ||
+                    !view_eq(t->defs[def_seen].label, line->label)) {
+                    moved = 1;
+                }
+                def_seen++;
+            }
+        }
+        layout_end(&lay);
+        ss->relaid = sec->last - k;
+        if (all_dirty) {
+            // Literal pools are only sized by the layout
+            total = sec->code_off + sec->code_len + (old_total - old_end);
+            code_reserve(&as->code, total > 0 ? total : 1, &as->oom);
+            memcpy(as->code.data, old.data, sec->code_off);
+        }
+        moved |= def_seen != def_count;
+        free(t->defs);
+        t->defs = NULL;
+
+        if (widen_far_instructions(as, sec) > 0) {
+            // Something no longer reaches its operand: relax the whole
+            // section the way a full assembly would, and encode it again
+            unrelax_section(as, sec);
+            layout_section(as, sec);
+            for (int i = sec->first; i < sec->last; i++) {
+                line_at(as, i)->state |= LINE_DIRTY;
+            }
+            total = sec->code_off + sec->code_len + (old_total - old_end);
+            code_reserve(&as->code, total > 0 ? total : 1, &as->oom);
+            memcpy(as->code.data, old.data, sec->code_off);
+            kline = section_line;
+            ss->relaid = sec->last - sec->first;
+        }
+
+        // Move the code of later sections behind the new end of this one
+        int code_delta = sec->code_off + sec->code_len - old_end;
+        memcpy(as->code.data + old_end + code_delta, old.data + old_end, old_total - old_end);
+        as->code.len = old_total + code_delta;
+        if (code_delta != 0) {
+            for (Section *later = sec + 1; later < as->sections + as->section_count; later++) {
+                later->code_off += code_delta;
+            }
+            for (int i = sec->last; i < as->line_count; i++) {
+                line_at(as, i)->code_off += code_delta;
+            }
+        }
+        base_changed |= moved && sec->base_count > 0;
+
+        // Drop the pass1 diagnostics of the relaid statements; those of
+        // later sections are kept
+        keep_pass1 = 0;
+        while (keep_pass1 < old_pass1 && t->old_diags[keep_pass1].line < kline) {
+            keep_pass1++;
+        }
+        later_pass1 = keep_pass1;
+        while (later_pass1 < old_pass1 && t->old_diags[later_pass1].line < next_line) {
+            later_pass1++;
+        }
+
+        // Statements of the section whose operand symbol moved, appeared or
+        // vanished, or whose base register changed; EXTDEF statements check
+        // their names again
+        for (int i = sec->first; (moved || base_changed) && i < sec->last; i++) {
+            Line *line = line_at(as, i);
+            if (line->state & LINE_DIRTY) {
+                continue;
+            }
+            if ((base_changed && (line->format == 3 || line->directive == DIR_BASE)) ||
+                (moved && (line->directive == DIR_EXTDEF || operand_is_expression(line)))) {
+                line->state |= LINE_DIRTY;
+                continue;
+            }
+            StrView sym = line_symbol(line);
+            if (sym.len == 0) {
+                continue;
+            }
+            int addr;
+            int found = symtab_lookup(&sec->symtab, &t->pc.stats, sym.ptr, sym.len, &addr);
+            int was_found = !(line->state & LINE_UNRESOLVED);
+            if (found != was_found || (found && addr != line->value)) {
+                line->state |= LINE_DIRTY;
+            }
+        }
+        ss->object_stale = 1;
+    }
+    free(t->fresh);
+    t->fresh = NULL;
+
+    // Encode what is dirty, in statement (and so source line) order
+    int scan_first = fast ? s0 : sec->first;
+    int scan_last = fast ? s0 + fresh_count : sec->last;
+    int line_count = 0;
+    int line_cap = 0;
+    for (int i = scan_first; i < scan_last; i++) {
+        Line *line = line_at(as, i);
+        if (!(line->state & LINE_DIRTY)) {
+            continue;
+        }
+        int relocated = line->state & (LINE_RELOCATE | LINE_EXTERNAL);
+        line->state &= ~(LINE_DIRTY | LINE_UNRESOLVED);
+        memset(line_code(as, line), 0, line->code_len);
+        t->pc.base = base_before(as, sec, &t->pc.stats, i);
+        t->pc.pool = pool_before(sec, i);
+        encode_line(&t->pc, line);
+        if (line_count == line_cap) {
+            line_cap = line_cap ? line_cap * 2 : 64;
+            t->lines = (int*)xrealloc(&as->oom, t->lines, line_cap * sizeof(int));
+        }
+        t->lines[line_count++] = line->line_no;
+        if (fast && line->code_len > 0) {
+            session_touch(ss, i);
+        }
+        // M records name the symbol and are not patched in place
+        if (relocated || (line->state & (LINE_RELOCATE | LINE_EXTERNAL))) {
+            ss->object_stale = 1;
+        }
+    }
+    ss->reencoded = line_count;
+    probe_stats_merge(&as->lookup_stats, &t->pc.stats);
+    probe_stats_merge(&as->keyword_stats, &t->pc.keyword_stats);
+
+    // Rebuild the list: kept, new and later sections' (renumbered) pass1
+    // diagnostics, then the old pass2 ones (renumbered, minus replaced and
+    // re-encoded lines) merged with the new ones by line
+    for (int i = 0; i < keep_pass1; i++) {
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &t->old_diags[i]);
+    }
+    for (int i = 0; i < sec->diag_count; i++) {
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &sec->diags[i]);
+    }
+    sec->diag_count = 0;
+    sec->error_count = 0;
+    for (int i = later_pass1; i < old_pass1; i++) {
+        SicDiagnostic d = t->old_diags[i];
+        d.line += delta;
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &d);
+    }
+    resolve_entry(as);
+    if (as->entry != entry) {
+        ss->object_stale = 1;
+    }
+    as->pass1_diag_count = as->diag_count;
+
+    int r = 0;
+    int n = 0;
+    for (int i = old_pass2; i < old_count; i++) {
+        SicDiagnostic d = t->old_diags[i];
+        if (d.line >= first && d.line < first + remove) {
+            continue;
+        }
+        if (d.line >= first + remove) {
+            d.line += delta;
+        }
+        while (r < line_count && t->lines[r] < d.line) {
+            r++;
+        }
+        if (r < line_count && t->lines[r] == d.line) {
+            continue;
+        }
+        while (n < t->pc.diag_count && t->pc.diags[n].line <= d.line) {
+            diag_append(&as->diags, &as->diag_count, &as->diag_cap, &t->pc.diags[n++]);
+        }
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &d);
+    }
+    while (n < t->pc.diag_count) {
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &t->pc.diags[n++]);
+    }
+    free(t->pc.diags);
+    t->pc.diags = NULL;
+    free(t->lines);
+    t->lines = NULL;
+    free(t->old_diags);
+    t->old_diags = NULL;
+
+    as->error_count = 0;
+    for (int i = 0; i < as->diag_count; i++) {
+        if (as->diags[i].severity == SIC_SEVERITY_ERROR) {
+            as->error_count++;
+        }
+    }
+    return as->error_count > 0 ? SIC_ERR_ASSEMBLY : SIC_OK;
+}
+
+// Apply an edit and bring the object file up to date
+static int session_edit(Session *ss, int first, int remove, const StrView *text, int insert) {
+    if (setjmp(ss->as.oom.jump)) {
+        scratch_free(&ss->scratch);
+        ss->broken = 1;
+        return SIC_ERR_NOMEM;
+    }
+    int status = apply_edit(ss, first, remove, text, insert);
+    if (status == SIC_ERR_ARGS) {
+        snprintf(ss->failure, sizeof(ss->failure), "Line %d is outside the program.", first);
+        return status;
+    }
+    if (!sync_object(ss)) {
+        object_failure(ss);
+        return SIC_ERR_ARGS;
+    }
+    return status;
+}
+
+static int session_list(Session *ss) {
+    if (setjmp(ss->as.oom.jump)) {
+        return SIC_ERR_NOMEM;
+    }
+    if (!session_write_listing(ss)) {
+        snprintf(ss->failure, sizeof(ss->failure), "Cannot write %s.", ss->lst_file);
+        return SIC_ERR_ARGS;
+    }
+    return SIC_OK;
+}
+
+#define READ_NOMEM (-2)      // read_request(): the line did not fit in memory
+
+// Grow the array at *p to hold at least need elements of size bytes.
+// Returns 0, leaving the array as it was, if it cannot.
+static int grow_buffer(void **p, int *cap, long long need, size_t size) {
+    if (need <= *cap) {
+        return 1;
+    }
+    long long n = *cap ? *cap : 64;
+    while (n < need) {
+        n *= 2;
+    }
+    if (n > INT_MAX / (long long)size) {
+        return 0;
+    }
+    void *grown = realloc(*p, (size_t)n * size);
+    if (grown == NULL) {
+        return 0;
+    }
+    *p = grown;
+    *cap = (int)n;
+    return 1;
+}
+
+// Read one line of any length (without the newline); -1 at end of input,
+// READ_NOMEM once a line too long to hold has been skipped
+static int read_request(FILE *fp, char **buf, int *cap) {
+    int len = 0;
+    int c;
+    int nomem = 0;
+    while ((c = getc(fp)) != EOF && c != '\n') {
+        if (nomem || !grow_buffer((void**)buf, cap, (long long)len + 2, 1)) {
+            nomem = 1;
+            continue;
+        }
+        (*buf)[len++] = (char)c;
+    }
+    if (nomem) {
+        return READ_NOMEM;
+    }
+    if (c == EOF && len == 0) {
+        return -1;
+    }
+    if (len > 0 && (*buf)[len - 1] == '\r') {
+        len--;
+    }
+    if (*buf != NULL) {
+        (*buf)[len] = '\0';
+    }
+    return len;
+}
+
+// Requests on stdin, one response line each on stdout:
+//   open <input> <output_obj> <output_lst>
+//   edit <line> <delete> <insert>     followed by <insert> source lines
+//   list                              rewrite the listing
+//   diag                              print the diagnostics, then "ok <count>"
+//   quit
+static int run_daemon(int format, int threads, int fill_records) {
+    Session ss;
+    session_init(&ss, format, threads, fill_records);
+    int loaded = 0;
+    char *req = NULL;
+    int req_cap = 0;
+    char *text = NULL;          // Lines of one edit, back to back
+    int text_cap = 0;
+    StrView *views = NULL;
+    int view_cap = 0;
+    int *offsets = NULL;        // Where each line starts in text
+    int offset_cap = 0;
+
+    for (;;) {
+        int len = read_request(stdin, &req, &req_cap);
+        if (len == READ_NOMEM) {
+            printf("error Out of memory.\n");
+            fflush(stdout);
+            continue;
+        }
+        if (len < 0) {
+            break;
+        }
+        const char *p = req;
+        const char *end = req + len;
+        StrView cmd = next_token(&p, end);
+        double start = now_seconds();
+        if (cmd.len == 0) {
+            continue;
+        } else if (view_eq(cmd, make_view("quit", 4))) {
+            printf("ok\n");
+            break;
+        } else if (view_eq(cmd, make_view("open", 4))) {
+            StrView args[3];
+            for (int i = 0; i < 3; i++) {
+                args[i] = next_token(&p, end);
+            }
+            if (args[2].len == 0) {
+                printf("error Usage: open <input> <output_obj> <output_lst>\n");
+            } else {
+                char *names[3];
+                for (int i = 0; i < 3; i++) {
+                    names[i] = copy_string(args[i].ptr, args[i].len);
+                }
+                int status = session_open(&ss, names[0], names[1], names[2]);
+                loaded = status == SIC_OK || status == SIC_ERR_ASSEMBLY;
+                if (loaded) {
+                    printf("ok statements=%d errors=%d time=%.3fms\n", ss.as.line_count,
+                           ss.as.error_count, (now_seconds() - start) * 1e3);
+                } else {
+                    printf("error %s\n", status == SIC_ERR_NOMEM ? "Out of memory." : ss.failure);
+                }
+                for (int i = 0; i < 3; i++) {
+                    free(names[i]);
+                }
+            }
+        } else if (view_eq(cmd, make_view("edit", 4))) {
+            int first = (int)view_to_long(next_token(&p, end), 10);
+            int remove = (int)view_to_long(next_token(&p, end), 10);
+            int insert = (int)view_to_long(next_token(&p, end), 10);
+            if (insert < 0 || remove < 0) {
+                insert = remove = 0;
+                first = 0;
+            }
+            // Gather the new lines first: req is reused while reading them.
+            // The buffers grow with the lines that actually arrive, never
+            // by the count claimed; lines that do not fit are still read
+            // so the next request is found.
+            int used = 0;
+            int got = 0;
+            int nomem = 0;
+            for (; got < insert; got++) {
+                int n = read_request(stdin, &req, &req_cap);
+                if (n == -1) {
+                    break;
+                }
+                nomem = nomem || n == READ_NOMEM ||
+                        !grow_buffer((void**)&offsets, &offset_cap, (long long)got + 2, sizeof(int)) ||
+                        !grow_buffer((void**)&text, &text_cap, (long long)used + n + 1, 1);
+                if (nomem) {
+                    continue;
+                }
+                memcpy(text + used, req, n);
+                offsets[got] = used;
+                used += n;
+            }
+            if (!nomem && got > 0) {
+                offsets[got] = used;
+                nomem = !grow_buffer((void**)&views, &view_cap, got, sizeof(StrView));
+            }
+            for (int i = 0; !nomem && i < got; i++) {
+                views[i] = make_view(text + offsets[i], offsets[i + 1] - offsets[i]);
+            }
+            if (!loaded) {
+                printf("error No program is open.\n");
+            } else if (nomem) {
+                printf("error Out of memory.\n");
+            } else if (got < insert) {
+                printf("error Expected %d lines.\n", insert);
+            } else {
+                int status = session_edit(&ss, first, remove, views, insert);
+                if (status == SIC_ERR_ARGS || status == SIC_ERR_NOMEM) {
+                    printf("error %s\n", status == SIC_ERR_NOMEM ? "Out of memory." : ss.failure);
+                } else {
+                    printf("ok statements=%d errors=%d relaid=%d reencoded=%d %s=%d time=%.3fms\n",
+                           ss.as.line_count, ss.as.error_count, ss.relaid, ss.reencoded,
+                           ss.rewritten ? "rewritten" : "patched", ss.rewritten ? 1 : ss.patched,
+                           (now_seconds() - start) * 1e3);
+                }
+            }
+        } else if (view_eq(cmd, make_view("list", 4))) {
+            if (!loaded) {
+                printf("error No program is open.\n");
+            } else if (session_list(&ss) != SIC_OK) {
+                printf("error %s\n", ss.failure);
+            } else {
+                printf("ok time=%.3fms\n", (now_seconds() - start) * 1e3);
+            }
+        } else if (view_eq(cmd, make_view("diag", 4))) {
+            print_diagnostics(ss.as.diags, ss.as.diag_count, NULL, stdout);
+            printf("ok %d\n", ss.as.diag_count);
+        } else {
+            printf("error Unknown request '%.*s'.\n", cmd.len, cmd.ptr);
+        }
+        fflush(stdout);
+    }
+    fflush(stdout);
+    free(req);
+    free(text);
+    free(views);
+    free(offsets);
+    session_close(&ss);
+    return 0;
+}
+
+/*
+ * One-pass assembly (--one-pass)
+ *
+ * The source is read a line at a time and never kept: each statement is
+ * encoded as soon as it is read, and its listing row and T record bytes
+ * are passed on at once. A format 3/4 operand or WORD naming a symbol not
+ * defined yet is encoded with its field zero and threaded onto the fixup
+ * chain of that symbol, which is entered as SYM_FORWARD with the chain head
+ * as its value. The definition walks the chain and fills each field in:
+ * inside the T record still being collected if the bytes are there,
+ * otherwise with a short T record of its own that the loader copies over
+ * them. Memory grows with the symbols of a section and the references
+ * still open, not with the program, so a source of any length can be piped
+ * through.
+ *
+ * Without a second look there is no relaxation: a forward reference must
+ * reach its target in format 3 from where it stands (or be written with
+ * +), EQU and ORG name only symbols defined above them, and the D records
+ * of a section follow its text.
+ */
+
+// What a fixup fills in
+enum {
+    FIX_FORMAT3 = 0,    // Displacement of a format 3 instruction
+    FIX_FORMAT4,        // Address field of a format 4 instruction
+    FIX_WORD,           // A WORD
+    FIX_BASE,           // Format 3 with a known target, waiting for the BASE symbol
+    FIX_BASE_VALUE      // A BASE statement, checking the value its symbol gets
+};
+
+// A field waiting for a symbol, on that symbol's chain
+typedef struct {
+    int address;        // Of the instruction or WORD
+    int next;           // Next fixup on the chain (or the free list), -1 at the end
+    int line_no;
+    int base;           // FIX_FORMAT3: base register value, -1 none
+    int base_name;      // Name pool offset of the BASE symbol, if base_waiting
+    int base_len;
+    int target;         // FIX_BASE: the operand's address
+    unsigned char kind; // FIX_*
+    unsigned char base_waiting; // FIX_FORMAT3: the BASE symbol is not defined yet
+    unsigned char size; // Bytes of code
+    unsigned char code[4]; // As encoded, the field still zero
+} Fixup;
+
+// An M record, written when its section ends
+typedef struct {
+    int address;
+    int half_bytes;     // 5 (format 4 address) or 6 (WORD)
+    int sign;           // 1 to add the address, -1 to subtract it
+    int name_off;       // EXTREF symbol in the name pool, -1 for the section itself
+    int name_len;
+} OnePassMod;
+
+// A name met on some line: an EXTDEF entry, or an undefined reference
+typedef struct {
+    int name_off;
+    int name_len;
+    int line_no;
+} OnePassName;
+
+typedef struct {
+    Assembler *as;
+    OutBuf *obj;
+    OutBuf *lst;
+    TextSink sink;
+    Section sec;        // Current control section: its symbols and literals
+    Pass2Chunk pc;      // Encodes the statements of sec
+    int section_open;
+    int section_index;  // Sections already ended
+    char name[6];       // Of the current section
+    int name_len;
+    int start_addr;
+    int length;         // Set by END, 0 otherwise
+    int LC;
+    size_t length_off;  // Output offset of the H record's length field
+    int entry;          // Execution address END named, -1 until one does
+    char *program;      // Label of the START statement, NULL if none
+    size_t entry_off;   // Output offset of the first section's E record address
+    SymbolTable first_symtab; // Symbols of the first section once it has ended
+    int base;           // Base register value, -1 none
+    int base_waiting;   // BASE named base_name, which is not defined yet
+    int base_name;
+    int base_len;
+    int pool;           // Literal pools placed in the section
+    int first_literal;  // sec.literals from here on wait for the next pool
+
+    unsigned char text[TEXT_RECORD_MAX]; // T record being collected
+    int text_addr;
+    int text_len;
+
+    Fixup *fixups;
+    int fixup_count;
+    int fixup_cap;
+    int free_fixup;     // Head of the free list, -1 if empty
+
+    OnePassMod *mods;
+    int mod_count;
+    int mod_cap;
+
+    OnePassName *defs;  // EXTDEF names; the text is in def_names
+    int def_count;
+    int def_cap;
+    char *def_names;
+    int def_names_len;
+    int def_names_cap;
+
+    char *buf;          // Line being read
+    int buf_cap;
+} OnePass;
+
+static void onepass_init(OnePass *op, Assembler *as, OutBuf *obj, OutBuf *lst) {
+    memset(op, 0, sizeof(OnePass));
+    op->as = as;
+    op->obj = obj;
+    op->lst = lst;
+    op->sink.ob = obj;
+    symtab_init(&op->sec.symtab, &as->oom);
+    symtab_init(&op->first_symtab, &as->oom);
+    op->pc.as = as;
+    op->pc.sec = &op->sec;
+    op->base = -1;
+    op->free_fixup = -1;
+    op->entry = -1;
+}
+
+static void onepass_free(OnePass *op) {
+    symtab_free(&op->sec.symtab);
+    symtab_free(&op->first_symtab);
+    free(op->program);
+    free(op->sec.literals);
+    free(op->pc.diags);
+    free(op->fixups);
+    free(op->mods);
+    free(op->defs);
+    free(op->def_names);
+    free(op->buf);
+}
+
+// Pass the T record being collected on to the object file
+static void onepass_flush_text(OnePass *op) {
+    if (op->text_len > 0) {
+        emit_text_record(&op->sink, op->text_addr, op->text, op->text_len);
+        op->text_len = 0;
+    }
+}
+
+// Add the code of one statement at address, cutting T records as
+// for_each_code_run does: at gaps in the addresses and at the size limit
+static void onepass_text(OnePass *op, int address, const unsigned char *bytes, int n) {
+    if (op->text_len > 0 && address != op->text_addr + op->text_len) {
+        onepass_flush_text(op);
+    }
+    while (n > 0) {
+        if (op->text_len == TEXT_RECORD_MAX ||
+            (!op->as->fill_records && op->text_len > 0 && op->text_len + n > TEXT_RECORD_MAX)) {
+            onepass_flush_text(op);
+        }
+        if (op->text_len == 0) {
+            op->text_addr = address;
+        }
+        int piece = n < TEXT_RECORD_MAX - op->text_len ? n : TEXT_RECORD_MAX - op->text_len;
+        memcpy(op->text + op->text_len, bytes, piece);
+        op->text_len += piece;
+        address += piece;
+        bytes += piece;
+        n -= piece;
+    }
+}
+
+// Replace code already passed on: in place where it is still in the T
+// record being collected, by a T record of its own where it was written out.
+// With --fill-records a statement may be split between the two.
+static void onepass_patch_text(OnePass *op, int address, const unsigned char *bytes, int n) {
+    int written = n;
+    if (op->text_len > 0 && address + n > op->text_addr &&
+        address < op->text_addr + op->text_len) {
+        int from = address > op->text_addr ? address : op->text_addr;
+        memcpy(op->text + (from - op->text_addr), bytes + (from - address),
+               (size_t)(address + n - from));
+        written = from - address;
+    }
+    if (written > 0) {
+        emit_text_record(&op->sink, address, bytes, written);
+    }
+}
+
+static void onepass_add_mod(OnePass *op, int address, int half_bytes, int sign, int name_off, int name_len) {
+    if (op->mod_count == op->mod_cap) {
+        op->mod_cap = op->mod_cap ? op->mod_cap * 2 : 64;
+        op->mods = (OnePassMod*)xrealloc(&op->as->oom, op->mods, op->mod_cap * sizeof(OnePassMod));
+    }
+    OnePassMod *mod = &op->mods[op->mod_count++];
+    mod->address = address;
+    mod->half_bytes = half_bytes;
+    mod->sign = sign;
+    mod->name_off = name_off;
+    mod->name_len = name_len;
+}
+
+// Whether the BASE symbol at name_off is still ahead; if not, *base gets
+// the base register value it holds (-1 if it names no address)
+static int onepass_base_ahead(OnePass *op, int name_off, int name_len, int *base) {
+    SymbolTable *st = &op->sec.symtab;
+    const Symbol *sym = symtab_find(st, &st->stats, st->names + name_off, name_len);
+    if (sym != NULL && sym->kind == SYM_FORWARD) {
+        return 1;
+    }
+    *base = sym == NULL || sym->kind == SYM_EXTERNAL || sym->address < 0 ? -1 : sym->address;
+    return 0;
+}
+
+// Base register assumption in effect (-1: none, or the BASE symbol is not
+// defined yet while op->base_waiting)
+static int onepass_base(OnePass *op) {
+    if (op->base_waiting &&
+        !onepass_base_ahead(op, op->base_name, op->base_len, &op->base)) {
+        op->base_waiting = 0;
+    }
+    return op->base;
+}
+
+// Thread a copy of fix onto the chain of name, entering name as
+// SYM_FORWARD if it is new
+static void onepass_forward(OnePass *op, StrView name, const Fixup *fix) {
+    SymbolTable *st = &op->sec.symtab;
+    int f = op->free_fixup;
+    if (f >= 0) {
+        op->free_fixup = op->fixups[f].next;
+    } else {
+        if (op->fixup_count == op->fixup_cap) {
+            op->fixup_cap = op->fixup_cap ? op->fixup_cap * 2 : 64;
+            op->fixups = (Fixup*)xrealloc(&op->as->oom, op->fixups, op->fixup_cap * sizeof(Fixup));
+        }
+        f = op->fixup_count++;
+    }
+    op->fixups[f] = *fix;
+    const Symbol *sym = symtab_find(st, &st->stats, name.ptr, name.len);
+    if (sym == NULL) {
+        op->fixups[f].next = -1;
+        symtab_insert(st, name.ptr, name.len, f, SYM_FORWARD);
+    } else {
+        op->fixups[f].next = sym->address;
+        symtab_set(st, name.ptr, name.len, f, SYM_FORWARD);
+    }
+}
+
+// Fill in fixup f now that its symbol has a value of the given kind, and
+// list the patched bytes under the symbol's name (shown)
+static void onepass_resolve(OnePass *op, int f, StrView shown, int value, int kind) {
+    Assembler *as = op->as;
+    Fixup *fix = &op->fixups[f];
+    unsigned char *code = fix->code;
+    int ok = 1;
+    if (fix->kind == FIX_BASE_VALUE) {
+        if (kind == SYM_EXTERNAL) {
+            report_error(as, fix->line_no, "External symbol '%.*s' cannot be a BASE", shown.len, shown.ptr);
+        } else if (value < 0) {
+            report_error(as, fix->line_no, "BASE value out of range");
+        }
+        fix->next = op->free_fixup;
+        op->free_fixup = f;
+        return;
+    }
+    if (fix->kind == FIX_FORMAT4 || fix->kind == FIX_WORD) {
+        int word = fix->kind == FIX_WORD;
+        if (kind == SYM_ABSOLUTE && !word && (value < 0 || value > 0xFFFFF)) {
+            report_error(as, fix->line_no, code[0] & 2 ? "Address out of range" :
+                                                         "Immediate value out of range");
+            value = 0;
+        } else if (kind == SYM_ABSOLUTE && word && !fits_word(value)) {
+            report_error(as, fix->line_no, "WORD value %d does not fit in 24 bits", value);
+            value = 0;
+        } else if (kind != SYM_ABSOLUTE) {
+            // Relocated by the loader, or filled in with the EXTREF symbol
+            int name_off = -1;
+            int name_len = 0;
+            if (kind == SYM_EXTERNAL) {
+                const SymbolTable *st = &op->sec.symtab;
+                const Symbol *sym = symtab_find(st, &op->pc.stats, shown.ptr, shown.len);
+                name_off = sym->name_off;
+                name_len = sym->name_len;
+            }
+            onepass_add_mod(op, fix->address + (word ? 0 : 1), word ? 6 : 5, 1, name_off, name_len);
+        }
+        if (word) {
+            code[0] = (unsigned char)(value >> 16);
+        } else {
+            code[1] |= (unsigned char)((value >> 16) & 0xF);
+        }
+        code[fix->size - 2] = (unsigned char)(value >> 8);
+        code[fix->size - 1] = (unsigned char)value;
+    } else {
+        int target = value;
+        int base = fix->base;
+        int waiting = 0;
+        if (fix->kind == FIX_BASE) {
+            target = fix->target;
+            base = kind == SYM_EXTERNAL || value < 0 ? -1 : value;
+        } else if (fix->base_waiting) {
+            waiting = onepass_base_ahead(op, fix->base_name, fix->base_len, &base);
+        }
+        int disp = 0;
+        unsigned char bp = 0;
+        if (kind == SYM_EXTERNAL && fix->kind == FIX_FORMAT3) {
+            report_error(as, fix->line_no, "External reference needs format 4");
+            ok = 0;
+        } else if (kind == SYM_ABSOLUTE && fix->kind == FIX_FORMAT3) {
+            if (value < 0 || value > 0xFFF) {
+                report_error(as, fix->line_no, code[0] & 2 ? "Address out of range" :
+                                                             "Immediate value out of range");
+                ok = 0;
+            }
+            disp = value & 0xFFF;
+        } else if (!format3_disp(fix->address, target, base, &disp, &bp)) {
+            if (waiting) {
+                // Reachable only from the base register, whose symbol is
+                // still ahead: wait for that instead
+                fix->kind = FIX_BASE;
+                fix->target = target;
+                onepass_forward(op, make_view(op->sec.symtab.names + fix->base_name, fix->base_len), fix);
+                fix = &op->fixups[f];
+                fix->next = op->free_fixup;
+                op->free_fixup = f;
+                return;
+            }
+            report_error(as, fix->line_no, "Operand out of range for format 3");
+            ok = 0;
+        }
+        if (ok) {
+            code[1] |= (unsigned char)((bp & FLAG_B ? 0x40 : 0) | (bp & FLAG_P ? 0x20 : 0) | disp >> 8);
+            code[2] = (unsigned char)disp;
+        }
+    }
+    if (ok) {
+        onepass_patch_text(op, fix->address, code, fix->size);
+        list_row(op->lst, fix->address, make_view("*", 1), shown, empty_view, code, fix->size);
+    }
+    fix->next = op->free_fixup;
+    op->free_fixup = f;
+}
+
+// Define name and fill in the references waiting for it, in source order;
+// the listing shows them under `shown`
+static void onepass_define(OnePass *op, StrView name, StrView shown, int value, int kind, int line_no) {
+    SymbolTable *st = &op->sec.symtab;
+    const Symbol *sym = symtab_find(st, &st->stats, name.ptr, name.len);
+    if (sym == NULL) {
+        symtab_insert(st, name.ptr, name.len, value, kind);
+        return;
+    }
+    if (sym->kind != SYM_FORWARD) {
+        report_error(op->as, line_no, "Duplicate symbol '%.*s'", name.len, name.ptr);
+        return;
+    }
+    // Chains are built newest first
+    int f = sym->address;
+    int prev = -1;
+    while (f >= 0) {
+        int next = op->fixups[f].next;
+        op->fixups[f].next = prev;
+        prev = f;
+        f = next;
+    }
+    symtab_set(st, name.ptr, name.len, value, kind);
+    for (f = prev; f >= 0; ) {
+        int next = op->fixups[f].next;
+        onepass_resolve(op, f, shown, value, kind);
+        f = next;
+    }
+}
+
+// Report an expression that did not evaluate
+static void onepass_expr_error(OnePass *op, int line_no, const Expr *e, StrView text) {
+    char msg[256];
+    expr_message(e, text, msg, (int)sizeof(msg));
+    report_error(op->as, line_no, "%s", msg);
+}
+
+// If the field of a WORD or format 3/4 instruction names a symbol still
+// ahead (or a literal, whose pool always is), put it on that symbol's chain
+// with the bytes as far as they are known in the code buffer; returns 0 if
+// the statement can be encoded as it stands
+static int onepass_wait(OnePass *op, Line *line) {
+    Assembler *as = op->as;
+    SymbolTable *st = &op->sec.symtab;
+    Fixup fix;
+    memset(&fix, 0, sizeof(Fixup));
+    fix.address = line->address;
+    fix.line_no = line->line_no;
+    fix.size = (unsigned char)line->code_len;
+    StrView wait = empty_view;
+    char key[LITERAL_KEY_MAX];
+    Expr e;
+
+    if (line->directive == DIR_WORD) {
+        eval_expression(st, &op->pc.stats, line->operand, line->address, &e);
+        if (e.status == EXPR_UNDEFINED && view_eq(e.name, line->operand)) {
+            fix.kind = FIX_WORD;
+            wait = line->operand;
+        }
+    } else if (line->format >= 3 && line->kw->opcode != 0x4C) {
+        StrView symbol = split_operand(line->operand, &line->flags);
+        fix.kind = line->format == 4 ? FIX_FORMAT4 : FIX_FORMAT3;
+        fix.base = onepass_base(op);
+        fix.base_waiting = (unsigned char)op->base_waiting;
+        fix.base_name = op->base_name;
+        fix.base_len = op->base_len;
+        fix.code[0] = (unsigned char)(line->kw->opcode | (line->flags & FLAG_N ? 2 : 0) |
+                                      (line->flags & FLAG_I ? 1 : 0));
+        fix.code[1] = (unsigned char)((line->flags & FLAG_X ? 0x80 : 0) | (line->format == 4 ? 0x10 : 0));
+        if (is_literal(symbol)) {
+            // A malformed literal is left for the encoder to report
+            int size;
+            int len = literal_key(symbol, op->pool, key, &size);
+            if (len > 0 && symtab_find(st, &st->stats, key, len) == NULL) {
+                Section *sec = &op->sec;
+                if (sec->literal_count == sec->literal_cap) {
+                    sec->literal_cap = sec->literal_cap ? sec->literal_cap * 2 : 16;
+                    sec->literals = (Literal*)xrealloc(&as->oom, sec->literals,
+                                                       sec->literal_cap * sizeof(Literal));
+                }
+                char *text = (char*)arena_alloc(&as->arena, symbol.len);
+                memcpy(text, symbol.ptr, symbol.len);
+                Literal *lit = &sec->literals[sec->literal_count++];
+                lit->text = make_view(text, symbol.len);
+                lit->size = size;
+                lit->line_no = line->line_no;
+            }
+            wait = make_view(key, len);
+        } else {
+            eval_expression(st, &op->pc.stats, symbol, line->address, &e);
+            int disp;
+            unsigned char bp;
+            if (e.status == EXPR_UNDEFINED && view_eq(e.name, symbol)) {
+                wait = symbol;
+            } else if (e.status == EXPR_OK && e.kind == SYM_RELATIVE && line->format == 3 &&
+                       fix.base_waiting && !format3_disp(line->address, e.value, -1, &disp, &bp)) {
+                fix.kind = FIX_BASE;
+                fix.target = e.value;
+                wait = make_view(st->names + op->base_name, op->base_len);
+            }
+        }
+    }
+    if (wait.len == 0) {
+        return 0;
+    }
+    memcpy(line_code(as, line), fix.code, line->code_len);
+    onepass_forward(op, wait, &fix);
+    return 1;
+}
+
+// Encode line into the code buffer, noting the M record it needs
+static void onepass_encode(OnePass *op, Line *line) {
+    Assembler *as = op->as;
+    Pass2Chunk *pc = &op->pc;
+    int base = onepass_base(op);
+    pc->base = base >= 0 ? base : -1;
+    encode_line(pc, line);
+    for (int i = 0; i < pc->diag_count; i++) {
+        diag_append(&as->diags, &as->diag_count, &as->diag_cap, &pc->diags[i]);
+    }
+    as->error_count += pc->error_count;
+    pc->diag_count = 0;
+    pc->error_count = 0;
+    if (!(line->state & (LINE_RELOCATE | LINE_EXTERNAL))) {
+        return;
+    }
+    int word = line->directive == DIR_WORD;
+    int address = line->address + (word ? 0 : 1);
+    int half_bytes = word ? 6 : 5;
+    if (!(line->state & LINE_EXTERNAL)) {
+        onepass_add_mod(op, address, half_bytes, 1, -1, 0);
+        return;
+    }
+    // One M record per EXTREF term, named from the pool (the line's text
+    // does not outlive it)
+    const SymbolTable *st = &op->sec.symtab;
+    Expr e;
+    eval_expression(st, &pc->stats, line_symbol(line), line->address, &e);
+    if (e.relative) {
+        onepass_add_mod(op, address, half_bytes, 1, -1, 0);
+    }
+    for (int k = 0; k < e.external_count; k++) {
+        StrView name = e.externals[k].name;
+        const Symbol *sym = symtab_find(st, &pc->stats, name.ptr, name.len);
+        onepass_add_mod(op, address, half_bytes, e.externals[k].sign, sym->name_off, sym->name_len);
+    }
+}
+
+// Place the literals collected since the last pool at the location
+// counter, as the pool of line; returns the bytes they take
+static int onepass_pool(OnePass *op, const Line *line) {
+    Section *sec = &op->sec;
+    int address = op->LC;
+    for (int i = op->first_literal; i < sec->literal_count; i++) {
+        const Literal *lit = &sec->literals[i];
+        unsigned char bytes[LITERAL_MAX];
+        char key[LITERAL_KEY_MAX];
+        int size;
+        int len = literal_key(lit->text, op->pool, key, &size);
+        literal_bytes(lit->text, bytes);
+        onepass_text(op, address, bytes, size);
+        list_row(op->lst, address, make_view("*", 1), lit->text, empty_view, bytes, size);
+        onepass_define(op, make_view(key, len), lit->text, address, SYM_RELATIVE, line->line_no);
+        address += size;
+    }
+    if (address > op->LC) {
+        op->pool++;
+    }
+    op->first_literal = sec->literal_count;
+    return address - op->LC;
+}
+
+// BASE: a symbol still ahead is waited for, on its chain so that its
+// value is checked when it is defined and reported if it never is
+static void onepass_set_base(OnePass *op, const Line *line) {
+    SymbolTable *st = &op->sec.symtab;
+    StrView operand = line->operand;
+    Expr e;
+    eval_expression(st, &op->pc.stats, operand, op->LC, &e);
+    op->base = -1;
+    op->base_waiting = 0;
+    if (e.status == EXPR_UNDEFINED && view_eq(e.name, operand)) {
+        Fixup fix;
+        memset(&fix, 0, sizeof(Fixup));
+        fix.address = line->address;
+        fix.line_no = line->line_no;
+        fix.kind = FIX_BASE_VALUE;
+        onepass_forward(op, operand, &fix);
+        const Symbol *sym = symtab_find(st, &st->stats, operand.ptr, operand.len);
+        op->base_waiting = 1;
+        op->base_name = sym->name_off;
+        op->base_len = sym->name_len;
+    } else if (e.status != EXPR_OK) {
+        onepass_expr_error(op, line->line_no, &e, operand);
+    } else if (e.kind == SYM_EXTERNAL) {
+        report_error(op->as, line->line_no, "External symbol '%.*s' cannot be a BASE",
+                     operand.len, operand.ptr);
+    } else if (e.value < 0) {
+        report_error(op->as, line->line_no, "BASE value out of range");
+    } else {
+        op->base = e.value;
+    }
+}
+
+// EXTREF: the names are entered and their R records written at once
+static void onepass_extref(OnePass *op, const Line *line) {
+    OutBuf *ob = op->obj;
+    StrView list = line->operand;
+    int count = 0;
+    while (list.len > 0) {
+        StrView name = next_list_item(&list);
+        if (name.len == 0) {
+            continue;
+        }
+        onepass_define(op, name, name, 0, SYM_EXTERNAL, line->line_no);
+        if (count % 12 == 0) {
+            if (count > 0) {
+                out_char(ob, '\n');
+            }
+            out_char(ob, 'R');
+        }
+        out_record_name(ob, name);
+        count++;
+    }
+    if (count > 0) {
+        out_char(ob, '\n');
+    }
+}
+
+// EXTDEF: the names are kept until the section ends
+static void onepass_extdef(OnePass *op, const Line *line) {
+    StrView list = line->operand;
+    while (list.len > 0) {
+        StrView name = next_list_item(&list);
+        if (name.len == 0) {
+            continue;
+        }
+        if (op->def_names_len + name.len > op->def_names_cap) {
+            int cap = op->def_names_cap ? op->def_names_cap : 256;
+            while (op->def_names_len + name.len > cap) {
+                cap *= 2;
+            }
+            op->def_names = (char*)xrealloc(&op->as->oom, op->def_names, cap);
+            op->def_names_cap = cap;
+        }
+        if (op->def_count == op->def_cap) {
+            op->def_cap = op->def_cap ? op->def_cap * 2 : 16;
+            op->defs = (OnePassName*)xrealloc(&op->as->oom, op->defs, op->def_cap * sizeof(OnePassName));
+        }
+        OnePassName *def = &op->defs[op->def_count++];
+        def->name_off = op->def_names_len;
+        def->name_len = name.len;
+        def->line_no = line->line_no;
+        memcpy(op->def_names + op->def_names_len, name.ptr, name.len);
+        op->def_names_len += name.len;
+    }
+}
+
+// LABEL EQU expression, over symbols defined above it
+static void onepass_equ(OnePass *op, const Line *line) {
+    if (line->label.len == 0) {
+        report_error(op->as, line->line_no, "EQU needs a label");
+        return;
+    }
+    Expr e;
+    eval_expression(&op->sec.symtab, &op->pc.stats, line->operand, op->LC, &e);
+    expr_no_external(&e);
+    if (e.status != EXPR_OK) {
+        onepass_expr_error(op, line->line_no, &e, line->operand);
+        e.value = 0;
+        e.kind = SYM_ABSOLUTE;
+    }
+    onepass_define(op, line->label, line->label, e.value, e.kind, line->line_no);
+}
+
+// H record of the section line opens; its length is filled in at the end
+static void onepass_section_begin(OnePass *op, const Line *line) {
+    OutBuf *ob = op->obj;
+    op->section_open = 1;
+    op->start_addr = 0;
+    if (op->section_index == 0 && line->directive == DIR_START) {
+        op->start_addr = (int)view_to_long(line->operand, 16);
+        op->program = copy_string(line->label.ptr, line->label.len);
+    }
+    op->LC = op->start_addr;
+    op->length = 0;
+    op->base = -1;
+    op->base_waiting = 0;
+    op->pool = 0;
+    op->first_literal = 0;
+    op->name_len = line->label.len < 6 ? line->label.len : 6;
+    memcpy(op->name, line->label.ptr, op->name_len);
+
+    out_char(ob, 'H');
+    out_str(ob, op->name, op->name_len);
+    out_str(ob, "      ", 6 - op->name_len);
+    out_hex(ob, (unsigned int)op->start_addr, 6);
+    op->length_off = ob->written + ob->len;
+    out_str(ob, "000000\n", 7);
+}
+
+static int compare_by_line(const void *a, const void *b) {
+    const OnePassName *x = (const OnePassName*)a;
+    const OnePassName *y = (const OnePassName*)b;
+    if (x->line_no != y->line_no) {
+        return x->line_no < y->line_no ? -1 : 1;
+    }
+    return x->name_off - y->name_off;
+}
+
+// Report the references still waiting when the section ends, in source
+// order (literals without a pool are reported on their own)
+static void onepass_report_undefined(OnePass *op) {
+    const SymbolTable *st = &op->sec.symtab;
+    OnePassName *refs = NULL;
+    int count = 0;
+    int cap = 0;
+    for (int i = 0; i < st->capacity; i++) {
+        const Symbol *sym = &st->slots[i];
+        if (sym->hash == 0 || sym->kind != SYM_FORWARD || st->names[sym->name_off] == '=') {
+            continue;
+        }
+        for (int f = sym->address; f >= 0; f = op->fixups[f].next) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 16;
+                refs = (OnePassName*)xrealloc(&op->as->oom, refs, cap * sizeof(OnePassName));
+            }
+            refs[count].name_off = sym->name_off;
+            refs[count].name_len = sym->name_len;
+            refs[count++].line_no = op->fixups[f].line_no;
+        }
+    }
+    if (count > 1) {
+        qsort(refs, count, sizeof(OnePassName), compare_by_line);
+    }
+    for (int i = 0; i < count; i++) {
+        report_error(op->as, refs[i].line_no, "Undefined symbol '%.*s'",
+                     refs[i].name_len, st->names + refs[i].name_off);
+    }
+    free(refs);
+}
+
+// Overwrite the 6 hex digits at offset off of the object file with value
+static int onepass_patch_hex(OnePass *op, size_t off, int value) {
+    char digits[6];
+    for (int i = 5; i >= 0; i--) {
+        digits[i] = hex_chars[value & 0xF];
+        value >>= 4;
+    }
+    return outbuf_patch(op->obj, off, digits, 6);
+}
+
+// END names the execution address: a symbol of the first section or the
+// program name. The E record naming it has already been written when END
+// closes a later section, and is filled in afterwards.
+static void onepass_end(OnePass *op, const Line *line) {
+    if (line->operand.len == 0) {
+        return;
+    }
+    const SymbolTable *st = op->section_index == 0 ? &op->sec.symtab : &op->first_symtab;
+    Expr e;
+    eval_expression(st, &op->pc.stats, line->operand, line->address, &e);
+    expr_no_external(&e);
+    if (e.status == EXPR_UNDEFINED && op->program != NULL &&
+        view_eq(line->operand, make_view(op->program, (int)strlen(op->program)))) {
+        return;
+    }
+    if (e.status != EXPR_OK) {
+        onepass_expr_error(op, line->line_no, &e, line->operand);
+        return;
+    }
+    op->entry = e.value;
+    if (op->section_index > 0 && !onepass_patch_hex(op, op->entry_off, op->entry)) {
+        report_error(op->as, 0, "Cannot go back to fill in the E record: the object file must be seekable");
+    }
+}
+
+// Finish the section: its last T record, then M, D and E records, and its
+// length back into the H record
+static void onepass_section_end(OnePass *op) {
+    if (!op->section_open) {
+        return;
+    }
+    Assembler *as = op->as;
+    Section *sec = &op->sec;
+    SymbolTable *st = &sec->symtab;
+    OutBuf *ob = op->obj;
+    for (int i = op->first_literal; i < sec->literal_count; i++) {
+        const Literal *lit = &sec->literals[i];
+        report_error(as, lit->line_no, "Literal %.*s has no LTORG or END to place it",
+                     lit->text.len, lit->text.ptr);
+    }
+    onepass_flush_text(op);
+    onepass_report_undefined(op);
+
+    for (int i = 0; i < op->mod_count; i++) {
+        const OnePassMod *mod = &op->mods[i];
+        StrView name = mod->name_off >= 0 ? make_view(st->names + mod->name_off, mod->name_len) :
+                                            make_view(op->name, op->name_len);
+        out_modification(ob, mod->address, mod->half_bytes, mod->sign, name);
+    }
+
+    int count = 0;
+    for (int i = 0; i < op->def_count; i++) {
+        StrView name = make_view(op->def_names + op->defs[i].name_off, op->defs[i].name_len);
+        const Symbol *sym = symtab_find(st, &st->stats, name.ptr, name.len);
+        if (sym == NULL || sym->kind == SYM_EXTERNAL || sym->kind == SYM_FORWARD) {
+            report_error(as, op->defs[i].line_no, "EXTDEF symbol '%.*s' is not defined in this section",
+                         name.len, name.ptr);
+            continue;
+        }
+        if (count % 6 == 0) {
+            if (count > 0) {
+                out_char(ob, '\n');
+            }
+            out_char(ob, 'D');
+        }
+        out_record_name(ob, name);
+        out_hex(ob, (unsigned int)sym->address, 6);
+        count++;
+    }
+    if (count > 0) {
+        out_char(ob, '\n');
+    }
+
+    // End record; only the first section names the entry point
+    out_char(ob, 'E');
+    if (op->section_index == 0) {
+        op->entry_off = ob->written + ob->len;
+        out_hex(ob, (unsigned int)(op->entry >= 0 ? op->entry : op->start_addr), 6);
+    }
+    out_char(ob, '\n');
+
+    int length = op->length != 0 ? op->length : op->LC - op->start_addr;
+    if (!onepass_patch_hex(op, op->length_off, length)) {
+        report_error(as, 0, "Cannot go back to fill in the H record: the object file must be seekable");
+    }
+
+    if (op->section_index == 0) {
+        // Kept for an END in a later section to name its entry point
+        SymbolTable kept = op->first_symtab;
+        op->first_symtab = *st;
+        *st = kept;
+    }
+    symtab_clear(st);
+    arena_reset(&as->arena);
+    sec->literal_count = 0;
+    op->fixup_count = 0;
+    op->free_fixup = -1;
+    op->mod_count = 0;
+    op->def_count = 0;
+    op->def_names_len = 0;
+    op->section_open = 0;
+    op->section_index++;
+}
+
+// Assemble one statement and pass on its records and listing rows
+static void onepass_statement(OnePass *op, Line *line) {
+    Assembler *as = op->as;
+    int directive = line->directive;
+    if (directive == DIR_CSECT) {
+        onepass_section_end(op);
+    }
+    int opens = !op->section_open;
+    if (opens) {
+        onepass_section_begin(op, line);
+    }
+    line->address = op->LC;
+    line->code_off = 0;
+    line->code_len = 0;
+    if (directive == DIR_CSECT || (opens && op->section_index == 0 && directive == DIR_START)) {
+        list_row(op->lst, line->address, line->label, line->mnemonic, line->operand, NULL, 0);
+        return;
+    }
+
+    if (line->label.len > 0 && directive != DIR_EQU) {
+        onepass_define(op, line->label, line->label, op->LC, SYM_RELATIVE, line->line_no);
+    }
+    switch (directive) {
+    case DIR_LTORG:
+    case DIR_END: {
+        list_row(op->lst, line->address, line->label, line->mnemonic, line->operand, NULL, 0);
+        int size = onepass_pool(op, line);
+        if (directive == DIR_END) {
+            op->length = op->LC + size - op->start_addr;
+            onepass_end(op, line);
+        }
+        op->LC += size;
+        return;
+    }
+    case DIR_RESW:
+    case DIR_RESB: {
+        int size;
+        char msg[256];
+        if (reserve_size(&op->sec.symtab, &op->pc.stats, line, op->LC, &size, msg, (int)sizeof(msg))) {
+            op->LC += size;
+        } else {
+            report_error(as, line->line_no, "%s", msg);
+        }
+        break;
+    }
+    case DIR_ORG: {
+        Expr e;
+        eval_origin(&op->sec.symtab, &op->pc.stats, line->operand, op->LC, &e);
+        if (e.status == EXPR_OK) {
+            op->LC = e.value;
+        } else {
+            onepass_expr_error(op, line->line_no, &e, line->operand);
+        }
+        break;
+    }
+    case DIR_BASE:
+        onepass_set_base(op, line);
+        break;
+    case DIR_NOBASE:
+        op->base = -1;
+        op->base_waiting = 0;
+        break;
+    case DIR_EXTREF:
+        onepass_extref(op, line);
+        break;
+    case DIR_EXTDEF:
+        onepass_extdef(op, line);
+        break;
+    case DIR_EQU:
+        onepass_equ(op, line);
+        break;
+    case DIR_MEND:
+    case DIR_IF:
+    case DIR_ELSE:
+    case DIR_ENDIF:
+        report_error(as, line->line_no, "%.*s outside a macro definition",
+                     line->mnemonic.len, line->mnemonic.ptr);
+        break;
+    case DIR_BYTE:
+    case DIR_WORD:
+    case DIR_NONE:
+        line->code_len = code_size(line);
+        code_reserve(&as->code, line->code_len > 0 ? line->code_len : 1, &as->oom);
+        memset(as->code.data, 0, line->code_len);
+        if (!onepass_wait(op, line)) {
+            onepass_encode(op, line);
+        }
+        break;
+    default:
+        break;
+    }
+    const unsigned char *code = line_code(as, line);
+    if (line->code_len > 0) {
+        onepass_text(op, line->address, code, line->code_len);
+    }
+    list_row(op->lst, line->address, line->label, line->mnemonic, line->operand, code, line->code_len);
+    op->LC += line->code_len;
+}
+
+// Read, assemble and write out the program a statement at a time
+static void run_one_pass(OnePass *op, FILE *in) {
+    Assembler *as = op->as;
+    static const char header[] = "Address\tLabel\tMnemonic\tOperand\tObject Code\n";
+    out_str(op->lst, header, (int)sizeof(header) - 1);
+    stats_mark(as);
+    int len;
+    int line_no = 0;
+    int in_macro = 0;
+    while ((len = read_request(in, &op->buf, &op->buf_cap)) != -1) {
+        if (len == READ_NOMEM) {
+            longjmp(as->oom.jump, 1);
+        }
+        line_no++;
+        if (as->stats != NULL) {
+            as->stats->bytes_read += len + 1;
+        }
+        StrView raw = view_trim(make_view(op->buf, len));
+        if (raw.len == 0 || raw.ptr[0] == '.') {
+            continue;
+        }
+        Line line;
+        memset(&line, 0, sizeof(Line));
+        parse_statement(&line, raw, line_no, &as->keyword_stats);
+        // Macro bodies would have to outlive the line buffer: definitions
+        // are rejected and skipped
+        if (in_macro || line.directive == DIR_MACRO) {
+            if (!in_macro) {
+                report_error(as, line_no, "Macros are not supported with --one-pass");
+            }
+            in_macro = line.directive != DIR_MEND;
+            continue;
+        }
+        onepass_statement(op, &line);
+    }
+    onepass_section_end(op);
+    as->source_line_count = line_no;
+    if (ferror(in)) {
+        report_error(as, 0, "Cannot read the input.");
+    }
+    probe_stats_merge(&as->lookup_stats, &op->pc.stats);
+    if (as->stats != NULL) {
+        as->stats->text_records += op->sink.count;
+    }
+    stats_output(as, op->obj, PHASE_PASS1);
+    stats_output(as, op->lst, PHASE_PASS1);
+}
+
+// Diagnostics by line, those of one line in the order they were reported;
+// those tied to no line come last
+static int compare_diagnostics(const void *a, const void *b) {
+    const SicDiagnostic *x = *(const SicDiagnostic *const*)a;
+    const SicDiagnostic *y = *(const SicDiagnostic *const*)b;
+    unsigned int lx = (unsigned int)x->line - 1;
+    unsigned int ly = (unsigned int)y->line - 1;
+    if (lx != ly) {
+        return lx < ly ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+// Put the diagnostics in source order: fixups report theirs when the
+// symbol is defined, which may be far below the reference. Left as they
+// are if there is no memory to sort them.
+static void onepass_sort_diagnostics(Assembler *as) {
+    int n = as->diag_count;
+    if (n < 2) {
+        return;
+    }
+    const SicDiagnostic **order = (const SicDiagnostic**)malloc(n * sizeof(SicDiagnostic*));
+    SicDiagnostic *sorted = (SicDiagnostic*)malloc(n * sizeof(SicDiagnostic));
+    if (order != NULL && sorted != NULL) {
+        for (int i = 0; i < n; i++) {
+            order[i] = &as->diags[i];
+        }
+        qsort(order, n, sizeof(SicDiagnostic*), compare_diagnostics);
+        for (int i = 0; i < n; i++) {
+            sorted[i] = *order[i];
+        }
+        free(as->diags);
+        as->diags = sorted;
+        as->diag_cap = n;
+        sorted = NULL;
+    }
+    free(order);
+    free(sorted);
+}
+
+// run_one_pass() with allocation failures unwinding back here
+static int run_one_pass_assembly(OnePass *op, FILE *in) {
+    if (setjmp(op->as->oom.jump)) {
+        report_error(op->as, 0, "Out of memory");
+        onepass_sort_diagnostics(op->as);
+        return SIC_ERR_NOMEM;
+    }
+    run_one_pass(op, in);
+    onepass_sort_diagnostics(op->as);
+    return op->as->error_count > 0 ? SIC_ERR_ASSEMBLY : SIC_OK;
+}
+
+// Assemble input_file ("-" for standard input) in one pass into
+// obj_file/lst_file (NULL: not wanted); diagnostics stay in as->diags
+static int assemble_one_pass(Assembler *as, const char *input_file, const char *obj_file,
+                             const char *lst_file, int format) {
+    assembler_reset(as);
+    // Both are produced statement by statement: one not wanted is discarded
+    if (obj_file == NULL) {
+        obj_file = NULL_DEVICE;
+    }
+    if (lst_file == NULL) {
+        lst_file = NULL_DEVICE;
+    }
+    if (format != SIC_FORMAT_OBJ) {
+        report_error(as, 0, "One-pass assembly writes the obj format only");
+        return SIC_ERR_ARGS;
+    }
+    FILE *in = strcmp(input_file, "-") == 0 ? stdin : fopen(input_file, "r");
+    if (in == NULL) {
+        report_error(as, 0, "Cannot open %s for reading.", input_file);
+        return SIC_ERR_ARGS;
+    }
+    OutBuf obj, lst;
+    if (!outbuf_open(&obj, obj_file, 0, &as->oom)) {
+        report_error(as, 0, "Cannot open %s for writing.", obj_file);
+        if (in != stdin) {
+            fclose(in);
+        }
+        return SIC_ERR_ARGS;
+    }
+    if (!outbuf_open(&lst, lst_file, 0, &as->oom)) {
+        report_error(as, 0, "Cannot open %s for writing.", lst_file);
+        outbuf_close(&obj);
+        if (in != stdin) {
+            fclose(in);
+        }
+        return SIC_ERR_ARGS;
+    }
+    OnePass op;
+    onepass_init(&op, as, &obj, &lst);
+    int status = run_one_pass_assembly(&op, in);
+    onepass_free(&op);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (!outbuf_close(&obj)) {
+        report_error(as, 0, "Cannot write %s.", obj_file);
+    }
+    if (!outbuf_close(&lst)) {
+        report_error(as, 0, "Cannot write %s.", lst_file);
+    }
+    if (status == SIC_OK && as->error_count > 0) {
+        status = SIC_ERR_ASSEMBLY;
+    }
+    return status;
+}
+
+/*
+ * Linking loader (link)
+ *
+ * Reads H/D/R/T/M/E object programs and places their control sections one
+ * after the other from the load address. Pass 1 reads only H, D and E
+ * records and builds ESTAB, the hashed table of section names and EXTDEF
+ * symbols. Pass 2 streams every record once more, copying T records into a
+ * flat memory image and applying each M record as it comes: the bytes it
+ * modifies were loaded by earlier T records of the same section, and its
+ * symbol is found with a single hash lookup, so linking stays linear in the
+ * size of the input however many modules there are.
+ */
+
+#define SIC_MEMORY_SIZE 0x100000    // 20-bit addresses
+
+// One control section read from an object file
+typedef struct {
+    StrView name;
+    int start;          // Address it was assembled for (H record)
+    int length;
+    int address;        // Where it is loaded
+} LinkModule;
+
+// One input object file and what linking it reported
+typedef struct {
+    char *path;
+    SourceBuffer src;
+    int first_module;   // Its sections are modules first_module, ...
+    SicDiagnostic *diags;
+    int diag_count;
+    int diag_cap;
+} LinkInput;
+
+typedef struct {
+    LinkInput *inputs;
+    int input_count;
+    int input_cap;
+    LinkModule *modules;
+    int module_count;
+    int module_cap;
+    SymbolTable estab;  // External symbol table: name => load address
+    unsigned char *image;
+    int load;           // Address of image[0]
+    int size;
+    int entry;          // Execution address, -1 until an E record names one
+    int error_count;
+    AllocContext oom;
+} Linker;
+
+static void linker_init(Linker *lk) {
+    memset(lk, 0, sizeof(Linker));
+    symtab_init(&lk->estab, &lk->oom);
+    lk->entry = -1;
+}
+
+static void linker_free(Linker *lk) {
+    for (int i = 0; i < lk->input_count; i++) {
+        source_close(&lk->inputs[i].src);
+        free(lk->inputs[i].path);
+        free(lk->inputs[i].diags);
+    }
+    free(lk->inputs);
+    free(lk->modules);
+    free(lk->image);
+    symtab_free(&lk->estab);
+    memset(lk, 0, sizeof(Linker));
+}
+
+static void linker_add_input(Linker *lk, StrView path) {
+    if (lk->input_count == lk->input_cap) {
+        lk->input_cap = lk->input_cap ? lk->input_cap * 2 : 64;
+        lk->inputs = (LinkInput*)xrealloc(&lk->oom, lk->inputs, lk->input_cap * sizeof(LinkInput));
+    }
+    LinkInput *in = &lk->inputs[lk->input_count++];
+    memset(in, 0, sizeof(LinkInput));
+    source_borrow(&in->src, "", 0);
+    in->path = copy_string(path.ptr, path.len);
+}
+
+// Report an error against a record of an input file
+static void link_error(Linker *lk, LinkInput *in, int line_no, const char *fmt, ...) {
+    lk->error_count++;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_vadd(&in->diags, &in->diag_count, &in->diag_cap, SIC_SEVERITY_ERROR, line_no, fmt, ap);
+    va_end(ap);
+}
+
+// n hex digits of rec starting at column at; returns 0 if they are missing
+// or not hex
+static int record_hex(StrView rec, int at, int n, int *value) {
+    if (at + n > rec.len) {
+        return 0;
+    }
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        int d = hex_digit(rec.ptr[at + i]);
+        if (d < 0) {
+            return 0;
+        }
+        v = v << 4 | d;
+    }
+    *value = v;
+    return 1;
+}
+
+// Symbol name in the 6 columns of rec starting at column at, unpadded
+static StrView record_name(StrView rec, int at) {
+    if (at >= rec.len) {
+        return empty_view;
+    }
+    int len = rec.len - at < 6 ? rec.len - at : 6;
+    return view_trim(make_view(rec.ptr + at, len));
+}
+
+static void estab_define(Linker *lk, LinkInput *in, int line_no, StrView name, int address) {
+    if (!symtab_insert(&lk->estab, name.ptr, name.len, address, SYM_RELATIVE)) {
+        link_error(lk, in, line_no, "Duplicate external symbol '%.*s'", name.len, name.ptr);
+    }
+}
+
+// Pass 1: give every control section its load address and enter section
+// names and EXTDEF symbols into ESTAB
+static void link_define(Linker *lk, LinkInput *in, int *next_address) {
+    const char *cursor = in->src.data;
+    const char *end = in->src.data + in->src.size;
+    StrView rec;
+    LinkModule *mod = NULL;
+    in->first_module = lk->module_count;
+    for (int line_no = 1; next_line(&cursor, end, &rec); line_no++) {
+        rec = view_trim(rec);
+        if (rec.len == 0) {
+            continue;
+        }
+        switch (rec.ptr[0]) {
+        case 'H':
+            if (lk->module_count == lk->module_cap) {
+                lk->module_cap = lk->module_cap ? lk->module_cap * 2 : 256;
+                lk->modules = (LinkModule*)xrealloc(&lk->oom, lk->modules,
+                                                    lk->module_cap * sizeof(LinkModule));
+            }
+            mod = &lk->modules[lk->module_count++];
+            memset(mod, 0, sizeof(LinkModule));
+            mod->name = record_name(rec, 1);
+            mod->address = *next_address;
+            if (!record_hex(rec, 7, 6, &mod->start) || !record_hex(rec, 13, 6, &mod->length)) {
+                link_error(lk, in, line_no, "Malformed H record");
+                mod->start = mod->length = 0;
+            }
+            *next_address += mod->length;
+            if (mod->name.len > 0) {
+                estab_define(lk, in, line_no, mod->name, mod->address);
+            }
+            break;
+        case 'D':
+            if (mod == NULL) {
+                link_error(lk, in, line_no, "D record outside a control section");
+                break;
+            }
+            for (int at = 1; at < rec.len; at += 12) {
+                StrView name = record_name(rec, at);
+                int address;
+                if (name.len == 0 || !record_hex(rec, at + 6, 6, &address)) {
+                    link_error(lk, in, line_no, "Malformed D record");
+                    break;
+                }
+                estab_define(lk, in, line_no, name, address - mod->start + mod->address);
+            }
+            break;
+        case 'E': {
+            int address;
+            if (mod != NULL && lk->entry < 0 && record_hex(rec, 1, 6, &address)) {
+                lk->entry = address - mod->start + mod->address;
+            }
+            mod = NULL;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+// Add value to the field made of the low half_bytes hex digits of the
+// (half_bytes + 1) / 2 bytes at field
+static void modify_field(unsigned char *field, int half_bytes, int value) {
+    int n = (half_bytes + 1) / 2;
+    unsigned int old = 0;
+    for (int i = 0; i < n; i++) {
+        old = old << 8 | field[i];
+    }
+    unsigned int mask = (1u << (4 * half_bytes)) - 1;
+    unsigned int updated = (old & ~mask) | ((old + (unsigned int)value) & mask);
+    for (int i = n - 1; i >= 0; i--) {
+        field[i] = (unsigned char)updated;
+        updated >>= 8;
+    }
+}
+
+// Pass 2: load T records into the image and apply M records, streaming
+// through the file once
+static void link_load(Linker *lk, LinkInput *in) {
+    const char *cursor = in->src.data;
+    const char *end = in->src.data + in->src.size;
+    StrView rec;
+    LinkModule *mod = NULL;
+    int next_module = in->first_module;
+    for (int line_no = 1; next_line(&cursor, end, &rec); line_no++) {
+        rec = view_trim(rec);
+        if (rec.len == 0) {
+            continue;
+        }
+        if (rec.ptr[0] == 'H') {
+            mod = &lk->modules[next_module++];
+            continue;
+        }
+        if (rec.ptr[0] == 'E') {
+            mod = NULL;
+            continue;
+        }
+        if (rec.ptr[0] != 'T' && rec.ptr[0] != 'M') {
+            continue;
+        }
+        if (mod == NULL) {
+            link_error(lk, in, line_no, "%c record outside a control section", rec.ptr[0]);
+            continue;
+        }
+        int address;
+        int n;
+        if (!record_hex(rec, 1, 6, &address) || !record_hex(rec, 7, 2, &n)) {
+            link_error(lk, in, line_no, "Malformed %c record", rec.ptr[0]);
+            continue;
+        }
+        int off = address - mod->start;
+        unsigned char *dst = lk->image + (mod->address - lk->load) + off;
+        if (rec.ptr[0] == 'T') {
+            if (off < 0 || off + n > mod->length || rec.len < 9 + 2 * n) {
+                link_error(lk, in, line_no, "T record outside its control section");
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                int hi = hex_digit(rec.ptr[9 + 2*i]);
+                int lo = hex_digit(rec.ptr[9 + 2*i + 1]);
+                if (hi < 0 || lo < 0) {
+                    link_error(lk, in, line_no, "Malformed T record");
+                    break;
+                }
+                dst[i] = (unsigned char)(hi << 4 | lo);
+            }
+            continue;
+        }
+
+        // M record: address, length in half-bytes, then +NAME or -NAME. With
+        // no name, or the section's own, the field moves with the section.
+        if (n < 1 || n > 6 || off < 0 || off + (n + 1) / 2 > mod->length) {
+            link_error(lk, in, line_no, "M record outside its control section");
+            continue;
+        }
+        int negative = rec.len > 9 && rec.ptr[9] == '-';
+        StrView name = rec.len > 10 ? view_trim(make_view(rec.ptr + 10, rec.len - 10)) : empty_view;
+        int value = mod->address - mod->start;
+        if (name.len > 0 && !view_eq(name, mod->name)) {
+            const Symbol *sym = symtab_find(&lk->estab, &lk->estab.stats, name.ptr, name.len);
+            if (sym == NULL) {
+                link_error(lk, in, line_no, "Undefined external symbol '%.*s'", name.len, name.ptr);
+                continue;
+            }
+            value = sym->address;
+        }
+        modify_field(dst, n, negative ? -value : value);
+    }
+}
+
+// Link every input into one image; returns 0 if anything went wrong
+static int link_inputs(Linker *lk) {
+    int next_address = lk->load;
+    for (int i = 0; i < lk->input_count; i++) {
+        LinkInput *in = &lk->inputs[i];
+        if (!source_open(&in->src, in->path)) {
+            link_error(lk, in, 0, "Cannot open %s for reading.", in->path);
+            continue;
+        }
+        link_define(lk, in, &next_address);
+    }
+    lk->size = next_address - lk->load;
+    if (next_address > SIC_MEMORY_SIZE) {
+        link_error(lk, &lk->inputs[0], 0, "Linked program does not fit in memory (ends at %X)",
+                   next_address);
+        return 0;
+    }
+    if (lk->error_count > 0) {
+        return 0;
+    }
+    lk->image = (unsigned char*)xrealloc(&lk->oom, NULL, lk->size > 0 ? lk->size : 1);
+    memset(lk->image, 0, lk->size);
+    for (int i = 0; i < lk->input_count; i++) {
+        link_load(lk, &lk->inputs[i]);
+    }
+    if (lk->entry < 0) {
+        lk->entry = lk->load;
+    }
+    return lk->error_count == 0;
+}
+
+// The image as a flat binary, Intel HEX or S-records
+static void write_link_image(Linker *lk, OutBuf *ob, int format) {
+    if (format == SIC_FORMAT_IHEX) {
+        IhexState st = { ob, 0 };
+        for (int off = 0; off < lk->size; off += HEX_RECORD_MAX) {
+            int n = lk->size - off < HEX_RECORD_MAX ? lk->size - off : HEX_RECORD_MAX;
+            emit_ihex_data(&st, lk->load + off, lk->image + off, n);
+        }
+        out_ihex_trailer(ob, lk->entry);
+    } else if (format == SIC_FORMAT_SREC) {
+        SrecState st = { ob, lk->load + lk->size > 0x10000 ? 3 : 2 };
+        StrView name = lk->module_count > 0 ? lk->modules[0].name : empty_view;
+        out_srec_record(ob, 0, 2, 0, (const unsigned char*)name.ptr, name.len);
+        for (int off = 0; off < lk->size; off += HEX_RECORD_MAX) {
+            int n = lk->size - off < HEX_RECORD_MAX ? lk->size - off : HEX_RECORD_MAX;
+            emit_srec_data(&st, lk->load + off, lk->image + off, n);
+        }
+        out_srec_trailer(ob, st.addr_bytes, lk->entry);
+    } else {
+        out_str(ob, (const char*)lk->image, lk->size);
+    }
+}
+
+// link [--load=ADDR] [--format=bin|ihex|srec] [--manifest FILE] <output> <input.obj>...
+// (lk->oom must be armed)
+static int link_main(Linker *lk, int argc, char *argv[]) {
+    int load = 0;
+    int format = SIC_FORMAT_BIN;
+    const char *output = NULL;
+    const char *manifest = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--load=", 7) == 0) {
+            load = (int)strtol(argv[i] + 7, NULL, 16);
+        } else if (strcmp(argv[i], "--format=bin") == 0) {
+            format = SIC_FORMAT_BIN;
+        } else if (strcmp(argv[i], "--format=ihex") == 0) {
+            format = SIC_FORMAT_IHEX;
+        } else if (strcmp(argv[i], "--format=srec") == 0) {
+            format = SIC_FORMAT_SREC;
+        } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (output == NULL) {
+            output = argv[i];
+        } else {
+            linker_add_input(lk, make_view(argv[i], (int)strlen(argv[i])));
+        }
+    }
+    // Manifest: one object file per line, '#' starts a comment
+    SourceBuffer list;
+    if (manifest != NULL) {
+        if (!source_open(&list, manifest)) {
+            printf("Cannot read manifest %s\n", manifest);
+            return 1;
+        }
+        const char *cursor = list.data;
+        const char *end = list.data + list.size;
+        StrView line;
+        while (next_line(&cursor, end, &line)) {
+            line = view_trim(line);
+            if (line.len > 0 && line.ptr[0] != '#') {
+                linker_add_input(lk, line);
+            }
+        }
+        source_close(&list);
+    }
+    if (output == NULL || lk->input_count == 0 || load < 0 || load >= SIC_MEMORY_SIZE) {
+        printf("Usage: link [--load=ADDR] [--format=bin|ihex|srec] [--manifest FILE] <output> <input.obj>...\n");
+        return 1;
+    }
+    lk->load = load;
+
+    double start = now_seconds();
+    int ok = link_inputs(lk);
+    if (ok) {
+        OutBuf ob;
+        if (!outbuf_open(&ob, output, format == SIC_FORMAT_BIN, &lk->oom)) {
+            link_error(lk, &lk->inputs[0], 0, "Cannot open %s for writing.", output);
+        } else {
+            write_link_image(lk, &ob, format);
+            if (!outbuf_close(&ob)) {
+                link_error(lk, &lk->inputs[0], 0, "Cannot write %s.", output);
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    for (int i = 0; i < lk->input_count; i++) {
+        print_diagnostics(lk->inputs[i].diags, lk->inputs[i].diag_count, lk->inputs[i].path, stderr);
+    }
+    int rc = lk->error_count > 0 ? 1 : 0;
+    if (rc) {
+        printf("\033[1;31mLink failed.\033[0m\n");
+        printf("\033[1;31m number of errors: %d\033[0m\n", lk->error_count);
+    } else {
+        printf("\033[0;32mLink completed.\033[0m\n");
+        printf("%d control sections from %d files, %d symbols: %d bytes at %06X, entry %06X, %.3f s\n",
+               lk->module_count, lk->input_count, lk->estab.count, lk->size, lk->load, lk->entry, elapsed);
+    }
+    return rc;
+}
+
+static int run_link(int argc, char *argv[]) {
+    Linker lk;
+    linker_init(&lk);
+    int rc;
+    if (setjmp(lk.oom.jump)) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        rc = 1;
+    } else {
+        rc = link_main(&lk, argc, argv);
+    }
+    linker_free(&lk);
+    return rc;
+}
+
+/*
+ * Simulator (sim)
+ *
+ * Runs a linked program in a 1 MB SIC/XE machine. Each instruction is
+ * decoded once, the first time it runs, into a Decoded entry of a cache
+ * indexed by address: handler, length, addressing mode and the target with
+ * any PC-relative displacement already added. Stores send the entries they
+ * may overlap back to H_DECODE, so self-modifying code is decoded again.
+ * Handlers chain into each other with computed goto where the compiler has
+ * it (threaded dispatch) and through a switch loop elsewhere.
+ *
+ * RD reads a byte from stdin, WD writes one to stdout and TD always reports
+ * the device ready. A run ends when control returns through the initial L
+ * register, on a jump to itself ("J *"), on SVC, on an invalid instruction
+ * or after --max instructions.
+ */
+
+#define SIM_MASK (SIC_MEMORY_SIZE - 1)
+#define SIM_RETURN 0xFFFFFF         // Initial L: RSUB to it ends the run
+
+// Instruction handlers; H_DECODE (0) marks a cache entry not decoded yet
+enum {
+    H_DECODE = 0, H_INVALID,
+    // Format 3/4
+    H_ADD, H_SUB, H_MUL, H_DIV, H_AND, H_OR, H_COMP,
+    H_LDA, H_LDB, H_LDL, H_LDS, H_LDT, H_LDX, H_LDCH,
+    H_STA, H_STB, H_STL, H_STS, H_STT, H_STX, H_STCH, H_STSW,
+    H_J, H_JEQ, H_JGT, H_JLT, H_JSUB, H_RSUB, H_TIX, H_TD, H_RD, H_WD,
+    H_ADDF, H_SUBF, H_MULF, H_DIVF, H_COMPF, H_LDF, H_STF, H_LPS, H_SSK, H_STI,
+    // Format 2
+    H_ADDR, H_SUBR, H_MULR, H_DIVR, H_COMPR, H_CLEAR, H_RMO, H_SHIFTL, H_SHIFTR,
+    H_SVC, H_TIXR,
+    // Format 1
+    H_FIX, H_FLOAT, H_NORM, H_HIO, H_SIO, H_TIO,
+    H_COUNT
+};
+
+// Mnemonic of each handler; opcodes and formats come from the keyword table
+typedef struct {
+    const char *name;
+    int handler;
+} SimOpcode;
+
+static const SimOpcode sim_opcodes[] = {
+    {"ADD", H_ADD}, {"SUB", H_SUB}, {"MUL", H_MUL}, {"DIV", H_DIV}, {"AND", H_AND},
+    {"OR", H_OR}, {"COMP", H_COMP}, {"LDA", H_LDA}, {"LDB", H_LDB}, {"LDL", H_LDL},
+    {"LDS", H_LDS}, {"LDT", H_LDT}, {"LDX", H_LDX}, {"LDCH", H_LDCH}, {"STA", H_STA},
+    {"STB", H_STB}, {"STL", H_STL}, {"STS", H_STS}, {"STT", H_STT}, {"STX", H_STX},
+    {"STCH", H_STCH}, {"STSW", H_STSW}, {"J", H_J}, {"JEQ", H_JEQ}, {"JGT", H_JGT},
+    {"JLT", H_JLT}, {"JSUB", H_JSUB}, {"RSUB", H_RSUB}, {"TIX", H_TIX}, {"TD", H_TD},
+    {"RD", H_RD}, {"WD", H_WD}, {"ADDF", H_ADDF}, {"SUBF", H_SUBF}, {"MULF", H_MULF},
+    {"DIVF", H_DIVF}, {"COMPF", H_COMPF}, {"LDF", H_LDF}, {"STF", H_STF}, {"LPS", H_LPS},
+    {"SSK", H_SSK}, {"STI", H_STI}, {"ADDR", H_ADDR}, {"SUBR", H_SUBR}, {"MULR", H_MULR},
+    {"DIVR", H_DIVR}, {"COMPR", H_COMPR}, {"CLEAR", H_CLEAR}, {"RMO", H_RMO},
+    {"SHIFTL", H_SHIFTL}, {"SHIFTR", H_SHIFTR}, {"SVC", H_SVC}, {"TIXR", H_TIXR},
+    {"FIX", H_FIX}, {"FLOAT", H_FLOAT}, {"NORM", H_NORM}, {"HIO", H_HIO}, {"SIO", H_SIO},
+    {"TIO", H_TIO},
+};
+
+// Register numbers, as encoded in format 2 instructions
+enum {
+    SIM_REG_A = 0, SIM_REG_X = 1, SIM_REG_L = 2, SIM_REG_B = 3, SIM_REG_S = 4,
+    SIM_REG_T = 5, SIM_REG_F = 6, SIM_REG_PC = 8, SIM_REG_SW = 9
+};
+
+// Addressing mode bits of a decoded format 3/4 instruction
+enum {
+    SIM_MODE_X = 0x01,          // Add X
+    SIM_MODE_B = 0x02,          // Add B (base-relative)
+    SIM_MODE_INDIRECT = 0x04,   // The target holds the address
+    SIM_MODE_IMMEDIATE = 0x08   // The target is the operand
+};
+
+// One predecoded instruction (8 bytes)
+typedef struct {
+    unsigned char handler;      // H_*
+    unsigned char len;          // Bytes
+    unsigned char mode;         // SIM_MODE_*
+    unsigned char cycles;       // Cost charged per execution
+    int target;                 // Format 3/4: target before X/B/indirection;
+                                // format 2: r1 << 4 | r2
+} Decoded;
+
+typedef struct {
+    unsigned char *mem;         // SIC_MEMORY_SIZE bytes, plus slack for reads at the end
+    Decoded *cache;             // One entry per address
+    int reg[16];                // By register number (PC is kept apart while running)
+    double F;
+    int cc;                     // Condition code: -1 <, 0 =, 1 >
+    unsigned char handlers[64]; // Handler of each opcode (opcode >> 2)
+    unsigned char formats[H_COUNT];
+    long long limit;            // Instructions before giving up
+    long long instructions;
+    long long cycles;
+    const char *stop;           // Why the run ended
+    int failed;                 // It ended abnormally
+} Machine;
+
+static int sim_init(Machine *m, long long limit) {
+    memset(m, 0, sizeof(Machine));
+    m->mem = (unsigned char*)calloc(SIC_MEMORY_SIZE + 8, 1);
+    m->cache = (Decoded*)calloc(SIC_MEMORY_SIZE, sizeof(Decoded));
+    if (m->mem == NULL || m->cache == NULL) {
+        free(m->mem);
+        free(m->cache);
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(sim_opcodes) / sizeof(sim_opcodes[0]); i++) {
+        const char *name = sim_opcodes[i].name;
+        const Keyword *kw = lookup_keyword_n(name, (int)strlen(name));
+        m->handlers[kw->opcode >> 2] = (unsigned char)sim_opcodes[i].handler;
+        m->formats[sim_opcodes[i].handler] = (unsigned char)kw->format;
+    }
+    for (int i = 0; i < 64; i++) {
+        if (m->handlers[i] == H_DECODE) {
+            m->handlers[i] = H_INVALID;
+        }
+    }
+    m->reg[SIM_REG_L] = SIM_RETURN;
+    m->limit = limit;
+    return 1;
+}
+
+static void sim_free(Machine *m) {
+    free(m->mem);
+    free(m->cache);
+    memset(m, 0, sizeof(Machine));
+}
+
+static int sext24(int v) {
+    return (v & 0x800000) ? v - 0x1000000 : v;
+}
+
+// Low 24 bits of the product of two signed words
+static int mul24(int a, int b) {
+    return (int)(((long long)sext24(a) * sext24(b)) & 0xFFFFFF);
+}
+
+// F truncated to a signed word; values out of range saturate and NaN is 0
+static int fix24(double f) {
+    if (f != f) {
+        return 0;
+    }
+    if (f >= 0x7FFFFF) {
+        return 0x7FFFFF;
+    }
+    if (f <= -0x800000) {
+        return 0x800000;
+    }
+    return (int)f & 0xFFFFFF;
+}
+
+static int compare(int a, int b) {
+    return a < b ? -1 : a > b;
+}
+
+static int load24(const unsigned char *mem, int a) {
+    a &= SIM_MASK;
+    return mem[a] << 16 | mem[a + 1] << 8 | mem[a + 2];
+}
+
+// Bytes at [a, a+n) changed: instructions overlapping them decode again
+static void sim_invalidate(Machine *m, int a, int n) {
+    for (int i = a - 3; i < a + n; i++) {
+        // H_DECODE charges the entry's cycles too: none until it is decoded
+        m->cache[i & SIM_MASK].handler = H_DECODE;
+        m->cache[i & SIM_MASK].cycles = 0;
+    }
+}
+
+static void store24(Machine *m, int a, int v) {
+    a &= SIM_MASK;
+    m->mem[a] = (unsigned char)(v >> 16);
+    m->mem[(a + 1) & SIM_MASK] = (unsigned char)(v >> 8);
+    m->mem[(a + 2) & SIM_MASK] = (unsigned char)v;
+    sim_invalidate(m, a, 3);
+}
+
+// 48-bit SIC/XE float (sign, 11-bit exponent excess 1024, 36-bit fraction
+// 0.1xxx) at a, converted through the IEEE double bit layout
+static double load_float(const unsigned char *mem, int a) {
+    unsigned long long bits = 0;
+    for (int i = 0; i < 6; i++) {
+        bits = bits << 8 | mem[(a + i) & SIM_MASK];
+    }
+    unsigned long long frac = bits & 0xFFFFFFFFFULL;
+    int exp = (int)(bits >> 36) & 0x7FF;
+    if (frac == 0) {
+        return 0.0;
+    }
+    while (!(frac & 0x800000000ULL)) {
+        frac <<= 1;
+        exp--;
+    }
+    // 0.1f x 2^(exp-1024) = 1.f x 2^(exp-1025)
+    long long e = exp - 1025 + 1023;
+    if (e <= 0) {
+        return 0.0;
+    }
+    unsigned long long d = (unsigned long long)e << 52 | (frac & 0x7FFFFFFFFULL) << 17;
+    d |= (bits >> 47) << 63;
+    double v;
+    memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
+static void store_float(Machine *m, int a, double v) {
+    unsigned long long d;
+    memcpy(&d, &v, sizeof(d));
+    unsigned long long bits = 0;
+    int e = (int)(d >> 52) & 0x7FF;
+    if (e != 0) {
+        int exp = e - 1023 + 1025;
+        if (exp > 0x7FF) {
+            exp = 0x7FF;
+        }
+        bits = (d >> 63) << 47 | (unsigned long long)(exp < 0 ? 0 : exp) << 36 |
+               0x800000000ULL | ((d >> 17) & 0x7FFFFFFFFULL);
+    }
+    for (int i = 5; i >= 0; i--) {
+        m->mem[(a + i) & SIM_MASK] = (unsigned char)bits;
+        bits >>= 8;
+    }
+    sim_invalidate(m, a, 6);
+}
+
+// Fill the cache entry of the instruction at pc
+static void sim_decode(Machine *m, int pc) {
+    const unsigned char *b = m->mem + pc;
+    Decoded *d = &m->cache[pc];
+    d->handler = m->handlers[b[0] >> 2];
+    d->mode = 0;
+    d->target = 0;
+    d->cycles = 1;
+    switch (m->formats[d->handler]) {
+    case 1:
+        d->len = 1;
+        break;
+    case 2:
+        d->len = 2;
+        d->target = b[1];
+        break;
+    case 3: {
+        int ni = b[0] & 3;
+        int target;
+        d->cycles = 2;
+        if (b[1] & 0x80) {
+            d->mode |= SIM_MODE_X;
+        }
+        if (ni == 0) {
+            // SIC: 15-bit address
+            d->len = 3;
+            target = (b[1] & 0x7F) << 8 | b[2];
+        } else if (b[1] & 0x10) {
+            // Format 4: 20-bit address
+            d->len = 4;
+            target = (b[1] & 0x0F) << 16 | b[2] << 8 | b[3];
+        } else {
+            d->len = 3;
+            target = (b[1] & 0x0F) << 8 | b[2];
+            if (b[1] & 0x20) {
+                target = pc + 3 + (target ^ 0x800) - 0x800;
+            } else if (b[1] & 0x40) {
+                d->mode |= SIM_MODE_B;
+            }
+        }
+        if (ni == 1) {
+            d->mode |= SIM_MODE_IMMEDIATE;
+        } else if (ni == 2) {
+            d->mode |= SIM_MODE_INDIRECT;
+            d->cycles++;
+        }
+        d->target = target & SIM_MASK;
+        break;
+    }
+    default:
+        d->len = 1;
+        break;
+    }
+}
+
+// Target address (or immediate value) of a format 3/4 instruction that is
+// not plain direct; indirection yields a full 24-bit word
+static int sim_address(const Machine *m, const Decoded *d) {
+    int ta = d->target;
+    if (d->mode & SIM_MODE_X) {
+        ta += m->reg[SIM_REG_X];
+    }
+    if (d->mode & SIM_MODE_B) {
+        ta += m->reg[SIM_REG_B];
+    }
+    ta &= SIM_MASK;
+    if (d->mode & SIM_MODE_INDIRECT) {
+        ta = load24(m->mem, ta);
+    }
+    return ta;
+}
+
+#ifdef __GNUC__
+#define SIM_THREADED
+#endif
+
+// Run from entry until the program stops
+static void sim_run(Machine *m, int entry) {
+    unsigned char *mem = m->mem;
+    Decoded *cache = m->cache;
+    int *reg = m->reg;
+    int pc = entry & SIM_MASK;
+    long long budget = m->limit;
+    long long cycles = 0;
+    const Decoded *d;
+    int ta;
+    int r1, r2;
+
+// Effective address, word and byte operands of the current instruction
+#define EA() (d->mode == 0 ? d->target : sim_address(m, d))
+#define WORD() ((d->mode & SIM_MODE_IMMEDIATE) ? EA() : load24(mem, EA()))
+#define BYTE() ((d->mode & SIM_MODE_IMMEDIATE) ? EA() & 0xFF : mem[EA() & SIM_MASK])
+#define FLOAT() ((d->mode & SIM_MODE_IMMEDIATE) ? (double)EA() : load_float(mem, EA()))
+#define REGS() (r1 = d->target >> 4, r2 = d->target & 15)
+#define STOP(why, bad) do { m->stop = (why); m->failed = (bad); goto halt; } while (0)
+// Transfer control to ta; a jump to itself or back through L stops the run
+#define JUMP() do {                                                          \
+        if (ta > SIM_MASK) STOP("returned", 0);                              \
+        if (ta == pc) STOP("jump to itself", 0);                             \
+        pc = ta;                                                             \
+    } while (0)
+
+#ifdef SIM_THREADED
+    static void *const dispatch[H_COUNT] = {
+        [H_DECODE] = &&L_H_DECODE, [H_INVALID] = &&L_H_INVALID,
+        [H_ADD] = &&L_H_ADD, [H_SUB] = &&L_H_SUB, [H_MUL] = &&L_H_MUL, [H_DIV] = &&L_H_DIV,
+        [H_AND] = &&L_H_AND, [H_OR] = &&L_H_OR, [H_COMP] = &&L_H_COMP,
+        [H_LDA] = &&L_H_LDA, [H_LDB] = &&L_H_LDB, [H_LDL] = &&L_H_LDL, [H_LDS] = &&L_H_LDS,
+        [H_LDT] = &&L_H_LDT, [H_LDX] = &&L_H_LDX, [H_LDCH] = &&L_H_LDCH,
+        [H_STA] = &&L_H_STA, [H_STB] = &&L_H_STB, [H_STL] = &&L_H_STL, [H_STS] = &&L_H_STS,
+        [H_STT] = &&L_H_STT, [H_STX] = &&L_H_STX, [H_STCH] = &&L_H_STCH, [H_STSW] = &&L_H_STSW,
+        [H_J] = &&L_H_J, [H_JEQ] = &&L_H_JEQ, [H_JGT] = &&L_H_JGT, [H_JLT] = &&L_H_JLT,
+        [H_JSUB] = &&L_H_JSUB, [H_RSUB] = &&L_H_RSUB, [H_TIX] = &&L_H_TIX,
+        [H_TD] = &&L_H_TD, [H_RD] = &&L_H_RD, [H_WD] = &&L_H_WD,
+        [H_ADDF] = &&L_H_ADDF, [H_SUBF] = &&L_H_SUBF, [H_MULF] = &&L_H_MULF,
+        [H_DIVF] = &&L_H_DIVF, [H_COMPF] = &&L_H_COMPF, [H_LDF] = &&L_H_LDF,
+        [H_STF] = &&L_H_STF, [H_LPS] = &&L_H_LPS, [H_SSK] = &&L_H_SSK, [H_STI] = &&L_H_STI,
+        [H_ADDR] = &&L_H_ADDR, [H_SUBR] = &&L_H_SUBR, [H_MULR] = &&L_H_MULR,
+        [H_DIVR] = &&L_H_DIVR, [H_COMPR] = &&L_H_COMPR, [H_CLEAR] = &&L_H_CLEAR,
+        [H_RMO] = &&L_H_RMO, [H_SHIFTL] = &&L_H_SHIFTL, [H_SHIFTR] = &&L_H_SHIFTR,
+        [H_SVC] = &&L_H_SVC, [H_TIXR] = &&L_H_TIXR,
+        [H_FIX] = &&L_H_FIX, [H_FLOAT] = &&L_H_FLOAT, [H_NORM] = &&L_H_NORM,
+        [H_HIO] = &&L_H_HIO, [H_SIO] = &&L_H_SIO, [H_TIO] = &&L_H_TIO,
+    };
+#define OP(h) L_##h: cycles += d->cycles;
+#define NEXT() do {                                                          \
+        if (pc > SIM_MASK) goto off_the_end;                                 \
+        if (--budget < 0) goto out_of_budget;                                \
+        d = &cache[pc];                                                      \
+        goto *dispatch[d->handler];                                          \
+    } while (0)
+#define REDISPATCH() goto *dispatch[d->handler]
+    NEXT();
+    {
+        {
+#else
+#define OP(h) case h: cycles += d->cycles;
+#define NEXT() continue
+#define REDISPATCH() goto redispatch
+    for (;;) {
+        if (pc > SIM_MASK) {
+            goto off_the_end;
+        }
+        if (--budget < 0) {
+            goto out_of_budget;
+        }
+        d = &cache[pc];
+redispatch:
+        switch (d->handler) {
+#endif
+        OP(H_DECODE)
+            sim_decode(m, pc);
+            if (pc + d->len > SIC_MEMORY_SIZE) {
+                budget++;   // Not executed
+                goto off_the_end;
+            }
+            REDISPATCH();
+        OP(H_INVALID)
+            STOP("invalid instruction", 1);
+
+        OP(H_ADD)  reg[SIM_REG_A] = (reg[SIM_REG_A] + WORD()) & 0xFFFFFF; pc += d->len; NEXT();
+        OP(H_SUB)  reg[SIM_REG_A] = (reg[SIM_REG_A] - WORD()) & 0xFFFFFF; pc += d->len; NEXT();
+        OP(H_MUL)  reg[SIM_REG_A] = mul24(reg[SIM_REG_A], WORD()); pc += d->len; NEXT();
+        OP(H_DIV)
+            ta = sext24(WORD());
+            if (ta == 0) {
+                STOP("division by zero", 1);
+            }
+            reg[SIM_REG_A] = (sext24(reg[SIM_REG_A]) / ta) & 0xFFFFFF;
+            pc += d->len;
+            NEXT();
+        OP(H_AND)  reg[SIM_REG_A] &= WORD(); pc += d->len; NEXT();
+        OP(H_OR)   reg[SIM_REG_A] |= WORD(); pc += d->len; NEXT();
+        OP(H_COMP) m->cc = compare(sext24(reg[SIM_REG_A]), sext24(WORD())); pc += d->len; NEXT();
+
+        OP(H_LDA)  reg[SIM_REG_A] = WORD(); pc += d->len; NEXT();
+        OP(H_LDB)  reg[SIM_REG_B] = WORD(); pc += d->len; NEXT();
+        OP(H_LDL)  reg[SIM_REG_L] = WORD(); pc += d->len; NEXT();
+        OP(H_LDS)  reg[SIM_REG_S] = WORD(); pc += d->len; NEXT();
+        OP(H_LDT)  reg[SIM_REG_T] = WORD(); pc += d->len; NEXT();
+        OP(H_LDX)  reg[SIM_REG_X] = WORD(); pc += d->len; NEXT();
+        OP(H_LDCH) reg[SIM_REG_A] = (reg[SIM_REG_A] & 0xFFFF00) | BYTE(); pc += d->len; NEXT();
+
+        OP(H_STA)  store24(m, EA(), reg[SIM_REG_A]); pc += d->len; NEXT();
+        OP(H_STB)  store24(m, EA(), reg[SIM_REG_B]); pc += d->len; NEXT();
+        OP(H_STL)  store24(m, EA(), reg[SIM_REG_L]); pc += d->len; NEXT();
+        OP(H_STS)  store24(m, EA(), reg[SIM_REG_S]); pc += d->len; NEXT();
+        OP(H_STT)  store24(m, EA(), reg[SIM_REG_T]); pc += d->len; NEXT();
+        OP(H_STX)  store24(m, EA(), reg[SIM_REG_X]); pc += d->len; NEXT();
+        OP(H_STSW) store24(m, EA(), (m->cc + 1) << 6); pc += d->len; NEXT();
+        OP(H_STCH)
+            ta = EA() & SIM_MASK;
+            mem[ta] = (unsigned char)reg[SIM_REG_A];
+            sim_invalidate(m, ta, 1);
+            pc += d->len;
+            NEXT();
+
+        OP(H_J)    ta = EA(); JUMP(); NEXT();
+        OP(H_JEQ)  if (m->cc == 0) { ta = EA(); JUMP(); } else { pc += d->len; } NEXT();
+        OP(H_JGT)  if (m->cc > 0) { ta = EA(); JUMP(); } else { pc += d->len; } NEXT();
+        OP(H_JLT)  if (m->cc < 0) { ta = EA(); JUMP(); } else { pc += d->len; } NEXT();
+        OP(H_JSUB) ta = EA(); reg[SIM_REG_L] = pc + d->len; JUMP(); NEXT();
+        OP(H_RSUB) ta = reg[SIM_REG_L]; JUMP(); NEXT();
+        OP(H_TIX)
+            reg[SIM_REG_X] = (reg[SIM_REG_X] + 1) & 0xFFFFFF;
+            m->cc = compare(sext24(reg[SIM_REG_X]), sext24(WORD()));
+            pc += d->len;
+            NEXT();
+
+        OP(H_TD)   m->cc = -1; pc += d->len; NEXT();
+        OP(H_RD)
+            ta = getchar();
+            reg[SIM_REG_A] = (reg[SIM_REG_A] & 0xFFFF00) | (ta == EOF ? 0 : ta);
+            pc += d->len;
+            NEXT();
+        OP(H_WD)   putchar(reg[SIM_REG_A] & 0xFF); pc += d->len; NEXT();
+
+        OP(H_ADDF)  m->F += FLOAT(); pc += d->len; NEXT();
+        OP(H_SUBF)  m->F -= FLOAT(); pc += d->len; NEXT();
+        OP(H_MULF)  m->F *= FLOAT(); pc += d->len; NEXT();
+        OP(H_DIVF)
+            if (FLOAT() == 0.0) {
+                STOP("division by zero", 1);
+            }
+            m->F /= FLOAT();
+            pc += d->len;
+            NEXT();
+        OP(H_COMPF) { double v = FLOAT(); m->cc = m->F < v ? -1 : m->F > v; } pc += d->len; NEXT();
+        OP(H_LDF)   m->F = FLOAT(); pc += d->len; NEXT();
+        OP(H_STF)   store_float(m, EA(), m->F); pc += d->len; NEXT();
+        // Privileged: no supervisor state to change
+        OP(H_LPS)   pc += d->len; NEXT();
+        OP(H_SSK)   pc += d->len; NEXT();
+        OP(H_STI)   pc += d->len; NEXT();
+
+        OP(H_ADDR)  REGS(); reg[r2] = (reg[r2] + reg[r1]) & 0xFFFFFF; pc += 2; NEXT();
+        OP(H_SUBR)  REGS(); reg[r2] = (reg[r2] - reg[r1]) & 0xFFFFFF; pc += 2; NEXT();
+        OP(H_MULR)  REGS(); reg[r2] = mul24(reg[r2], reg[r1]); pc += 2; NEXT();
+        OP(H_DIVR)
+            REGS();
+            if (sext24(reg[r1]) == 0) {
+                STOP("division by zero", 1);
+            }
+            reg[r2] = (sext24(reg[r2]) / sext24(reg[r1])) & 0xFFFFFF;
+            pc += 2;
+            NEXT();
+        OP(H_COMPR) REGS(); m->cc = compare(sext24(reg[r1]), sext24(reg[r2])); pc += 2; NEXT();
+        OP(H_CLEAR)
+            REGS();
+            reg[r1] = 0;
+            if (r1 == SIM_REG_F) {
+                m->F = 0.0;
+            }
+            pc += 2;
+            NEXT();
+        OP(H_RMO)   REGS(); reg[r2] = reg[r1]; pc += 2; NEXT();
+        OP(H_SHIFTL)
+            // Circular, by r2 + 1 bits
+            REGS();
+            reg[r1] = ((reg[r1] << (r2 + 1)) | (reg[r1] >> (23 - r2))) & 0xFFFFFF;
+            pc += 2;
+            NEXT();
+        OP(H_SHIFTR)
+            // Arithmetic, by r2 + 1 bits
+            REGS();
+            reg[r1] = (sext24(reg[r1]) >> (r2 + 1)) & 0xFFFFFF;
+            pc += 2;
+            NEXT();
+        OP(H_SVC)   STOP("SVC", 0);
+        OP(H_TIXR)
+            REGS();
+            reg[SIM_REG_X] = (reg[SIM_REG_X] + 1) & 0xFFFFFF;
+            m->cc = compare(sext24(reg[SIM_REG_X]), sext24(reg[r1]));
+            pc += 2;
+            NEXT();
+
+        OP(H_FIX)   reg[SIM_REG_A] = fix24(m->F); pc += 1; NEXT();
+        OP(H_FLOAT) m->F = sext24(reg[SIM_REG_A]); pc += 1; NEXT();
+        OP(H_TIO)   m->cc = -1; pc += 1; NEXT();
+        // Floats are kept normalized; there is no I/O channel to drive
+        OP(H_NORM)  pc += 1; NEXT();
+        OP(H_HIO)   pc += 1; NEXT();
+        OP(H_SIO)   pc += 1; NEXT();
+        }
+    }
+
+out_of_budget:
+    budget = 0;
+    m->stop = "instruction limit reached";
+    m->failed = 1;
+    goto halt;
+off_the_end:
+    // The next instruction would not lie wholly inside memory
+    m->stop = "ran off the end of memory";
+    m->failed = 1;
+halt:
+    reg[SIM_REG_PC] = pc;
+    reg[SIM_REG_SW] = (m->cc + 1) << 6;
+    m->instructions = m->limit - budget;
+    m->cycles = cycles;
+#undef EA
+#undef WORD
+#undef BYTE
+#undef FLOAT
+#undef REGS
+#undef STOP
+#undef JUMP
+#undef OP
+#undef NEXT
+#undef REDISPATCH
+}
+
+// sim [--load=ADDR] [--entry=ADDR] [--max=N] <image.bin | input.obj...>
+// (lk->oom must be armed)
+static int sim_main(Linker *lk, int argc, char *argv[]) {
+    int load = 0;
+    int entry = -1;
+    long long limit = LLONG_MAX;
+    const char *image = NULL;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        if (strncmp(argv[i], "--load=", 7) == 0) {
+            load = (int)strtol(argv[i] + 7, NULL, 16);
+        } else if (strncmp(argv[i], "--entry=", 8) == 0) {
+            entry = (int)strtol(argv[i] + 8, NULL, 16);
+        } else if (strncmp(argv[i], "--max=", 6) == 0) {
+            limit = strtoll(argv[i] + 6, NULL, 10);
+        } else if (len > 4 && strcmp(argv[i] + len - 4, ".bin") == 0) {
+            image = argv[i];
+        } else {
+            linker_add_input(lk, make_view(argv[i], (int)len));
+        }
+    }
+    if ((image == NULL) == (lk->input_count == 0) || load < 0 || load >= SIC_MEMORY_SIZE) {
+        printf("Usage: sim [--load=ADDR] [--entry=ADDR] [--max=N] <image.bin | input.obj...>\n");
+        return 1;
+    }
+
+    Machine m;
+    if (!sim_init(&m, limit)) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    int ok = 1;
+    if (image != NULL) {
+        // Flat image: loaded at --load, entered there unless --entry says otherwise
+        SourceBuffer src;
+        if (!source_open(&src, image)) {
+            fprintf(stderr, "Error: Cannot open %s for reading.\n", image);
+            ok = 0;
+        } else {
+            size_t room = (size_t)(SIC_MEMORY_SIZE - load);
+            memcpy(m.mem + load, src.data, src.size < room ? src.size : room);
+            source_close(&src);
+        }
+        if (entry < 0) {
+            entry = load;
+        }
+    } else {
+        lk->load = load;
+        ok = link_inputs(lk);
+        for (int i = 0; i < lk->input_count; i++) {
+            print_diagnostics(lk->inputs[i].diags, lk->inputs[i].diag_count, lk->inputs[i].path, stderr);
+        }
+        if (ok) {
+            memcpy(m.mem + lk->load, lk->image, lk->size);
+            if (entry < 0) {
+                entry = lk->entry;
+            }
+        }
+    }
+    if (!ok) {
+        sim_free(&m);
+        return 1;
+    }
+
+    double start = now_seconds();
+    sim_run(&m, entry);
+    double elapsed = now_seconds() - start;
+    fflush(stdout);
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+    const int *r = m.reg;
+    fprintf(stderr, "Stopped: %s at %06X\n", m.stop, r[SIM_REG_PC]);
+    fprintf(stderr, "A=%06X X=%06X L=%06X B=%06X S=%06X T=%06X F=%g SW=%06X\n",
+            r[SIM_REG_A], r[SIM_REG_X], r[SIM_REG_L], r[SIM_REG_B], r[SIM_REG_S],
+            r[SIM_REG_T], m.F, r[SIM_REG_SW]);
+    fprintf(stderr, "%lld instructions, %lld cycles in %.3f s: %.1f M instructions/s\n",
+            m.instructions, m.cycles, elapsed, m.instructions / elapsed / 1e6);
+    int rc = m.failed ? 1 : 0;
+    sim_free(&m);
+    return rc;
+}
+
+static int run_sim(int argc, char *argv[]) {
+    Linker lk;
+    linker_init(&lk);
+    int rc;
+    if (setjmp(lk.oom.jump)) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        rc = 1;
+    } else {
+        rc = sim_main(&lk, argc, argv);
+    }
+    linker_free(&lk);
+    return rc;
+}
+
+/*
+ * Benchmark (bench)
+ *
+ * Generates synthetic SIC/XE programs and times each phase of assembling
+ * them: pass1, pass2, the object writer and the listing writer. The
+ * generator is seeded, so a given set of options always produces the same
+ * program, and every phase is run --repeat times with the fastest run
+ * reported, which keeps the figures steady enough to compare builds.
+ * Outputs go to the null device so only formatting and the write calls
+ * are measured, not the disk.
+ *
+ * The program is cut into control sections of --section statements so
+ * that addresses stay within 20 bits however many lines are asked for.
+ * Symbolic operands refer to labels at most BENCH_WINDOW labels away,
+ * forward or backward, so most of them fit a PC-relative displacement.
+ */
+
+#define BENCH_WINDOW 16             // Labels an operand may reach in either direction
+
+// Shape of the generated program; the ratios are probabilities in [0, 1]
+typedef struct {
+    long long lines;        // Source lines
+    int section;            // Statements per control section
+    double labels;          // Lines that define a label
+    double forward;         // Symbolic operands naming a label defined later
+    double data;            // Lines that are BYTE/WORD/RESB/RESW
+    double reserve;         // Data lines that only reserve space (RESB/RESW)
+    double format2;         // Instructions that are format 2
+    unsigned long long seed;
+} BenchShape;
+
+// Fastest run of each phase
+typedef struct {
+    double pass1;
+    double pass2;
+    double object;
+    double listing;
+    size_t object_bytes;
+    size_t listing_bytes;
+    int error_count;
+} BenchTimes;
+
+static unsigned long long bench_random(unsigned long long *state) {
+    // xorshift64*
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double bench_chance(unsigned long long *state) {
+    return (double)(bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int bench_pick(unsigned long long *state, int n) {
+    return (int)(bench_random(state) % (unsigned long long)n);
+}
+
+// Label names are Q followed by the label number in base 36 (no mnemonic,
+// directive or register starts with Q)
+static void out_bench_label(OutBuf *ob, long long id) {
+    char text[16];
+    int n = 0;
+    do {
+        text[n++] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"[id % 36];
+        id /= 36;
+    } while (id > 0);
+    out_char(ob, 'Q');
+    while (n > 0) {
+        out_char(ob, text[--n]);
+    }
+}
+
+static void out_bench_number(OutBuf *ob, int value) {
+    char text[16];
+    int n = snprintf(text, sizeof(text), "%d", value);
+    out_str(ob, text, n);
+}
+
+// Operand naming a label of the current section: labels first..first+count-1
+// are in the section and the next one to be defined is first+defined
+static void out_bench_symbol(OutBuf *ob, const BenchShape *shape, unsigned long long *rng,
+                             long long first, int count, int defined) {
+    int forward = defined < count && (defined == 0 || bench_chance(rng) < shape->forward);
+    int lo, hi;
+    if (forward) {
+        lo = defined;
+        hi = defined + BENCH_WINDOW < count ? defined + BENCH_WINDOW : count;
+    } else {
+        lo = defined > BENCH_WINDOW ? defined - BENCH_WINDOW : 0;
+        hi = defined;
+    }
+    out_bench_label(ob, first + lo + bench_pick(rng, hi - lo));
+}
+
+static void out_bench_instruction(OutBuf *ob, const BenchShape *shape, unsigned long long *rng,
+                                  long long first, int count, int defined) {
+    static const char *const format2[] = {
+        "CLEAR\tX", "COMPR\tA,S", "ADDR\tS,A", "TIXR\tT", "RMO\tA,B", "SHIFTL\tA,4"
+    };
+    static const char *const loads[] = {"LDA", "ADD", "SUB", "COMP", "LDT", "LDX", "TIX"};
+    static const char *const others[] = {"STA", "STX", "J", "JEQ", "JLT", "JSUB", "LDCH", "STCH"};
+    if (bench_chance(rng) < shape->format2) {
+        const char *text = format2[bench_pick(rng, 6)];
+        out_str(ob, text, (int)strlen(text));
+        return;
+    }
+    double r = bench_chance(rng);
+    if (r < 0.02) {
+        out_str(ob, "RSUB", 4);
+        return;
+    }
+    int load = r < 0.5;
+    const char *mnemonic = load ? loads[bench_pick(rng, 7)] : others[bench_pick(rng, 8)];
+    out_str(ob, mnemonic, (int)strlen(mnemonic));
+    out_char(ob, '\t');
+    r = bench_chance(rng);
+    if (count == 0 || (load && r < 0.15)) {
+        out_char(ob, '#');
+        out_bench_number(ob, bench_pick(rng, 4096));
+        return;
+    }
+    if (r > 0.95) {
+        out_char(ob, '@');
+    }
+    out_bench_symbol(ob, shape, rng, first, count, defined);
+    if (r > 0.85 && r <= 0.95) {
+        out_str(ob, ",X", 2);
+    }
+}
+
+static void out_bench_data(OutBuf *ob, const BenchShape *shape, unsigned long long *rng) {
+    if (bench_chance(rng) < shape->reserve) {
+        if (bench_pick(rng, 2)) {
+            out_str(ob, "RESW\t", 5);
+            out_bench_number(ob, 1 + bench_pick(rng, 4));
+        } else {
+            out_str(ob, "RESB\t", 5);
+            out_bench_number(ob, 1 + bench_pick(rng, 12));
+        }
+        return;
+    }
+    int kind = bench_pick(rng, 3);
+    if (kind == 0) {
+        out_str(ob, "WORD\t", 5);
+        out_bench_number(ob, bench_pick(rng, 100000));
+    } else if (kind == 1) {
+        out_str(ob, "BYTE\tC'", 7);
+        for (int n = 1 + bench_pick(rng, 8); n > 0; n--) {
+            out_char(ob, (char)('A' + bench_pick(rng, 26)));
+        }
+        out_char(ob, '\'');
+    } else {
+        out_str(ob, "BYTE\tX'", 7);
+        for (int n = 1 + bench_pick(rng, 4); n > 0; n--) {
+            out_hex(ob, (unsigned)bench_pick(rng, 256), 2);
+        }
+        out_char(ob, '\'');
+    }
+}
+
+// Write a synthetic program of shape->lines lines to ob
+static void bench_generate(OutBuf *ob, const BenchShape *shape) {
+    unsigned long long rng = shape->seed ? shape->seed : 1;
+    unsigned char *labeled = (unsigned char*)xrealloc(ob->oom, NULL, shape->section);
+    long long label_base = 0;
+    long long remaining = shape->lines - 1;     // The END line
+    for (long long s = 0; remaining > 0; s++) {
+        // Header, then decide up front which statements carry labels so
+        // forward references know how many the section will have
+        if (s == 0) {
+            out_str(ob, "BENCH\tSTART\t0\n", 14);
+        } else {
+            out_char(ob, 'S');
+            out_bench_label(ob, s);
+            out_str(ob, "\tCSECT\n", 7);
+        }
+        remaining--;
+        int body = remaining < shape->section - 1 ? (int)remaining : shape->section - 1;
+        int count = 0;
+        for (int i = 0; i < body; i++) {
+            labeled[i] = bench_chance(&rng) < shape->labels;
+            count += labeled[i];
+        }
+        int defined = 0;
+        for (int i = 0; i < body; i++) {
+            if (labeled[i]) {
+                out_bench_label(ob, label_base + defined++);
+            }
+            out_char(ob, '\t');
+            if (bench_chance(&rng) < shape->data) {
+                out_bench_data(ob, shape, &rng);
+            } else {
+                out_bench_instruction(ob, shape, &rng, label_base, count, defined);
+            }
+            out_char(ob, '\n');
+        }
+        label_base += count;
+        remaining -= body;
+    }
+    out_str(ob, "\tEND\tBENCH\n", 11);
+    free(labeled);
+}
+
+// Peak resident set size of the process in bytes (0 where unknown)
+static long long peak_rss(void) {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return (long long)usage.ru_maxrss;
+#else
+        return (long long)usage.ru_maxrss * 1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+static double keep_faster(double best, double t) {
+    return best < 0 || t < best ? t : best;
+}
+
+// Assemble source once, lowering the times of the phases that ran faster
+static int bench_run(Assembler *as, const char *source, size_t size, BenchTimes *times) {
+    assembler_reset(as);
+    source_borrow(&as->src, source, size);
+    OutBuf obj, lst;
+    if (!outbuf_open(&obj, NULL_DEVICE, 0, &as->oom)) {
+        return 0;
+    }
+    if (!outbuf_open(&lst, NULL_DEVICE, 0, &as->oom)) {
+        outbuf_close(&obj);
+        return 0;
+    }
+    if (setjmp(as->oom.jump)) {
+        outbuf_close(&obj);
+        outbuf_close(&lst);
+        return 0;
+    }
+    double t0 = now_seconds();
+    pass1(as);
+    as->pass1_diag_count = as->diag_count;
+    double t1 = now_seconds();
+    pass2(as);
+    double t2 = now_seconds();
+    write_object(as, &obj, SIC_FORMAT_OBJ);
+    outbuf_flush(&obj);
+    double t3 = now_seconds();
+    write_listing(as, &lst);
+    outbuf_flush(&lst);
+    double t4 = now_seconds();
+    times->pass1 = keep_faster(times->pass1, t1 - t0);
+    times->pass2 = keep_faster(times->pass2, t2 - t1);
+    times->object = keep_faster(times->object, t3 - t2);
+    times->listing = keep_faster(times->listing, t4 - t3);
+    times->object_bytes = obj.written;
+    times->listing_bytes = lst.written;
+    times->error_count = as->error_count;
+    outbuf_close(&obj);
+    outbuf_close(&lst);
+    return 1;
+}
+
+// Generate the program into path, or into memory handed back in *source
+static int bench_source(const BenchShape *shape, const char *path, char **source, size_t *size) {
+    AllocContext oom;
+    OutBuf ob;
+    oom.allocations = NULL;
+    if (setjmp(oom.jump)) {
+        outbuf_close(&ob);
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 0;
+    }
+    if (path == NULL) {
+        outbuf_open_memory(&ob, &oom);
+    } else if (!outbuf_open(&ob, path, 0, &oom)) {
+        fprintf(stderr, "Error: Cannot open %s for writing.\n", path);
+        return 0;
+    }
+    bench_generate(&ob, shape);
+    if (path == NULL) {
+        *source = outbuf_take(&ob, size);
+    } else if (!outbuf_close(&ob)) {
+        fprintf(stderr, "Error: Cannot write %s.\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+static void print_bench_phase(const char *name, double seconds, long long lines, size_t bytes) {
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    printf("  %-8s %10.4f s %14.0f lines/s %10.1f MB/s\n",
+           name, seconds, lines / seconds, bytes / seconds / 1e6);
+}
+
+static int parse_ratio(const char *text, double *ratio) {
+    char *end;
+    double v = strtod(text, &end);
+    if (end == text || *end != '\0' || v < 0 || v > 1) {
+        return 0;
+    }
+    *ratio = v;
+    return 1;
+}
+
+// bench [--lines=N[,N...]] [--repeat=N] [--seed=N] [--section=N] [--threads=N]
+//       [--labels=P] [--forward=P] [--data=P] [--reserve=P] [--format2=P] [--emit=FILE]
+static int run_bench(int argc, char *argv[]) {
+    BenchShape shape;
+    shape.lines = 0;
+    shape.section = 50000;
+    shape.labels = 0.3;
+    shape.forward = 0.4;
+    shape.data = 0.2;
+    shape.reserve = 0.3;
+    shape.format2 = 0.2;
+    shape.seed = 1;
+    long long sizes[16] = {10000, 100000, 1000000, 10000000};
+    int size_count = 4;
+    int repeat = 3;
+    int threads = 1;
+    const char *emit = NULL;
+    int ok = 1;
+    for (int i = 0; i < argc && ok; i++) {
+        const char *a = argv[i];
+        if (strncmp(a, "--lines=", 8) == 0) {
+            size_count = 0;
+            for (const char *p = a + 8; ok && *p != '\0' && size_count < 16; ) {
+                char *end;
+                sizes[size_count] = strtoll(p, &end, 10);
+                ok = end != p && sizes[size_count] >= 2;
+                size_count++;
+                p = *end == ',' ? end + 1 : end;
+            }
+        } else if (strncmp(a, "--repeat=", 9) == 0) {
+            repeat = atoi(a + 9);
+            ok = repeat > 0;
+        } else if (strncmp(a, "--seed=", 7) == 0) {
+            shape.seed = strtoull(a + 7, NULL, 10);
+        } else if (strncmp(a, "--section=", 10) == 0) {
+            shape.section = atoi(a + 10);
+            ok = shape.section >= 2;
+        } else if (strncmp(a, "--threads=", 10) == 0) {
+            threads = atoi(a + 10);
+            if (threads <= 0) {
+                threads = default_jobs();
+            }
+        } else if (strncmp(a, "--labels=", 9) == 0) {
+            ok = parse_ratio(a + 9, &shape.labels);
+        } else if (strncmp(a, "--forward=", 10) == 0) {
+            ok = parse_ratio(a + 10, &shape.forward);
+        } else if (strncmp(a, "--data=", 7) == 0) {
+            ok = parse_ratio(a + 7, &shape.data);
+        } else if (strncmp(a, "--reserve=", 10) == 0) {
+            ok = parse_ratio(a + 10, &shape.reserve);
+        } else if (strncmp(a, "--format2=", 10) == 0) {
+            ok = parse_ratio(a + 10, &shape.format2);
+        } else if (strncmp(a, "--emit=", 7) == 0) {
+            emit = a + 7;
+        } else {
+            ok = 0;
+        }
+    }
+    if (!ok || size_count == 0) {
+        printf("Usage: bench [--lines=N[,N...]] [--repeat=N] [--seed=N] [--section=N] [--threads=N]\n"
+               "             [--labels=P] [--forward=P] [--data=P] [--reserve=P] [--format2=P] [--emit=FILE]\n");
+        return 1;
+    }
+
+    if (emit != NULL) {
+        // Only write the program (the first size) for use elsewhere
+        shape.lines = sizes[0];
+        return bench_source(&shape, emit, NULL, NULL) ? 0 : 1;
+    }
+
+    Assembler assembler;
+    assembler_init(&assembler);
+    assembler.jobs = threads;
+    int rc = 0;
+    printf("labels %.2f, forward %.2f, data %.2f, reserve %.2f, format2 %.2f, seed %llu, "
+           "best of %d, %d thread%s\n", shape.labels, shape.forward, shape.data, shape.reserve,
+           shape.format2, shape.seed, repeat, threads, threads == 1 ? "" : "s");
+    for (int i = 0; i < size_count && rc == 0; i++) {
+        shape.lines = sizes[i];
+        char *source;
+        size_t size;
+        if (!bench_source(&shape, NULL, &source, &size)) {
+            rc = 1;
+            break;
+        }
+        BenchTimes times;
+        times.pass1 = times.pass2 = times.object = times.listing = -1;
+        for (int r = 0; r < repeat && rc == 0; r++) {
+            if (!bench_run(&assembler, source, size, &times)) {
+                fprintf(stderr, "Error: Out of memory.\n");
+                rc = 1;
+            }
+        }
+        if (rc == 0) {
+            double total = times.pass1 + times.pass2 + times.object + times.listing;
+            printf("%lld lines, %.1f MB source:\n", shape.lines, size / 1e6);
+            print_bench_phase("pass1", times.pass1, shape.lines, size);
+            print_bench_phase("pass2", times.pass2, shape.lines, size);
+            print_bench_phase("object", times.object, shape.lines, times.object_bytes);
+            print_bench_phase("listing", times.listing, shape.lines, times.listing_bytes);
+            print_bench_phase("total", total, shape.lines, size);
+            printf("  peak RSS %.1f MB", peak_rss() / 1048576.0);
+            if (times.error_count > 0) {
+                printf(", %d errors", times.error_count);
+            }
+            printf("\n");
+        }
+        // The assembler points into the source until the next reset
+        assembler_reset(&assembler);
+        free(source);
+    }
+    assembler_free(&assembler);
+    return rc;
+}
+
+/*
+ * main function
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "link") == 0) {
+        return run_link(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "sim") == 0) {
+        return run_sim(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return run_bench(argc - 2, argv + 2);
+    }
+    const char **files = (const char**)calloc(argc, sizeof(char*));
+    int file_count = 0;
+    int show_symstats = 0;
+    int show_stats = 0;             // 1: table, 2: JSON
+    int format = SIC_FORMAT_OBJ;
+    int jobs = -1;                  // -1: single-file mode
+    int threads = 1;                // pass2 threads per file
+    const char *manifest = NULL;
+    int daemon = 0;
+    int one_pass = 0;
+    int fill_records = 0;
+    int optimize = 0;
+    int outputs = 3;                // Bit 0: object, bit 1: listing
+    const char *cache_dir = NULL;
+    long long cache_size = 256;     // MB
+    int cache_stats = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--symstats") == 0) {
+            show_symstats = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            show_stats = 2;
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            const char *name = argv[i] + 9;
+            if (strcmp(name, "obj") == 0) {
+                format = SIC_FORMAT_OBJ;
+            } else if (strcmp(name, "bin") == 0) {
+                format = SIC_FORMAT_BIN;
+            } else if (strcmp(name, "ihex") == 0) {
+                format = SIC_FORMAT_IHEX;
+            } else if (strcmp(name, "srec") == 0) {
+                format = SIC_FORMAT_SREC;
+            } else {
+                printf("Unknown format '%s' (expected obj, bin, ihex or srec)\n", name);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+            if (threads <= 0) {
+                threads = default_jobs();
+            }
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon = 1;
+        } else if (strcmp(argv[i], "--one-pass") == 0) {
+            one_pass = 1;
+        } else if (strcmp(argv[i], "--fill-records") == 0) {
+            fill_records = 1;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optimize = 1;
+        } else if (strcmp(argv[i], "--no-list") == 0) {
+            outputs &= ~2;
+        } else if (strcmp(argv[i], "--list-only") == 0) {
+            outputs &= ~1;
+        } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            cache_dir = argv[i] + 8;
+        } else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            cache_size = atoll(argv[i] + 13);
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = 1;
+        } else {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    if (optimize && (daemon || one_pass)) {
+        printf("-O cannot be used with --daemon or --one-pass\n");
+        return 1;
+    }
+    // Statistics describe one assembly
+    if ((show_stats || show_symstats) && (daemon || jobs >= 0 || manifest != NULL)) {
+        printf("--stats and --symstats cannot be used with --daemon, --jobs or --manifest\n");
+        return 1;
+    }
+    BuildCache cache;
+    BuildCache *build_cache = NULL;
+    if (cache_dir != NULL) {
+        if (daemon || one_pass) {
+            printf("--cache cannot be used with --daemon or --one-pass\n");
+            return 1;
+        }
+        if (!cache_open(&cache, cache_dir, cache_size * 1024 * 1024)) {
+            printf("Cannot use %s as a build cache\n", cache_dir);
+            return 1;
+        }
+        build_cache = &cache;
+        // --cache-stats alone only reports on the directory
+        if (cache_stats && file_count == 0 && manifest == NULL) {
+            free(files);
+            cache_close(build_cache);
+            cache_report(build_cache, stdout);
+            return 0;
+        }
+    }
+
+    if (daemon) {
+        free(files);
+        return run_daemon(format, threads, fill_records);
+    }
+
+    // Batch mode: every positional argument (and manifest entry) is an input
+    if (jobs >= 0 || manifest != NULL) {
+        BatchItem *items = NULL;
+        int count = 0;
+        int cap = 0;
+        if (manifest != NULL && !read_manifest(manifest, &items, &count, &cap)) {
+            printf("Cannot read manifest %s\n", manifest);
+            return 1;
+        }
+        for (int i = 0; i < file_count; i++) {
+            StrView input = make_view(files[i], (int)strlen(files[i]));
+            batch_add(&items, &count, &cap, input, empty_view, empty_view);
+        }
+        free(files);
+        if (count == 0) {
+            printf("No input files\n");
+            return 1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!(outputs & 1)) {
+                free(items[i].obj_file);
+                items[i].obj_file = NULL;
+            }
+            if (!(outputs & 2)) {
+                free(items[i].lst_file);
+                items[i].lst_file = NULL;
+            }
+        }
+        int rc = run_batch(items, count, jobs > 0 ? jobs : default_jobs(), threads, format,
+                           fill_records, optimize, build_cache);
+        if (build_cache != NULL) {
+            cache_close(build_cache);
+            if (cache_stats) {
+                cache_report(build_cache, stdout);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            free(items[i].input);
+            free(items[i].obj_file);
+            free(items[i].lst_file);
+            free(items[i].diags);
+        }
+        free(items);
+        return rc;
+    }
+
+    // The input, then one file per output ("-" for standard output)
+    if (outputs == 0 || file_count != (outputs == 3 ? 3 : 2)) {
+        printf("Usage: %s [--symstats] [--stats[=json]] [--threads=N] [--format=obj|bin|ihex|srec] [--fill-records] [-O] <input_file> <output_obj> <output_lst>\n", argv[0]);
+        printf("       %s [options] --no-list <input_file> <output_obj>\n", argv[0]);
+        printf("       %s [options] --list-only <input_file> <output_lst>\n", argv[0]);
+        printf("       %s --one-pass [--stats[=json]] <input_file | -> <output_obj> <output_lst>\n", argv[0]);
+        printf("       %s --jobs N [--format=...] [--manifest FILE] <input_file>...\n", argv[0]);
+        printf("       %s --cache=DIR [--cache-size=MB] [--cache-stats] [options] <input_file> ...\n", argv[0]);
+        printf("       %s link [--load=ADDR] [--format=bin|ihex|srec] <output> <input.obj>...\n", argv[0]);
+        printf("       %s sim [--load=ADDR] [--entry=ADDR] [--max=N] <image.bin | input.obj...>\n", argv[0]);
+        printf("       %s bench [--lines=N[,N...]] [--repeat=N] [--emit=FILE] ...\n", argv[0]);
+        return 1;
+    }
+    const char *obj_file = outputs & 1 ? files[1] : NULL;
+    const char *lst_file = outputs == 3 ? files[2] : outputs & 2 ? files[1] : NULL;
+    int to_stdout = (obj_file != NULL && strcmp(obj_file, "-") == 0) +
+                    (lst_file != NULL && strcmp(lst_file, "-") == 0);
+    if (to_stdout > 1) {
+        printf("Only one output can go to standard output\n");
+        return 1;
+    }
+    // Initialize assembler
+    Assembler assembler;
+    assembler_init(&assembler);
+    assembler.jobs = threads;
+    assembler.fill_records = fill_records;
+    assembler.optimize = optimize;
+    AssemblyStats stats;
+    if (show_stats) {
+        memset(&stats, 0, sizeof(stats));
+        assembler.stats = &stats;
+        assembler.oom.allocations = &stats.allocations;
+    }
+
+    // Assemble
+    int lines;
+    int status = one_pass ? assemble_one_pass(&assembler, files[0], obj_file, lst_file, format)
+                          : assemble_cached(build_cache, &assembler, files[0], obj_file, lst_file,
+                                            format, &lines);
+    free(files);
+    print_diagnostics(assembler.diags, assembler.diag_count, NULL, stderr);
+    // Keep standard output for the object or listing written there
+    FILE *report_out = to_stdout ? stderr : stdout;
+    if (build_cache != NULL) {
+        cache_close(build_cache);
+        if (cache_stats) {
+            cache_report(build_cache, report_out);
+        }
+    }
+    if (show_symstats) {
+        symtab_report(&assembler, stderr);
+    }
+    if (show_stats) {
+        stats_report(&assembler, &stats, show_stats == 2, stderr);
+    }
+    if (assembler.error_count>0){
+        fprintf(report_out, "\033[1;31mAssembly failed.\033[0m\n");
+        fprintf(report_out, "\033[1;31m number of errors: %d\033[0m\n",assembler.error_count);
+    }
+    else{
+        fprintf(report_out, "\033[0;32mAssembly completed.\033[0m\n");
+    }
+    if (optimize) {
+        fprintf(report_out, "Peephole: %d statements rewritten, %d bytes and about %ld cycles saved\n",
+                assembler.peephole.rewrites, assembler.peephole.bytes, assembler.peephole.cycles);
+    }
+
+    assembler_free(&assembler);
+    return status == SIC_ERR_ARGS || status == SIC_ERR_NOMEM ? 1 : 0;
 }
+#endif
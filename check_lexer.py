@@ -0,0 +1,118 @@
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+# 比對 SIMD (SSE2 / AVX2) 與逐字元 (-DSIC_SCALAR_LEXER) 斷詞器的結果
+# 以 bench 產生的程式為底，隨機改變欄位之間的空白、加上行尾註解與含空白/句點的字串常數，
+# 每個版本的物件檔、清單檔與錯誤訊息都必須與未打亂的原始程式完全相同
+# 用法: python check_lexer.py [次數] [種子]
+
+BUILDS = {
+    "scalar": ["-DSIC_SCALAR_LEXER"],
+    "sse2": [],
+    "avx2": ["-mavx2"],
+}
+
+BLANKS = " \t\v\f"
+
+
+def build(workdir):
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "assembler.c")
+    exes = {}
+    for name, flags in BUILDS.items():
+        exe = os.path.join(workdir, "asm_" + name)
+        subprocess.run(["gcc", "-O2", "-pthread"] + flags + ["-o", exe, source], check=True)
+        exes[name] = exe
+    return exes
+
+
+def blanks(rng, least):
+    # 偶爾放很長的空白，讓欄位跨過 16 / 32 Bytes 的區塊邊界
+    n = rng.randint(least, 70) if rng.random() < 0.2 else rng.randint(least, 3)
+    return "".join(rng.choice(BLANKS) for _ in range(n))
+
+
+def comment(rng):
+    text = rng.choice([". done", ".", ". a . b", ". it's C'A B'", ".X'F1'  ,X"])
+    return blanks(rng, 1) + text
+
+
+def constants(rng, count):
+    # 引號內的空白與句點不可被當成註解或欄位分隔
+    lines = []
+    for _ in range(count):
+        body = "".join(rng.choice("AB .,") for _ in range(rng.randint(1, 20)))
+        lines.append("\tBYTE\tC'%s'" % body)
+    return lines
+
+
+def fuzz_line(rng, line):
+    fields = line.split("\t")
+    label, mnemonic = fields[0], fields[1]
+    operand = fields[2] if len(fields) > 2 else ""
+    out = label + blanks(rng, 1) if label else blanks(rng, 0)
+    out += mnemonic
+    if operand:
+        out += blanks(rng, 1) + operand
+    if rng.random() < 0.3:
+        out += comment(rng)
+    elif rng.random() < 0.3:
+        out += blanks(rng, 1)
+    if rng.random() < 0.1:
+        out += "\r"
+    return out
+
+
+def assemble(exe, path):
+    obj = path + ".obj"
+    lst = path + ".lst"
+    run = subprocess.run([exe, path, obj, lst], capture_output=True, text=True)
+    with open(obj, "rb") as f:
+        obj_data = f.read()
+    with open(lst, "rb") as f:
+        lst_data = f.read()
+    return obj_data, lst_data, run.stdout + run.stderr
+
+
+def check(exes, workdir, seed):
+    rng = random.Random(seed)
+    base = os.path.join(workdir, "base.asm")
+    subprocess.run([exes["scalar"], "bench", "--lines=%d" % rng.randint(50, 3000),
+                    "--seed=%d" % seed, "--section=%d" % rng.choice([300, 50000]),
+                    "--emit=" + base], check=True, capture_output=True)
+    with open(base) as f:
+        lines = f.read().split("\n")
+    if lines[-1] == "":
+        lines.pop()
+    # 字串常數放在第一個敘述之後，仍屬於同一個區段
+    lines[1:1] = constants(rng, rng.randint(1, 5))
+    with open(base, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    fuzzed = os.path.join(workdir, "fuzzed.asm")
+    with open(fuzzed, "w", newline="") as f:
+        f.write("\n".join([lines[0]] + [fuzz_line(rng, l) for l in lines[1:]]) + "\n")
+
+    expected = assemble(exes["scalar"], base)
+    for name, exe in exes.items():
+        if assemble(exe, fuzzed) != expected:
+            print("seed %d: %s lexer differs (kept in %s)" % (seed, name, workdir))
+            return False
+    return True
+
+
+def main():
+    runs = int(sys.argv[1]) if len(sys.argv) > 1 else 50
+    seed = int(sys.argv[2]) if len(sys.argv) > 2 else 1
+    workdir = tempfile.mkdtemp(prefix="sic_lexer_")
+    exes = build(workdir)
+    for i in range(runs):
+        if not check(exes, workdir, seed + i):
+            return 1
+    print("%d programs: scalar, SSE2 and AVX2 lexers agree" % runs)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,189 @@
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+# 檢查 T Record 的切分：一般模式、--fill-records 與 --one-pass 產生的物件檔
+# 經 link 後必須是相同的記憶體映像；--fill-records 的記錄數不可多於一般模式，
+# 且除了位址不連續處與區段結尾外，每筆 T Record 都要填滿 30 Bytes。
+# 另外以常駐模式 (--daemon) 隨機修改程式，每次修改後的物件檔都必須與重新完整組譯的結果相同。
+# 用法: python check_records.py [次數] [種子]
+
+TEXT_RECORD_MAX = 30
+MODES = [[], ["--fill-records"], ["--one-pass"], ["--one-pass", "--fill-records"]]
+# 修改時不碰這些敘述，以免改變區段、符號或 literal pool
+FIXED = {"START", "END", "CSECT", "EXTDEF", "EXTREF", "EQU", "ORG", "BASE", "NOBASE", "LTORG"}
+
+
+def build(workdir):
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "assembler.c")
+    exe = os.path.join(workdir, "asm")
+    subprocess.run(["gcc", "-O2", "-pthread", "-o", exe, source], check=True)
+    return exe
+
+
+def sections(obj):
+    # 每個區段的 T Records：[(位址, 長度)]
+    result = []
+    for rec in obj.split("\n"):
+        if rec.startswith("H"):
+            result.append([])
+        elif rec.startswith("T"):
+            addr = int(rec[1:7], 16)
+            length = int(rec[7:9], 16)
+            if length > TEXT_RECORD_MAX or len(rec) != 9 + 2 * length:
+                raise ValueError("malformed T record " + rec)
+            result[-1].append((addr, length))
+    return result
+
+
+def code_records(recs):
+    # --one-pass 以重疊的 T Record 補上前向參考，這些不算在程式碼的切分內；
+    # 跨過記錄邊界的指令要補兩筆，所以只比較程式碼本身的記錄數
+    code = []
+    for addr, length in recs:
+        if not code or addr >= code[-1][0] + code[-1][1]:
+            code.append((addr, length))
+    return code
+
+
+def check_filled(secs):
+    for recs in secs:
+        code = code_records(recs)
+        for (addr, length), (next_addr, _) in zip(code, code[1:]):
+            if addr + length == next_addr and length != TEXT_RECORD_MAX:
+                return "T record at %06X holds %d bytes but the next one continues it" % (addr, length)
+    return None
+
+
+def image(exe, workdir, obj_path):
+    bin_path = os.path.join(workdir, "image.bin")
+    run = subprocess.run([exe, "link", bin_path, obj_path], capture_output=True, text=True)
+    entry = re.search(r"entry ([0-9A-F]+)", run.stdout)
+    with open(bin_path, "rb") as f:
+        return f.read(), entry.group(1) if entry else None
+
+
+def assemble(exe, workdir, path, mode):
+    obj = os.path.join(workdir, "out.obj")
+    lst = os.path.join(workdir, "out.lst")
+    subprocess.run([exe] + mode + [path, obj, lst], capture_output=True)
+    with open(obj) as f:
+        return f.read(), obj
+
+
+def check_modes(exe, workdir, path):
+    images = []
+    counts = []
+    for mode in MODES:
+        obj, obj_path = assemble(exe, workdir, path, mode)
+        secs = sections(obj)
+        counts.append(sum(len(code_records(recs)) for recs in secs))
+        if "--fill-records" in mode:
+            problem = check_filled(secs)
+            if problem:
+                return "%s: %s" % (" ".join(mode), problem)
+        images.append(image(exe, workdir, obj_path))
+    if any(img != images[0] for img in images):
+        return "linked images differ between modes"
+    if counts[1] > counts[0] or counts[3] > counts[2]:
+        return "--fill-records wrote more T records (%s)" % counts
+    return None
+
+
+def editable(line):
+    fields = line.split("\t")
+    return len(fields) > 1 and fields[0] == "" and fields[1] not in FIXED
+
+
+def check_daemon(exe, workdir, path, lines, mode, rng, edits):
+    daemon = subprocess.Popen([exe, "--daemon"] + mode, stdin=subprocess.PIPE,
+                              stdout=subprocess.PIPE, text=True)
+
+    def request(text):
+        daemon.stdin.write(text)
+        daemon.stdin.flush()
+        return daemon.stdout.readline()
+
+    obj = os.path.join(workdir, "daemon.obj")
+    request("open %s %s %s\n" % (path, obj, os.path.join(workdir, "daemon.lst")))
+    lines = list(lines)
+    pool = [l for l in lines if editable(l)]
+    edited = os.path.join(workdir, "edited.asm")
+    problem = None
+    for n in range(edits):
+        spots = [i for i, l in enumerate(lines) if editable(l)]
+        if not spots:
+            break
+        i = rng.choice(spots)
+        kind = rng.randrange(4)
+        if kind == 0:
+            steps = [(i, 1, [rng.choice(pool)])]
+        elif kind == 1:
+            steps = [(i, 0, [rng.choice(pool) for _ in range(rng.randint(1, 4))])]
+        elif kind == 2:
+            steps = [(i, 1, [])]
+        else:
+            # 先改成不認得的指令，再換回原來的指令，最後在前面插入一行讓區段重新配置：
+            # 長度不變的取代不重新配置，指令格式必須跟著換過來。
+            # 加上沒有人參考的新標籤，FOO 才不會被當成標籤
+            fields = lines[i].split("\t")
+            fields[0] = "ZZ%d" % n
+            real = "\t".join(fields)
+            fields[1] = "FOO"
+            steps = [(i, 1, ["\t".join(fields)]), (i, 1, [real]), (i, 0, [rng.choice(pool)])]
+        for first, remove, new in steps:
+            reply = request("edit %d %d %d\n%s" % (first + 1, remove, len(new),
+                                                    "".join(l + "\n" for l in new)))
+            lines[first:first + remove] = new
+            if not reply.startswith("ok"):
+                problem = "daemon replied " + reply.strip()
+                break
+            with open(edited, "w") as f:
+                f.write("\n".join(lines) + "\n")
+            expected, _ = assemble(exe, workdir, edited, mode)
+            with open(obj) as f:
+                if f.read() != expected:
+                    problem = "daemon object differs from a full assembly (%s)" % " ".join(mode)
+                    break
+        if problem:
+            break
+    request("quit\n")
+    daemon.wait()
+    return problem
+
+
+def check(exe, workdir, seed):
+    rng = random.Random(seed)
+    path = os.path.join(workdir, "program.asm")
+    subprocess.run([exe, "bench", "--lines=%d" % rng.randint(50, 2000), "--seed=%d" % seed,
+                    "--section=%d" % rng.choice([200, 50000]),
+                    "--data=%.2f" % rng.uniform(0, 0.5), "--reserve=%.2f" % rng.uniform(0, 1),
+                    "--emit=" + path], check=True, capture_output=True)
+    with open(path) as f:
+        lines = f.read().rstrip("\n").split("\n")
+    problem = check_modes(exe, workdir, path)
+    for mode in ([], ["--fill-records"]):
+        problem = problem or check_daemon(exe, workdir, path, lines, mode, rng, 10)
+    if problem:
+        print("seed %d: %s (kept in %s)" % (seed, problem, workdir))
+        return False
+    return True
+
+
+def main():
+    runs = int(sys.argv[1]) if len(sys.argv) > 1 else 30
+    seed = int(sys.argv[2]) if len(sys.argv) > 2 else 1
+    workdir = tempfile.mkdtemp(prefix="sic_records_")
+    exe = build(workdir)
+    for i in range(runs):
+        if not check(exe, workdir, seed + i):
+            return 1
+    print("%d programs: records agree in every mode and after daemon edits" % runs)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
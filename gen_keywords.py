@@ -0,0 +1,183 @@
+import re
+import sys
+
+# 產生 assembler.c 中的靜態完美雜湊關鍵字表 (opcode / directive / register)
+# 修改下列清單後執行: python gen_keywords.py assembler.c
+
+TABLE_SIZE = 512
+
+# (mnemonic, opcode, format, format 2 operand shape)
+OPCODES = [
+    # 格式3/4 指令
+    ("ADD", 0x18, 3, None),
+    ("ADDF", 0x58, 3, None),
+    ("AND", 0x40, 3, None),
+    ("COMP", 0x28, 3, None),
+    ("COMPF", 0x88, 3, None),
+    ("DIV", 0x24, 3, None),
+    ("DIVF", 0x64, 3, None),
+    ("J", 0x3C, 3, None),
+    ("JEQ", 0x30, 3, None),
+    ("JGT", 0x34, 3, None),
+    ("JLT", 0x38, 3, None),
+    ("JSUB", 0x48, 3, None),
+    ("LDA", 0x00, 3, None),
+    ("LDB", 0x68, 3, None),
+    ("LDCH", 0x50, 3, None),
+    ("LDF", 0x70, 3, None),
+    ("LDL", 0x08, 3, None),
+    ("LDS", 0x6C, 3, None),
+    ("LDT", 0x74, 3, None),
+    ("LDX", 0x04, 3, None),
+    ("LPS", 0xD0, 3, None),
+    ("MUL", 0x20, 3, None),
+    ("MULF", 0x60, 3, None),
+    ("OR", 0x44, 3, None),
+    ("RD", 0xD8, 3, None),
+    ("RSUB", 0x4C, 3, None),
+    ("SSK", 0xEC, 3, None),
+    ("STA", 0x0C, 3, None),
+    ("STB", 0x78, 3, None),
+    ("STCH", 0x54, 3, None),
+    ("STF", 0x80, 3, None),
+    ("STI", 0xD4, 3, None),
+    ("STL", 0x14, 3, None),
+    ("STS", 0x7C, 3, None),
+    ("STSW", 0xE8, 3, None),
+    ("STT", 0x84, 3, None),
+    ("STX", 0x10, 3, None),
+    ("SUB", 0x1C, 3, None),
+    ("SUBF", 0x5C, 3, None),
+    ("TD", 0xE0, 3, None),
+    ("TIX", 0x2C, 3, None),
+    ("WD", 0xDC, 3, None),
+    # 格式2 指令
+    ("ADDR", 0x90, 2, "F2_RR"),
+    ("CLEAR", 0xB4, 2, "F2_R"),
+    ("COMPR", 0xA0, 2, "F2_RR"),
+    ("DIVR", 0x9C, 2, "F2_RR"),
+    ("MULR", 0x98, 2, "F2_RR"),
+    ("RMO", 0xAC, 2, "F2_RR"),
+    ("SHIFTL", 0xA4, 2, "F2_RN"),
+    ("SHIFTR", 0xA8, 2, "F2_RN"),
+    ("SUBR", 0x94, 2, "F2_RR"),
+    ("SVC", 0xB0, 2, "F2_N"),
+    ("TIXR", 0xB8, 2, "F2_R"),
+    # 格式1 指令
+    ("FIX", 0xC4, 1, None),
+    ("FLOAT", 0xC0, 1, None),
+    ("HIO", 0xF4, 1, None),
+    ("NORM", 0xC8, 1, None),
+    ("SIO", 0xF0, 1, None),
+    ("TIO", 0xF8, 1, None),
+]
+
+# (directive, enum name)
+DIRECTIVES = [
+    ("START", "DIR_START"),
+    ("END", "DIR_END"),
+    ("BYTE", "DIR_BYTE"),
+    ("WORD", "DIR_WORD"),
+    ("RESW", "DIR_RESW"),
+    ("RESB", "DIR_RESB"),
+    ("ORG", "DIR_ORG"),
+    ("EQU", "DIR_EQU"),
+    ("CSECT", "DIR_CSECT"),
+    ("BASE", "DIR_BASE"),
+    ("NOBASE", "DIR_NOBASE"),
+    ("EXTDEF", "DIR_EXTDEF"),
+    ("EXTREF", "DIR_EXTREF"),
+    ("LTORG", "DIR_LTORG"),
+    ("MACRO", "DIR_MACRO"),
+    ("MEND", "DIR_MEND"),
+    ("IF", "DIR_IF"),
+    ("ELSE", "DIR_ELSE"),
+    ("ENDIF", "DIR_ENDIF"),
+]
+
+# (register, number)
+REGISTERS = [
+    ("A", 0),
+    ("X", 1),
+    ("L", 2),
+    ("B", 3),
+    ("S", 4),
+    ("T", 5),
+    ("F", 6),
+    ("PC", 8),
+    ("SW", 9),
+]
+
+BEGIN = "/* BEGIN GENERATED KEYWORD TABLE (gen_keywords.py) */"
+END = "/* END GENERATED KEYWORD TABLE */"
+
+
+# 必須與 assembler.c 的 hash_keyword() 相同
+def hash_keyword(name, seed):
+    h = seed
+    for c in name.encode():
+        h ^= c
+        h = (h * 16777619) & 0xFFFFFFFF
+    return (h ^ (h >> 15)) & (TABLE_SIZE - 1)
+
+
+def find_seed(names):
+    for seed in range(1, 1 << 24):
+        seed_value = (2166136261 + seed * 0x9E3779B1) & 0xFFFFFFFF
+        slots = set()
+        for name in names:
+            slot = hash_keyword(name, seed_value)
+            if slot in slots:
+                break
+            slots.add(slot)
+        else:
+            return seed_value
+    raise RuntimeError("no perfect hash seed found")
+
+
+def build_entries():
+    entries = []
+    for name, opcode, fmt, shape in OPCODES:
+        entries.append((name, "KW_OPCODE", "0x%02X" % opcode, fmt, "DIR_NONE", 0,
+                        shape or "F2_NONE"))
+    for name, enum in DIRECTIVES:
+        entries.append((name, "KW_DIRECTIVE", "0x00", 0, enum, 0, "F2_NONE"))
+    for name, number in REGISTERS:
+        entries.append((name, "KW_REGISTER", "0x00", 0, "DIR_NONE", number, "F2_NONE"))
+    return entries
+
+
+def generate():
+    entries = build_entries()
+    names = [e[0] for e in entries]
+    if len(set(names)) != len(names):
+        raise RuntimeError("duplicate keyword")
+    seed = find_seed(names)
+    rows = sorted(((hash_keyword(e[0], seed), e) for e in entries))
+    out = [BEGIN]
+    out.append("#define KEYWORD_TABLE_SIZE %d" % TABLE_SIZE)
+    out.append("#define KEYWORD_HASH_SEED 0x%08Xu" % seed)
+    out.append("")
+    out.append("static const Keyword keyword_table[KEYWORD_TABLE_SIZE] = {")
+    for slot, (name, kind, opcode, fmt, directive, reg, shape) in rows:
+        out.append('    [%3d] = {"%s", %d, %s, %s, %d, %s, %d, %s},' % (
+            slot, name, len(name), kind, opcode, fmt, directive, reg, shape))
+    out.append("};")
+    out.append(END)
+    return "\n".join(out)
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "assembler.c"
+    with open(path, encoding="utf-8") as f:
+        source = f.read()
+    pattern = re.compile(re.escape(BEGIN) + ".*?" + re.escape(END), re.S)
+    if not pattern.search(source):
+        raise RuntimeError("keyword table markers not found in " + path)
+    source = pattern.sub(lambda m: generate(), source)
+    with open(path, "w", encoding="utf-8", newline="\n") as f:
+        f.write(source)
+
+
+if __name__ == "__main__":
+    main()
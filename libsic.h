@@ -0,0 +1,85 @@
+/*
+ * libsic - SIC/XE assembler as an in-memory library
+ *
+ * sic_assemble() takes a source buffer and returns the object program, the
+ * listing and a list of diagnostics in freshly allocated buffers. It keeps no
+ * global state, never touches the filesystem and never exits the process,
+ * so independent assemblies may run concurrently on different threads.
+ *
+ * Build the library without the command-line front end:
+ *   gcc -O2 -DSIC_NO_MAIN -c assembler.c -o libsic.o
+ */
+#ifndef LIBSIC_H
+#define LIBSIC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Object output formats
+enum {
+    SIC_FORMAT_OBJ = 0,     // H/T/E text records
+    SIC_FORMAT_BIN,         // Flat memory image
+    SIC_FORMAT_IHEX,        // Intel HEX
+    SIC_FORMAT_SREC         // Motorola S-records
+};
+
+// Return codes of sic_assemble()
+enum {
+    SIC_OK = 0,             // Assembled without errors
+    SIC_ERR_ASSEMBLY,       // Outputs were produced but diagnostics contain errors
+    SIC_ERR_NOMEM,          // Ran out of memory; outputs are not available
+    SIC_ERR_ARGS            // Invalid arguments
+};
+
+enum {
+    SIC_SEVERITY_ERROR = 0,
+    SIC_SEVERITY_WARNING
+};
+
+#define SIC_MESSAGE_LEN 160
+
+// One diagnostic, in source order
+typedef struct {
+    int line;                       // Source line (1-based), 0 if not tied to a line
+    int severity;                   // SIC_SEVERITY_*
+    char message[SIC_MESSAGE_LEN];
+} SicDiagnostic;
+
+typedef struct {
+    int format;                     // SIC_FORMAT_*
+    int want_object;                // Produce result->object
+    int want_listing;               // Produce result->listing
+    int threads;                    // Threads used to encode (pass 2); 1 = calling thread only
+    int fill_records;               // Fill every T record, splitting statements between records
+    int optimize;                   // Run the peephole optimizer (-O)
+} SicOptions;
+
+typedef struct {
+    unsigned char *object;          // Object program in the requested format
+    size_t object_size;
+    char *listing;                  // Listing text (not NUL-terminated)
+    size_t listing_size;
+    SicDiagnostic *diagnostics;
+    int diagnostic_count;
+    int error_count;
+    long allocations;               // Heap allocations made by this assembly
+} SicResult;
+
+// Default options: H/T/E object program and listing
+void sic_options_init(SicOptions *options);
+
+// Assemble size bytes of source; options may be NULL for the defaults.
+// The result must be released with sic_result_free() whatever the return code.
+int sic_assemble(const char *source, size_t size, const SicOptions *options,
+                 SicResult *result);
+
+void sic_result_free(SicResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif